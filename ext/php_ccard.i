@@ -1,5 +1,7 @@
 %module ccard
 %{
+#include "explicit_set.h"
+#include "block_epoch.h"
 #include "adaptive_counting.h"
 struct adp_cnt_ctx_s {
     int err;
@@ -12,6 +14,19 @@ struct adp_cnt_ctx_s {
     uint32_t b_e;
     uint32_t bmp_len;
     uint8_t *M;
+    uint32_t epoch;
+    uint8_t *dirty;
+    uint64_t *pending;
+    uint32_t p_cnt;
+    uint32_t p_size;
+    void *sidx;
+    uint8_t *sval;
+    uint32_t s_cnt;
+    uint8_t s_stale;
+    exp_set_t *es;
+    uint8_t view;
+    const ccard_allocator_t *alloc;
+    blk_epoch_t *be;
 };
 %}
 
@@ -2,6 +2,7 @@
 #define ADAPTIVE_COUNTING_H__
 
 #include "ccard_common.h"
+#include "hyperloglog_counting.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,6 +16,11 @@ typedef struct adp_cnt_ctx_s adp_cnt_ctx_t;
 /**
  * Initialize adaptive counting context with optional raw bitmap.
  *
+ * With CCARD_OPT_EXPLICIT, a context without initial bitmap keeps distinct
+ * hash values and counts exactly until they take more memory than the
+ * normal bitmap, then they are converted to a sparse bitmap. Raw bitmap of
+ * such context is an explicit one, see explicit_set.h.
+ *
  * @param[in] buf Pointer to the raw bitmap (no header). NULL if there's
  * none.
  * @param[in] len_or_k The length of the bitmap if buf is not NULL;
@@ -34,6 +40,9 @@ adp_cnt_ctx_t  *adp_cnt_raw_init(const void *obuf, uint32_t len_or_k,
 /**
  * Initialize adaptive counting context with optional serialized bitmap.
  *
+ * The serialized bitmap could be a compressed one, see
+ * adp_cnt_get_compressed_bytes.
+ *
  * @param[in] buf Pointer to the serialized bitmap (with 3 bytes header).
  * NULL if there's none.
  * @param[in] len_or_k The length of the bitmap if buf is not NULL;
@@ -51,6 +60,116 @@ adp_cnt_ctx_t  *adp_cnt_raw_init(const void *obuf, uint32_t len_or_k,
 adp_cnt_ctx_t  *adp_cnt_init(const void *obuf, uint32_t len_or_k,
                              uint8_t opt);
 
+/**
+ * Initialize adaptive counting context with optional raw bitmap, whose
+ * memory is got from the given allocator instead of the global one.
+ *
+ * @param[in] alloc Allocator of the context, e.g. the one of an arena got
+ * by ccard_arena_allocator. NULL for the global one.
+ *
+ * @see adp_cnt_raw_init, ccard_set_allocator
+ * */
+adp_cnt_ctx_t  *adp_cnt_raw_init_alloc(const void *obuf, uint32_t len_or_k,
+                                       uint8_t opt,
+                                       const ccard_allocator_t *alloc);
+
+/**
+ * Initialize adaptive counting context with optional serialized bitmap,
+ * whose memory is got from the given allocator instead of the global one.
+ *
+ * @param[in] alloc Allocator of the context, NULL for the global one.
+ *
+ * @see adp_cnt_init, ccard_set_allocator
+ * */
+adp_cnt_ctx_t  *adp_cnt_init_alloc(const void *obuf, uint32_t len_or_k,
+                                   uint8_t opt,
+                                   const ccard_allocator_t *alloc);
+
+/**
+ * Initialize adaptive counting context as a view of serialized bitmap, which
+ * is borrowed in place instead of copied, e.g. bitmap in a memory-mapped
+ * file or shared memory.
+ *
+ * Only normal bitmaps could be borrowed, sparse, explicit or compressed ones
+ * should be given to adp_cnt_init. A read-only view could be estimated,
+ * serialized and merged from, while updating it fails with CCARD_ERR_VIEW.
+ * A writable view updates the borrowed bitmap in place, but it can't be
+ * folded or packed. The bitmap must outlive the view, and shouldn't be
+ * changed but through the view.
+ *
+ * A shared view is a writable one whose bitmap is updated by other
+ * processes as well, e.g. in a segment mapped by ccard_shm_open. Its
+ * registers are raised atomically, so processes offer to and merge into the
+ * same bitmap without locks.
+ *
+ * @param[in] buf Pointer to the serialized bitmap (with 3 bytes header).
+ * @param[in] len The length of the serialized bitmap.
+ * @param[in] flags CCARD_VIEW_RDONLY, CCARD_VIEW_WRITABLE or
+ * CCARD_VIEW_SHARED.
+ *
+ * @retval not-NULL A context borrowing the bitmap. adp_cnt_fini releases
+ * the context only.
+ * @retval NULL If the bitmap can't be borrowed.
+ *
+ * @see adp_cnt_init, adp_cnt_fini
+ * */
+adp_cnt_ctx_t  *adp_cnt_view_init(const void *buf, uint32_t len,
+                                  uint8_t flags);
+
+/**
+ * Initialize adaptive counting context as a deep copy of another one, with
+ * the same representation and delta epoch, from the allocator of src. The
+ * estimator state (sum and number of empty buckets) is copied, so buckets
+ * aren't traversed again. A view is copied into a context owning its
+ * bitmap.
+ *
+ * @param[in] src Pointer to the context to copy.
+ *
+ * @retval not-NULL An initialized context to be used with the rest of
+ * methods.
+ * @retval NULL If error occured.
+ *
+ * @see adp_cnt_copy_into, adp_cnt_fini
+ * */
+adp_cnt_ctx_t  *adp_cnt_clone(adp_cnt_ctx_t *src);
+
+/**
+ * Overwrite a context with a deep copy of another one, like adp_cnt_clone.
+ * Memory of dst is resized only if src needs a different size, so copying
+ * between contexts of the same k and representation doesn't allocate.
+ * Pending sparse buckets of src are merged first, and the pending array of
+ * dst is kept for reuse. dst keeps its allocator and lazy reset.
+ *
+ * @param[in,out] dst Pointer to the context to be overwritten, which can't
+ * be a view.
+ * @param[in] src Pointer to the context to copy.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured, dst could only be finalized then.
+ *
+ * @see adp_cnt_clone
+ * */
+int             adp_cnt_copy_into(adp_cnt_ctx_t *dst, adp_cnt_ctx_t *src);
+
+/**
+ * Replace bitmap in the context with a serialized one, like a context
+ * initialized by adp_cnt_init with it. A normal bitmap of the same hash
+ * function and k is copied over the normal bitmap of the context in place,
+ * others are decoded into a temporary context first. The next delta is a
+ * full one.
+ *
+ * @param[in,out] ctx Pointer to the context, which can't be a view.
+ * @param[in] buf Pointer to the serialized bitmap, see adp_cnt_get_bytes.
+ * @param[in] len The length of the serialized bitmap.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured, ctx is unchanged if the bitmap is invalid.
+ *
+ * @see adp_cnt_init, adp_cnt_get_bytes
+ * */
+int             adp_cnt_load_bytes(adp_cnt_ctx_t *ctx, const void *buf,
+                                   uint32_t len);
+
 /**
  * Retrieve the cardinality calculated from bitmap in the context using
  * LogLog Counting.
@@ -107,6 +226,45 @@ int             adp_cnt_offer(adp_cnt_ctx_t *ctx, const void *buf,
  * */
 int             adp_cnt_reset(adp_cnt_ctx_t *ctx);
 
+/**
+ * Turn lazy reset of the context on or off. With lazy reset, adp_cnt_reset
+ * costs O(1) instead of clearing the whole bitmap: it only advances an epoch,
+ * and each block of 256 bytes of the bitmap is cleared when it's touched for
+ * the first time after reset, e.g. for window counters reset very often. Only the normal
+ * bitmap is reset lazily, sparse and explicit ones are reset as usual.
+ * Views can't be reset lazily.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] on 1 to turn lazy reset on, 0 to turn it off.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see adp_cnt_reset
+ * */
+int             adp_cnt_set_lazy_reset(adp_cnt_ctx_t *ctx, int on);
+
+/**
+ * Turn concurrent mode of the context on or off. In concurrent mode, many
+ * threads could call adp_cnt_offer on the context at the same time without
+ * locking, and adp_cnt_card while they're offering: buckets are raised by
+ * atomic compare-and-swap, and the raised amounts are added to a few
+ * accumulators shared by turns among threads, which are summed up by
+ * adp_cnt_card. Sparse and explicit buckets are converted to the normal
+ * bitmap when it's turned on, and it stays normal.
+ * Other functions mustn't be called while threads are offering. Views and
+ * contexts with lazy reset can't be concurrent.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] on 1 to turn concurrent mode on, 0 to turn it off.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see adp_cnt_offer, adp_cnt_set_lazy_reset
+ * */
+int             adp_cnt_set_concurrent(adp_cnt_ctx_t *ctx, int on);
+
 /**
  * Get the raw bitmap or bitmap length from context.
  *
@@ -139,6 +297,48 @@ int             adp_cnt_get_raw_bytes(adp_cnt_ctx_t *ctx, void *buf,
 int             adp_cnt_get_bytes(adp_cnt_ctx_t *ctx, void *buf,
                                   uint32_t *len);
 
+/**
+ * Get the serialized bitmap as an I/O vector pointing to the bitmap in the
+ * context, e.g. for writev or sendmsg without copying the bitmap into a
+ * buffer. iov[0] points to the header stored in hdr and iov[1] to the
+ * bitmap, which together are the same bytes as adp_cnt_get_bytes. The
+ * vector is valid until the context is modified or finalized.
+ *
+ * Only bitmaps stored as they are serialized could be got this way, explicit ones
+ * fail with CCARD_ERR_INVALID_ARGUMENT and should be got by
+ * adp_cnt_get_bytes.
+ *
+ * @param[in] ctx Pointer to the context.
+ * @param[out] hdr Buffer of CCARD_IOV_HDR_LEN bytes storing the header.
+ * @param[out] iov Store 2 elements of the I/O vector.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see adp_cnt_get_bytes
+ * */
+int             adp_cnt_get_iov(adp_cnt_ctx_t *ctx, uint8_t *hdr,
+                                struct iovec *iov);
+
+/**
+ * Get the compressed serialized bitmap or its length from context. It's
+ * the same as adp_cnt_get_bytes except that CCARD_FLAG_COMPRESSED is set in
+ * the algorithm byte and the bitmap is encoded by bc_encode, which could
+ * be given to adp_cnt_init and adp_cnt_merge_bytes directly.
+ *
+ * @param[in] ctx Pointer to the context.
+ * @param[out] buf Pointer to buffer storing returning bitmap. NULL if only
+ * bitmap length is needed.
+ * @param[out] len Pointer to variable storing returning bitmap length.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see adp_cnt_get_bytes, bitmap_codec.h
+ * */
+int             adp_cnt_get_compressed_bytes(adp_cnt_ctx_t *ctx, void *buf,
+                                             uint32_t *len);
+
 /**
  * Merge several adaptive counting context into the current one,
  * effectively combined all distinct countings.
@@ -151,8 +351,9 @@ int             adp_cnt_get_bytes(adp_cnt_ctx_t *ctx, void *buf,
  * }
  * @endcode
  *
- * @note All context to be merged must be of the same bitmap length,
- * otherwise error will be returned!
+ * @note All context to be merged must use the same hash function,
+ * otherwise error will be returned! Contexts with different bitmap length
+ * are folded to the lowest precision among them, see adp_cnt_fold.
  *
  * @param[in,out] ctx Pointer to the context merging to.
  * @param[in] tbm Pointer to the first context to be merged. The rest
@@ -179,8 +380,8 @@ int             adp_cnt_merge(adp_cnt_ctx_t *ctx, adp_cnt_ctx_t *tbm,
  * }
  * @endcode
  *
- * @note All bitmaps to be merged must be of the same length with the
- * bitmap in current context, otherwise error will be returned!
+ * @note Bitmaps with different length from the bitmap in current context
+ * are folded to the lowest precision among them, see adp_cnt_fold.
  *
  * @param[in,out] ctx Pointer to the context merging to.
  * @param[in] buf Pointer to the first bitmap to be merged.
@@ -208,8 +409,8 @@ int             adp_cnt_merge_raw_bytes(adp_cnt_ctx_t *ctx,
  * }
  * @endcode
  *
- * @note All bitmaps to be merged must be of the same length with the
- * bitmap in current context, otherwise error will be returned!
+ * @note Bitmaps with different length from the bitmap in current context
+ * are folded to the lowest precision among them, see adp_cnt_fold.
  *
  * @param[in,out] ctx Pointer to the context merging to.
  * @param[in] buf Pointer to the first bitmap to be merged.
@@ -225,6 +426,126 @@ int             adp_cnt_merge_bytes(adp_cnt_ctx_t *ctx,
                                     const void *buf, uint32_t len,
                                     ...);
 
+/**
+ * Fold the bitmap in the context to a lower precision, as if all counted
+ * objects were offered to a context with 2^new_k buckets.
+ *
+ * Neighbouring buckets are combined and their values are recomputed with
+ * the dropped bucket index bits, so the result is exactly the same as
+ * counting with the lower precision from the beginning.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] new_k The base-2 logarithm of the new bitmap length, must be
+ * in range [1, current k].
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see adp_cnt_merge, adp_cnt_merge_bytes
+ * */
+int             adp_cnt_fold(adp_cnt_ctx_t *ctx, uint8_t new_k);
+
+/**
+ * Get the buckets raised since the given epoch as a delta, which could be
+ * applied to a replica of the context with adp_cnt_apply_delta.
+ *
+ * Modified buckets are tracked since the first delta was taken, each delta
+ * taken (buf is not NULL) advances the epoch of the context by 1. If
+ * since_epoch isn't the current epoch, or nothing was tracked yet, the delta
+ * carries the whole bitmap, which is always safe to apply as buckets are
+ * merged by maximum. Reset of the context isn't propagated by deltas.
+ *
+ * Usage:
+ * @code{c}
+ * uint32_t epoch = adp_cnt_epoch(ctx);
+ * adp_cnt_get_delta(ctx, epoch, NULL, &len);
+ * adp_cnt_get_delta(ctx, epoch, buf, &len);
+ * // send buf to replicas, then
+ * adp_cnt_apply_delta(replica, buf, len);
+ * @endcode
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] since_epoch Epoch of the context when the last delta was taken.
+ * @param[out] buf Pointer to buffer storing returning delta. NULL if only
+ * delta length is needed.
+ * @param[out] len Pointer to variable storing returning delta length.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see adp_cnt_apply_delta, adp_cnt_epoch
+ * */
+int             adp_cnt_get_delta(adp_cnt_ctx_t *ctx, uint32_t since_epoch,
+                                  void *buf, uint32_t *len);
+
+/**
+ * Apply a delta got by adp_cnt_get_delta to the context, buckets in it are
+ * merged by maximum.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] buf Pointer to the delta.
+ * @param[in] len Length of the delta.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see adp_cnt_get_delta
+ * */
+int             adp_cnt_apply_delta(adp_cnt_ctx_t *ctx, const void *buf,
+                                    uint32_t len);
+
+/**
+ * Get the current delta epoch of the context.
+ *
+ * @param[in] ctx Pointer to the context.
+ *
+ * @retval >=0 Number of deltas taken from the context.
+ * @retval -1 If error occured.
+ *
+ * @see adp_cnt_get_delta
+ * */
+int64_t         adp_cnt_epoch(adp_cnt_ctx_t *ctx);
+
+/**
+ * Convert the context to a hyperloglog counting context holding the same
+ * buckets, as if all counted objects were offered to it.
+ *
+ * Both algorithms take the highest k bits of hash value as bucket index and
+ * the number of trailing zeros of the rest bits plus 1 as bucket value, so
+ * buckets are copied as is. Sparse bitmap is kept sparse.
+ *
+ * @note Adaptive counting applies lookup3 hash function to elements unless
+ * murmur hash function is specified, the resulting context will use the
+ * same hash function.
+ *
+ * @param[in] ctx Pointer to the context.
+ *
+ * @retval not-NULL An initialized hyperloglog counting context, which should
+ * be released by hll_cnt_fini.
+ * @retval NULL If error occured.
+ *
+ * @see adp_cnt_from_hll
+ * */
+hll_cnt_ctx_t  *adp_cnt_to_hll(adp_cnt_ctx_t *ctx);
+
+/**
+ * Convert the given hyperloglog counting context to an adaptive counting
+ * context holding the same buckets, as if all counted objects were offered
+ * to it.
+ *
+ * @note Only contexts using murmur or lookup3 hash function could be
+ * converted, as adaptive counting doesn't support 64-bit murmur hash
+ * function.
+ *
+ * @param[in] hll Pointer to the hyperloglog counting context.
+ *
+ * @retval not-NULL An initialized adaptive counting context.
+ * @retval NULL If error occured.
+ *
+ * @see adp_cnt_to_hll
+ * */
+adp_cnt_ctx_t  *adp_cnt_from_hll(hll_cnt_ctx_t *hll);
+
 /**
  * Finalize and release resources of the given adaptive counting context.
  *
@@ -0,0 +1,110 @@
+#ifndef BITMAPCODEC_H__
+#define BITMAPCODEC_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Compressed encoding of bitmaps got by *_cnt_get_raw_bytes. A compressed
+ * bitmap is:
+ *
+ *  +--------------------+------------------+----------+
+ *  | version[4]/mode[4] | length(varint)   | data[n]  |
+ *  +--------------------+------------------+----------+
+ *
+ * where length is the decoded bitmap length and data depends on mode:
+ *
+ *  - BC_STORED: bitmap as it is.
+ *  - BC_REGISTERS: byte per register. Base value, code width w, zero runs
+ *    of at least BC_RUN_MIN registers as (gap, length) varint pairs,
+ *    exception values, then w-bit codes of the rest registers, where code
+ *    0 is empty, code 2^w-1 takes the next exception value and others are
+ *    base + code - 1.
+ *  - BC_SPARSE: sparse bitmap, ID byte then each bucket as varint of
+ *    (index gap << 7 | value).
+ *  - BC_EXPLICIT: explicit bitmap, ID byte then varint gaps of hash values.
+ *  - BC_BITS: bit array, 1 if it's inverted, then the number of set bits
+ *    and their varint position gaps.
+ *
+ * Varints are little-endian base-128, gaps are from the previous item + 1.
+ * */
+enum {
+    BC_STORED = 0,
+    BC_REGISTERS = 1,
+    BC_SPARSE = 2,
+    BC_EXPLICIT = 3,
+    BC_BITS = 4
+};
+
+/**
+ * Encode a bitmap. The bitmap is stored as it is if the given mode doesn't
+ * fit it or doesn't make it smaller.
+ *
+ * @param[in] in Bitmap.
+ * @param[in] len Length of bitmap.
+ * @param[in] mode Preferred mode, BC_*.
+ * @param[out] out Buffer that stores compressed bitmap. NULL if only length
+ * is needed.
+ *
+ * @retval Length of compressed bitmap in bytes.
+ * */
+uint32_t        bc_encode(const uint8_t *in, uint32_t len, uint8_t mode,
+                          uint8_t *out);
+
+/**
+ * Decode a compressed bitmap.
+ *
+ * @param[in] in Compressed bitmap.
+ * @param[in] len Length of compressed bitmap.
+ * @param[out] out Buffer that stores bitmap. NULL if only length is needed.
+ * @param[in,out] out_len Length of buffer, set to length of bitmap.
+ *
+ * @retval 0 If success.
+ * @retval -1 If the compressed bitmap is corrupted or buffer is too small.
+ * */
+int             bc_decode(const uint8_t *in, uint32_t len, uint8_t *out,
+                          uint32_t *out_len);
+
+/**
+ * Compress serialized bytes got by *_cnt_get_bytes, CCARD_FLAG_COMPRESSED
+ * is set in the algorithm byte and the bitmap is encoded by bc_encode.
+ *
+ * @param[in] in Serialized bytes.
+ * @param[in] len Length of serialized bytes.
+ * @param[in] mode Preferred mode, BC_*.
+ * @param[out] out Buffer that stores compressed bytes. NULL if only length
+ * is needed.
+ * @param[in,out] out_len Length of buffer, set to length of compressed
+ * bytes.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ * */
+int             bc_compress_bytes(const uint8_t *in, uint32_t len,
+                                  uint8_t mode, uint8_t *out,
+                                  uint32_t *out_len);
+
+/**
+ * Decompress serialized bytes got by bc_compress_bytes.
+ *
+ * @param[in] in Compressed bytes.
+ * @param[in] len Length of compressed bytes.
+ * @param[out] out_len Length of serialized bytes.
+ *
+ * @retval not-NULL Serialized bytes, which should be freed by the caller.
+ * @retval NULL If the compressed bytes are corrupted.
+ * */
+uint8_t        *bc_decompress_bytes(const uint8_t *in, uint32_t len,
+                                    uint32_t *out_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vi:ft=c ts=4 sw=4 fdm=marker et
+ * */
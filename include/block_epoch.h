@@ -0,0 +1,102 @@
+#ifndef BLOCKEPOCH_H__
+#define BLOCKEPOCH_H__
+
+#include <stdint.h>
+#include "ccard_alloc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Bytes of each block, base-2 logarithm
+ * */
+#define BE_SHIFT 8
+
+/**
+ * Check whether byte i of the guarded array is in a stale block, whose bytes
+ * must be read as zeros.
+ * */
+#define BE_STALE(be, i) ((be)->stamps[(i) >> BE_SHIFT] != (be)->epoch)
+
+/**
+ * Per-block epoch stamps of a byte array, used for lazy reset of counters.
+ * Reset only advances the epoch, blocks stamped with an older epoch are
+ * stale: their bytes are read as zeros and the block is cleared on the
+ * first write. So resetting costs O(1), and clearing is paid by the blocks
+ * actually touched afterwards.
+ * */
+typedef struct blk_epoch_s {
+    uint32_t        epoch;  /* current epoch */
+    uint32_t       *stamps; /* epoch each block was cleared at */
+    uint32_t        blocks; /* blocks number */
+    uint32_t        stale;  /* stale blocks number */
+    uint32_t        len;    /* length of the guarded array */
+    const ccard_allocator_t *alloc; /* allocator of stamps */
+} blk_epoch_t;
+
+/**
+ * Initialize stamps of a byte array, all blocks are up to date.
+ *
+ * @param[in] len Length of the guarded array.
+ * @param[in] alloc Allocator of stamps, NULL for the global one.
+ *
+ * @retval not-NULL Initialized stamps to be used with the rest of methods.
+ * @retval NULL If error occured.
+ * */
+blk_epoch_t    *be_init(uint32_t len, const ccard_allocator_t *alloc);
+
+/**
+ * Make all blocks stale. Once in 2^32 resets the epoch wraps around, then
+ * the array is cleared at once.
+ *
+ * @param[in] be Stamps.
+ * @param[in,out] M The guarded array.
+ * */
+void            be_reset(blk_epoch_t *be, uint8_t *M);
+
+/**
+ * Clear the block of byte i if it's stale, must be called before byte i is
+ * read or written directly.
+ *
+ * @param[in] be Stamps.
+ * @param[in,out] M The guarded array.
+ * @param[in] i Byte index.
+ * */
+void            be_touch(blk_epoch_t *be, uint8_t *M, uint32_t i);
+
+/**
+ * Clear all stale blocks, so that the whole array could be accessed
+ * directly.
+ *
+ * @param[in] be Stamps.
+ * @param[in,out] M The guarded array.
+ * */
+void            be_flush(blk_epoch_t *be, uint8_t *M);
+
+/**
+ * Mark all blocks up to date without clearing them, after the whole array
+ * was overwritten.
+ *
+ * @param[in] be Stamps.
+ * */
+void            be_sync(blk_epoch_t *be);
+
+/**
+ * Destory stamps and release resource.
+ *
+ * @param[in] be Stamps.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ * */
+int             be_fini(blk_epoch_t *be);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vi:ft=c ts=4 sw=4 fdm=marker et
+ * */
@@ -0,0 +1,341 @@
+#ifndef CCARD_ALLOC_H__
+#define CCARD_ALLOC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Memory allocator used by contexts. Every context keeps the allocator it
+ * was initialized with, and all of its memory (the context itself, bitmaps,
+ * sparse and explicit buckets, scratch buffers) is got from and returned to
+ * that allocator.
+ *
+ * Contexts are initialized with the global allocator, see
+ * ccard_set_allocator, or with a given one by the xxx_cnt_init_alloc and
+ * xxx_cnt_raw_init_alloc variants. The allocator must outlive all contexts
+ * using it.
+ * */
+typedef struct ccard_allocator_s {
+    /** Allocate size bytes, like malloc */
+    void           *(*malloc_fn) (void *opaque, size_t size);
+    /** Resize ptr to size bytes, like realloc */
+    void           *(*realloc_fn) (void *opaque, void *ptr, size_t size);
+    /** Release ptr, like free */
+    void            (*free_fn) (void *opaque, void *ptr);
+    /** User data passed to above functions */
+    void           *opaque;
+} ccard_allocator_t;
+
+/**
+ * Opaque bump arena type
+ * */
+typedef struct ccard_arena_s ccard_arena_t;
+
+/**
+ * Opaque slab allocator type
+ * */
+typedef struct ccard_slab_s ccard_slab_t;
+
+/**
+ * Opaque huge page allocator type
+ * */
+typedef struct ccard_huge_s ccard_huge_t;
+
+/**
+ * Huge page allocator flags, see ccard_huge_init
+ * */
+enum {
+    CCARD_HUGE_HUGETLB = 0x01      /**< Explicit huge pages (MAP_HUGETLB) */
+};
+
+/**
+ * Set the global allocator used by contexts initialized afterwards, contexts
+ * initialized before keep using the old one.
+ *
+ * @param[in] alloc The allocator, which is referenced instead of copied.
+ * NULL to restore the default one based on malloc, realloc and free.
+ *
+ * @see ccard_get_allocator
+ * */
+void            ccard_set_allocator(const ccard_allocator_t *alloc);
+
+/**
+ * Get the global allocator.
+ *
+ * @retval The allocator set by ccard_set_allocator or the default one.
+ *
+ * @see ccard_set_allocator
+ * */
+const ccard_allocator_t *ccard_get_allocator(void);
+
+/**
+ * Allocate memory from the given allocator.
+ *
+ * @param[in] alloc The allocator, NULL for the global one.
+ * @param[in] size Bytes to allocate.
+ *
+ * @retval not-NULL Allocated memory.
+ * @retval NULL If error occured.
+ * */
+void           *ccard_malloc(const ccard_allocator_t *alloc, size_t size);
+
+/**
+ * Allocate zero-filled memory for n items of the given size.
+ *
+ * @see ccard_malloc
+ * */
+void           *ccard_calloc(const ccard_allocator_t *alloc, size_t n,
+                             size_t size);
+
+/**
+ * Resize memory got from the given allocator, allocate new memory if ptr is
+ * NULL.
+ *
+ * @see ccard_malloc
+ * */
+void           *ccard_realloc(const ccard_allocator_t *alloc, void *ptr,
+                              size_t size);
+
+/**
+ * Release memory got from the given allocator, nothing happens if ptr is
+ * NULL.
+ *
+ * @see ccard_malloc
+ * */
+void            ccard_free(const ccard_allocator_t *alloc, void *ptr);
+
+/**
+ * Copy size bytes into memory got from the given allocator, which is resized
+ * by ccard_realloc, so that it's reused if it's large enough.
+ *
+ * @param[in] alloc The allocator, NULL for the global one.
+ * @param[in] dst Memory to be reused, could be NULL.
+ * @param[in] src Bytes to copy, NULL to release dst.
+ * @param[in] size Bytes to copy, 0 to release dst.
+ *
+ * @retval not-NULL The copy.
+ * @retval NULL If src is NULL, size is 0 or error occured, dst is released
+ * in either case.
+ * */
+void           *ccard_copy(const ccard_allocator_t *alloc, void *dst,
+                           const void *src, size_t size);
+
+/**
+ * Initialize a bump arena. Memory is carved sequentially from blocks got
+ * from the global allocator, releasing single allocations is a no-op except
+ * for the latest one, and everything is released at once by
+ * ccard_arena_reset or ccard_arena_fini.
+ *
+ * It's meant for many short-lived contexts, e.g. per-group counters of a
+ * query, which are all dropped together. Contexts in the arena don't need to
+ * be finalized, but shouldn't be used after the arena is reset. The arena
+ * isn't thread-safe.
+ *
+ * Usage:
+ * @code{c}
+ * ccard_arena_t *arena = ccard_arena_init(0);
+ * const ccard_allocator_t *alloc = ccard_arena_allocator(arena);
+ * for (i = 0; i < groups; i++) {
+ *     ctx[i] = hll_cnt_init_alloc(NULL, 10, CCARD_HASH_MURMUR, alloc);
+ * }
+ * ...
+ * ccard_arena_fini(arena);
+ * @endcode
+ *
+ * @param[in] block_size Bytes of each block, 0 for the default 64KB.
+ * Allocations larger than a quarter of it get a block of their own.
+ *
+ * @retval not-NULL An initialized arena.
+ * @retval NULL If error occured.
+ *
+ * @see ccard_arena_allocator, ccard_arena_fini
+ * */
+ccard_arena_t  *ccard_arena_init(size_t block_size);
+
+/**
+ * Get the allocator carving memory from arena, which lives as long as the
+ * arena.
+ *
+ * @param[in] arena The arena.
+ *
+ * @retval The allocator.
+ * */
+const ccard_allocator_t *ccard_arena_allocator(ccard_arena_t *arena);
+
+/**
+ * Get total bytes of blocks held by arena.
+ *
+ * @param[in] arena The arena.
+ *
+ * @retval Bytes of blocks.
+ * */
+size_t          ccard_arena_size(const ccard_arena_t *arena);
+
+/**
+ * Release all memory carved from arena at once, the first block is kept for
+ * reuse.
+ *
+ * @param[in] arena The arena.
+ *
+ * @retval 0 If success.
+ * @retval -1 If arena is NULL.
+ * */
+int             ccard_arena_reset(ccard_arena_t *arena);
+
+/**
+ * Release all memory carved from arena and the arena itself.
+ *
+ * @param[in] arena The arena.
+ *
+ * @retval 0 If success.
+ * @retval -1 If arena is NULL.
+ * */
+int             ccard_arena_fini(ccard_arena_t *arena);
+
+/**
+ * Initialize a slab allocator. Small allocations are rounded up to power of
+ * 2 size classes and carved from slabs got from the global allocator, freed
+ * chunks are kept in per-class free lists for reuse. Resizing within the
+ * size class is done in place, so counters growing their sparse bitmaps
+ * bucket by bucket don't copy them every time. Large allocations are passed
+ * to the global allocator.
+ *
+ * Unlike ccard_arena_t, memory is reused as contexts grow and shrink, while
+ * everything could still be released at once by ccard_slab_reset. The slab
+ * allocator isn't thread-safe.
+ *
+ * @retval not-NULL An initialized slab allocator.
+ * @retval NULL If error occured.
+ *
+ * @see ccard_slab_allocator, ccard_slab_fini
+ * */
+ccard_slab_t   *ccard_slab_init(void);
+
+/**
+ * Get the allocator carving memory from slabs, which lives as long as the
+ * slab allocator.
+ *
+ * @param[in] slab The slab allocator.
+ *
+ * @retval The allocator.
+ * */
+const ccard_allocator_t *ccard_slab_allocator(ccard_slab_t *slab);
+
+/**
+ * Get total bytes of slabs and large allocations held by slab allocator.
+ *
+ * @param[in] slab The slab allocator.
+ *
+ * @retval Bytes held.
+ * */
+size_t          ccard_slab_size(const ccard_slab_t *slab);
+
+/**
+ * Get bytes of chunks in use, rounded up to their size classes, which
+ * doesn't count freed chunks kept for reuse.
+ *
+ * @param[in] slab The slab allocator.
+ *
+ * @retval Bytes in use.
+ * */
+size_t          ccard_slab_used(const ccard_slab_t *slab);
+
+/**
+ * Release all memory carved from slab allocator at once.
+ *
+ * @param[in] slab The slab allocator.
+ *
+ * @retval 0 If success.
+ * @retval -1 If slab is NULL.
+ * */
+int             ccard_slab_reset(ccard_slab_t *slab);
+
+/**
+ * Release all memory carved from slab allocator and the allocator itself.
+ *
+ * @param[in] slab The slab allocator.
+ *
+ * @retval 0 If success.
+ * @retval -1 If slab is NULL.
+ * */
+int             ccard_slab_fini(ccard_slab_t *slab);
+
+/**
+ * Initialize a huge page allocator. Allocations of at least threshold
+ * bytes are mapped by mmap on their own, aligned to 2MB and advised to be
+ * backed by transparent huge pages (MADV_HUGEPAGE), smaller ones are passed
+ * to the global allocator.
+ *
+ * It's meant for large bitmaps, e.g. adaptive or linear counters of k above
+ * 20, which are updated at random positions, so that each offer doesn't
+ * miss the TLB. Memory could be bound to a NUMA node as well, for counters
+ * updated by threads on that node. The allocator isn't thread-safe.
+ *
+ * Usage:
+ * @code{c}
+ * ccard_huge_t *huge = ccard_huge_init(0, -1, 0);
+ * ctx = adp_cnt_raw_init_alloc(NULL, 26, CCARD_HASH_MURMUR,
+ *                              ccard_huge_allocator(huge));
+ * ...
+ * adp_cnt_fini(ctx);
+ * ccard_huge_fini(huge);
+ * @endcode
+ *
+ * @param[in] threshold Bytes from which allocations are mapped, 0 for the
+ * default 2MB.
+ * @param[in] node NUMA node to bind mapped memory to, -1 for no binding.
+ * Binding is best effort and only done on Linux.
+ * @param[in] flags CCARD_HUGE_HUGETLB to map explicit huge pages reserved
+ * by the system first, falling back to transparent ones if there are not
+ * enough, or 0.
+ *
+ * @retval not-NULL An initialized huge page allocator.
+ * @retval NULL If error occured, e.g. invalid node.
+ *
+ * @see ccard_huge_allocator, ccard_huge_fini
+ * */
+ccard_huge_t   *ccard_huge_init(size_t threshold, int node, int flags);
+
+/**
+ * Get the allocator mapping huge pages, which lives as long as the huge
+ * page allocator.
+ *
+ * @param[in] huge The huge page allocator.
+ *
+ * @retval The allocator.
+ * */
+const ccard_allocator_t *ccard_huge_allocator(ccard_huge_t *huge);
+
+/**
+ * Get total bytes of live mappings.
+ *
+ * @param[in] huge The huge page allocator.
+ *
+ * @retval Bytes mapped.
+ * */
+size_t          ccard_huge_mapped(const ccard_huge_t *huge);
+
+/**
+ * Release the huge page allocator. Unlike arena and slab allocators, memory
+ * got from it isn't released at once, contexts using it must be finalized
+ * before.
+ *
+ * @param[in] huge The huge page allocator.
+ *
+ * @retval 0 If success.
+ * @retval -1 If huge is NULL.
+ * */
+int             ccard_huge_fini(ccard_huge_t *huge);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vi:ft=c ts=4 sw=4 fdm=marker et
+ * */
@@ -0,0 +1,77 @@
+
+#ifndef CCARD_ARCHIVE_H__
+#define CCARD_ARCHIVE_H__
+
+#include "ccard_common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Sketch archive file is a plain concatenation of records, each one holds a
+ * serialized bitmap returned by xxx_cnt_get_bytes:
+ *
+ *  +-----------+-------------------------------+-----------+-----+
+ *  | length[4] | serialized bitmap[length]     | length[4] | ... |
+ *  +-----------+-------------------------------+-----------+-----+
+ *
+ * where length is a little-endian 32-bit integer, and the serialized bitmap
+ * starts with the 3 bytes algorithm/hash/k header.
+ * */
+
+/**
+ * Append a serialized bitmap to the archive file as a new record.
+ *
+ * @param[in] fd File descriptor of the archive file, should be opened for
+ * writing with O_APPEND.
+ * @param[in] buf Pointer to the serialized bitmap (with 3 bytes header).
+ * @param[in] len The length of the serialized bitmap.
+ *
+ * @retval 0 If success.
+ * @retval CCARD_ERR_INVALID_ARGUMENT If the given bitmap is invalid.
+ * @retval CCARD_ERR_IO If failed to write the file.
+ *
+ * @see ccard_archive_merge
+ * */
+int             ccard_archive_append(int fd, const void *buf, uint32_t len);
+
+/**
+ * Merge all records in the archive file into the given context.
+ *
+ * The file is memory-mapped and walked sequentially, every record is merged
+ * in place from the mapping by algo->merge_bytes, so no record is copied to
+ * heap.
+ *
+ * Usage:
+ * @code{c}
+ * hll_cnt_ctx_t *ctx = hll_cnt_init(NULL, 14, CCARD_HASH_MURMUR);
+ * if(ccard_archive_merge(ctx, hll_algo, "sketches.arc")) {
+ *     printf("Failed to merge archive: %s",
+ *            hll_cnt_errstr(hll_cnt_errnum(ctx)));
+ * }
+ * @endcode
+ *
+ * @param[in,out] ctx Pointer to the context merging to.
+ * @param[in] algo Algorithm definition of the context.
+ * @param[in] path Path of the archive file.
+ *
+ * @retval 0 If all records were merged successfully.
+ * @retval CCARD_ERR_INVALID_ARGUMENT If any argument is NULL.
+ * @retval CCARD_ERR_IO If failed to map the file or the file is truncated.
+ * @retval CCARD_ERR_MERGE_FAILED If any record can't be merged. Records
+ * before it have been merged already.
+ *
+ * @see ccard_archive_append
+ * */
+int             ccard_archive_merge(void *ctx, const ccard_algo_t *algo,
+                                    const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vi:ft=c ts=4 sw=4 fdm=marker et
+ * */
@@ -2,7 +2,9 @@
 #define CCARD_COMMON_H__
 
 #include <stdint.h>
+#include <sys/uio.h>
 #include "sparse_bitmap.h"
+#include "ccard_alloc.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,6 +18,10 @@ enum {
     CCARD_ERR_INVALID_CTX = -1,     /**< Invalid algorihm context */
     CCARD_ERR_MERGE_FAILED = -2,    /**< Merge failed */
     CCARD_ERR_INVALID_ARGUMENT = -3,    /**< Invalid argument */
+    CCARD_ERR_IO = -4,              /**< I/O error or corrupted file */
+    CCARD_ERR_VIEW = -5,            /**< Not allowed on view of borrowed
+                                      bitmap */
+    CCARD_ERR_NOMEM = -6,           /**< Out of memory */
     CCARD_ERR_PLACEHOLDER
 };
 
@@ -30,6 +36,41 @@ enum {
     CCARD_ALGO_PLACEHOLDER
 };
 
+/**
+ * Register width options, see hll_cnt_pack
+ * */
+enum {
+    CCARD_OPT_REG6 = 0x20,         /**< Packed 6-bit registers */
+    CCARD_OPT_REG5 = 0x40,         /**< Packed 5-bit registers */
+    CCARD_OPT_REG4 = 0x60,         /**< 4-bit offsets and exceptions */
+    CCARD_OPT_REG_MASK = 0x60
+};
+
+/**
+ * Serialization flags, combined with algorithm in the first byte
+ * */
+enum {
+    CCARD_FLAG_COMPRESSED = 0x20,  /**< Bitmap encoded by bc_encode */
+    CCARD_FLAG_DELTA = 0x40        /**< Delta of modified buckets only */
+};
+
+/**
+ * Bytes of header buffer given to xxx_cnt_get_iov, which holds the
+ * serialized header and the ID byte of a sparse bitmap stored without it
+ * */
+#define CCARD_IOV_HDR_LEN 4
+
+/**
+ * View flags, see xxx_cnt_view_init
+ * */
+enum {
+    CCARD_VIEW_RDONLY = 0x00,      /**< Borrowed bitmap is never written */
+    CCARD_VIEW_WRITABLE = 0x01,    /**< Borrowed bitmap is updated in place */
+    CCARD_VIEW_SHARED = 0x03       /**< Borrowed bitmap is shared by
+                                        processes and updated atomically,
+                                        see ccard_shm_open */
+};
+
 /**
  * Hash functions
  * */
@@ -77,6 +118,11 @@ typedef struct ccard_algo_s {
     int             (*errnum) (void *ctx);
     /** Convert error code to human-friendly messages */
     const char     *(*errstr) (int errn);
+    /** Allocate algorithm ctx with optional raw data from the given
+     * allocator */
+    void           *(*raw_init_alloc) (const void *buf, uint32_t len_or_hint,
+                                       uint8_t opt,
+                                       const ccard_allocator_t *alloc);
 } ccard_algo_t;
 
 #ifdef __cplusplus
@@ -0,0 +1,227 @@
+#ifndef CCARD_MAP_H__
+#define CCARD_MAP_H__
+
+#include "ccard_common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Sketch map is an open-addressing hash table from group key to counter
+ * context, e.g. for GROUP BY COUNT(DISTINCT). Contexts of all groups and
+ * copies of group keys are carved from a slab allocator owned by the map
+ * (see ccard_slab_init), so there's no allocation per group from the global
+ * allocator and all groups are released at once.
+ *
+ * Contexts are created by algo->raw_init_alloc with the options given to
+ * ccard_map_init. With CCARD_OPT_SPARSE, groups start with sparse bitmaps
+ * and each one is converted to the normal bitmap once it grows large
+ * enough, so small groups take a few bytes only.
+ *
+ * With a memory budget set by ccard_map_set_budget, the least recently used
+ * groups are spilled once the map takes more memory than the budget: their
+ * counters are serialized by algo->get_bytes, appended to a spill file in
+ * batches and released, while their keys stay in memory. A spilled group is
+ * read back on the next access, and ccard_map_card counts spilled groups
+ * from the mapped spill file without reading them back. Counter contexts got
+ * from the map are then valid only until the next call on the map, because
+ * they may be spilled by it.
+ *
+ * Usage:
+ * @code{c}
+ * ccard_map_t *map = ccard_map_init(hll_algo, 14,
+ *                                   CCARD_HASH_MURMUR | CCARD_OPT_SPARSE);
+ * for each row {
+ *     ccard_map_offer(map, group, group_len, value, value_len);
+ * }
+ * ccard_map_card(map, cards);
+ * ccard_map_fini(map);
+ * @endcode
+ * */
+
+/**
+ * Opaque sketch map type
+ * */
+typedef struct ccard_map_s ccard_map_t;
+
+/**
+ * Initialize an empty sketch map.
+ *
+ * @param[in] algo Algorithm definition of counters.
+ * @param[in] k Base-2 logarithm of buckets number of each counter.
+ * @param[in] opt Options of each counter, see algo->raw_init.
+ *
+ * @retval not-NULL An initialized map to be used with the rest of methods.
+ * @retval NULL If error occured.
+ *
+ * @see ccard_map_fini
+ * */
+ccard_map_t    *ccard_map_init(const ccard_algo_t *algo, uint8_t k,
+                               uint8_t opt);
+
+/**
+ * Set memory budget of the map and enable spilling cold groups to disk.
+ *
+ * @param[in,out] map The map.
+ * @param[in] budget Bytes of keys and counters to keep in memory, groups
+ * are spilled down to 7/8 of it once it's exceeded. The most recently used
+ * group is never spilled, so the budget may be exceeded by it alone.
+ * @param[in] path Path of spill file, which is created or truncated, and
+ * removed by ccard_map_fini. Ignored if the map has a spill file already.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see ccard_map_spilled
+ * */
+int             ccard_map_set_budget(ccard_map_t *map, size_t budget,
+                                     const char *path);
+
+/**
+ * Get counter context of a group.
+ *
+ * @param[in,out] map The map.
+ * @param[in] key Group key.
+ * @param[in] len Length of group key.
+ * @param[in] create 1 to create the group if it's not in the map.
+ *
+ * @retval not-NULL Counter context of the group, which is owned by the map
+ * and could be used with algo functions but fini. With a memory budget, it's
+ * valid until the next call on the map.
+ * @retval NULL If the group isn't in the map or error occured.
+ * */
+void           *ccard_map_get(ccard_map_t *map, const void *key,
+                              uint32_t len, int create);
+
+/**
+ * Offer a value to the counter of a group, which is created if it's not in
+ * the map.
+ *
+ * @param[in,out] map The map.
+ * @param[in] key Group key.
+ * @param[in] klen Length of group key.
+ * @param[in] buf Value to be distinct counted.
+ * @param[in] len Length of value.
+ *
+ * @retval 1 If the value affected counting of the group.
+ * @retval 0 If counting of the group isn't affected.
+ * @retval -1 If error occured.
+ *
+ * @see ccard_map_offer_batch
+ * */
+int             ccard_map_offer(ccard_map_t *map, const void *key,
+                                uint32_t klen, const void *buf,
+                                uint32_t len);
+
+/**
+ * Offer a batch of (group key, value) pairs. Consecutive pairs of the same
+ * group are looked up once, so batches sorted or clustered by group key are
+ * faster.
+ *
+ * @param[in,out] map The map.
+ * @param[in] n Number of pairs.
+ * @param[in] keys Group keys.
+ * @param[in] klens Lengths of group keys.
+ * @param[in] bufs Values to be distinct counted.
+ * @param[in] lens Lengths of values.
+ *
+ * @retval >=0 Number of values that affected counting.
+ * @retval -1 If error occured, pairs before the failed one were offered.
+ *
+ * @see ccard_map_offer
+ * */
+int64_t         ccard_map_offer_batch(ccard_map_t *map, uint32_t n,
+                                      const void *const *keys,
+                                      const uint32_t *klens,
+                                      const void *const *bufs,
+                                      const uint32_t *lens);
+
+/**
+ * Get number of groups in the map.
+ *
+ * @param[in] map The map.
+ *
+ * @retval Number of groups.
+ * */
+uint32_t        ccard_map_size(const ccard_map_t *map);
+
+/**
+ * Get number of groups spilled to disk.
+ *
+ * @param[in] map The map.
+ *
+ * @retval Number of spilled groups.
+ *
+ * @see ccard_map_set_budget
+ * */
+uint32_t        ccard_map_spilled(const ccard_map_t *map);
+
+/**
+ * Iterate over groups in the order they were created. Spilled groups are
+ * read back if ctx is wanted.
+ *
+ * @param[in,out] map The map.
+ * @param[in,out] pos Iterator position, must be 0 on the first call.
+ * @param[out] key Store group key, could be NULL.
+ * @param[out] len Store length of group key, could be NULL.
+ * @param[out] ctx Store counter context of the group, could be NULL.
+ *
+ * @retval 1 If a group was got.
+ * @retval 0 If there are no more groups or error occured, see
+ * ccard_map_errnum.
+ * */
+int             ccard_map_next(ccard_map_t *map, uint32_t *pos,
+                               const void **key, uint32_t *len,
+                               void **ctx);
+
+/**
+ * Get cardinalities of all groups.
+ *
+ * @param[in,out] map The map.
+ * @param[out] cards Store cardinalities of ccard_map_size groups, in the
+ * order of ccard_map_next.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ * */
+int             ccard_map_card(ccard_map_t *map, int64_t *cards);
+
+/**
+ * Remove all groups, spill file is truncated.
+ *
+ * @param[in,out] map The map.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ * */
+int             ccard_map_reset(ccard_map_t *map);
+
+/**
+ * Release the map and all of its groups, spill file is removed.
+ *
+ * @param[in] map The map.
+ *
+ * @retval 0 If success.
+ * @retval -1 If map is NULL.
+ * */
+int             ccard_map_fini(ccard_map_t *map);
+
+/**
+ * Get error code of the last failed operation, which could be converted to
+ * message by algo->errstr.
+ *
+ * @param[in] map The map.
+ *
+ * @retval Error code, CCARD_OK if there's no error.
+ * */
+int             ccard_map_errnum(ccard_map_t *map);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vi:ft=c ts=4 sw=4 fdm=marker et
+ * */
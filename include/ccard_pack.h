@@ -0,0 +1,191 @@
+#ifndef CCARD_PACK_H__
+#define CCARD_PACK_H__
+
+#include "ccard_common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Sketch pack file holds many serialized bitmaps of mixed algorithms, each
+ * one stored under a key, and a sorted index of keys, so that it's mapped
+ * once and any bitmap is looked up by binary search in O(log n):
+ *
+ *  +------------+----------+-----+----------+------------------+------+
+ *  | header[64] | record 0 | ... | record n | index[n * 32]    | keys |
+ *  +------------+----------+-----+----------+------------------+------+
+ *
+ * All integers are little-endian. The header is:
+ *
+ *  - magic[8] "CCARDPAK", version[4], number of records[4]
+ *  - offset of index[8], length of keys[8]
+ *  - checksum of index and keys[4], zero padding up to 64 bytes
+ *
+ * Records are serialized bitmaps returned by xxx_cnt_get_bytes (with the 3
+ * bytes algorithm/hash/k header), each one starting at an offset aligned to
+ * 64 bytes, i.e. a cache line. The index is sorted by key in memcmp order,
+ * shorter keys first on ties, and each entry is:
+ *
+ *  - offset of record[8], offset of key in keys[8]
+ *  - length of key[4], length of record[4]
+ *  - checksum of record[4], zero padding[4]
+ *
+ * Checksums are murmurhash of the covered bytes. Records are written first
+ * and the header last, so a pack that wasn't finished is rejected by
+ * ccard_pack_open.
+ *
+ * Records are got as pointers into the mapping, so they could be estimated
+ * or merged from without copying by read-only views, see xxx_cnt_view_init,
+ * while buf[0] tells which algorithm the record belongs to.
+ *
+ * Usage:
+ * @code{c}
+ * ccard_pack_writer_t *w = ccard_pack_create("daily.pak");
+ * for each sketch {
+ *     hll_cnt_get_bytes(ctx, buf, &len);
+ *     ccard_pack_add(w, key, klen, buf, len);
+ * }
+ * ccard_pack_finish(w);
+ *
+ * ccard_pack_t *pack = ccard_pack_open("daily.pak");
+ * if (ccard_pack_find(pack, key, klen, &buf, &len) == 0) {
+ *     hll_cnt_ctx_t *view = hll_cnt_view_init(buf, len, CCARD_VIEW_RDONLY);
+ *     ...
+ * }
+ * ccard_pack_close(pack);
+ * @endcode
+ * */
+
+/**
+ * Opaque pack writer type
+ * */
+typedef struct ccard_pack_writer_s ccard_pack_writer_t;
+
+/**
+ * Opaque mapped pack type
+ * */
+typedef struct ccard_pack_s ccard_pack_t;
+
+/**
+ * Create a pack file to be written.
+ *
+ * @param[in] path Path of the pack file, which is created or truncated.
+ *
+ * @retval not-NULL A writer to add records by ccard_pack_add.
+ * @retval NULL If error occured.
+ *
+ * @see ccard_pack_finish
+ * */
+ccard_pack_writer_t *ccard_pack_create(const char *path);
+
+/**
+ * Add a serialized bitmap to the pack under the given key. Records are
+ * written as they are added, while keys are kept in memory until the index
+ * is written by ccard_pack_finish.
+ *
+ * @param[in,out] w The writer.
+ * @param[in] key Key of the record, which must be unique in the pack.
+ * @param[in] klen Length of key.
+ * @param[in] buf Pointer to the serialized bitmap (with 3 bytes header).
+ * @param[in] len The length of the serialized bitmap.
+ *
+ * @retval 0 If success.
+ * @retval CCARD_ERR_INVALID_ARGUMENT If any argument is invalid.
+ * @retval CCARD_ERR_INVALID_CTX If failed to allocate memory.
+ * @retval CCARD_ERR_IO If failed to write the file.
+ * */
+int             ccard_pack_add(ccard_pack_writer_t *w, const void *key,
+                               uint32_t klen, const void *buf, uint32_t len);
+
+/**
+ * Write the index and the header, and release the writer.
+ *
+ * @param[in] w The writer.
+ *
+ * @retval 0 If success.
+ * @retval CCARD_ERR_INVALID_ARGUMENT If w is NULL or keys aren't unique, the
+ * pack is left unfinished.
+ * @retval CCARD_ERR_INVALID_CTX If failed to allocate memory.
+ * @retval CCARD_ERR_IO If failed to write the file, or any record failed to
+ * be added before.
+ * */
+int             ccard_pack_finish(ccard_pack_writer_t *w);
+
+/**
+ * Map a pack file and check its header and index.
+ *
+ * @param[in] path Path of the pack file.
+ *
+ * @retval not-NULL The mapped pack.
+ * @retval NULL If failed to map the file, or it isn't a finished pack.
+ *
+ * @see ccard_pack_close
+ * */
+ccard_pack_t   *ccard_pack_open(const char *path);
+
+/**
+ * Get number of records in the pack.
+ *
+ * @param[in] pack The pack.
+ *
+ * @retval Number of records.
+ * */
+uint32_t        ccard_pack_size(const ccard_pack_t *pack);
+
+/**
+ * Look a record up by key and check its checksum.
+ *
+ * @param[in] pack The pack.
+ * @param[in] key Key of the record.
+ * @param[in] klen Length of key.
+ * @param[out] buf Store pointer to the serialized bitmap, which is valid
+ * until the pack is closed.
+ * @param[out] len Store length of the serialized bitmap.
+ *
+ * @retval 0 If the record was found.
+ * @retval 1 If key isn't in the pack.
+ * @retval CCARD_ERR_INVALID_ARGUMENT If any argument is NULL.
+ * @retval CCARD_ERR_IO If the record is corrupted.
+ * */
+int             ccard_pack_find(const ccard_pack_t *pack, const void *key,
+                                uint32_t klen, const void **buf,
+                                uint32_t *len);
+
+/**
+ * Get the i-th record in key order and check its checksum.
+ *
+ * @param[in] pack The pack.
+ * @param[in] i Index of the record, less than ccard_pack_size.
+ * @param[out] key Store pointer to key, could be NULL.
+ * @param[out] klen Store length of key, could be NULL.
+ * @param[out] buf Store pointer to the serialized bitmap.
+ * @param[out] len Store length of the serialized bitmap.
+ *
+ * @retval 0 If success.
+ * @retval CCARD_ERR_INVALID_ARGUMENT If i is out of range or any required
+ * argument is NULL.
+ * @retval CCARD_ERR_IO If the record is corrupted.
+ * */
+int             ccard_pack_get(const ccard_pack_t *pack, uint32_t i,
+                               const void **key, uint32_t *klen,
+                               const void **buf, uint32_t *len);
+
+/**
+ * Unmap the pack, records and views of them can't be used afterwards.
+ *
+ * @param[in] pack The pack.
+ *
+ * @retval 0 If success.
+ * @retval -1 If pack is NULL.
+ * */
+int             ccard_pack_close(ccard_pack_t *pack);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vi:ft=c ts=4 sw=4 fdm=marker et
+ * */
@@ -0,0 +1,163 @@
+#ifndef CCARD_SHARDED_H__
+#define CCARD_SHARDED_H__
+
+#include "ccard_common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Sharded sketch counts distinct values offered by many threads with one
+ * private counter context (shard) per thread or per CPU, so that offers
+ * don't share registers or cache lines. It works with any algorithm through
+ * its ccard_algo_t, unlike concurrent contexts (see xxx_cnt_set_concurrent)
+ * which raise registers of one context atomically.
+ *
+ * Each offer takes the shard of the calling thread, or of the CPU it runs
+ * on with CCARD_SHARDED_CPU. The shard is held by an uncontended flag on
+ * its own cache line, and if it's held by another thread, e.g. one preempted
+ * on the same CPU or a reader merging it, the next free shard is taken
+ * instead, so offers never wait while there are more shards than threads
+ * offering.
+ *
+ * ccard_sharded_card merges all shards into a context of the same
+ * algorithm, which is kept with its cardinality until any shard is
+ * modified, so reading an idle sketch repeatedly costs a pass over the
+ * shard stamps only.
+ *
+ * Usage:
+ * @code{c}
+ * ccard_sharded_t *s = ccard_sharded_init(hll_algo, 14, CCARD_HASH_MURMUR,
+ *                                         0, CCARD_SHARDED_CPU);
+ * // in any thread
+ * ccard_sharded_offer(s, value, value_len);
+ * ...
+ * ccard_sharded_card(s);
+ * ccard_sharded_fini(s);
+ * @endcode
+ * */
+
+/**
+ * Opaque sharded sketch type
+ * */
+typedef struct ccard_sharded_s ccard_sharded_t;
+
+/**
+ * Sharded sketch flags, see ccard_sharded_init
+ * */
+enum {
+    CCARD_SHARDED_CPU = 0x01       /**< Pick shards by CPU (sched_getcpu) */
+};
+
+/**
+ * Initialize an empty sharded sketch.
+ *
+ * @param[in] algo Algorithm definition of shards.
+ * @param[in] k Base-2 logarithm of buckets number of each shard.
+ * @param[in] opt Options of each shard, see algo->raw_init. With
+ * CCARD_OPT_SPARSE, shards of threads offering a few values stay small.
+ * @param[in] shards Number of shards, 0 for the number of CPUs.
+ * @param[in] flags CCARD_SHARDED_CPU to pick shards by the CPU the calling
+ * thread runs on, or 0 to pick them by thread, in the order threads offer
+ * for the first time.
+ *
+ * @retval not-NULL An initialized sharded sketch.
+ * @retval NULL If error occured.
+ *
+ * @see ccard_sharded_fini
+ * */
+ccard_sharded_t *ccard_sharded_init(const ccard_algo_t *algo, uint8_t k,
+                                    uint8_t opt, uint32_t shards, int flags);
+
+/**
+ * Get number of shards.
+ *
+ * @param[in] s The sharded sketch.
+ *
+ * @retval Number of shards.
+ * */
+uint32_t        ccard_sharded_size(const ccard_sharded_t *s);
+
+/**
+ * Offer a value to the shard of the calling thread. Could be called by many
+ * threads at the same time.
+ *
+ * @param[in,out] s The sharded sketch.
+ * @param[in] buf Value to be distinct counted.
+ * @param[in] len Length of value.
+ *
+ * @retval 1 If the value affected counting of the shard.
+ * @retval 0 If counting of the shard isn't affected.
+ * @retval -1 If error occured.
+ * */
+int             ccard_sharded_offer(ccard_sharded_t *s, const void *buf,
+                                    uint32_t len);
+
+/**
+ * Get cardinality of all values offered to the sketch, shards are merged
+ * only if any of them was modified since the last call. Could be called
+ * while other threads are offering, values offered meanwhile may or may not
+ * be counted.
+ *
+ * @param[in,out] s The sharded sketch.
+ *
+ * @retval >=0 Estimated cardinality.
+ * @retval -1 If error occured.
+ * */
+int64_t         ccard_sharded_card(ccard_sharded_t *s);
+
+/**
+ * Get serialized bytes of all shards merged, see algo->get_bytes. Could be
+ * called while other threads are offering.
+ *
+ * @param[in,out] s The sharded sketch.
+ * @param[out] buf Store serialized bitmap, or NULL to get its length only.
+ * @param[in,out] len Length of buf, store length of serialized bitmap.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ * */
+int             ccard_sharded_get_bytes(ccard_sharded_t *s, void *buf,
+                                        uint32_t *len);
+
+/**
+ * Reset all shards, effectively clear cardinality to zero. Values offered
+ * by other threads meanwhile may or may not be kept.
+ *
+ * @param[in,out] s The sharded sketch.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ * */
+int             ccard_sharded_reset(ccard_sharded_t *s);
+
+/**
+ * Release the sharded sketch and all of its shards, no thread may be using
+ * it.
+ *
+ * @param[in] s The sharded sketch.
+ *
+ * @retval 0 If success.
+ * @retval -1 If s is NULL.
+ * */
+int             ccard_sharded_fini(ccard_sharded_t *s);
+
+/**
+ * Get error code of the last failed operation, which could be converted to
+ * message by algo->errstr.
+ *
+ * @param[in] s The sharded sketch.
+ *
+ * @retval Error code, CCARD_OK if there's no error.
+ * */
+int             ccard_sharded_errnum(ccard_sharded_t *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vi:ft=c ts=4 sw=4 fdm=marker et
+ * */
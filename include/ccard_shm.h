@@ -0,0 +1,107 @@
+#ifndef CCARD_SHM_H__
+#define CCARD_SHM_H__
+
+#include "ccard_common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Shared sketches live in memory shared by processes, e.g. pre-forked
+ * workers, which all offer into one sketch without locks instead of keeping
+ * private ones to be merged later.
+ *
+ * A serialized normal bitmap (with 3 bytes header) is put in a POSIX shared
+ * memory segment by ccard_shm_open, or in a mapping shared by the caller,
+ * e.g. mmap with MAP_SHARED | MAP_ANONYMOUS before fork. Each process then
+ * borrows it by xxx_cnt_view_init with CCARD_VIEW_SHARED, which raises
+ * registers by atomic byte-max, i.e. compare-and-swap loops on the aligned
+ * words holding them. Estimator state which isn't in the bitmap, like sums
+ * of adaptive counting buckets, is recomputed on read.
+ *
+ * Shared views are supported by adaptive, hyperloglog and hyperloglogplus
+ * counting.
+ *
+ * Usage:
+ * @code{c}
+ * // before fork, or in every worker
+ * hll_cnt_ctx_t *tmp = hll_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR);
+ * hll_cnt_get_bytes(tmp, buf, &len);
+ * void *shm = ccard_shm_open("/sketch", buf, len);
+ * hll_cnt_ctx_t *ctx = hll_cnt_view_init(shm, len, CCARD_VIEW_SHARED);
+ * ...
+ * hll_cnt_offer(ctx, value, value_len);
+ * ...
+ * hll_cnt_fini(ctx);
+ * ccard_shm_close(shm, len);
+ * @endcode
+ * */
+
+/**
+ * Map a POSIX shared memory segment holding a serialized bitmap, the segment
+ * is created and initialized with the given bitmap if it doesn't exist.
+ *
+ * The creator writes the header last, so other processes opening the
+ * segment meanwhile wait for it to be initialized, up to about 1 second.
+ *
+ * @param[in] name Name of the segment, see shm_open.
+ * @param[in] buf Pointer to the initial serialized bitmap (with 3 bytes
+ * header), also checked against the header of an existing segment.
+ * @param[in] len The length of the serialized bitmap, which is the size of
+ * the segment.
+ *
+ * @retval not-NULL The mapping of len bytes.
+ * @retval NULL If failed to map the segment, or an existing one holds
+ * another kind of bitmap.
+ *
+ * @see ccard_shm_close, ccard_shm_unlink
+ * */
+void           *ccard_shm_open(const char *name, const void *buf,
+                               uint32_t len);
+
+/**
+ * Unmap a segment mapped by ccard_shm_open, views of it can't be used
+ * afterwards. The segment stays until it's unlinked.
+ *
+ * @param[in] addr The mapping.
+ * @param[in] len The length of the mapping.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ * */
+int             ccard_shm_close(void *addr, uint32_t len);
+
+/**
+ * Remove a shared memory segment, processes having it mapped keep using it.
+ *
+ * @param[in] name Name of the segment.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ * */
+int             ccard_shm_unlink(const char *name);
+
+/**
+ * Raise byte i of a buffer to v atomically, by compare-and-swap on the
+ * aligned 32-bit word holding it. Bytes whose word isn't entirely in the
+ * buffer are swapped alone.
+ *
+ * @param[in,out] buf The buffer, which may be updated by other processes.
+ * @param[in] len The length of the buffer.
+ * @param[in] i Index of the byte, less than len.
+ * @param[in] v The value to raise to.
+ *
+ * @retval The old value, the byte was raised if it's less than v.
+ * */
+uint8_t         ccard_shm_max(uint8_t *buf, uint32_t len, uint32_t i,
+                              uint8_t v);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vi:ft=c ts=4 sw=4 fdm=marker et
+ * */
@@ -0,0 +1,147 @@
+#ifndef EXPLICITSET_H__
+#define EXPLICITSET_H__
+
+#include <stdint.h>
+#include "ccard_alloc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Set of distinct 64-bit hash values in an open-addressing table, used as the
+ * exact "explicit" tier before counting with registers. Empty slots are 0, so
+ * hash value 0 is tracked by a separate flag.
+ *
+ * The serialized explicit bitmap is:
+ *
+ *  +-------+-------+-------+-----+
+ *  | ID[1] | H0[8] | H1[8] | ... |
+ *  +-------+-------+-------+-----+
+ *
+ * where ID is 0xc0|k, see MAKE_EXPLICIT_ID, and H* are distinct hash values
+ * in ascending order, as 8-byte little-endian integers.
+ * */
+typedef struct exp_set_s {
+    uint32_t        count;  /* hash values number */
+    uint32_t        limit;  /* max hash values number */
+    uint32_t        size;   /* slots number, power of 2 */
+    uint8_t         zero;   /* 1 if hash value 0 is in the set */
+    uint64_t       *H;      /* slots */
+    const ccard_allocator_t *alloc; /* allocator of slots */
+} exp_set_t;
+
+/**
+ * Initialize a new empty set.
+ *
+ * @param[in] limit Max number of hash values the set could hold.
+ * @param[in] alloc Allocator of the set, NULL for the global one.
+ *
+ * @retval not-NULL An initialized set to be used with the rest of methods.
+ * @retval NULL If error occured.
+ * */
+exp_set_t      *es_init(uint32_t limit, const ccard_allocator_t *alloc);
+
+/**
+ * Add a hash value to set. The table grows geometrically while the set has
+ * less than limit values.
+ *
+ * @param[in] es Set.
+ * @param[in] h Hash value.
+ *
+ * @retval 1 If added.
+ * @retval 0 If it's in the set already.
+ * @retval -1 If error occured or the set is full.
+ * */
+int             es_add(exp_set_t *es, uint64_t h);
+
+/**
+ * Iterate over all hash values in set, in no particular order.
+ *
+ * @param[in] es Set.
+ * @param[in,out] pos Iterator position, must be 0 on the first call.
+ * @param[out] h Store next hash value.
+ *
+ * @retval 1 If a hash value was got.
+ * @retval 0 If there are no more values.
+ * */
+int             es_next(const exp_set_t *es, uint32_t *pos, uint64_t *h);
+
+/**
+ * Serialize set to explicit bitmap.
+ *
+ * @param[in] es Set.
+ * @param[in] k Base-2 logarithm of buckets number of the counter.
+ * @param[out] out Buffer that stores explicit bitmap. NULL if only length is
+ * needed.
+ *
+ * @retval Length of explicit bitmap in bytes.
+ * */
+uint32_t        es_dump(const exp_set_t *es, uint8_t k, uint8_t *out);
+
+/**
+ * Verify an explicit bitmap got by es_dump.
+ *
+ * @param[in] in Explicit bitmap.
+ * @param[in] len Length of explicit bitmap.
+ * @param[in] hl Bit length of hash values of the context it's merged to,
+ * values not fitting in hl bits are rejected.
+ *
+ * @retval -1 If the bitmap is corrupted.
+ * @retval >0 The base-2 logarithm of buckets number, i.e. k.
+ * */
+int             es_verify(const uint8_t *in, uint32_t len, uint8_t hl);
+
+/**
+ * Get the i-th hash value of an explicit bitmap.
+ *
+ * @param[in] in Explicit bitmap.
+ * @param[in] i Hash value number, less than (len - 1) / 8.
+ *
+ * @retval Hash value.
+ * */
+uint64_t        es_hash_at(const uint8_t *in, uint32_t i);
+
+/**
+ * Remove all hash values.
+ *
+ * @param[in] es Set.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ * */
+int             es_reset(exp_set_t *es);
+
+/**
+ * Copy set into another one, whose slots are reused if it has as many.
+ *
+ * @param[in] dst Set to be overwritten, NULL to initialize a new one.
+ * @param[in] src Set to copy, NULL to destroy dst.
+ * @param[in] alloc Allocator of the new set if dst is NULL, NULL for the
+ * global one.
+ *
+ * @retval not-NULL The copy.
+ * @retval NULL If src is NULL or error occured, dst is destroyed in either
+ * case.
+ * */
+exp_set_t      *es_copy(exp_set_t *dst, const exp_set_t *src,
+                        const ccard_allocator_t *alloc);
+
+/**
+ * Destory set and release resource.
+ *
+ * @param[in] es Set.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ * */
+int             es_fini(exp_set_t *es);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vi:ft=c ts=4 sw=4 fdm=marker et
+ * */
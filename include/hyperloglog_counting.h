@@ -15,10 +15,25 @@ typedef struct hll_cnt_ctx_s hll_cnt_ctx_t;
 /**
  * Initialize hyperloglog counting context with optional raw bitmap.
  *
- * @param[in] buf Pointer to the raw bitmap. NULL if there's none.
+ * With CCARD_OPT_SPARSE, a context without initial bitmap starts with a
+ * sparse bitmap of non-empty buckets in the same format as adaptive counting
+ * (see adp_cnt_raw_init), which is converted to the normal one once it gets
+ * as large as the registers. Raw and serialized bitmaps of sparse context
+ * are sparse ones as well.
+ *
+ * With CCARD_OPT_EXPLICIT, a context without initial bitmap keeps distinct
+ * hash values and counts exactly until they take more memory than the
+ * registers, then they are converted to a sparse bitmap. Raw bitmap of such
+ * context is an explicit one, see explicit_set.h. Explicit contexts and
+ * bitmaps are merged without folding, as hash values don't depend on k.
+ *
+ * @param[in] buf Pointer to the raw bitmap, either normal, sparse or
+ * explicit one. NULL if there's none.
  * @param[in] len_or_k The length of the bitmap if buf is not NULL;
  * otherwise it's the base-2 logarithm of the bitmap length.
- * @param[in] hf Hash function that be applied to elements.
+ * @param[in] hf Hash function that be applied to elements, optionally
+ * combined with CCARD_OPT_SPARSE or CCARD_OPT_EXPLICIT, and CCARD_OPT_REG6,
+ * CCARD_OPT_REG5 or CCARD_OPT_REG4 to pack registers.
  *
  * @retval not-NULL An initialized context to be used with the rest of
  * methods.
@@ -32,10 +47,15 @@ hll_cnt_ctx_t  *hll_cnt_raw_init(const void *obuf, uint32_t len_or_k,
 /**
  * Initialize hyperloglog counting context with optional serialized bitmap.
  *
+ * The serialized bitmap could be a compressed one, see
+ * hll_cnt_get_compressed_bytes.
+ *
  * @param[in] buf Pointer to the serialized bitmap. NULL if there's none.
  * @param[in] len_or_k The length of the bitmap if buf is not NULL;
  * otherwise it's the base-2 logarithm of the bitmap length.
- * @param[in] hf Hash function that be applied to elements.
+ * @param[in] hf Hash function that be applied to elements, optionally
+ * combined with CCARD_OPT_SPARSE, and CCARD_OPT_REG6, CCARD_OPT_REG5 or
+ * CCARD_OPT_REG4 to pack registers, see hll_cnt_raw_init.
  *
  * @retval not-NULL An initialized context to be used with the rest of
  * methods.
@@ -46,6 +66,115 @@ hll_cnt_ctx_t  *hll_cnt_raw_init(const void *obuf, uint32_t len_or_k,
 hll_cnt_ctx_t  *hll_cnt_init(const void *obuf, uint32_t len_or_k,
                              uint8_t hf);
 
+/**
+ * Initialize hyperloglog counting context with optional raw bitmap, whose
+ * memory is got from the given allocator instead of the global one.
+ *
+ * @param[in] alloc Allocator of the context, e.g. the one of an arena got
+ * by ccard_arena_allocator. NULL for the global one.
+ *
+ * @see hll_cnt_raw_init, ccard_set_allocator
+ * */
+hll_cnt_ctx_t  *hll_cnt_raw_init_alloc(const void *obuf, uint32_t len_or_k,
+                                       uint8_t hf,
+                                       const ccard_allocator_t *alloc);
+
+/**
+ * Initialize hyperloglog counting context with optional serialized bitmap,
+ * whose memory is got from the given allocator instead of the global one.
+ *
+ * @param[in] alloc Allocator of the context, NULL for the global one.
+ *
+ * @see hll_cnt_init, ccard_set_allocator
+ * */
+hll_cnt_ctx_t  *hll_cnt_init_alloc(const void *obuf, uint32_t len_or_k,
+                                   uint8_t hf,
+                                   const ccard_allocator_t *alloc);
+
+/**
+ * Initialize hyperloglog counting context as a view of serialized bitmap, which
+ * is borrowed in place instead of copied, e.g. bitmap in a memory-mapped
+ * file or shared memory.
+ *
+ * Only normal bitmaps could be borrowed, sparse, explicit or compressed ones
+ * should be given to hll_cnt_init. A read-only view could be estimated,
+ * serialized and merged from, while updating it fails with CCARD_ERR_VIEW.
+ * A writable view updates the borrowed bitmap in place, but it can't be
+ * folded or packed. The bitmap must outlive the view, and shouldn't be
+ * changed but through the view.
+ *
+ * A shared view is a writable one whose bitmap is updated by other
+ * processes as well, e.g. in a segment mapped by ccard_shm_open. Its
+ * registers are raised atomically, so processes offer to and merge into the
+ * same bitmap without locks.
+ *
+ * @param[in] buf Pointer to the serialized bitmap (with 3 bytes header).
+ * @param[in] len The length of the serialized bitmap.
+ * @param[in] flags CCARD_VIEW_RDONLY, CCARD_VIEW_WRITABLE or
+ * CCARD_VIEW_SHARED.
+ *
+ * @retval not-NULL A context borrowing the bitmap. hll_cnt_fini releases
+ * the context only.
+ * @retval NULL If the bitmap can't be borrowed.
+ *
+ * @see hll_cnt_init, hll_cnt_fini
+ * */
+hll_cnt_ctx_t  *hll_cnt_view_init(const void *buf, uint32_t len,
+                                  uint8_t flags);
+
+/**
+ * Initialize hyperloglog counting context as a deep copy of another one,
+ * with the same representation (sparse, explicit, dense or packed registers)
+ * and delta epoch, from the allocator of src. A view is copied into a
+ * context owning its bitmap.
+ *
+ * @param[in] src Pointer to the context to copy.
+ *
+ * @retval not-NULL An initialized context to be used with the rest of
+ * methods.
+ * @retval NULL If error occured.
+ *
+ * @see hll_cnt_copy_into, hll_cnt_fini
+ * */
+hll_cnt_ctx_t  *hll_cnt_clone(hll_cnt_ctx_t *src);
+
+/**
+ * Overwrite a context with a deep copy of another one, like hll_cnt_clone.
+ * Memory of dst is resized only if src needs a different size, so copying
+ * between contexts of the same k and representation doesn't allocate, e.g.
+ * snapshots of a counter taken over and over. dst keeps its allocator and
+ * lazy reset.
+ *
+ * @param[in,out] dst Pointer to the context to be overwritten, which can't
+ * be a view.
+ * @param[in] src Pointer to the context to copy.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured, dst could only be finalized then.
+ *
+ * @see hll_cnt_clone
+ * */
+int             hll_cnt_copy_into(hll_cnt_ctx_t *dst, hll_cnt_ctx_t *src);
+
+/**
+ * Replace bitmap in the context with a serialized one, like a context
+ * initialized by hll_cnt_init with it. A normal bitmap of the same hash
+ * function and k is copied over dense unpacked registers in place, others
+ * are decoded into a temporary context first. Register width set by
+ * hll_cnt_pack is kept, and the next delta is a full one.
+ *
+ * @param[in,out] ctx Pointer to the context, which can't be a view.
+ * @param[in] buf Pointer to the serialized bitmap, see hll_cnt_get_bytes.
+ * @param[in] len The length of the serialized bitmap.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured, ctx is unchanged if the bitmap is invalid.
+ *
+ * @see hll_cnt_init, hll_cnt_get_bytes
+ * */
+int             hll_cnt_load_bytes(hll_cnt_ctx_t *ctx, const void *buf,
+                                   uint32_t len);
+
 /**
  * Retrieve the cardinality calculated from bitmap in the context using
  * Hyperloglog Counting.
@@ -88,6 +217,45 @@ int             hll_cnt_offer(hll_cnt_ctx_t *ctx, const void *buf,
  * */
 int             hll_cnt_reset(hll_cnt_ctx_t *ctx);
 
+/**
+ * Turn lazy reset of the context on or off. With lazy reset, hll_cnt_reset
+ * costs O(1) instead of clearing the whole bitmap: it only advances an epoch,
+ * and each block of 256 bytes of the bitmap is cleared when it's touched for
+ * the first time after reset, e.g. for window counters reset very often. Only dense
+ * unpacked registers are reset lazily, sparse, explicit and packed ones are
+ * reset as usual.
+ * Views can't be reset lazily.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] on 1 to turn lazy reset on, 0 to turn it off.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see hll_cnt_reset
+ * */
+int             hll_cnt_set_lazy_reset(hll_cnt_ctx_t *ctx, int on);
+
+/**
+ * Turn concurrent mode of the context on or off. In concurrent mode, many
+ * threads could call hll_cnt_offer on the context at the same time without
+ * locking, and hll_cnt_card while they're offering: registers are raised by
+ * atomic compare-and-swap, like the ones of shared views. Sparse, explicit
+ * and packed registers are converted to dense 8-bit ones when it's turned on,
+ * and stay dense, so hll_cnt_pack to other widths fails meanwhile.
+ * Other functions mustn't be called while threads are offering. Views and
+ * contexts with lazy reset can't be concurrent.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] on 1 to turn concurrent mode on, 0 to turn it off.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see hll_cnt_offer, hll_cnt_set_lazy_reset
+ * */
+int             hll_cnt_set_concurrent(hll_cnt_ctx_t *ctx, int on);
+
 /**
  * Get the raw bitmap or bitmap length from context.
  *
@@ -120,6 +288,48 @@ int             hll_cnt_get_raw_bytes(hll_cnt_ctx_t *ctx, void *buf,
 int             hll_cnt_get_bytes(hll_cnt_ctx_t *ctx, void *buf,
                                   uint32_t *len);
 
+/**
+ * Get the serialized bitmap as an I/O vector pointing to the bitmap in the
+ * context, e.g. for writev or sendmsg without copying the bitmap into a
+ * buffer. iov[0] points to the header stored in hdr and iov[1] to the
+ * bitmap, which together are the same bytes as hll_cnt_get_bytes. The
+ * vector is valid until the context is modified or finalized.
+ *
+ * Only bitmaps stored as they are serialized could be got this way, explicit and packed ones
+ * fail with CCARD_ERR_INVALID_ARGUMENT and should be got by
+ * hll_cnt_get_bytes.
+ *
+ * @param[in] ctx Pointer to the context.
+ * @param[out] hdr Buffer of CCARD_IOV_HDR_LEN bytes storing the header.
+ * @param[out] iov Store 2 elements of the I/O vector.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see hll_cnt_get_bytes
+ * */
+int             hll_cnt_get_iov(hll_cnt_ctx_t *ctx, uint8_t *hdr,
+                                struct iovec *iov);
+
+/**
+ * Get the compressed serialized bitmap or its length from context. It's
+ * the same as hll_cnt_get_bytes except that CCARD_FLAG_COMPRESSED is set in
+ * the algorithm byte and the bitmap is encoded by bc_encode, which could
+ * be given to hll_cnt_init and hll_cnt_merge_bytes directly.
+ *
+ * @param[in] ctx Pointer to the context.
+ * @param[out] buf Pointer to buffer storing returning bitmap. NULL if only
+ * bitmap length is needed.
+ * @param[out] len Pointer to variable storing returning bitmap length.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see hll_cnt_get_bytes, bitmap_codec.h
+ * */
+int             hll_cnt_get_compressed_bytes(hll_cnt_ctx_t *ctx, void *buf,
+                                             uint32_t *len);
+
 /**
  * Merge several hyperloglog counting context into the current one,
  * effectively combined all distinct countings.
@@ -132,8 +342,9 @@ int             hll_cnt_get_bytes(hll_cnt_ctx_t *ctx, void *buf,
  * }
  * @endcode
  *
- * @note All context to be merged must be of the same bitmap length,
- * otherwise error will be returned!
+ * @note All context to be merged must use the same hash function,
+ * otherwise error will be returned! Contexts with different bitmap length
+ * are folded to the lowest precision among them, see hll_cnt_fold.
  *
  * @param[in,out] ctx Pointer to the context merging to.
  * @param[in] tbm Pointer to the first context to be merged. The rest
@@ -160,8 +371,8 @@ int             hll_cnt_merge(hll_cnt_ctx_t *ctx, hll_cnt_ctx_t *tbm,
  * }
  * @endcode
  *
- * @note All bitmap to be merged must be of the same length with the bitmap
- * in current context, otherwise error will be returned!
+ * @note Bitmaps with different length from the bitmap in current context
+ * are folded to the lowest precision among them, see hll_cnt_fold.
  *
  * @param[in,out] ctx Pointer to the context merging to.
  * @param[in] buf Pointer to the first bitmap to be merged.
@@ -190,8 +401,8 @@ int             hll_cnt_merge_raw_bytes(hll_cnt_ctx_t *ctx,
  * }
  * @endcode
  *
- * @note All bitmap to be merged must be of the same length with the bitmap
- * in current context, otherwise error will be returned!
+ * @note Bitmaps with different length from the bitmap in current context
+ * are folded to the lowest precision among them, see hll_cnt_fold.
  *
  * @param[in,out] ctx Pointer to the context merging to.
  * @param[in] buf Pointer to the first bitmap to be merged.
@@ -207,6 +418,112 @@ int             hll_cnt_merge_bytes(hll_cnt_ctx_t *ctx,
                                     const void *buf, uint32_t len,
                                     ...);
 
+/**
+ * Fold the bitmap in the context to a lower precision, as if all counted
+ * objects were offered to a context with 2^new_k buckets.
+ *
+ * Neighbouring buckets are combined and their values are recomputed with
+ * the dropped bucket index bits, so the result is exactly the same as
+ * counting with the lower precision from the beginning. Memory of the
+ * dropped buckets is released.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] new_k The base-2 logarithm of the new bitmap length, must be
+ * in range [1, current k].
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see hll_cnt_merge, hll_cnt_merge_bytes
+ * */
+int             hll_cnt_fold(hll_cnt_ctx_t *ctx, uint8_t new_k);
+
+/**
+ * Change the width of registers in the context. Registers are kept in bytes
+ * by default, packing them in 6 or 5 bits saves 25% or 37.5% memory, at the
+ * cost of slower offering.
+ *
+ * With 4 bits, registers are kept as offsets from the minimum of them, and
+ * the few ones exceeding 4-bit offset are kept in an exception table, which
+ * saves about 50% memory without losing any precision.
+ *
+ * Serialized bitmaps are always in bytes, regardless of register width.
+ * Sparse context keeps the width until it's converted to the normal one.
+ *
+ * @note 5-bit registers saturate at 31, which will only be exceeded with
+ * 64-bit hash functions and at probability less than 2^-30.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] width Bits per register, must be 8, 6, 5 or 4.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see hll_cnt_raw_init, hll_cnt_init
+ * */
+int             hll_cnt_pack(hll_cnt_ctx_t *ctx, uint8_t width);
+
+/**
+ * Get the buckets raised since the given epoch as a delta, which could be
+ * applied to a replica of the context with hll_cnt_apply_delta.
+ *
+ * Modified buckets are tracked since the first delta was taken, each delta
+ * taken (buf is not NULL) advances the epoch of the context by 1. If
+ * since_epoch isn't the current epoch, or nothing was tracked yet, the delta
+ * carries the whole bitmap, which is always safe to apply as buckets are
+ * merged by maximum. Reset of the context isn't propagated by deltas.
+ *
+ * Usage:
+ * @code{c}
+ * uint32_t epoch = hll_cnt_epoch(ctx);
+ * hll_cnt_get_delta(ctx, epoch, NULL, &len);
+ * hll_cnt_get_delta(ctx, epoch, buf, &len);
+ * // send buf to replicas, then
+ * hll_cnt_apply_delta(replica, buf, len);
+ * @endcode
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] since_epoch Epoch of the context when the last delta was taken.
+ * @param[out] buf Pointer to buffer storing returning delta. NULL if only
+ * delta length is needed.
+ * @param[out] len Pointer to variable storing returning delta length.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see hll_cnt_apply_delta, hll_cnt_epoch
+ * */
+int             hll_cnt_get_delta(hll_cnt_ctx_t *ctx, uint32_t since_epoch,
+                                  void *buf, uint32_t *len);
+
+/**
+ * Apply a delta got by hll_cnt_get_delta to the context, buckets in it are
+ * merged by maximum.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] buf Pointer to the delta.
+ * @param[in] len Length of the delta.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see hll_cnt_get_delta
+ * */
+int             hll_cnt_apply_delta(hll_cnt_ctx_t *ctx, const void *buf,
+                                    uint32_t len);
+
+/**
+ * Get the current delta epoch of the context.
+ *
+ * @param[in] ctx Pointer to the context.
+ *
+ * @retval >=0 Number of deltas taken from the context.
+ * @retval -1 If error occured.
+ *
+ * @see hll_cnt_get_delta
+ * */
+int64_t         hll_cnt_epoch(hll_cnt_ctx_t *ctx);
+
 /**
  * Finalize and release resources of the given hyperloglog counting
  * context.
@@ -243,6 +560,138 @@ int             hll_cnt_errnum(hll_cnt_ctx_t *ctx);
  * */
 const char     *hll_cnt_errstr(int errn);
 
+/**
+ * Opaque virtual hyperloglog counting context type
+ * */
+typedef struct vhll_cnt_ctx_s vhll_cnt_ctx_t;
+
+/**
+ * Initialize virtual hyperloglog counting context, counting distinct
+ * elements per key with one register pool shared by all keys (vHLL).
+ *
+ * Each key owns 2^log2s virtual registers, which are pseudo-randomly mapped
+ * to the 2^log2m registers of the pool by key. Elements are offered to the
+ * virtual registers of their key like hll_cnt_offer, so registers of a key
+ * are raised by other keys mapped to the same ones, and vhll_cnt_card
+ * subtracts such noise estimated from the whole pool. Memory is fixed to
+ * 2^log2m bytes however many keys there are, e.g. distinct destinations of
+ * each one of 10M sources in a 256MB pool (log2m = 28).
+ *
+ * The noise grows with the total cardinality of the pool, so small keys are
+ * estimated with much larger relative errors than by a standalone counter.
+ *
+ * @param[in] log2m Base-2 logarithm of registers number of the pool, from
+ * log2s + 1 to 31.
+ * @param[in] log2s Base-2 logarithm of virtual registers number of each key,
+ * from 4 to 16.
+ * @param[in] hf Hash function that be applied to elements.
+ *
+ * @retval not-NULL An initialized context to be used with the rest of
+ * vhll_cnt_* methods.
+ * @retval NULL If error occured.
+ *
+ * @see vhll_cnt_fini
+ * */
+vhll_cnt_ctx_t *vhll_cnt_init(uint8_t log2m, uint8_t log2s, uint8_t hf);
+
+/**
+ * Initialize virtual hyperloglog counting context, whose memory is got from
+ * the given allocator instead of the global one.
+ *
+ * @param[in] alloc Allocator of the context, NULL for the global one.
+ *
+ * @see vhll_cnt_init, ccard_set_allocator
+ * */
+vhll_cnt_ctx_t *vhll_cnt_init_alloc(uint8_t log2m, uint8_t log2s,
+                                    uint8_t hf,
+                                    const ccard_allocator_t *alloc);
+
+/**
+ * Offer a object of the given key to be distinct counted.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] key Pointer to the key.
+ * @param[in] klen The length of the key.
+ * @param[in] buf Pointer to the buffer storing object.
+ * @param[in] len The length of the buffer.
+ *
+ * @retval 1 If the object raised a register of the pool.
+ * @retval 0 If registers aren't affected by the object.
+ * @retval -1 If error occured.
+ *
+ * @see vhll_cnt_card
+ * */
+int             vhll_cnt_offer(vhll_cnt_ctx_t *ctx, const void *key,
+                               uint32_t klen, const void *buf,
+                               uint32_t len);
+
+/**
+ * Retrieve the cardinality of the given key. The estimate of the whole pool
+ * is cached until registers are raised, so querying many keys after
+ * offering scans the pool once.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] key Pointer to the key.
+ * @param[in] klen The length of the key.
+ *
+ * @retval >=0 Estimated cardinality of the key, 0 for keys never offered up
+ * to noise.
+ * @retval -1 If error occured.
+ *
+ * @see vhll_cnt_offer, vhll_cnt_card_total
+ * */
+int64_t         vhll_cnt_card(vhll_cnt_ctx_t *ctx, const void *key,
+                              uint32_t klen);
+
+/**
+ * Retrieve the cardinality of the whole pool counted by hyperloglog over all
+ * registers, which is the noise subtracted by vhll_cnt_card. It's close to
+ * the number of distinct (key, object) pairs if keys are small, while
+ * objects of keys much larger than 2^log2s are underestimated, as they only
+ * raise the virtual registers of their keys.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ *
+ * @retval >=0 Estimated cardinality of the pool.
+ * @retval -1 If error occured.
+ *
+ * @see vhll_cnt_card
+ * */
+int64_t         vhll_cnt_card_total(vhll_cnt_ctx_t *ctx);
+
+/**
+ * Reset all registers of the pool.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ * */
+int             vhll_cnt_reset(vhll_cnt_ctx_t *ctx);
+
+/**
+ * Finalize and release resources of the given virtual hyperloglog counting
+ * context.
+ *
+ * @param[in] ctx Pointer to the context to release.
+ *
+ * @retval 0 if finalized successfully.
+ * @retval -1 if error occured.
+ *
+ * @see vhll_cnt_init
+ * */
+int             vhll_cnt_fini(vhll_cnt_ctx_t *ctx);
+
+/**
+ * Get error status of the given context, which could be converted to message
+ * by hll_cnt_errstr.
+ *
+ * @param[in] ctx Pointer to the context.
+ *
+ * @retval <=0 Error number in the context.
+ * */
+int             vhll_cnt_errnum(vhll_cnt_ctx_t *ctx);
+
 /**
  * Hyperloglog counting algorithm definition
  * */
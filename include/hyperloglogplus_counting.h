@@ -27,9 +27,49 @@ typedef struct hllp_cnt_ctx_s hllp_cnt_ctx_t;
  * */
 hllp_cnt_ctx_t  *hllp_cnt_raw_init(const void *obuf, uint32_t len_or_k);
 
+/**
+ * Initialize hyperloglogplus counting context with optional raw bitmap and
+ * options.
+ *
+ * With CCARD_OPT_SPARSE, a context without initial bitmap starts in sparse
+ * representation: hashes are kept with 2^25 precision as a sorted list in
+ * varint-delta coding, and new ones are collected in a temporary buffer
+ * merged into the list in batches. Cardinality of sparse context is
+ * estimated by linear counting with 2^25 buckets, which is nearly exact.
+ * The context is converted to the normal one once the list gets larger
+ * than the bitmap, k must be in range [4, 18] for sparse representation.
+ *
+ * Raw bitmap of sparse context starts with a sparse ID (see
+ * sparse_bitmap.h), it always gets a sparse context.
+ *
+ * With CCARD_OPT_EXPLICIT, a context without initial bitmap keeps distinct
+ * hashes and counts exactly until they take more memory than the registers.
+ * They are converted to sparse representation then if k is in range
+ * [4, 18], otherwise to the normal one. Raw bitmap of such context is an
+ * explicit one, see explicit_set.h.
+ *
+ * @param[in] buf Pointer to the raw bitmap. NULL if there's none.
+ * @param[in] len_or_k The length of the bitmap if buf is not NULL;
+ * otherwise it's the base-2 logarithm of the bitmap length.
+ * @param[in] opt Options, combination of CCARD_OPT_SPARSE or
+ * CCARD_OPT_EXPLICIT and one of CCARD_OPT_REG6, CCARD_OPT_REG5 (see
+ * hllp_cnt_pack).
+ *
+ * @retval not-NULL An initialized context to be used with the rest of
+ * methods.
+ * @retval NULL If error occured.
+ *
+ * @see hllp_cnt_fini, hllp_cnt_raw_init
+ * */
+hllp_cnt_ctx_t  *hllp_cnt_raw_init_opt(const void *obuf, uint32_t len_or_k,
+                                       uint8_t opt);
+
 /**
  * Initialize hyperloglogplus counting context with optional serialized bitmap.
  *
+ * The serialized bitmap could be a compressed one, see
+ * hllp_cnt_get_compressed_bytes.
+ *
  * @param[in] buf Pointer to the serialized bitmap. NULL if there's none.
  * @param[in] len_or_k The length of the bitmap if buf is not NULL;
  * otherwise it's the base-2 logarithm of the bitmap length.
@@ -42,6 +82,115 @@ hllp_cnt_ctx_t  *hllp_cnt_raw_init(const void *obuf, uint32_t len_or_k);
  * */
 hllp_cnt_ctx_t  *hllp_cnt_init(const void *obuf, uint32_t len_or_k);
 
+/**
+ * Initialize hyperloglog++ counting context with optional raw bitmap and
+ * options, whose memory is got from the given allocator instead of the
+ * global one.
+ *
+ * @param[in] alloc Allocator of the context, e.g. the one of an arena got
+ * by ccard_arena_allocator. NULL for the global one.
+ *
+ * @see hllp_cnt_raw_init_opt, ccard_set_allocator
+ * */
+hllp_cnt_ctx_t  *hllp_cnt_raw_init_alloc(const void *obuf, uint32_t len_or_k,
+                                         uint8_t opt,
+                                         const ccard_allocator_t *alloc);
+
+/**
+ * Initialize hyperloglog++ counting context with optional serialized bitmap,
+ * whose memory is got from the given allocator instead of the global one.
+ *
+ * @param[in] alloc Allocator of the context, NULL for the global one.
+ *
+ * @see hllp_cnt_init, ccard_set_allocator
+ * */
+hllp_cnt_ctx_t  *hllp_cnt_init_alloc(const void *obuf, uint32_t len_or_k,
+                                     const ccard_allocator_t *alloc);
+
+/**
+ * Initialize hyperloglogplus counting context as a view of serialized bitmap, which
+ * is borrowed in place instead of copied, e.g. bitmap in a memory-mapped
+ * file or shared memory.
+ *
+ * Only normal bitmaps could be borrowed, sparse, explicit or compressed ones
+ * should be given to hllp_cnt_init. A read-only view could be estimated,
+ * serialized and merged from, while updating it fails with CCARD_ERR_VIEW.
+ * A writable view updates the borrowed bitmap in place, but it can't be
+ * folded or packed. The bitmap must outlive the view, and shouldn't be
+ * changed but through the view.
+ *
+ * A shared view is a writable one whose bitmap is updated by other
+ * processes as well, e.g. in a segment mapped by ccard_shm_open. Its
+ * registers are raised atomically, so processes offer to and merge into the
+ * same bitmap without locks.
+ *
+ * @param[in] buf Pointer to the serialized bitmap (with 3 bytes header).
+ * @param[in] len The length of the serialized bitmap.
+ * @param[in] flags CCARD_VIEW_RDONLY, CCARD_VIEW_WRITABLE or
+ * CCARD_VIEW_SHARED.
+ *
+ * @retval not-NULL A context borrowing the bitmap. hllp_cnt_fini releases
+ * the context only.
+ * @retval NULL If the bitmap can't be borrowed.
+ *
+ * @see hllp_cnt_init, hllp_cnt_fini
+ * */
+hllp_cnt_ctx_t *hllp_cnt_view_init(const void *buf, uint32_t len,
+                                   uint8_t flags);
+
+/**
+ * Initialize hyperloglog plus counting context as a deep copy of another
+ * one, with the same representation (sparse, explicit, dense or packed
+ * registers) and delta epoch, from the allocator of src. A view is copied
+ * into a context owning its bitmap.
+ *
+ * @param[in] src Pointer to the context to copy.
+ *
+ * @retval not-NULL An initialized context to be used with the rest of
+ * methods.
+ * @retval NULL If error occured.
+ *
+ * @see hllp_cnt_copy_into, hllp_cnt_fini
+ * */
+hllp_cnt_ctx_t *hllp_cnt_clone(hllp_cnt_ctx_t *src);
+
+/**
+ * Overwrite a context with a deep copy of another one, like hllp_cnt_clone.
+ * Memory of dst is resized only if src needs a different size, so copying
+ * between contexts of the same k and representation doesn't allocate. The
+ * temporary buffer of sparse src is merged first, and the one of dst is
+ * kept for reuse. dst keeps its allocator.
+ *
+ * @param[in,out] dst Pointer to the context to be overwritten, which can't
+ * be a view.
+ * @param[in] src Pointer to the context to copy.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured, dst could only be finalized then.
+ *
+ * @see hllp_cnt_clone
+ * */
+int             hllp_cnt_copy_into(hllp_cnt_ctx_t *dst, hllp_cnt_ctx_t *src);
+
+/**
+ * Replace bitmap in the context with a serialized one, like a context
+ * initialized by hllp_cnt_init with it. A normal bitmap of the same k is
+ * copied over dense unpacked registers in place, others are decoded into a
+ * temporary context first. Register width set by hllp_cnt_pack is kept, and
+ * the next delta is a full one.
+ *
+ * @param[in,out] ctx Pointer to the context, which can't be a view.
+ * @param[in] buf Pointer to the serialized bitmap, see hllp_cnt_get_bytes.
+ * @param[in] len The length of the serialized bitmap.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured, ctx is unchanged if the bitmap is invalid.
+ *
+ * @see hllp_cnt_init, hllp_cnt_get_bytes
+ * */
+int             hllp_cnt_load_bytes(hllp_cnt_ctx_t *ctx, const void *buf,
+                                    uint32_t len);
+
 /**
  * Retrieve the cardinality calculated from bitmap in the context using
  * Hyperloglogplus Counting.
@@ -63,7 +212,8 @@ int64_t         hllp_cnt_card(hllp_cnt_ctx_t *ctx);
  * @param[in] buf Pointer to the buffer storing object.
  * @param[in] len The length of the buffer.
  *
- * @retval 1 If the object affected final counting.
+ * @retval 1 If the object affected final counting. Always returned by
+ * sparse context.
  * @retval 0 If final counting isn't affected by the object.
  * @retval -1 If error occured.
  *
@@ -84,6 +234,26 @@ int             hllp_cnt_offer(hllp_cnt_ctx_t *ctx, const void *buf,
  * */
 int             hllp_cnt_reset(hllp_cnt_ctx_t *ctx);
 
+/**
+ * Turn concurrent mode of the context on or off. In concurrent mode, many
+ * threads could call hllp_cnt_offer on the context at the same time without
+ * locking, and hllp_cnt_card while they're offering: registers are raised by
+ * atomic compare-and-swap, like the ones of shared views. Sparse, explicit
+ * and packed registers are converted to dense 8-bit ones when it's turned on,
+ * and stay dense, so hllp_cnt_pack to other widths fails meanwhile.
+ * Other functions mustn't be called while threads are offering. Views can't
+ * be concurrent.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] on 1 to turn concurrent mode on, 0 to turn it off.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see hllp_cnt_offer
+ * */
+int             hllp_cnt_set_concurrent(hllp_cnt_ctx_t *ctx, int on);
+
 /**
  * Get the raw bitmap or bitmap length from context.
  *
@@ -116,6 +286,48 @@ int             hllp_cnt_get_raw_bytes(hllp_cnt_ctx_t *ctx, void *buf,
 int             hllp_cnt_get_bytes(hllp_cnt_ctx_t *ctx, void *buf,
                                    uint32_t *len);
 
+/**
+ * Get the serialized bitmap as an I/O vector pointing to the bitmap in the
+ * context, e.g. for writev or sendmsg without copying the bitmap into a
+ * buffer. iov[0] points to the header stored in hdr and iov[1] to the
+ * bitmap, which together are the same bytes as hllp_cnt_get_bytes. The
+ * vector is valid until the context is modified or finalized.
+ *
+ * Only bitmaps stored as they are serialized could be got this way, explicit and packed ones
+ * fail with CCARD_ERR_INVALID_ARGUMENT and should be got by
+ * hllp_cnt_get_bytes.
+ *
+ * @param[in] ctx Pointer to the context.
+ * @param[out] hdr Buffer of CCARD_IOV_HDR_LEN bytes storing the header.
+ * @param[out] iov Store 2 elements of the I/O vector.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see hllp_cnt_get_bytes
+ * */
+int             hllp_cnt_get_iov(hllp_cnt_ctx_t *ctx, uint8_t *hdr,
+                                 struct iovec *iov);
+
+/**
+ * Get the compressed serialized bitmap or its length from context. It's
+ * the same as hllp_cnt_get_bytes except that CCARD_FLAG_COMPRESSED is set in
+ * the algorithm byte and the bitmap is encoded by bc_encode, which could
+ * be given to hllp_cnt_init and hllp_cnt_merge_bytes directly.
+ *
+ * @param[in] ctx Pointer to the context.
+ * @param[out] buf Pointer to buffer storing returning bitmap. NULL if only
+ * bitmap length is needed.
+ * @param[out] len Pointer to variable storing returning bitmap length.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see hllp_cnt_get_bytes, bitmap_codec.h
+ * */
+int             hllp_cnt_get_compressed_bytes(hllp_cnt_ctx_t *ctx, void *buf,
+                                              uint32_t *len);
+
 /**
  * Merge several hyperloglogplus counting context into the current one,
  * effectively combined all distinct countings.
@@ -128,8 +340,9 @@ int             hllp_cnt_get_bytes(hllp_cnt_ctx_t *ctx, void *buf,
  * }
  * @endcode
  *
- * @note All context to be merged must be of the same bitmap length,
- * otherwise error will be returned!
+ * @note All context to be merged must use the same hash function,
+ * otherwise error will be returned! Contexts with different bitmap length
+ * are folded to the lowest precision among them, see hllp_cnt_fold.
  *
  * @param[in,out] ctx Pointer to the context merging to.
  * @param[in] tbm Pointer to the first context to be merged. The rest
@@ -156,8 +369,8 @@ int             hllp_cnt_merge(hllp_cnt_ctx_t *ctx, hllp_cnt_ctx_t *tbm,
  * }
  * @endcode
  *
- * @note All bitmap to be merged must be of the same length with the bitmap
- * in current context, otherwise error will be returned!
+ * @note Bitmaps with different length from the bitmap in current context
+ * are folded to the lowest precision among them, see hllp_cnt_fold.
  *
  * @param[in,out] ctx Pointer to the context merging to.
  * @param[in] buf Pointer to the first bitmap to be merged.
@@ -186,8 +399,8 @@ int             hllp_cnt_merge_raw_bytes(hllp_cnt_ctx_t *ctx,
  * }
  * @endcode
  *
- * @note All bitmap to be merged must be of the same length with the bitmap
- * in current context, otherwise error will be returned!
+ * @note Bitmaps with different length from the bitmap in current context
+ * are folded to the lowest precision among them, see hllp_cnt_fold.
  *
  * @param[in,out] ctx Pointer to the context merging to.
  * @param[in] buf Pointer to the first bitmap to be merged.
@@ -203,6 +416,108 @@ int             hllp_cnt_merge_bytes(hllp_cnt_ctx_t *ctx,
                                      const void *buf, uint32_t len,
                                      ...);
 
+/**
+ * Fold the bitmap in the context to a lower precision, as if all counted
+ * objects were offered to a context with 2^new_k buckets.
+ *
+ * Neighbouring buckets are combined and their values are recomputed with
+ * the dropped bucket index bits, so the result is exactly the same as
+ * counting with the lower precision from the beginning.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] new_k The base-2 logarithm of the new bitmap length, must be
+ * in range [4, current k].
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see hllp_cnt_merge, hllp_cnt_merge_bytes
+ * */
+int             hllp_cnt_fold(hllp_cnt_ctx_t *ctx, uint8_t new_k);
+
+/**
+ * Change the width of registers in the context. Registers are kept in bytes
+ * by default, packing them in 6 or 5 bits saves 25% or 37.5% memory, at the
+ * cost of slower offering. 6 bits are enough for any register value of
+ * HyperLogLog++.
+ *
+ * Serialized bitmaps are always in bytes, regardless of register width.
+ * Sparse context keeps the width until it's converted to the normal one.
+ *
+ * @note 5-bit registers saturate at 31, which will only be exceeded at
+ * probability less than 2^-30.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] width Bits per register, must be 8, 6 or 5.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see hllp_cnt_raw_init, hllp_cnt_init
+ * */
+int             hllp_cnt_pack(hllp_cnt_ctx_t *ctx, uint8_t width);
+
+/**
+ * Get the buckets raised since the given epoch as a delta, which could be
+ * applied to a replica of the context with hllp_cnt_apply_delta.
+ *
+ * Modified buckets are tracked since the first delta was taken, each delta
+ * taken (buf is not NULL) advances the epoch of the context by 1. If
+ * since_epoch isn't the current epoch, or nothing was tracked yet, the delta
+ * carries the whole bitmap, which is always safe to apply as buckets are
+ * merged by maximum. Reset of the context isn't propagated by deltas.
+ *
+ * Usage:
+ * @code{c}
+ * uint32_t epoch = hllp_cnt_epoch(ctx);
+ * hllp_cnt_get_delta(ctx, epoch, NULL, &len);
+ * hllp_cnt_get_delta(ctx, epoch, buf, &len);
+ * // send buf to replicas, then
+ * hllp_cnt_apply_delta(replica, buf, len);
+ * @endcode
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] since_epoch Epoch of the context when the last delta was taken.
+ * @param[out] buf Pointer to buffer storing returning delta. NULL if only
+ * delta length is needed.
+ * @param[out] len Pointer to variable storing returning delta length.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see hllp_cnt_apply_delta, hllp_cnt_epoch
+ * */
+int             hllp_cnt_get_delta(hllp_cnt_ctx_t *ctx, uint32_t since_epoch,
+                                   void *buf, uint32_t *len);
+
+/**
+ * Apply a delta got by hllp_cnt_get_delta to the context, buckets in it are
+ * merged by maximum.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] buf Pointer to the delta.
+ * @param[in] len Length of the delta.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see hllp_cnt_get_delta
+ * */
+int             hllp_cnt_apply_delta(hllp_cnt_ctx_t *ctx, const void *buf,
+                                     uint32_t len);
+
+/**
+ * Get the current delta epoch of the context.
+ *
+ * @param[in] ctx Pointer to the context.
+ *
+ * @retval >=0 Number of deltas taken from the context.
+ * @retval -1 If error occured.
+ *
+ * @see hllp_cnt_get_delta
+ * */
+int64_t         hllp_cnt_epoch(hllp_cnt_ctx_t *ctx);
+
 /**
  * Finalize and release resources of the given hyperloglogplus counting
  * context.
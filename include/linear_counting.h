@@ -33,6 +33,9 @@ lnr_cnt_ctx_t  *lnr_cnt_raw_init(const void *obuf, uint32_t len_or_k,
 /**
  * Initialize linear counting context with optional serialized bitmap.
  *
+ * The serialized bitmap could be a compressed one, see
+ * lnr_cnt_get_compressed_bytes.
+ *
  * @param[in] buf Pointer to the serialized bitmap (with 3 bytes header).
  * NULL if there's none.
  * @param[in] len_or_k The length of the bitmap if buf is not NULL;
@@ -49,6 +52,104 @@ lnr_cnt_ctx_t  *lnr_cnt_raw_init(const void *obuf, uint32_t len_or_k,
 lnr_cnt_ctx_t  *lnr_cnt_init(const void *obuf, uint32_t len_or_k,
                              uint8_t hf);
 
+/**
+ * Initialize linear counting context with optional raw bitmap, whose memory
+ * is got from the given allocator instead of the global one.
+ *
+ * @param[in] alloc Allocator of the context, e.g. the one of an arena got
+ * by ccard_arena_allocator. NULL for the global one.
+ *
+ * @see lnr_cnt_raw_init, ccard_set_allocator
+ * */
+lnr_cnt_ctx_t  *lnr_cnt_raw_init_alloc(const void *obuf, uint32_t len_or_k,
+                                       uint8_t hf,
+                                       const ccard_allocator_t *alloc);
+
+/**
+ * Initialize linear counting context with optional serialized bitmap, whose
+ * memory is got from the given allocator instead of the global one.
+ *
+ * @param[in] alloc Allocator of the context, NULL for the global one.
+ *
+ * @see lnr_cnt_init, ccard_set_allocator
+ * */
+lnr_cnt_ctx_t  *lnr_cnt_init_alloc(const void *obuf, uint32_t len_or_k,
+                                   uint8_t hf,
+                                   const ccard_allocator_t *alloc);
+
+/**
+ * Initialize linear counting context as a view of serialized bitmap, which
+ * is borrowed in place instead of copied, e.g. bitmap in a memory-mapped
+ * file or shared memory.
+ *
+ * Only normal bitmaps could be borrowed, sparse, explicit or compressed ones
+ * should be given to lnr_cnt_init. A read-only view could be estimated,
+ * serialized and merged from, while updating it fails with CCARD_ERR_VIEW.
+ * A writable view updates the borrowed bitmap in place, but it can't be
+ * folded or packed. The bitmap must outlive the view, and shouldn't be
+ * changed but through the view.
+ *
+ * @param[in] buf Pointer to the serialized bitmap (with 3 bytes header).
+ * @param[in] len The length of the serialized bitmap.
+ * @param[in] flags CCARD_VIEW_RDONLY or CCARD_VIEW_WRITABLE.
+ *
+ * @retval not-NULL A context borrowing the bitmap. lnr_cnt_fini releases
+ * the context only.
+ * @retval NULL If the bitmap can't be borrowed.
+ *
+ * @see lnr_cnt_init, lnr_cnt_fini
+ * */
+lnr_cnt_ctx_t  *lnr_cnt_view_init(const void *buf, uint32_t len,
+                                  uint8_t flags);
+
+/**
+ * Initialize linear counting context as a copy of another one, from the
+ * allocator of src. The count of empty bits is copied, so the bitmap isn't
+ * traversed again. A view is copied into a context owning its bitmap.
+ *
+ * @param[in] src Pointer to the context to copy.
+ *
+ * @retval not-NULL An initialized context to be used with the rest of
+ * methods.
+ * @retval NULL If error occured.
+ *
+ * @see lnr_cnt_copy_into, lnr_cnt_fini
+ * */
+lnr_cnt_ctx_t  *lnr_cnt_clone(lnr_cnt_ctx_t *src);
+
+/**
+ * Overwrite a context with a copy of another one of the same bitmap length,
+ * whose bitmap is copied in place without any allocation. dst keeps its
+ * allocator and lazy reset.
+ *
+ * @param[in,out] dst Pointer to the context to be overwritten, which can't
+ * be a view.
+ * @param[in] src Pointer to the context to copy.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured, e.g. bitmap lengths differ.
+ *
+ * @see lnr_cnt_clone
+ * */
+int             lnr_cnt_copy_into(lnr_cnt_ctx_t *dst, lnr_cnt_ctx_t *src);
+
+/**
+ * Replace bitmap in the context with a serialized one of the same hash
+ * function and bitmap length, which is copied in place. Compressed bitmap
+ * is decoded first.
+ *
+ * @param[in,out] ctx Pointer to the context, which can't be a view.
+ * @param[in] buf Pointer to the serialized bitmap, see lnr_cnt_get_bytes.
+ * @param[in] len The length of the serialized bitmap.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured, ctx is unchanged then.
+ *
+ * @see lnr_cnt_init, lnr_cnt_get_bytes
+ * */
+int             lnr_cnt_load_bytes(lnr_cnt_ctx_t *ctx, const void *buf,
+                                   uint32_t len);
+
 /**
  * Retrieve the cardinality calculated from bitmap in the context using
  * Linear Counting.
@@ -91,6 +192,23 @@ int             lnr_cnt_offer(lnr_cnt_ctx_t *ctx, const void *buf,
  * */
 int             lnr_cnt_reset(lnr_cnt_ctx_t *ctx);
 
+/**
+ * Turn lazy reset of the context on or off. With lazy reset, lnr_cnt_reset
+ * costs O(1) instead of clearing the whole bitmap: it only advances an epoch,
+ * and each block of 256 bytes of the bitmap is cleared when it's touched for
+ * the first time after reset, e.g. for window counters reset very often.
+ * Views can't be reset lazily.
+ *
+ * @param[in,out] ctx Pointer to the context.
+ * @param[in] on 1 to turn lazy reset on, 0 to turn it off.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see lnr_cnt_reset
+ * */
+int             lnr_cnt_set_lazy_reset(lnr_cnt_ctx_t *ctx, int on);
+
 /**
  * Get the raw bitmap or bitmap length from context.
  *
@@ -123,6 +241,44 @@ int             lnr_cnt_get_raw_bytes(lnr_cnt_ctx_t *ctx, void *buf,
 int             lnr_cnt_get_bytes(lnr_cnt_ctx_t *ctx, void *buf,
                                   uint32_t *len);
 
+/**
+ * Get the serialized bitmap as an I/O vector pointing to the bitmap in the
+ * context, e.g. for writev or sendmsg without copying the bitmap into a
+ * buffer. iov[0] points to the header stored in hdr and iov[1] to the
+ * bitmap, which together are the same bytes as lnr_cnt_get_bytes. The
+ * vector is valid until the context is modified or finalized.
+ *
+ * @param[in] ctx Pointer to the context.
+ * @param[out] hdr Buffer of CCARD_IOV_HDR_LEN bytes storing the header.
+ * @param[out] iov Store 2 elements of the I/O vector.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see lnr_cnt_get_bytes
+ * */
+int             lnr_cnt_get_iov(lnr_cnt_ctx_t *ctx, uint8_t *hdr,
+                                struct iovec *iov);
+
+/**
+ * Get the compressed serialized bitmap or its length from context. It's
+ * the same as lnr_cnt_get_bytes except that CCARD_FLAG_COMPRESSED is set in
+ * the algorithm byte and the bitmap is encoded by bc_encode, which could
+ * be given to lnr_cnt_init and lnr_cnt_merge_bytes directly.
+ *
+ * @param[in] ctx Pointer to the context.
+ * @param[out] buf Pointer to buffer storing returning bitmap. NULL if only
+ * bitmap length is needed.
+ * @param[out] len Pointer to variable storing returning bitmap length.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ *
+ * @see lnr_cnt_get_bytes, bitmap_codec.h
+ * */
+int             lnr_cnt_get_compressed_bytes(lnr_cnt_ctx_t *ctx, void *buf,
+                                             uint32_t *len);
+
 /**
  * Merge several linear counting context into the current one,
  * effectively combined all distinct countings.
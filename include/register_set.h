@@ -2,37 +2,76 @@
 #define REGISTERSET_H__
 
 #include <stdint.h>
+#include "ccard_alloc.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * Set of fixed-width registers packed into 32-bit words. Registers never
+ * straddle word boundaries, so each word holds floor(32 / width) registers
+ * and the remaining high bits are always zero, as stream-lib does.
+ * */
 typedef struct reg_set_s {
-    uint32_t        count;
-    uint32_t        size;
+    uint32_t        count;  /* logical registers number */
+    uint32_t        size;   /* words number */
+    uint8_t         width;  /* bits per register */
+    const ccard_allocator_t *alloc; /* allocator of the set */
     uint32_t        M[1];
 } reg_set_t;
 
 /**
- * Initialize a new register set.
+ * Initialize a new register set of 5-bit registers, which is compatible with
+ * stream-lib.
  *
  * @param[in] count Logical elements number of register set.
  * @param[in] values Initial values. NULL if there is no initial values.
- * @param[in] len Length of initial values.
+ * @param[in] len Length of initial values in words.
  *
  * @retval not-NULL An initialized register set to be used with the rest of
  * methods.
  * @retval NULL If error occured.
+ *
+ * @see rs_init_width
  * */
 reg_set_t      *rs_init(uint32_t count, uint32_t *values,
                         uint32_t len);
 
+/**
+ * Initialize a new register set with the given register width.
+ *
+ * @param[in] count Logical elements number of register set.
+ * @param[in] width Bits per register, must be in range [1, 8].
+ * @param[in] values Initial values. NULL if there is no initial values.
+ * @param[in] len Length of initial values in words, must not be greater
+ * than words needed by count registers.
+ *
+ * @retval not-NULL An initialized register set to be used with the rest of
+ * methods.
+ * @retval NULL If error occured.
+ * */
+reg_set_t      *rs_init_width(uint32_t count, uint8_t width,
+                              const uint32_t *values, uint32_t len);
+
+/**
+ * Initialize a new register set with the given register width and
+ * allocator.
+ *
+ * @param[in] alloc Allocator of the set, NULL for the global one.
+ *
+ * @see rs_init_width
+ * */
+reg_set_t      *rs_init_alloc(uint32_t count, uint8_t width,
+                              const uint32_t *values, uint32_t len,
+                              const ccard_allocator_t *alloc);
+
 /**
  * Set value.
  *
  * @param[in] rs Register set.
  * @param[in] pos Logical element number.
- * @param[in] value Value to be set.
+ * @param[in] value Value to be set, truncated to register width.
  *
  * @retval 0 If success.
  * @retval -1 If error occured.
@@ -51,12 +90,37 @@ int             rs_set(reg_set_t *rs, uint32_t pos, uint32_t value);
  * */
 int             rs_get(reg_set_t *rs, uint32_t pos, uint32_t *value);
 
+/**
+ * Set each register to the maximum of itself and the corresponding one of
+ * another register set. Whole words are compared at once.
+ *
+ * @param[in,out] rs Register set.
+ * @param[in] other Register set of the same count and width.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ * */
+int             rs_merge(reg_set_t *rs, const reg_set_t *other);
+
+/**
+ * Sum 2^-value of all registers and count zero ones, which are needed by
+ * loglog-family estimators.
+ *
+ * @param[in] rs Register set.
+ * @param[out] sum Store sum of 2^-value.
+ * @param[out] zeros Store number of zero registers.
+ *
+ * @retval 0 If success.
+ * @retval -1 If error occured.
+ * */
+int             rs_sum(const reg_set_t *rs, double *sum, uint32_t *zeros);
+
 /**
  * Convert register set to bitmap.
  *
  * @param[in] rs Register set.
  * @param[out] bits Buffer that stores bitmap.
- * @param[in|out] len Buffer size and bitmap length.
+ * @param[in|out] len Buffer size and bitmap length in words.
  *
  * @retval 0 If success.
  * @retval -1 If error occured.
@@ -64,6 +128,23 @@ int             rs_get(reg_set_t *rs, uint32_t pos, uint32_t *value);
 int             rs_bits(reg_set_t *rs, uint32_t *bits,
                         uint32_t *len);
 
+/**
+ * Copy register set into another one, whose memory is reused if it has the
+ * same number of words.
+ *
+ * @param[in] dst Register set to be overwritten, NULL to initialize a new
+ * one.
+ * @param[in] src Register set to copy, NULL to destroy dst.
+ * @param[in] alloc Allocator of the new set if dst is NULL, NULL for the
+ * global one.
+ *
+ * @retval not-NULL The copy.
+ * @retval NULL If src is NULL or error occured, dst is destroyed in either
+ * case.
+ * */
+reg_set_t      *rs_copy(reg_set_t *dst, const reg_set_t *src,
+                        const ccard_allocator_t *alloc);
+
 /**
  * Destory register set and release resource.
  *
@@ -11,12 +11,17 @@ extern "C" {
 #define IS_SPARSE_BMP(bmp) ((bmp)[0] & 0x80)
 #define MAKE_SPARSE_ID(k) (0x80 | (k))
 #define K_FROM_ID(id) (0x7f & (id))
+#define IS_EXPLICIT_BMP(bmp) (((bmp)[0] & 0xc0) == 0xc0)
+#define MAKE_EXPLICIT_ID(k) (0xc0 | (k))
+#define K_FROM_EXPLICIT_ID(id) (0x3f & (id))
 
 /**
  * Additional options
  * */
 enum {
-    CCARD_OPT_SPARSE = 0x10
+    CCARD_OPT_SPARSE = 0x10,
+    CCARD_OPT_EXPLICIT = 0x80   /**< Count exactly until hashes take more
+                                  memory than registers */
 };
 
 /**
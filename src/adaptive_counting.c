@@ -8,6 +8,10 @@
 #include <math.h>
 #include "murmurhash.h"
 #include "lookup3hash.h"
+#include "explicit_set.h"
+#include "bitmap_codec.h"
+#include "block_epoch.h"
+#include "ccard_shm.h"
 #include "adaptive_counting.h"
 
 struct adp_cnt_ctx_s {
@@ -21,6 +25,52 @@ struct adp_cnt_ctx_s {
     uint32_t b_e;       /* number of empty buckets */
     uint32_t bmp_len;   /* actual bitmap length */
     uint8_t *M;         /* pointer to buckets array */
+    uint32_t epoch;     /* number of deltas taken, see adp_cnt_get_delta */
+    uint8_t *dirty;     /* bit per bucket modified since the last delta */
+    uint64_t *pending;  /* new sparse buckets not merged yet, index << 8 |
+                           value */
+    uint32_t p_cnt;     /* number of pending buckets */
+    uint32_t p_size;    /* capacity of pending buckets */
+    void *sidx;         /* sorted sparse bucket indexes, uint16_t if k <= 16
+                           or uint32_t otherwise */
+    uint8_t *sval;      /* sparse bucket values, parallel to sidx */
+    uint32_t s_cnt;     /* number of sparse buckets */
+    uint8_t s_stale;    /* 1 if sparse bitmap in M is out of date */
+    exp_set_t *es;      /* explicit hash values, M is an empty sparse bitmap
+                           if it's not NULL */
+    uint8_t view;       /* VIEW_* if M is borrowed from caller */
+    const ccard_allocator_t *alloc; /* allocator of the context */
+    blk_epoch_t *be;    /* block stamps if reset is lazy, only the normal
+                           bitmap may have stale blocks */
+    struct adp_acc_s *acc;  /* accumulators of concurrent offers, NULL
+                               unless concurrent, see adp_cnt_set_concurrent */
+    void *acc_mem;      /* allocated memory holding acc */
+};
+
+/* number of accumulators of a concurrent context, threads share them by
+ * turns */
+#define ACC_SLOTS 16
+
+/* bytes of a cache line, accumulators don't share them */
+#define LINE_SIZE 64
+
+/**
+ * Amounts Rsum and b_e are changed by concurrent offers of some threads, not
+ * added to the context yet. Each one takes a cache line, so that threads
+ * don't contend on them.
+ * */
+struct adp_acc_s {
+    uint32_t rsum;      /* sum of raised amounts of buckets */
+    uint32_t filled;    /* number of buckets which were empty */
+    uint8_t pad[LINE_SIZE - 2 * sizeof(uint32_t)];
+};
+
+/* context views, see adp_cnt_view_init */
+enum {
+    VIEW_NONE,
+    VIEW_RDONLY,
+    VIEW_WRITABLE,
+    VIEW_SHARED
 };
 
 /**
@@ -71,6 +121,11 @@ static const double alpha[] = {
  */
 static const double B_s = 0.051;
 
+/**
+ * max number of buckets pending to be merged to sparse bitmap
+ */
+#define PENDING_MAX 256
+
 static uint8_t
 num_of_trail_zeros(uint64_t i)
 {
@@ -88,88 +143,521 @@ num_of_trail_zeros(uint64_t i)
     return n - (uint8_t)((i << 1) >> 63);
 }
 
+/**
+ * Get the effective bit length of hash values produced by the given hash
+ * function, should be kept consistent with adp_cnt_offer.
+ * */
+static uint8_t
+hash_len(uint8_t hf)
+{
+    if (hf == CCARD_HASH_MURMUR) {
+        return 32;
+    }
+
+    return 64;
+}
+
+/**
+ * Fold one bucket of a bitmap with 2^k buckets into a normal bitmap with
+ * 2^(k-d) buckets.
+ *
+ * The bucket index is the highest k bits of hash value, and the bucket value
+ * is the number of trailing zeros of the rest (hl - k) bits plus 1. When
+ * dropping the lowest d bits of bucket index, those bits are prepended to the
+ * bits used for counting trailing zeros, so the value only changes if all the
+ * original (hl - k) bits were zeros.
+ * */
+static void
+fold_bucket(uint8_t *dbm, uint8_t hl, uint8_t k, uint8_t d,
+            uint32_t idx, uint8_t r)
+{
+    uint32_t low;
+    uint32_t nidx = idx >> d;
+
+    if (r == 0) {
+        return;
+    }
+
+    if (r > hl - k) {
+        /* all original counting bits are zero, continue counting on the
+         * dropped index bits */
+        low = idx & ((1U << d) - 1);
+        r = hl - k + (low ? num_of_trail_zeros(low) : d) + 1;
+    }
+
+    if (dbm[nidx] < r) {
+        dbm[nidx] = r;
+    }
+}
+
+/*
+ * While counting, sparse buckets are kept as a structure of arrays: sorted
+ * fixed-width indexes in sidx and bucket values in sval, so that no index
+ * has to be decoded from bytes on search. The sparse bitmap in M is reduced
+ * to the ID byte and rebuilt by sparse_sync_bitmap only when it's needed,
+ * i.e. before serializing or merging.
+ * */
+/**
+ * Clear blocks left stale by lazy reset, before the bitmap is read as a
+ * whole.
+ * */
+static void
+lazy_flush(adp_cnt_ctx_t *ctx)
+{
+    if(ctx->be && ctx->be->stale) {
+        be_flush(ctx->be, ctx->M);
+    }
+}
+
+/**
+ * Get accumulator slot of the calling thread, threads are assigned slots in
+ * turn the first time they offer concurrently.
+ * */
+static uint32_t
+acc_slot(void)
+{
+    static uint32_t next = 0;
+    static __thread uint32_t slot = 0;  /* slot + 1, 0 if not assigned */
+
+    if(!slot) {
+        slot = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % ACC_SLOTS + 1;
+    }
+    return slot - 1;
+}
+
+/**
+ * Get Rsum and b_e including amounts not added to the context yet by
+ * concurrent offers.
+ * */
+static void
+acc_sum(const adp_cnt_ctx_t *ctx, uint32_t *Rsum, uint32_t *b_e)
+{
+    uint32_t i;
+
+    *Rsum = ctx->Rsum;
+    *b_e = ctx->b_e;
+    for(i = 0; ctx->acc && i < ACC_SLOTS; i++) {
+        *Rsum += __atomic_load_n(&ctx->acc[i].rsum, __ATOMIC_RELAXED);
+        *b_e -= __atomic_load_n(&ctx->acc[i].filled, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Drop amounts of concurrent offers, after Rsum and b_e have been recomputed
+ * or reset.
+ * */
+static void
+acc_clear(adp_cnt_ctx_t *ctx)
+{
+    if(ctx->acc) {
+        memset(ctx->acc, 0, sizeof(struct adp_acc_s) * ACC_SLOTS);
+    }
+}
+
+static uint32_t
+sparse_idx_size(adp_cnt_ctx_t *ctx)
+{
+    return ctx->k <= 16 ? sizeof(uint16_t) : sizeof(uint32_t);
+}
+
+static uint32_t
+sparse_idx_get(adp_cnt_ctx_t *ctx, uint32_t i)
+{
+    if(ctx->k <= 16) {
+        return ((uint16_t *)ctx->sidx)[i];
+    }
+
+    return ((uint32_t *)ctx->sidx)[i];
+}
+
+static void
+sparse_idx_set(adp_cnt_ctx_t *ctx, uint32_t i, uint32_t idx)
+{
+    if(ctx->k <= 16) {
+        ((uint16_t *)ctx->sidx)[i] = (uint16_t)idx;
+    } else {
+        ((uint32_t *)ctx->sidx)[i] = idx;
+    }
+}
+
+/**
+ * Branchless lower bound search, the range is halved by a conditional move
+ * instead of a branch on every step.
+ *
+ * @retval Position of the first index not less than key.
+ * */
+static uint32_t
+lower_bound16(const uint16_t *a, uint32_t n, uint32_t key)
+{
+    const uint16_t *base = a;
+    uint32_t half;
+
+    if(n == 0) {
+        return 0;
+    }
+
+    while(n > 1) {
+        half = n >> 1;
+        base = base[half] < key ? base + half : base;
+        n -= half;
+    }
+
+    return (base - a) + (*base < key);
+}
+
+static uint32_t
+lower_bound32(const uint32_t *a, uint32_t n, uint32_t key)
+{
+    const uint32_t *base = a;
+    uint32_t half;
+
+    if(n == 0) {
+        return 0;
+    }
+
+    while(n > 1) {
+        half = n >> 1;
+        base = base[half] < key ? base + half : base;
+        n -= half;
+    }
+
+    return (base - a) + (*base < key);
+}
+
+/**
+ * Search the given bucket among sparse buckets.
+ *
+ * @retval -1 Not found.
+ * @retval >=0 Position of the bucket in sparse bucket arrays.
+ * */
 static int
-sparse_bisect_search(adp_cnt_ctx_t *ctx, int bkt_no)
-{
-    int step = ctx->sidx_len + 1; /* B[1] and IDX[d] */
-    int cur_bkts = (ctx->bmp_len - 1) / step; /* current buckets in sparse
-                                                 array */
-    int begin = 0, end = cur_bkts, mid, off, idx;
-
-    /* bisect-search the given bucket in sparse array */
-    while(begin <= end && begin < cur_bkts && end >= 0) {
-        mid = (begin + end) >> 1;
-        off = mid * step + 1;
-        idx = sparse_bytes_to_int(ctx->M, off + 1, ctx->sidx_len);
-        if(bkt_no == idx) {
-            return off;
-        } else if(bkt_no < idx) {
-            end = mid - 1;
-        } else {
-            begin = mid + 1;
-        }
+sparse_search(adp_cnt_ctx_t *ctx, uint32_t bkt_no)
+{
+    uint32_t pos;
+
+    if(ctx->k <= 16) {
+        pos = lower_bound16((const uint16_t *)ctx->sidx, ctx->s_cnt, bkt_no);
+    } else {
+        pos = lower_bound32((const uint32_t *)ctx->sidx, ctx->s_cnt, bkt_no);
+    }
+
+    if(pos < ctx->s_cnt && sparse_idx_get(ctx, pos) == bkt_no) {
+        return pos;
     }
 
     return -1;
 }
 
+static void
+sparse_free(adp_cnt_ctx_t *ctx)
+{
+    ccard_free(ctx->alloc, ctx->sidx);
+    ccard_free(ctx->alloc, ctx->sval);
+    ctx->sidx = NULL;
+    ctx->sval = NULL;
+    ctx->s_cnt = 0;
+    ctx->s_stale = 0;
+}
+
+/**
+ * Load sparse bitmap in M to sparse bucket arrays, accumulate non-empty
+ * buckets and drop the bitmap except the ID byte.
+ * */
+static void
+sparse_load(adp_cnt_ctx_t *ctx)
+{
+    uint32_t i, off, step = ctx->sidx_len + 1;
+    uint32_t n = (ctx->bmp_len - 1) / step;
+
+    ctx->sidx = ccard_realloc(ctx->alloc, ctx->sidx, n * sparse_idx_size(ctx));
+    ctx->sval = ccard_realloc(ctx->alloc, ctx->sval, n);
+    for(i = 0, off = 1; i < n; i++, off += step) {
+        ctx->sval[i] = ctx->M[off];
+        sparse_idx_set(ctx, i,
+                       sparse_bytes_to_int(ctx->M, off + 1, ctx->sidx_len));
+        ctx->Rsum += ctx->M[off];
+        ctx->b_e--;
+    }
+    ctx->s_cnt = n;
+
+    ctx->M = ccard_realloc(ctx->alloc, ctx->M, 1);
+    ctx->bmp_len = 1;
+    ctx->s_stale = n > 0;
+}
+
+/**
+ * Mark sparse bitmap in M out of date before sparse buckets are modified.
+ * */
+static void
+sparse_drop_bitmap(adp_cnt_ctx_t *ctx)
+{
+    if(!ctx->s_stale) {
+        ctx->M = ccard_realloc(ctx->alloc, ctx->M, 1);
+        ctx->bmp_len = 1;
+        ctx->s_stale = 1;
+    }
+}
+
 static int
 sparse_should_use_normal_bitmap(adp_cnt_ctx_t *ctx, uint32_t used_bkts)
 {
     return (used_bkts + 1) * (ctx->sidx_len + 1) >= ctx->m;
 }
 
+/**
+ * Search the given bucket among pending ones, see sparse_pend_bucket.
+ *
+ * @retval -1 Not found.
+ * @retval >=0 Position of the bucket in pending array.
+ * */
+static int
+sparse_pending_search(adp_cnt_ctx_t *ctx, int bkt_no)
+{
+    uint32_t i;
+
+    for(i = 0; i < ctx->p_cnt; i++) {
+        if((ctx->pending[i] >> 8) == (uint64_t)bkt_no) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static int
+pending_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Merge all pending buckets to sparse bucket arrays.
+ *
+ * @note Pending buckets never exist in sparse bucket arrays, so the arrays
+ * are extended only once and merged from the tail in place.
+ * */
 static void
-sparse_insert_bucket(adp_cnt_ctx_t *ctx, int bkt_no, uint8_t bkt_val)
+sparse_flush_pending(adp_cnt_ctx_t *ctx)
 {
-    int step = ctx->sidx_len + 1;
-    int idx;
-    uint32_t off;
+    uint32_t src, dst;
+    uint32_t n = ctx->s_cnt + ctx->p_cnt;
+    int i;
 
-    /* extend sparse array for one more bucket */
-    ctx->M = realloc(ctx->M, ctx->bmp_len + step);
+    if(ctx->p_cnt == 0) {
+        return;
+    }
 
-    /* search insertion position */
-    for(off = 1; off < ctx->bmp_len; off += step) {
-        idx = sparse_bytes_to_int(ctx->M, off + 1, ctx->sidx_len);
-        if(idx > bkt_no) {
-            break;
+    qsort(ctx->pending, ctx->p_cnt, sizeof(uint64_t), pending_cmp);
+    ctx->sidx = ccard_realloc(ctx->alloc, ctx->sidx, n * sparse_idx_size(ctx));
+    ctx->sval = ccard_realloc(ctx->alloc, ctx->sval, n);
+
+    src = ctx->s_cnt;
+    dst = n;
+    for(i = ctx->p_cnt - 1; i >= 0; ) {
+        dst--;
+        if(src > 0 && sparse_idx_get(ctx, src - 1) > (ctx->pending[i] >> 8)) {
+            /* move original bucket backwards */
+            src--;
+            sparse_idx_set(ctx, dst, sparse_idx_get(ctx, src));
+            ctx->sval[dst] = ctx->sval[src];
+        } else {
+            sparse_idx_set(ctx, dst, ctx->pending[i] >> 8);
+            ctx->sval[dst] = ctx->pending[i] & 0xff;
+            i--;
         }
     }
-    if(off < ctx->bmp_len) {
-        /* insertion position is between original buckets, make room for
-         * inserted bucket */
-        memmove(ctx->M + off + step, ctx->M + off, ctx->bmp_len - off);
+
+    ctx->s_cnt = n;
+    ctx->p_cnt = 0;
+}
+
+/**
+ * Rebuild sparse bitmap in M from sparse bucket arrays, pending buckets are
+ * merged first. Nothing is done for normal bitmap.
+ * */
+static void
+sparse_sync_bitmap(adp_cnt_ctx_t *ctx)
+{
+    uint32_t i, off, step = ctx->sidx_len + 1;
+
+    sparse_flush_pending(ctx);
+    if(!ctx->s_stale) {
+        return;
+    }
+
+    ctx->bmp_len = ctx->s_cnt * step + 1;
+    ctx->M = ccard_realloc(ctx->alloc, ctx->M, ctx->bmp_len);
+    for(i = 0, off = 1; i < ctx->s_cnt; i++, off += step) {
+        ctx->M[off] = ctx->sval[i];
+        sparse_int_to_bytes(ctx->M, off + 1, ctx->sidx_len,
+                            sparse_idx_get(ctx, i));
     }
+    ctx->s_stale = 0;
+}
 
-    /* insert new bucket */
-    ctx->M[off] = bkt_val;
-    sparse_int_to_bytes(ctx->M, off + 1, ctx->sidx_len, bkt_no);
+/**
+ * Add a new bucket to sparse bitmap. It's pending in an unsorted array
+ * first, all pending buckets are merged in a batch once the array is full.
+ * The array grows geometrically while it's small compared to the bitmap.
+ * */
+static void
+sparse_pend_bucket(adp_cnt_ctx_t *ctx, int bkt_no, uint8_t bkt_val)
+{
+    uint32_t bkts = ctx->s_cnt;
+
+    if(ctx->p_cnt == ctx->p_size) {
+        if(ctx->p_size == 0
+           || (ctx->p_size < PENDING_MAX && ctx->p_size * 4 < bkts)) {
+            ctx->p_size = ctx->p_size ? ctx->p_size * 2 : 16;
+            ctx->pending = ccard_realloc(ctx->alloc, ctx->pending,
+                                   sizeof(uint64_t) * ctx->p_size);
+        } else {
+            sparse_flush_pending(ctx);
+        }
+    }
 
-    ctx->bmp_len += step;
+    ctx->pending[ctx->p_cnt++] = ((uint64_t)bkt_no << 8) | bkt_val;
 }
 
 static void
 sparse_to_normal_bitmap(adp_cnt_ctx_t *ctx)
 {
-    int idx;
-    uint32_t i, step = ctx->sidx_len + 1;
-    uint8_t *bmp = calloc(sizeof(uint8_t), ctx->m);
+    uint32_t i;
+    uint8_t *bmp = ccard_calloc(ctx->alloc, sizeof(uint8_t), ctx->m);
 
     /* convert sparse format to normal format */
-    for(i = 1; i < ctx->bmp_len; i += step) {
-        idx = sparse_bytes_to_int(ctx->M, i + 1, ctx->sidx_len);
-        bmp[idx] = ctx->M[i];
+    for(i = 0; i < ctx->s_cnt; i++) {
+        bmp[sparse_idx_get(ctx, i)] = ctx->sval[i];
+    }
+    for(i = 0; i < ctx->p_cnt; i++) {
+        bmp[ctx->pending[i] >> 8] = ctx->pending[i] & 0xff;
     }
+    ccard_free(ctx->alloc, ctx->pending);
+    ctx->pending = NULL;
+    ctx->p_cnt = ctx->p_size = 0;
+    sparse_free(ctx);
 
     /* replace sparse bucket array to normal one */
-    free(ctx->M);
+    ccard_free(ctx->alloc, ctx->M);
     ctx->bmp_len = ctx->m;
     ctx->M = bmp;
 }
 
+static void
+normal_to_sparse_bitmap(adp_cnt_ctx_t *ctx)
+{
+    uint32_t i, n = 0;
+
+    /* convert normal format to sparse bucket arrays */
+    ctx->sidx = ccard_malloc(ctx->alloc, (ctx->m - ctx->b_e) * sparse_idx_size(ctx));
+    ctx->sval = ccard_malloc(ctx->alloc, ctx->m - ctx->b_e);
+    for(i = 0; i < ctx->m; i++) {
+        if(ctx->M[i] > 0) {
+            sparse_idx_set(ctx, n, i);
+            ctx->sval[n++] = ctx->M[i];
+        }
+    }
+    ctx->s_cnt = n;
+
+    /* replace normal bucket array with the ID byte, sparse bitmap is
+     * rebuilt on demand */
+    ctx->M = ccard_realloc(ctx->alloc, ctx->M, 1);
+    ctx->M[0] = MAKE_SPARSE_ID(ctx->k);
+    ctx->bmp_len = 1;
+    ctx->s_stale = n > 0;
+}
+
+/**
+ * Encode buckets to be sent in a delta as sparse bitmap.
+ *
+ * @param[in] ctx Context in normal format.
+ * @param[in] full 1 if all non-empty buckets should be encoded, 0 if only
+ * those marked in dirty bitmap.
+ * @param[out] out Resulting sparse bitmap. NULL if only length is needed.
+ * @retval Length of the sparse bitmap.
+ * */
+static uint32_t
+delta_encode_sparse(adp_cnt_ctx_t *ctx, int full, uint8_t *out)
+{
+    uint32_t i, off = 1, step = ctx->sidx_len + 1;
+
+    if(out) {
+        out[0] = MAKE_SPARSE_ID(ctx->k);
+    }
+    for(i = 0; i < ctx->m; i++) {
+        if(!full && !ctx->dirty[i >> 3]) {
+            /* skip 8 clean buckets at once */
+            i |= 7;
+            continue;
+        }
+        if(ctx->M[i] == 0
+           || (!full && !(ctx->dirty[i >> 3] & (1 << (i & 7))))) {
+            continue;
+        }
+
+        if(out) {
+            out[off] = ctx->M[i];
+            sparse_int_to_bytes(out, off + 1, ctx->sidx_len, i);
+        }
+        off += step;
+    }
+
+    return off;
+}
+
+/**
+ * Get base-2 logarithm of total bucket number of the given raw bitmap.
+ * Bucket indexes of sparse bitmap must be in range and ascending, as they
+ * are merged in order and index buckets of the bitmap directly.
+ *
+ * @retval -1 Invalid raw bitmap.
+ * @retval >=0 The base-2 logarithm of total bucket number.
+ * */
+static int
+raw_bitmap_k(const uint8_t *in, uint32_t len)
+{
+    uint8_t k, sidx_len;
+    uint32_t i;
+    int64_t idx, last = -1;
+
+    if(len == 0) {
+        return -1;
+    }
+
+    if(IS_SPARSE_BMP(in)) {
+        k = K_FROM_ID(in[0]);
+        sidx_len = (k + 7) / 8;
+        if(k > 31 || (len - 1) % (sidx_len + 1) != 0) {
+            return -1;
+        }
+        for(i = 1; i < len; i += sidx_len + 1) {
+            idx = (uint32_t)sparse_bytes_to_int(in, i + 1, sidx_len);
+            if(idx >= (1LL << k) || idx <= last) {
+                return -1;
+            }
+            last = idx;
+        }
+    } else {
+        k = num_of_trail_zeros(len);
+        if(len != (uint32_t)(1 << k)) {
+            return -1;
+        }
+    }
+
+    if(k == 0 || k >= sizeof(alpha) / sizeof(alpha[0])) {
+        return -1;
+    }
+
+    return k;
+}
+
 /**
- * Verify context and given bitmap has identical total bucket number
+ * Verify the given bitmap could be merged to context
+ *
+ * Bitmaps with different total bucket number are acceptable, as they will be
+ * folded to the lowest precision before merging.
  *
  * @param[in] ctx Context to be merged to. Must be non-NULL.
  * @param[in] is_raw 1 if given bitmap is in raw format, 0 if in external
@@ -179,23 +667,22 @@ sparse_to_normal_bitmap(adp_cnt_ctx_t *ctx)
  * @retval -1 Verification failed, the given bitmap can't be merged to ctx.
  * @retval 0 Verification success and there exists at least 1 normal bitmap.
  * @retval 1 Verification success and there are only sparse bitmaps.
+ * @retval 2 Verification success and the given bitmap is an explicit one.
  * */
 static int
 unified_bitmap_verify(adp_cnt_ctx_t *ctx, int is_raw,
                       const void *buf, uint32_t len)
 {
-    int rc;
+    int k;
     const uint8_t *in = buf;
-    uint32_t m;
 
     assert(ctx && buf);
 
     if(!is_raw) {
         /* bitmap is not in raw format, check header first */
-        if(in[0] != CCARD_ALGO_ADAPTIVE
-           || in[1] != ctx->hf
-           || in[2] != ctx->k
-           || len <= 3) {
+        if(len <= 3
+           || in[0] != CCARD_ALGO_ADAPTIVE
+           || in[1] != ctx->hf) {
             return -1;
         }
 
@@ -204,18 +691,20 @@ unified_bitmap_verify(adp_cnt_ctx_t *ctx, int is_raw,
         len -= 3;
     }
 
-    if(IS_SPARSE_BMP(in)) {
-        m = 1 << K_FROM_ID(in[0]);
-        rc = 1;
-    } else {
-        m = len;
-        rc = 0;
+    if(IS_EXPLICIT_BMP(in)) {
+        k = es_verify(in, len, hash_len(ctx->hf));
+        if(k == -1 || (!is_raw && ((const uint8_t *)buf)[2] != k)) {
+            return -1;
+        }
+        return 2;
     }
-    if(ctx->m != m) {
+
+    k = raw_bitmap_k(in, len);
+    if(k == -1 || (!is_raw && ((const uint8_t *)buf)[2] != k)) {
         return -1;
     }
 
-    return rc;
+    return IS_SPARSE_BMP(in) ? 1 : 0;
 }
 
 /**
@@ -306,15 +795,38 @@ sparse_count_distinct_buckets(adp_cnt_ctx_t *ctx, int buf_cnt,
     return total_bkts;
 }
 
+/**
+ * Raise bucket j of dbm to r and mark it in dirty if it's not NULL. Buckets
+ * of a shared view are raised atomically, since other processes raise them
+ * as well.
+ * */
+static void
+raise_bucket(uint8_t *dbm, uint8_t *dirty, adp_cnt_ctx_t *ctx, uint32_t j,
+             uint8_t r)
+{
+    if(dbm == ctx->M && ctx->view == VIEW_SHARED) {
+        ccard_shm_max(dbm - 3, ctx->m + 3, j + 3, r);
+        return;
+    }
+
+    if(dbm[j] < r) {
+        dbm[j] = r;
+        if(dirty) {
+            dirty[j >> 3] |= 1 << (j & 7);
+        }
+    }
+}
+
 /**
  * Merge all given sparse/normal bitmaps to a normal bitmap
  *
  * @note dbm should be zero'd out before call this routine, otherwise the
- * result would be unexpected
+ * result would be unexpected. Raised buckets are marked in dirty if it is
+ * not NULL.
  * */
 static void
-merge_to_normal_bmp(uint8_t *dbm, adp_cnt_ctx_t *ctx, int buf_cnt,
-                    const uint8_t **pbuf, uint32_t *plen)
+merge_to_normal_bmp(uint8_t *dbm, uint8_t *dirty, adp_cnt_ctx_t *ctx,
+                    int buf_cnt, const uint8_t **pbuf, uint32_t *plen)
 {
     int step = ctx->sidx_len + 1;
     int i;
@@ -326,16 +838,12 @@ merge_to_normal_bmp(uint8_t *dbm, adp_cnt_ctx_t *ctx, int buf_cnt,
             for(j = 1; j < plen[i]; j += step) {
                 uint8_t r = pbuf[i][j];
                 int idx = sparse_bytes_to_int(pbuf[i], j + 1, ctx->sidx_len);
-                if(dbm[idx] < r) {
-                    dbm[idx] = r;
-                }
+                raise_bucket(dbm, dirty, ctx, idx, r);
             }
         } else {
             /* merge normal bitmap */
             for(j = 0; j < plen[i]; j++) {
-                if(dbm[j] < pbuf[i][j]) {
-                    dbm[j] = pbuf[i][j];
-                }
+                raise_bucket(dbm, dirty, ctx, j, pbuf[i][j]);
             }
         }
     }
@@ -423,15 +931,14 @@ update_estimator_state(adp_cnt_ctx_t *ctx, int init)
     ctx->Ca = alpha[ctx->k];
     ctx->Rsum = 0;
     ctx->b_e = ctx->m;
+    acc_clear(ctx);
 
     if(!init) {
         if(IS_SPARSE_BMP(ctx->M)) {
-            /* skip ID byte and accumulate all sparse buckets */
-            for(i = 1; i < ctx->bmp_len; i += ctx->sidx_len + 1) {
-                ctx->Rsum += ctx->M[i];
-                ctx->b_e--;
-            }
+            /* load and accumulate all sparse buckets */
+            sparse_load(ctx);
         } else {
+            sparse_free(ctx);
             /* traverse all buckets and accumulate non-empty ones */
             for(i = 0; i < ctx->bmp_len; i++) {
                 if (ctx->M[i] > 0) {
@@ -444,23 +951,98 @@ update_estimator_state(adp_cnt_ctx_t *ctx, int init)
 }
 
 /**
- * Merge all given raw bitmaps and replace bitmap in current context
- *
- * @note The given raw bitmap list should contains current context bitmap if it
- * should also be merged
+ * Release contexts of bitmaps folded by aux_merge_raw_bytes and their array
+ * */
+static void
+folded_fini(adp_cnt_ctx_t *ctx, adp_cnt_ctx_t **folded, int buf_cnt)
+{
+    int i;
+
+    if(!folded) {
+        return;
+    }
+    for(i = 1; i < buf_cnt; i++) {
+        if(folded[i]) {
+            adp_cnt_fini(folded[i]);
+        }
+    }
+    ccard_free(ctx->alloc, folded);
+}
+
+/**
+ * Merge all given raw bitmaps and replace bitmap in current context
+ *
+ * @note The given raw bitmap list should contains current context bitmap if it
+ * should also be merged
  * */
 static int
 aux_merge_raw_bytes(adp_cnt_ctx_t *ctx, int buf_cnt,
                     const uint8_t **pbuf, uint32_t *plen)
 {
     int rc;
+    int i;
+    int k;
+    int min_k = ctx->k;
     int gen_normal = 0;
     uint8_t *dbm = NULL;
     uint32_t dlen;
     uint32_t bkts = 0;
+    adp_cnt_ctx_t **folded = NULL;
+
+    /* fold all bitmaps to the lowest precision among them */
+    for(i = 1; i < buf_cnt; i++) {
+        k = raw_bitmap_k(pbuf[i], plen[i]);
+        if(k < 0) {
+            ctx->err = CCARD_ERR_MERGE_FAILED;
+            return -1;
+        }
+        if(k < min_k) {
+            min_k = k;
+        }
+    }
+    if(min_k < ctx->k) {
+        if(adp_cnt_fold(ctx, min_k)) {
+            /* views can't be folded */
+            return -1;
+        }
+        sparse_sync_bitmap(ctx);
+        pbuf[0] = ctx->M;
+        plen[0] = ctx->bmp_len;
+    }
+    for(i = 1; i < buf_cnt; i++) {
+        if(raw_bitmap_k(pbuf[i], plen[i]) == ctx->k) {
+            continue;
+        }
+
+        if(!folded) {
+            folded = (adp_cnt_ctx_t **)ccard_calloc(ctx->alloc, buf_cnt,
+                                                    sizeof(adp_cnt_ctx_t *));
+            if(!folded) {
+                ctx->err = CCARD_ERR_MERGE_FAILED;
+                return -1;
+            }
+        }
+        folded[i] = adp_cnt_raw_init_alloc(pbuf[i], plen[i], ctx->hf,
+                                           ctx->alloc);
+        if(!folded[i] || adp_cnt_fold(folded[i], ctx->k)) {
+            folded_fini(ctx, folded, buf_cnt);
+            ctx->err = CCARD_ERR_MERGE_FAILED;
+            return -1;
+        }
+        sparse_sync_bitmap(folded[i]);
+        pbuf[i] = folded[i]->M;
+        plen[i] = folded[i]->bmp_len;
+    }
 
     rc = is_there_normal_raw_bitmap(ctx, buf_cnt, pbuf, plen);
-    if(rc == 0) {
+    if(!IS_SPARSE_BMP(ctx->M)) {
+        /* context bitmap is in normal format already, merge the others into
+         * it in place to save allocation and copying */
+        merge_to_normal_bmp(ctx->M, ctx->dirty, ctx, buf_cnt - 1, pbuf + 1,
+                            plen + 1);
+        dbm = ctx->M;
+        dlen = ctx->bmp_len;
+    } else if(rc == 0) {
         /* there exists at least 1 normal bitmap, merge to normal format */
         dlen = ctx->m;
         gen_normal = 1;
@@ -478,25 +1060,230 @@ aux_merge_raw_bytes(adp_cnt_ctx_t *ctx, int buf_cnt,
         }
     }
 
-    dbm = (uint8_t *)calloc(sizeof(uint8_t), dlen);
-    if(gen_normal) {
-        merge_to_normal_bmp(dbm, ctx, buf_cnt, pbuf, plen);
-    } else {
-        merge_to_sparse_bmp(dbm, ctx, buf_cnt, pbuf, plen);
+    if(dbm != ctx->M) {
+        dbm = (uint8_t *)ccard_calloc(ctx->alloc, sizeof(uint8_t), dlen);
+        if(!dbm) {
+            folded_fini(ctx, folded, buf_cnt);
+            ctx->err = CCARD_ERR_MERGE_FAILED;
+            return -1;
+        }
+        if(gen_normal) {
+            merge_to_normal_bmp(dbm, NULL, ctx, buf_cnt, pbuf, plen);
+        } else {
+            merge_to_sparse_bmp(dbm, ctx, buf_cnt, pbuf, plen);
+        }
+
+        /* replace context bitmap with merged one */
+        ccard_free(ctx->alloc, ctx->M);
+        ctx->M = dbm;
     }
 
-    /* replace context bitmap with merged one and update estimator state */
-    free(ctx->M);
-    ctx->M = dbm;
+    /* update estimator state */
     ctx->bmp_len = dlen;
     update_estimator_state(ctx, 0);
 
+    folded_fini(ctx, folded, buf_cnt);
+
     ctx->err = CCARD_OK;
     return 0;
 }
 
+static void explicit_to_bitmap(adp_cnt_ctx_t *ctx);
+
+/**
+ * Update bucket counter with the given hash value, or add it to explicit
+ * hash values if they are still kept.
+ *
+ * @retval 1 Counter was modified.
+ * @retval 0 Counter was not modified.
+ * */
+static int
+offer_hash(adp_cnt_ctx_t *ctx, uint64_t x)
+{
+    int rc, modified = 0;
+    uint64_t j;
+    uint8_t r, hl = hash_len(ctx->hf);
+
+    if(ctx->es) {
+        rc = es_add(ctx->es, x);
+        if(rc >= 0) {
+            return rc;
+        }
+
+        /* explicit hash values take too much memory, fallback to counting
+         * with buckets */
+        explicit_to_bitmap(ctx);
+    }
+
+    j = x >> (hl - ctx->k);
+    r = (uint8_t)(num_of_trail_zeros(x << (ctx->k + 64 - hl)) - (ctx->k + 64 -
+                  hl) + 1);
+
+    if(ctx->acc) {
+        /* buckets are raised by other threads as well, amounts are added to
+         * the accumulator of this thread instead of the context */
+        struct adp_acc_s *acc;
+        uint8_t old = ccard_shm_max(ctx->M, ctx->m, j, r);
+
+        if(old >= r) {
+            return 0;
+        }
+        acc = &ctx->acc[acc_slot()];
+        __atomic_fetch_add(&acc->rsum, r - old, __ATOMIC_RELAXED);
+        if(old == 0) {
+            __atomic_fetch_add(&acc->filled, 1, __ATOMIC_RELAXED);
+        }
+        if(ctx->dirty) {
+            __atomic_fetch_or(&ctx->dirty[j >> 3], (uint8_t)(1 << (j & 7)),
+                              __ATOMIC_RELAXED);
+        }
+        return 1;
+    }
+    if(IS_SPARSE_BMP(ctx->M)) {
+        /* update sparse bucket counter */
+        int off = sparse_search(ctx, j);
+
+        if(off != -1) {
+            /* the bucket to be updated already exists, no need to decrease
+             * empty bucket counter */
+            if(ctx->sval[off] < r) {
+                sparse_drop_bitmap(ctx);
+                ctx->Rsum += r - ctx->sval[off];
+                ctx->sval[off] = r;
+                modified = 1;
+            }
+            return modified;
+        }
+
+        off = sparse_pending_search(ctx, j);
+        if(off != -1) {
+            /* the bucket is pending to be inserted already */
+            if((ctx->pending[off] & 0xff) < r) {
+                sparse_drop_bitmap(ctx);
+                ctx->Rsum += r - (ctx->pending[off] & 0xff);
+                ctx->pending[off] = (j << 8) | r;
+                modified = 1;
+            }
+            return modified;
+        }
+
+        if(!sparse_should_use_normal_bitmap(ctx, ctx->m - ctx->b_e)) {
+            /* still use sparse format to insert new bucket */
+            sparse_drop_bitmap(ctx);
+            sparse_pend_bucket(ctx, j, r);
+            ctx->Rsum += r;
+            ctx->b_e--;
+            return 1;
+        }
+
+        /* convert sparse buckets to normal format, fallback to CONT */
+        sparse_to_normal_bitmap(ctx);
+    }
+
+    /* CONT: update normal bucket counter */
+    if(ctx->view == VIEW_SHARED) {
+        /* Rsum and b_e are recomputed on read, see shared_sync */
+        return ccard_shm_max(ctx->M - 3, ctx->m + 3, j + 3, r) < r;
+    }
+    if(ctx->be) {
+        be_touch(ctx->be, ctx->M, j);
+    }
+    if (ctx->M[j] < r) {
+        ctx->Rsum += r - ctx->M[j];
+        if (ctx->M[j] == 0) {
+            ctx->b_e--;
+        }
+        ctx->M[j] = r;
+        if (ctx->dirty) {
+            ctx->dirty[j >> 3] |= 1 << (j & 7);
+        }
+
+        modified = 1;
+    }
+
+    return modified;
+}
+
+/**
+ * Replay all explicit hash values to bucket counters and drop them.
+ * */
+static void
+explicit_to_bitmap(adp_cnt_ctx_t *ctx)
+{
+    exp_set_t *es = ctx->es;
+    uint32_t pos = 0;
+    uint64_t h;
+
+    ctx->es = NULL;
+    while(es_next(es, &pos, &h)) {
+        offer_hash(ctx, h);
+    }
+    es_fini(es);
+}
+
+/**
+ * Merge all hash values of an explicit bitmap verified by es_verify.
+ *
+ * @note Hash values don't depend on k, so the context is never folded.
+ * */
+static void
+explicit_merge_bytes(adp_cnt_ctx_t *ctx, const uint8_t *in, uint32_t len)
+{
+    uint32_t i;
+
+    for(i = 0; i < (len - 1) / 8; i++) {
+        offer_hash(ctx, es_hash_at(in, i));
+    }
+}
+
+/**
+ * Merge all hash values of another explicit context.
+ * */
+static void
+explicit_merge(adp_cnt_ctx_t *ctx, const exp_set_t *es)
+{
+    uint32_t pos = 0;
+    uint64_t h;
+
+    while(es_next(es, &pos, &h)) {
+        offer_hash(ctx, h);
+    }
+}
+
+/**
+ * Merge the given raw bitmaps to context bitmap, see aux_merge_raw_bytes.
+ *
+ * @param[in] pbuf Raw bitmaps from pbuf[1], pbuf[0] is filled with context
+ * bitmap. Explicit context is converted to bitmap first if there is any.
+ * */
+static int
+aux_merge_ctx_bitmap(adp_cnt_ctx_t *ctx, int buf_cnt,
+                     const uint8_t **pbuf, uint32_t *plen)
+{
+    if(buf_cnt == 1) {
+        ctx->err = CCARD_OK;
+        return 0;
+    }
+
+    if(ctx->es) {
+        explicit_to_bitmap(ctx);
+    }
+    sparse_sync_bitmap(ctx);
+    pbuf[0] = ctx->M;
+    plen[0] = ctx->bmp_len;
+
+    return aux_merge_raw_bytes(ctx, buf_cnt, pbuf, plen);
+}
+
 adp_cnt_ctx_t *
 adp_cnt_raw_init(const void *obuf, uint32_t len_or_k, uint8_t opt)
+{
+    return adp_cnt_raw_init_alloc(obuf, len_or_k, opt, ccard_get_allocator());
+}
+
+adp_cnt_ctx_t *
+adp_cnt_raw_init_alloc(const void *obuf, uint32_t len_or_k, uint8_t opt,
+                       const ccard_allocator_t *alloc)
 {
     adp_cnt_ctx_t *ctx;
     uint8_t *buf = (uint8_t *)obuf;
@@ -506,6 +1293,26 @@ adp_cnt_raw_init(const void *obuf, uint32_t len_or_k, uint8_t opt)
         return NULL;
     }
 
+    if(!alloc) {
+        alloc = ccard_get_allocator();
+    }
+
+    if (buf && IS_EXPLICIT_BMP(buf)) {
+        /* explicit bitmap, see explicit_set.h */
+        int k = es_verify(buf, len_or_k, hash_len(HF(opt)));
+
+        if (k == -1) {
+            return NULL;
+        }
+
+        ctx = adp_cnt_raw_init_alloc(NULL, k, HF(opt) | CCARD_OPT_EXPLICIT,
+                                     alloc);
+        if (ctx) {
+            explicit_merge_bytes(ctx, buf, len_or_k);
+        }
+        return ctx;
+    }
+
     if (buf) {
         /* initial bitmap was given */
         uint8_t k;
@@ -528,7 +1335,12 @@ adp_cnt_raw_init(const void *obuf, uint32_t len_or_k, uint8_t opt)
              * if there're no non-empty buckets, sparse bitmap has only the ID
              * byte.
              */
-            k = K_FROM_ID(buf[0]);
+            int rk = raw_bitmap_k(buf, len_or_k);
+
+            if(rk == -1) {
+                return NULL;
+            }
+            k = rk;
             m = (uint32_t)(1 << k);
         } else {
             /* initial bitmap is normal one */
@@ -545,14 +1357,35 @@ adp_cnt_raw_init(const void *obuf, uint32_t len_or_k, uint8_t opt)
             return NULL;
         }
 
-        ctx = (adp_cnt_ctx_t *)malloc(sizeof(adp_cnt_ctx_t));
+        ctx = (adp_cnt_ctx_t *)ccard_malloc(alloc, sizeof(adp_cnt_ctx_t));
+        if(!ctx) {
+            return NULL;
+        }
+        ctx->alloc = alloc;
         ctx->err = CCARD_OK;
+        ctx->epoch = 0;
+        ctx->dirty = NULL;
+        ctx->pending = NULL;
+        ctx->p_cnt = ctx->p_size = 0;
+        ctx->sidx = NULL;
+        ctx->sval = NULL;
+        ctx->s_cnt = 0;
+        ctx->be = NULL;
+        ctx->acc = NULL;
+        ctx->acc_mem = NULL;
+        ctx->s_stale = 0;
         ctx->m = m;
         ctx->k = k;
         ctx->bmp_len = len_or_k;
-        ctx->M = malloc(ctx->bmp_len);
+        ctx->M = ccard_malloc(alloc, ctx->bmp_len);
+        if(!ctx->M) {
+            ccard_free(alloc, ctx);
+            return NULL;
+        }
         memcpy(ctx->M, buf, ctx->bmp_len);
         ctx->hf = HF(opt);
+        ctx->es = NULL;
+        ctx->view = VIEW_NONE;
 
         update_estimator_state(ctx, 0);
     } else {
@@ -563,24 +1396,46 @@ adp_cnt_raw_init(const void *obuf, uint32_t len_or_k, uint8_t opt)
             return NULL;
         }
 
-        if(opt & CCARD_OPT_SPARSE) {
-            /* create sparse bitmap with only ID byte*/
-            ctx = (adp_cnt_ctx_t *)malloc(sizeof(adp_cnt_ctx_t));
+        if(opt & (CCARD_OPT_SPARSE | CCARD_OPT_EXPLICIT)) {
+            /* create sparse bitmap with only ID byte, explicit hash values
+             * are converted to sparse buckets first */
+            ctx = (adp_cnt_ctx_t *)ccard_malloc(alloc, sizeof(adp_cnt_ctx_t));
+            if(!ctx) {
+                return NULL;
+            }
             ctx->bmp_len = 1;
-            ctx->M = malloc(ctx->bmp_len);
+            ctx->M = ccard_malloc(alloc, ctx->bmp_len);
             ctx->M[0] = MAKE_SPARSE_ID(k);
         } else {
             /* create normal bitmap */
-            ctx = (adp_cnt_ctx_t *)malloc(sizeof(adp_cnt_ctx_t));
+            ctx = (adp_cnt_ctx_t *)ccard_malloc(alloc, sizeof(adp_cnt_ctx_t));
+            if(!ctx) {
+                return NULL;
+            }
             ctx->bmp_len = 1 << k;
-            ctx->M = malloc(ctx->bmp_len);
+            ctx->M = ccard_malloc(alloc, ctx->bmp_len);
             memset(ctx->M, 0, ctx->bmp_len);
         }
 
+        ctx->alloc = alloc;
         ctx->err = CCARD_OK;
+        ctx->epoch = 0;
+        ctx->dirty = NULL;
+        ctx->pending = NULL;
+        ctx->p_cnt = ctx->p_size = 0;
+        ctx->sidx = NULL;
+        ctx->sval = NULL;
+        ctx->s_cnt = 0;
+        ctx->be = NULL;
+        ctx->acc = NULL;
+        ctx->acc_mem = NULL;
+        ctx->s_stale = 0;
         ctx->m = 1 << k;
         ctx->k = k;
         ctx->hf = HF(opt);
+        /* explicit hash values take no more memory than normal bitmap */
+        ctx->es = (opt & CCARD_OPT_EXPLICIT) ? es_init(ctx->m / 8, alloc) : NULL;
+        ctx->view = VIEW_NONE;
 
         update_estimator_state(ctx, 1);
     }
@@ -590,6 +1445,13 @@ adp_cnt_raw_init(const void *obuf, uint32_t len_or_k, uint8_t opt)
 
 adp_cnt_ctx_t *
 adp_cnt_init(const void *obuf, uint32_t len_or_k, uint8_t opt)
+{
+    return adp_cnt_init_alloc(obuf, len_or_k, opt, ccard_get_allocator());
+}
+
+adp_cnt_ctx_t *
+adp_cnt_init_alloc(const void *obuf, uint32_t len_or_k, uint8_t opt,
+                   const ccard_allocator_t *alloc)
 {
     uint8_t *buf = (uint8_t *)obuf;
 
@@ -598,10 +1460,25 @@ adp_cnt_init(const void *obuf, uint32_t len_or_k, uint8_t opt)
             return NULL;
         }
 
+        if(buf[0] & CCARD_FLAG_COMPRESSED) {
+            /* compressed bitmap, initialize with the decoded one */
+            uint32_t plen;
+            uint8_t *plain = bc_decompress_bytes(buf, len_or_k, &plen);
+            adp_cnt_ctx_t *ctx = plain ?
+                                 adp_cnt_init_alloc(plain, plen, opt, alloc) :
+                                 NULL;
+
+            free(plain);
+            return ctx;
+        }
+
         uint32_t data_segment_size = len_or_k - 3;
         uint8_t k = 0;
 
-        if(IS_SPARSE_BMP(&buf[3])) {
+        if(IS_EXPLICIT_BMP(&buf[3])) {
+            /* explicit bitmap, get k from the 1st byte of bitmap */
+            k = K_FROM_EXPLICIT_ID(buf[3]);
+        } else if(IS_SPARSE_BMP(&buf[3])) {
             /* sparse bitmap, get k from the 1st byte of bitmap */
             k = K_FROM_ID(buf[3]);
         } else {
@@ -617,156 +1494,463 @@ adp_cnt_init(const void *obuf, uint32_t len_or_k, uint8_t opt)
             return NULL;
         }
 
-        return adp_cnt_raw_init(buf + 3, data_segment_size, opt);
+        return adp_cnt_raw_init_alloc(buf + 3, data_segment_size, opt, alloc);
     }
 
-    return adp_cnt_raw_init(NULL, len_or_k, opt);
+    return adp_cnt_raw_init_alloc(NULL, len_or_k, opt, alloc);
 }
 
-int64_t
-adp_cnt_card_loglog(adp_cnt_ctx_t *ctx)
+adp_cnt_ctx_t *
+adp_cnt_view_init(const void *obuf, uint32_t len, uint8_t flags)
 {
-    double Ravg;
+    adp_cnt_ctx_t *ctx;
+    uint8_t *buf = (uint8_t *)obuf;
+    uint8_t k;
+
+    if (!buf || len <= 3 || IS_SPARSE_BMP(buf + 3)) {
+        /* only normal serialized bitmap could be borrowed */
+        return NULL;
+    }
+
+    k = num_of_trail_zeros(len - 3);
+    if (len - 3 != (uint32_t)(1 << k)
+        || k >= sizeof(alpha) / sizeof(alpha[0])
+        || buf[0] != CCARD_ALGO_ADAPTIVE
+        || buf[2] != k) {
+        return NULL;
+    }
+
+    ctx = (adp_cnt_ctx_t *)ccard_malloc(NULL, sizeof(adp_cnt_ctx_t));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->alloc = ccard_get_allocator();
+    ctx->err = CCARD_OK;
+    ctx->epoch = 0;
+    ctx->dirty = NULL;
+    ctx->pending = NULL;
+    ctx->p_cnt = ctx->p_size = 0;
+    ctx->sidx = NULL;
+    ctx->sval = NULL;
+    ctx->s_cnt = 0;
+    ctx->s_stale = 0;
+    ctx->be = NULL;
+    ctx->acc = NULL;
+    ctx->acc_mem = NULL;
+    ctx->m = len - 3;
+    ctx->k = k;
+    ctx->bmp_len = ctx->m;
+    ctx->M = buf + 3;
+    ctx->hf = buf[1];
+    ctx->es = NULL;
+    if((flags & CCARD_VIEW_SHARED) == CCARD_VIEW_SHARED) {
+        ctx->view = VIEW_SHARED;
+    } else if(flags & CCARD_VIEW_WRITABLE) {
+        ctx->view = VIEW_WRITABLE;
+    } else {
+        ctx->view = VIEW_RDONLY;
+    }
+
+    /* buckets are summed up once, the bitmap is not copied */
+    update_estimator_state(ctx, 0);
+
+    return ctx;
+}
+
+adp_cnt_ctx_t *
+adp_cnt_clone(adp_cnt_ctx_t *src)
+{
+    adp_cnt_ctx_t *ctx;
+
+    if (!src) {
+        return NULL;
+    }
+
+    ctx = (adp_cnt_ctx_t *)ccard_calloc(src->alloc, 1, sizeof(adp_cnt_ctx_t));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->alloc = src->alloc;
+    ctx->view = VIEW_NONE;
+
+    if (adp_cnt_copy_into(ctx, src) != 0) {
+        adp_cnt_fini(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+/**
+ * Convert explicit and sparse buckets to the normal bitmap, which could be
+ * raised atomically.
+ * */
+static void
+concurrent_prepare(adp_cnt_ctx_t *ctx)
+{
+    struct adp_acc_s *acc = ctx->acc;
+
+    /* replayed values are counted in Rsum and b_e directly */
+    ctx->acc = NULL;
+    if(ctx->es) {
+        explicit_to_bitmap(ctx);
+    }
+    if(IS_SPARSE_BMP(ctx->M)) {
+        sparse_to_normal_bitmap(ctx);
+    }
+    ctx->acc = acc;
+}
+
+int
+adp_cnt_copy_into(adp_cnt_ctx_t *dst, adp_cnt_ctx_t *src)
+{
+    adp_cnt_ctx_t old;
+
+    if (!dst || !src) {
+        return -1;
+    }
+
+    if (dst->view) {
+        dst->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    dst->err = CCARD_OK;
+    if (dst == src) {
+        return 0;
+    }
+
+    lazy_flush(src);
+    sparse_flush_pending(src);
+
+    /* take scalars and estimator state as they are, then copy buffers over
+     * the ones of dst, which are resized only if the sizes differ */
+    old = *dst;
+    *dst = *src;
+    dst->err = CCARD_OK;
+    dst->view = VIEW_NONE;
+    dst->alloc = old.alloc;
+
+    dst->M = ccard_copy(dst->alloc, old.M, src->M, src->bmp_len);
+    dst->dirty = ccard_copy(dst->alloc, old.dirty, src->dirty, (src->m + 7) / 8);
+    dst->sidx = ccard_copy(dst->alloc, old.sidx, src->sidx,
+                           src->s_cnt * sparse_idx_size(src));
+    dst->sval = ccard_copy(dst->alloc, old.sval, src->sval, src->s_cnt);
+    dst->es = es_copy(old.es, src->es, dst->alloc);
+    dst->pending = old.pending;
+    dst->p_cnt = 0;
+    dst->p_size = old.p_size;
+    /* concurrent mode belongs to dst, amounts of src are taken in Rsum and
+     * b_e */
+    acc_sum(src, &dst->Rsum, &dst->b_e);
+    dst->acc = old.acc;
+    dst->acc_mem = old.acc_mem;
+    acc_clear(dst);
+
+    /* buckets are all up to date, stamps are kept for later resets */
+    dst->be = old.be;
+    if (dst->be && dst->be->len != dst->m) {
+        be_fini(dst->be);
+        dst->be = be_init(dst->m, dst->alloc);
+    } else if (dst->be) {
+        be_sync(dst->be);
+    }
+
+    if (!dst->M || (src->dirty && !dst->dirty) ||
+        (src->s_cnt && (!dst->sidx || !dst->sval)) ||
+        (src->es && !dst->es) || (old.be && !dst->be)) {
+        dst->err = CCARD_ERR_INVALID_CTX;
+        return -1;
+    }
+
+    if(dst->acc) {
+        concurrent_prepare(dst);
+    }
+
+    return 0;
+}
+
+int
+adp_cnt_load_bytes(adp_cnt_ctx_t *ctx, const void *buf, uint32_t len)
+{
+    const uint8_t *in = (const uint8_t *)buf;
+    adp_cnt_ctx_t *tmp;
+    uint32_t epoch;
 
     if (!ctx) {
         return -1;
     }
 
-    Ravg = ctx->Rsum / (double)ctx->m;
+    if (ctx->view) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (!in || len <= 3) {
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    if (len == ctx->m + 3 && in[0] == CCARD_ALGO_ADAPTIVE
+        && in[1] == ctx->hf && in[2] == ctx->k && !IS_SPARSE_BMP(in + 3)
+        && !IS_SPARSE_BMP(ctx->M) && !ctx->es) {
+        /* normal bitmap of the same shape, overwrite buckets in place */
+        memcpy(ctx->M, in + 3, ctx->m);
+        if (ctx->be) {
+            be_sync(ctx->be);
+        }
+        update_estimator_state(ctx, 0);
+    } else {
+        tmp = adp_cnt_init_alloc(in, len, ctx->hf, ctx->alloc);
+        if (!tmp) {
+            ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+            return -1;
+        }
+
+        epoch = ctx->epoch;
+        if (adp_cnt_copy_into(ctx, tmp) != 0) {
+            adp_cnt_fini(tmp);
+            return -1;
+        }
+        adp_cnt_fini(tmp);
+        ctx->epoch = epoch;
+    }
+
+    /* buckets modified since the last delta are unknown */
+    ccard_free(ctx->alloc, ctx->dirty);
+    ctx->dirty = NULL;
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+/**
+ * Recompute estimator state of a shared view from its buckets, which are
+ * raised by other processes without updating this context.
+ * */
+static void
+shared_sync(adp_cnt_ctx_t *ctx)
+{
+    if(ctx->view == VIEW_SHARED) {
+        update_estimator_state(ctx, 0);
+    }
+}
+
+static int64_t
+card_loglog(adp_cnt_ctx_t *ctx, uint32_t Rsum)
+{
+    double Ravg;
+
+    Ravg = Rsum / (double)ctx->m;
     ctx->err = CCARD_OK;
     return (int64_t)(ctx->Ca * pow(2, Ravg));
 }
 
+int64_t
+adp_cnt_card_loglog(adp_cnt_ctx_t *ctx)
+{
+    uint32_t Rsum, b_e;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    shared_sync(ctx);
+    acc_sum(ctx, &Rsum, &b_e);
+    return card_loglog(ctx, Rsum);
+}
+
 int64_t
 adp_cnt_card(adp_cnt_ctx_t *ctx)
 {
-    double B = ctx->b_e / (double)ctx->m;
+    uint32_t Rsum, b_e;
+    double B;
 
     if (!ctx) {
         return -1;
     }
 
+    if (ctx->es) {
+        /* exact count of explicit hash values */
+        ctx->err = CCARD_OK;
+        return ctx->es->count;
+    }
+
+    shared_sync(ctx);
+    acc_sum(ctx, &Rsum, &b_e);
+    B = b_e / (double)ctx->m;
+
     if (B >= B_s) {
         ctx->err = CCARD_OK;
         return (int64_t)round((-(double)ctx->m) * log(B));
     }
 
-    return adp_cnt_card_loglog(ctx);
+    return card_loglog(ctx, Rsum);
 }
 
 int
 adp_cnt_offer(adp_cnt_ctx_t *ctx, const void *buf, uint32_t len)
 {
-    int modified = 0;
-    uint64_t x, j;
-    uint8_t r, hl;
+    int modified;
+    uint64_t x;
 
     if (!ctx) {
         return -1;
     }
 
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
     switch (ctx->hf) {
         case CCARD_HASH_MURMUR:
             x = (uint64_t)murmurhash((void *)buf, len, -1);
-            hl = 32;
             break;
         case CCARD_HASH_LOOKUP3:
             x = lookup3ycs64_2((const char *)buf);
-            hl = 64;
             break;
         default:
             /* default to use lookup3 hash function */
             x = lookup3ycs64_2((const char *)buf);
-            hl = 64;
     }
 
-    j = x >> (hl - ctx->k);
-    r = (uint8_t)(num_of_trail_zeros(x << (ctx->k + 64 - hl)) - (ctx->k + 64 -
-                  hl) + 1);
-
-    if(IS_SPARSE_BMP(ctx->M)) {
-        /* update sparse bucket counter */
-        int off = sparse_bisect_search(ctx, j);
+    modified = offer_hash(ctx, x);
 
-        if(off != -1) {
-            /* the bucket to be updated already exists, no need to decrease
-             * empty bucket counter */
-            if(ctx->M[off] < r) {
-                ctx->Rsum += r - ctx->M[off];
-                ctx->M[off] = r;
-                modified = 1;
-            }
-            return modified;
-        }
+    /* not written unless changed, threads offering concurrently would
+     * otherwise contend on the cache line */
+    if (ctx->err != CCARD_OK) {
+        ctx->err = CCARD_OK;
+    }
+    return modified;
+}
 
-        if(!sparse_should_use_normal_bitmap(ctx, ctx->m - ctx->b_e)) {
-            /* still use sparse format to insert new bucket */
-            sparse_insert_bucket(ctx, j, r);
-            ctx->Rsum += r;
-            ctx->b_e--;
-            return 1;
-        }
+int
+adp_cnt_get_raw_bytes(adp_cnt_ctx_t *ctx, void *buf, uint32_t *len)
+{
+    uint8_t *out = (uint8_t *)buf;
 
-        /* convert sparse buckets to normal format, fallback to CONT */
-        sparse_to_normal_bitmap(ctx);
+    if (!ctx || !len) {
+        return -1;
     }
 
-    /* CONT: update normal bucket counter */
-    if (ctx->M[j] < r) {
-        ctx->Rsum += r - ctx->M[j];
-        if (ctx->M[j] == 0) {
-            ctx->b_e--;
+    lazy_flush(ctx);
+
+    if (ctx->es) {
+        if (out && *len < es_dump(ctx->es, ctx->k, NULL)) {
+            return -1;
         }
-        ctx->M[j] = r;
+        *len = es_dump(ctx->es, ctx->k, out);
+        return 0;
+    }
 
-        modified = 1;
+    sparse_sync_bitmap(ctx);
+    if (out && *len < ctx->bmp_len) {
+        return -1;
     }
 
-    ctx->err = CCARD_OK;
-    return modified;
+    if(out) {
+        memcpy(out, ctx->M, ctx->bmp_len);
+    }
+    *len = ctx->bmp_len;
+
+    return 0;
 }
 
 int
-adp_cnt_get_raw_bytes(adp_cnt_ctx_t *ctx, void *buf, uint32_t *len)
+adp_cnt_get_bytes(adp_cnt_ctx_t *ctx, void *buf, uint32_t *len)
 {
+    /*
+     +--------------+---------+------------------------------+-----------+
+     | algorithm[1] | hash[1] | bitmap length(base-2 log)[1] | bitmap[n] |
+     +--------------+---------+------------------------------+-----------+
+     */
+    uint8_t algo = CCARD_ALGO_ADAPTIVE;
     uint8_t *out = (uint8_t *)buf;
+    uint32_t blen;
+
+    if (!ctx || !len) {
+        return -1;
+    }
+
+    lazy_flush(ctx);
+
+    sparse_sync_bitmap(ctx);
+    blen = ctx->es ? es_dump(ctx->es, ctx->k, NULL) : ctx->bmp_len;
+    if (out && *len < blen + 3) {
+        return -1;
+    }
 
-    if (!ctx || !len || (out && *len < ctx->bmp_len)) {
+    if (out) {
+        out[0] = algo;
+        out[1] = ctx->hf;
+        out[2] = ctx->k;
+        if (ctx->es) {
+            es_dump(ctx->es, ctx->k, out + 3);
+        } else {
+            memcpy(out + 3, ctx->M, ctx->bmp_len);
+        }
+    }
+    *len = blen + 3;
+
+    return 0;
+}
+
+int
+adp_cnt_get_iov(adp_cnt_ctx_t *ctx, uint8_t *hdr, struct iovec *iov)
+{
+    if (!ctx || !hdr || !iov) {
         return -1;
     }
 
-    if(out) {
-        memcpy(out, ctx->M, ctx->bmp_len);
+    if (ctx->es) {
+        /* explicit hash values are dumped by adp_cnt_get_bytes only */
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
     }
-    *len = ctx->bmp_len;
 
+    lazy_flush(ctx);
+    sparse_sync_bitmap(ctx);
+
+    hdr[0] = CCARD_ALGO_ADAPTIVE;
+    hdr[1] = ctx->hf;
+    hdr[2] = ctx->k;
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = 3;
+    iov[1].iov_base = ctx->M;
+    iov[1].iov_len = ctx->bmp_len;
+
+    ctx->err = CCARD_OK;
     return 0;
 }
 
 int
-adp_cnt_get_bytes(adp_cnt_ctx_t *ctx, void *buf, uint32_t *len)
+adp_cnt_get_compressed_bytes(adp_cnt_ctx_t *ctx, void *buf, uint32_t *len)
 {
-    /*
-     +--------------+---------+------------------------------+-----------+
-     | algorithm[1] | hash[1] | bitmap length(base-2 log)[1] | bitmap[n] |
-     +--------------+---------+------------------------------+-----------+
-     */
-    uint8_t algo = CCARD_ALGO_ADAPTIVE;
-    uint8_t *out = (uint8_t *)buf;
+    uint8_t *tmp, mode;
+    uint32_t tlen;
+    int rc;
 
-    if (!ctx || !len || (out && *len < ctx->bmp_len + 3)) {
+    if (!ctx || !len || adp_cnt_get_bytes(ctx, NULL, &tlen)) {
         return -1;
     }
 
-    if (out) {
-        out[0] = algo;
-        out[1] = ctx->hf;
-        out[2] = ctx->k;
-        memcpy(out + 3, ctx->M, ctx->bmp_len);
+    tmp = (uint8_t *)ccard_malloc(ctx->alloc, tlen);
+    if (!tmp) {
+        return -1;
+    }
+    adp_cnt_get_bytes(ctx, tmp, &tlen);
+    if(IS_EXPLICIT_BMP(tmp + 3)) {
+        mode = BC_EXPLICIT;
+    } else if(IS_SPARSE_BMP(tmp + 3)) {
+        mode = BC_SPARSE;
+    } else {
+        mode = BC_REGISTERS;
     }
-    *len = ctx->bmp_len + 3;
+    rc = bc_compress_bytes(tmp, tlen, mode, (uint8_t *)buf, len);
+    ccard_free(ctx->alloc, tmp);
 
-    return 0;
+    return rc;
 }
 
 int
@@ -780,6 +1964,13 @@ adp_cnt_merge(adp_cnt_ctx_t *ctx, adp_cnt_ctx_t *tbm, ...)
         return -1;
     }
 
+    lazy_flush(ctx);
+
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
     if (tbm) {
         int invalid = 0;
         int buf_cnt;
@@ -788,12 +1979,14 @@ adp_cnt_merge(adp_cnt_ctx_t *ctx, adp_cnt_ctx_t *tbm, ...)
 
         /* count number of estimators and validate them */
         buf_cnt = 2; /* current context and the 1st estimator in args */
+        sparse_sync_bitmap(tbm);
         rc = unified_bitmap_verify(ctx, 1, tbm->M, tbm->bmp_len);
         if(rc == -1 || ctx->hf != tbm->hf) {
             invalid = 1;
         } else {
             va_start(vl, tbm);
             while ((bm = va_arg(vl, adp_cnt_ctx_t *)) != NULL) {
+                sparse_sync_bitmap(bm);
                 rc = unified_bitmap_verify(ctx, 1, bm->M, bm->bmp_len);
                 if(rc == -1 || ctx->hf != bm->hf) {
                     invalid = 1;
@@ -812,22 +2005,22 @@ adp_cnt_merge(adp_cnt_ctx_t *ctx, adp_cnt_ctx_t *tbm, ...)
         pbuf = (const uint8_t **)alloca(sizeof(const uint8_t *) * buf_cnt);
         plen = (uint32_t *)alloca(sizeof(uint32_t) * buf_cnt);
 
-        /* initialize buffer array */
-        buf_cnt = 2;
-        pbuf[0] = ctx->M;
-        plen[0] = ctx->bmp_len;
-        pbuf[1] = tbm->M;
-        plen[1] = tbm->bmp_len;
-
+        /* initialize buffer array, explicit contexts are merged directly */
+        buf_cnt = 1;
         va_start(vl, tbm);
-        while ((bm = va_arg(vl, adp_cnt_ctx_t *)) != NULL) {
+        for (bm = tbm; bm != NULL; bm = va_arg(vl, adp_cnt_ctx_t *)) {
+            if (bm->es) {
+                explicit_merge(ctx, bm->es);
+                continue;
+            }
+            lazy_flush(bm);
             pbuf[buf_cnt] = bm->M;
             plen[buf_cnt] = bm->bmp_len;
             buf_cnt++;
         }
         va_end(vl);
 
-        rc = aux_merge_raw_bytes(ctx, buf_cnt, pbuf, plen);
+        rc = aux_merge_ctx_bitmap(ctx, buf_cnt, pbuf, plen);
     } else {
         ctx->err = CCARD_OK;
         rc = 0;
@@ -846,9 +2039,16 @@ adp_cnt_merge_raw_bytes(adp_cnt_ctx_t *ctx, const void *buf, uint32_t len, ...)
         return -1;
     }
 
+    lazy_flush(ctx);
+
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
     if (buf) {
         int invalid = 0;
-        int buf_cnt;
+        int buf_cnt, first;
         const void *in_buf;
         uint32_t in_len;
         const uint8_t **pbuf;
@@ -881,23 +2081,26 @@ adp_cnt_merge_raw_bytes(adp_cnt_ctx_t *ctx, const void *buf, uint32_t len, ...)
         pbuf = (const uint8_t **)alloca(sizeof(const uint8_t *) * buf_cnt);
         plen = (uint32_t *)alloca(sizeof(uint32_t) * buf_cnt);
 
-        /* initialize buffer array */
-        buf_cnt = 2;
-        pbuf[0] = ctx->M;
-        plen[0] = ctx->bmp_len;
-        pbuf[1] = buf;
-        plen[1] = len;
-
+        /* initialize buffer array, explicit bitmaps are merged directly */
+        buf_cnt = 1;
+        in_len = len;
         va_start(vl, len);
-        while((in_buf = va_arg(vl, const void *)) != NULL) {
-            in_len = va_arg(vl, uint32_t);
+        for(in_buf = buf, first = 1; in_buf != NULL;
+            in_buf = va_arg(vl, const void *), first = 0) {
+            if(!first) {
+                in_len = va_arg(vl, uint32_t);
+            }
+            if(IS_EXPLICIT_BMP((const uint8_t *)in_buf)) {
+                explicit_merge_bytes(ctx, in_buf, in_len);
+                continue;
+            }
             pbuf[buf_cnt] = in_buf;
             plen[buf_cnt] = in_len;
             buf_cnt++;
         }
         va_end(vl);
 
-        rc = aux_merge_raw_bytes(ctx, buf_cnt, pbuf, plen);
+        rc = aux_merge_ctx_bitmap(ctx, buf_cnt, pbuf, plen);
     } else {
         ctx->err = CCARD_OK;
         rc = 0;
@@ -916,59 +2119,82 @@ adp_cnt_merge_bytes(adp_cnt_ctx_t *ctx, const void *buf, uint32_t len, ...)
         return -1;
     }
 
+    lazy_flush(ctx);
+
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
     if (buf) {
         int invalid = 0;
-        int buf_cnt;
-        const void *in_buf;
-        uint32_t in_len;
-        const uint8_t **pbuf;
-        uint32_t *plen;
+        int buf_cnt, in_cnt, i;
+        const uint8_t **ibuf, **pbuf;
+        uint32_t *ilen, *plen;
+        uint8_t **plain;
 
+        /* count number of buffers */
+        in_cnt = 1;
+        va_start(vl, len);
+        while(va_arg(vl, const void *) != NULL) {
+            va_arg(vl, uint32_t);
+            in_cnt++;
+        }
+        va_end(vl);
 
-        /* count number of buffers and validate them */
-        buf_cnt = 2; /* current context and the 1st buffer in args */
-        rc = unified_bitmap_verify(ctx, 0, buf, len);
-        if(rc == -1) {
-            invalid = 1;
-        } else {
-            va_start(vl, len);
-            while((in_buf = va_arg(vl, const void *)) != NULL) {
-                in_len = va_arg(vl, uint32_t);
-                rc = unified_bitmap_verify(ctx, 0, in_buf, in_len);
-                if(rc == -1) {
-                    invalid = 1;
-                    break;
-                }
-                buf_cnt++;
+        ibuf = (const uint8_t **)alloca(sizeof(const uint8_t *) * in_cnt);
+        ilen = (uint32_t *)alloca(sizeof(uint32_t) * in_cnt);
+        plain = (uint8_t **)alloca(sizeof(uint8_t *) * in_cnt);
+
+        /* decode compressed buffers and validate them */
+        ibuf[0] = (const uint8_t *)buf;
+        ilen[0] = len;
+        va_start(vl, len);
+        for(i = 1; i < in_cnt; i++) {
+            ibuf[i] = va_arg(vl, const uint8_t *);
+            ilen[i] = va_arg(vl, uint32_t);
+        }
+        va_end(vl);
+        for(i = 0; i < in_cnt; i++) {
+            plain[i] = NULL;
+            if(!invalid && ilen[i] > 3 && (ibuf[i][0] & CCARD_FLAG_COMPRESSED)) {
+                plain[i] = bc_decompress_bytes(ibuf[i], ilen[i], &ilen[i]);
+                ibuf[i] = plain[i];
+                invalid = plain[i] == NULL;
+            }
+            if(!invalid) {
+                invalid = unified_bitmap_verify(ctx, 0, ibuf[i], ilen[i]) == -1;
             }
-            va_end(vl);
         }
 
         if(invalid) {
+            for(i = 0; i < in_cnt; i++) {
+                free(plain[i]);
+            }
             ctx->err = CCARD_ERR_MERGE_FAILED;
             return -1;
         }
 
-        pbuf = (const uint8_t **)alloca(sizeof(const uint8_t *) * buf_cnt);
-        plen = (uint32_t *)alloca(sizeof(uint32_t) * buf_cnt);
-
-        /* initialize buffer array (strip headers) */
-        buf_cnt = 2;
-        pbuf[0] = ctx->M;
-        plen[0] = ctx->bmp_len;
-        pbuf[1] = (const uint8_t *)buf + 3;
-        plen[1] = len - 3;
+        pbuf = (const uint8_t **)alloca(sizeof(const uint8_t *) * (in_cnt + 1));
+        plen = (uint32_t *)alloca(sizeof(uint32_t) * (in_cnt + 1));
 
-        va_start(vl, len);
-        while((in_buf = va_arg(vl, const void *)) != NULL) {
-            in_len = va_arg(vl, uint32_t);
-            pbuf[buf_cnt] = (const uint8_t *)in_buf + 3;
-            plen[buf_cnt] = in_len - 3;
+        /* initialize buffer array (strip headers), explicit bitmaps are
+         * merged directly */
+        buf_cnt = 1;
+        for(i = 0; i < in_cnt; i++) {
+            if(IS_EXPLICIT_BMP(ibuf[i] + 3)) {
+                explicit_merge_bytes(ctx, ibuf[i] + 3, ilen[i] - 3);
+                continue;
+            }
+            pbuf[buf_cnt] = ibuf[i] + 3;
+            plen[buf_cnt] = ilen[i] - 3;
             buf_cnt++;
         }
-        va_end(vl);
 
-        rc = aux_merge_raw_bytes(ctx, buf_cnt, pbuf, plen);
+        rc = aux_merge_ctx_bitmap(ctx, buf_cnt, pbuf, plen);
+        for(i = 0; i < in_cnt; i++) {
+            free(plain[i]);
+        }
     } else {
         ctx->err = CCARD_OK;
         rc = 0;
@@ -977,6 +2203,267 @@ adp_cnt_merge_bytes(adp_cnt_ctx_t *ctx, const void *buf, uint32_t len, ...)
     return rc;
 }
 
+int
+adp_cnt_fold(adp_cnt_ctx_t *ctx, uint8_t new_k)
+{
+    uint8_t d, hl;
+    uint8_t *dbm;
+    uint32_t i;
+    int was_sparse;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    if (new_k == 0 || new_k > ctx->k) {
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    if(ctx->be) {
+        /* stamps are renewed for the folded bitmap */
+        lazy_flush(ctx);
+        be_fini(ctx->be);
+        ctx->be = be_init(1U << new_k, ctx->alloc);
+    }
+
+    if (new_k < ctx->k && ctx->view) {
+        /* borrowed bitmap can't be resized */
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (new_k < ctx->k && ctx->es) {
+        /* explicit hash values don't depend on k, only the limit is
+         * lowered */
+        ctx->M[0] = MAKE_SPARSE_ID(new_k);
+        ctx->k = new_k;
+        ctx->m = 1 << new_k;
+        update_estimator_state(ctx, 1);
+        ctx->es->limit = ctx->m / 8;
+        if(ctx->es->count > ctx->es->limit) {
+            explicit_to_bitmap(ctx);
+        }
+    } else if (new_k < ctx->k) {
+        sparse_flush_pending(ctx);
+        d = ctx->k - new_k;
+        hl = hash_len(ctx->hf);
+        dbm = (uint8_t *)ccard_calloc(ctx->alloc, sizeof(uint8_t), 1 << new_k);
+        if(!dbm) {
+            ctx->err = CCARD_ERR_INVALID_CTX;
+            return -1;
+        }
+
+        was_sparse = IS_SPARSE_BMP(ctx->M);
+        if(was_sparse) {
+            for(i = 0; i < ctx->s_cnt; i++) {
+                fold_bucket(dbm, hl, ctx->k, d, sparse_idx_get(ctx, i),
+                            ctx->sval[i]);
+            }
+        } else {
+            for(i = 0; i < ctx->m; i++) {
+                fold_bucket(dbm, hl, ctx->k, d, i, ctx->M[i]);
+            }
+        }
+
+        /* replace context bitmap with folded one and update estimator state,
+         * bucket indexes have changed so the next delta will be a full one */
+        ccard_free(ctx->alloc, ctx->M);
+        ctx->M = dbm;
+        ccard_free(ctx->alloc, ctx->dirty);
+        ctx->dirty = NULL;
+        ctx->k = new_k;
+        ctx->m = 1 << new_k;
+        ctx->bmp_len = ctx->m;
+        update_estimator_state(ctx, 0);
+
+        if(was_sparse
+           && !sparse_should_use_normal_bitmap(ctx, ctx->m - ctx->b_e)) {
+            /* keep sparse format if it still has less memory overhead */
+            normal_to_sparse_bitmap(ctx);
+        }
+    }
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int
+adp_cnt_get_delta(adp_cnt_ctx_t *ctx, uint32_t since_epoch, void *buf,
+                  uint32_t *len)
+{
+    /*
+     +--------------------+---------+------------------------------+-----------+
+     | algorithm|DELTA[1] | hash[1] | bitmap length(base-2 log)[1] | bitmap[n] |
+     +--------------------+---------+------------------------------+-----------+
+
+     bitmap is a sparse one holding only the buckets raised since the given
+     epoch, or a normal one if that is shorter. Explicit bitmap is always a
+     full one.
+     */
+    uint8_t *out = (uint8_t *)buf;
+    uint32_t blen;
+    int full = 1, sparse = 0;
+
+    if (!ctx || !len) {
+        return -1;
+    }
+
+    lazy_flush(ctx);
+
+    sparse_sync_bitmap(ctx);
+    if(ctx->es) {
+        /* explicit hash values are sent as a whole */
+        blen = es_dump(ctx->es, ctx->k, NULL);
+    } else if(IS_SPARSE_BMP(ctx->M)) {
+        /* sparse bitmap is compact enough to be sent as a whole */
+        blen = ctx->bmp_len;
+    } else {
+        full = !ctx->dirty || since_epoch != ctx->epoch;
+        blen = delta_encode_sparse(ctx, full, NULL);
+        if(blen < ctx->m) {
+            sparse = 1;
+        } else {
+            blen = ctx->m;
+        }
+    }
+
+    if (out && *len < blen + 3) {
+        return -1;
+    }
+
+    if (out) {
+        out[0] = CCARD_ALGO_ADAPTIVE | CCARD_FLAG_DELTA;
+        out[1] = ctx->hf;
+        out[2] = ctx->k;
+        if(ctx->es) {
+            es_dump(ctx->es, ctx->k, out + 3);
+        } else if(IS_SPARSE_BMP(ctx->M)) {
+            memcpy(out + 3, ctx->M, ctx->bmp_len);
+        } else {
+            if(sparse) {
+                delta_encode_sparse(ctx, full, out + 3);
+            } else {
+                memcpy(out + 3, ctx->M, ctx->m);
+            }
+
+            /* track buckets modified from now on */
+            if(ctx->dirty) {
+                memset(ctx->dirty, 0, (ctx->m + 7) / 8);
+            } else {
+                ctx->dirty = (uint8_t *)ccard_calloc(ctx->alloc, 1, (ctx->m + 7) / 8);
+            }
+        }
+        ctx->epoch++;
+    }
+    *len = blen + 3;
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int
+adp_cnt_apply_delta(adp_cnt_ctx_t *ctx, const void *buf, uint32_t len)
+{
+    const uint8_t *in = (const uint8_t *)buf;
+    int k = -1;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    lazy_flush(ctx);
+
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if(in && len > 3) {
+        k = IS_EXPLICIT_BMP(in + 3) ? es_verify(in + 3, len - 3,
+                                              hash_len(ctx->hf))
+                                    : raw_bitmap_k(in + 3, len - 3);
+    }
+    if(!in || len <= 3
+       || in[0] != (CCARD_ALGO_ADAPTIVE | CCARD_FLAG_DELTA)
+       || in[1] != ctx->hf
+       || k != in[2]) {
+        ctx->err = CCARD_ERR_MERGE_FAILED;
+        return -1;
+    }
+
+    return adp_cnt_merge_raw_bytes(ctx, in + 3, len - 3, NULL);
+}
+
+int64_t
+adp_cnt_epoch(adp_cnt_ctx_t *ctx)
+{
+    if (!ctx) {
+        return -1;
+    }
+
+    ctx->err = CCARD_OK;
+    return ctx->epoch;
+}
+
+hll_cnt_ctx_t *
+adp_cnt_to_hll(adp_cnt_ctx_t *ctx)
+{
+    hll_cnt_ctx_t *hll;
+    uint8_t hf, *buf;
+    uint32_t len;
+
+    if (!ctx) {
+        return NULL;
+    }
+
+    lazy_flush(ctx);
+
+    /* any hash function but murmur falls back to lookup3, see adp_cnt_offer */
+    hf = ctx->hf == CCARD_HASH_MURMUR ? CCARD_HASH_MURMUR : CCARD_HASH_LOOKUP3;
+
+    if (ctx->es) {
+        /* hyperloglog shares the same explicit bitmap format */
+        len = es_dump(ctx->es, ctx->k, NULL);
+        buf = (uint8_t *)ccard_malloc(ctx->alloc, len);
+        es_dump(ctx->es, ctx->k, buf);
+        hll = hll_cnt_raw_init_alloc(buf, len, hf, ctx->alloc);
+        ccard_free(ctx->alloc, buf);
+
+        ctx->err = CCARD_OK;
+        return hll;
+    }
+
+    /* hyperloglog shares the same sparse bitmap format */
+    sparse_sync_bitmap(ctx);
+    hll = hll_cnt_raw_init_alloc(ctx->M, ctx->bmp_len, hf, ctx->alloc);
+
+    ctx->err = CCARD_OK;
+    return hll;
+}
+
+adp_cnt_ctx_t *
+adp_cnt_from_hll(hll_cnt_ctx_t *hll)
+{
+    adp_cnt_ctx_t *ctx = NULL;
+    uint8_t *buf;
+    uint32_t len;
+
+    if (hll_cnt_get_bytes(hll, NULL, &len)) {
+        return NULL;
+    }
+
+    /* serialized bitmap is needed to get the hash function */
+    buf = (uint8_t *)ccard_malloc(NULL, len);
+    hll_cnt_get_bytes(hll, buf, &len);
+    if(buf[1] == CCARD_HASH_MURMUR || buf[1] == CCARD_HASH_LOOKUP3) {
+        ctx = adp_cnt_raw_init(buf + 3, len - 3, buf[1]);
+    }
+    ccard_free(NULL, buf);
+
+    return ctx;
+}
+
 int
 adp_cnt_reset(adp_cnt_ctx_t *ctx)
 {
@@ -984,12 +2471,27 @@ adp_cnt_reset(adp_cnt_ctx_t *ctx)
         return -1;
     }
 
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
     ctx->err = CCARD_OK;
     ctx->Rsum = 0;
     ctx->b_e = ctx->m;
+    ctx->p_cnt = 0;
+    acc_clear(ctx);
+    if(ctx->es) {
+        es_reset(ctx->es);
+    }
     if(IS_SPARSE_BMP(ctx->M)) {
-        ctx->M = realloc(ctx->M, 1);
+        ctx->M = ccard_realloc(ctx->alloc, ctx->M, 1);
         ctx->M[0] = MAKE_SPARSE_ID(ctx->k);
+        ctx->bmp_len = 1;
+        ctx->s_cnt = 0;
+        ctx->s_stale = 0;
+    } else if(ctx->be) {
+        be_reset(ctx->be, ctx->M);
     } else {
         memset(ctx->M, 0, ctx->m);
     }
@@ -997,12 +2499,98 @@ adp_cnt_reset(adp_cnt_ctx_t *ctx)
     return 0;
 }
 
+int
+adp_cnt_set_lazy_reset(adp_cnt_ctx_t *ctx, int on)
+{
+    if (!ctx) {
+        return -1;
+    }
+
+    if (ctx->view) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (on && ctx->acc) {
+        /* stamps can't be touched atomically with buckets */
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    ctx->err = CCARD_OK;
+    if (on && !ctx->be) {
+        ctx->be = be_init(ctx->m, ctx->alloc);
+        if (!ctx->be) {
+            ctx->err = CCARD_ERR_INVALID_CTX;
+            return -1;
+        }
+    } else if (!on && ctx->be) {
+        lazy_flush(ctx);
+        be_fini(ctx->be);
+        ctx->be = NULL;
+    }
+
+    return 0;
+}
+
+int
+adp_cnt_set_concurrent(adp_cnt_ctx_t *ctx, int on)
+{
+    void *mem;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    if (ctx->view) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (on && ctx->be) {
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    ctx->err = CCARD_OK;
+    if (on && !ctx->acc) {
+        /* accumulators are aligned by hand, the allocator only aligns to
+         * words */
+        mem = ccard_calloc(ctx->alloc, 1, sizeof(struct adp_acc_s) * ACC_SLOTS
+                           + LINE_SIZE);
+        if (!mem) {
+            ctx->err = CCARD_ERR_NOMEM;
+            return -1;
+        }
+        concurrent_prepare(ctx);
+        ctx->acc_mem = mem;
+        ctx->acc = (struct adp_acc_s *)(void *)((uint8_t *)mem +
+                   LINE_SIZE - (uintptr_t)mem % LINE_SIZE);
+    } else if (!on && ctx->acc) {
+        /* take amounts of concurrent offers in the context */
+        acc_sum(ctx, &ctx->Rsum, &ctx->b_e);
+        ccard_free(ctx->alloc, ctx->acc_mem);
+        ctx->acc_mem = NULL;
+        ctx->acc = NULL;
+    }
+
+    return 0;
+}
+
 int
 adp_cnt_fini(adp_cnt_ctx_t *ctx)
 {
     if (ctx) {
-        free(ctx->M);
-        free(ctx);
+        if(!ctx->view) {
+            ccard_free(ctx->alloc, ctx->M);
+        }
+        ccard_free(ctx->alloc, ctx->dirty);
+        ccard_free(ctx->alloc, ctx->pending);
+        sparse_free(ctx);
+        es_fini(ctx->es);
+        be_fini(ctx->be);
+        ccard_free(ctx->alloc, ctx->acc_mem);
+        ccard_free(ctx->alloc, ctx);
         return 0;
     }
 
@@ -1026,6 +2614,10 @@ adp_cnt_errstr(int err)
         "No error",
         "Invalid algorithm context",
         "Merge bitmap failed",
+        "Invalid argument",
+        "I/O error",
+        "Not allowed on view",
+        "Out of memory",
         NULL
     };
 
@@ -1036,6 +2628,26 @@ adp_cnt_errstr(int err)
     return "Invalid error number";
 }
 
+static ccard_algo_t adp_algo_def = {
+    .raw_init = (void *(*)(const void *, uint32_t, uint8_t))adp_cnt_raw_init,
+    .init = (void *(*)(const void *, uint32_t, uint8_t))adp_cnt_init,
+    .card = (int64_t (*)(void *))adp_cnt_card,
+    .offer = (int (*)(void *, const void *, uint32_t))adp_cnt_offer,
+    .reset = (int (*)(void *))adp_cnt_reset,
+    .get_raw_bytes = (int (*)(void *, void *, uint32_t *))adp_cnt_get_raw_bytes,
+    .get_bytes = (int (*)(void *, void *, uint32_t *))adp_cnt_get_bytes,
+    .merge = (int (*)(void *, void *, ...))adp_cnt_merge,
+    .merge_raw_bytes = (int (*)(void *, const void *, uint32_t, ...))adp_cnt_merge_raw_bytes,
+    .merge_bytes = (int (*)(void *, const void *, uint32_t, ...))adp_cnt_merge_bytes,
+    .fini = (int (*)(void *))adp_cnt_fini,
+    .errnum = (int (*)(void *))adp_cnt_errnum,
+    .errstr = adp_cnt_errstr,
+    .raw_init_alloc = (void *(*)(const void *, uint32_t, uint8_t,
+                                 const ccard_allocator_t *))adp_cnt_raw_init_alloc
+};
+
+ccard_algo_t *adp_algo = &adp_algo_def;
+
 /* vi:ft=c ts=4 sw=4 fdm=marker et
  * */
 
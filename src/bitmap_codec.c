@@ -0,0 +1,569 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "ccard_common.h"
+#include "bitmap_codec.h"
+
+/* format version, in the high 4 bits of the first byte */
+static const uint8_t BC_VERSION = 1;
+
+/* min length of zero runs taken out of register codes */
+static const uint32_t BC_RUN_MIN = 16;
+
+// Byte writer, only counts bytes if p is NULL
+typedef struct bc_writer_s {
+    uint8_t *p;
+    uint32_t n;
+    uint64_t acc;   // pending bits
+    int bits;
+} bc_writer_t;
+
+typedef struct bc_reader_s {
+    const uint8_t *p;
+    uint32_t len;
+    uint32_t off;
+    uint64_t acc;
+    int bits;
+    int err;        // 1 if read beyond the end
+} bc_reader_t;
+
+static void put_byte(bc_writer_t *w, uint8_t b)
+{
+    if (w->p) {
+        w->p[w->n] = b;
+    }
+    w->n++;
+}
+
+static void put_varint(bc_writer_t *w, uint64_t v)
+{
+    while (v >= 0x80) {
+        put_byte(w, (uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    put_byte(w, (uint8_t)v);
+}
+
+// Append the lowest n (<= 8) bits of v, least significant bit first
+static void put_bits(bc_writer_t *w, uint32_t v, int n)
+{
+    w->acc |= (uint64_t)v << w->bits;
+    w->bits += n;
+    while (w->bits >= 8) {
+        put_byte(w, (uint8_t)w->acc);
+        w->acc >>= 8;
+        w->bits -= 8;
+    }
+}
+
+static void flush_bits(bc_writer_t *w)
+{
+    if (w->bits > 0) {
+        put_byte(w, (uint8_t)w->acc);
+    }
+    w->acc = 0;
+    w->bits = 0;
+}
+
+static uint8_t get_byte(bc_reader_t *r)
+{
+    if (r->off >= r->len) {
+        r->err = 1;
+        return 0;
+    }
+    return r->p[r->off++];
+}
+
+static uint64_t get_varint(bc_reader_t *r)
+{
+    uint64_t v = 0;
+    uint8_t b;
+    int shift;
+
+    for (shift = 0; shift < 64; shift += 7) {
+        b = get_byte(r);
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return v;
+        }
+    }
+    r->err = 1;
+    return 0;
+}
+
+static uint32_t get_bits(bc_reader_t *r, int n)
+{
+    uint32_t v;
+
+    while (r->bits < n) {
+        r->acc |= (uint64_t)get_byte(r) << r->bits;
+        r->bits += 8;
+    }
+    v = (uint32_t)(r->acc & ((1u << n) - 1));
+    r->acc >>= n;
+    r->bits -= n;
+
+    return v;
+}
+
+// Find the next run of at least BC_RUN_MIN zero registers from position i
+static int next_run(const uint8_t *in, uint32_t len, uint32_t i, uint32_t *start, uint32_t *rlen)
+{
+    uint32_t j;
+
+    while (i < len) {
+        for (; i < len && in[i]; i++);
+        for (j = i; j < len && !in[j]; j++);
+        if (j - i >= BC_RUN_MIN) {
+            *start = i;
+            *rlen = j - i;
+            return 1;
+        }
+        i = j;
+    }
+
+    return 0;
+}
+
+static uint32_t varint_len(uint64_t v)
+{
+    uint32_t n = 1;
+
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static int enc_registers(const uint8_t *in, uint32_t len, bc_writer_t *w)
+{
+    uint32_t hist[256] = {0}, cnt = 0, nruns = 0, nexc, i, start, rlen;
+    uint32_t covered, best = UINT32_MAX, cost, W;
+    uint8_t base = 1, width = 8, b, c, esc;
+    int wd;
+
+    // histogram of registers out of zero runs
+    for (i = 0; next_run(in, len, i, &start, &rlen); i = start + rlen) {
+        for (; i < start; i++) {
+            hist[in[i]]++;
+        }
+        nruns++;
+    }
+    for (; i < len; i++) {
+        hist[in[i]]++;
+    }
+    for (i = 0; i < 256; i++) {
+        cnt += hist[i];
+    }
+
+    // pick the window of values which makes codes and exceptions smallest,
+    // it sits around the mean as register values are concentrated there
+    for (wd = 1; wd <= 8; wd++) {
+        W = (1u << wd) - 2;
+        covered = 0;
+        for (i = 1; i < 1 + W && i < 256; i++) {
+            covered += hist[i];
+        }
+        for (b = 1; ; b++) {
+            cost = (uint32_t)(((uint64_t)cnt * wd + 7) / 8) + (cnt - hist[0] - covered);
+            if (cost < best) {
+                best = cost;
+                base = b;
+                width = (uint8_t)wd;
+            }
+            if (W == 0 || b + W > 255) {
+                break;
+            }
+            covered += hist[b + W] - hist[b];
+        }
+    }
+
+    W = (1u << width) - 2;
+    esc = (uint8_t)((1u << width) - 1);
+    nexc = 0;
+    for (i = 1; i < 256; i++) {
+        if (i < base || i >= base + W) {
+            nexc += hist[i];
+        }
+    }
+
+    put_byte(w, base);
+    put_byte(w, width);
+    put_varint(w, nruns);
+    for (i = 0; next_run(in, len, i, &start, &rlen); i = start + rlen) {
+        put_varint(w, start - i);
+        put_varint(w, rlen - BC_RUN_MIN);
+    }
+
+    put_varint(w, nexc);
+    for (i = 0; i < len; i++) {
+        if (in[i] && (in[i] < base || in[i] >= base + W)) {
+            put_byte(w, in[i]);
+        }
+    }
+
+    for (i = 0; next_run(in, len, i, &start, &rlen); i = start + rlen) {
+        for (; i < start; i++) {
+            c = in[i];
+            put_bits(w, c == 0 ? 0 : (c < base || c >= base + W) ? esc : c - base + 1, width);
+        }
+    }
+    for (; i < len; i++) {
+        c = in[i];
+        put_bits(w, c == 0 ? 0 : (c < base || c >= base + W) ? esc : c - base + 1, width);
+    }
+    flush_bits(w);
+
+    return 0;
+}
+
+static int dec_registers(bc_reader_t *r, uint8_t *out, uint32_t len)
+{
+    bc_reader_t runs, exc;
+    uint32_t nruns, nexc, i, j, start, rlen;
+    uint8_t base, width, esc, c;
+
+    base = get_byte(r);
+    width = get_byte(r);
+    if (width == 0 || width > 8) {
+        return -1;
+    }
+    esc = (uint8_t)((1u << width) - 1);
+
+    // skip runs and exceptions, they are read along with codes
+    nruns = (uint32_t)get_varint(r);
+    runs = *r;
+    for (i = 0; i < nruns && !r->err; i++) {
+        get_varint(r);
+        get_varint(r);
+    }
+    nexc = (uint32_t)get_varint(r);
+    if (r->err || nexc > r->len - r->off) {
+        return -1;
+    }
+    exc = *r;
+    r->off += nexc;
+
+    for (i = 0, j = 0; j <= nruns; j++) {
+        if (j < nruns) {
+            start = i + (uint32_t)get_varint(&runs);
+            rlen = (uint32_t)get_varint(&runs) + BC_RUN_MIN;
+            if (start < i || start > len || rlen > len - start) {
+                return -1;
+            }
+        } else {
+            start = len;
+            rlen = 0;
+        }
+
+        for (; i < start && !r->err; i++) {
+            c = (uint8_t)get_bits(r, width);
+            if (c == esc) {
+                if (nexc == 0) {
+                    return -1;
+                }
+                c = get_byte(&exc);
+                nexc--;
+            } else if (c) {
+                c = (uint8_t)(base + c - 1);
+            }
+            out[i] = c;
+        }
+        memset(out + i, 0, rlen);
+        i += rlen;
+    }
+
+    return r->err || nexc ? -1 : 0;
+}
+
+static int enc_sparse(const uint8_t *in, uint32_t len, bc_writer_t *w)
+{
+    uint8_t k = K_FROM_ID(in[0]), sidx_len = (k + 7) / 8;
+    uint32_t i, idx, next = 0;
+
+    if (k == 0 || k > 31 || (len - 1) % (sidx_len + 1) != 0) {
+        return -1;
+    }
+
+    put_byte(w, in[0]);
+    for (i = 1; i < len; i += sidx_len + 1) {
+        idx = (uint32_t)sparse_bytes_to_int(in, i + 1, sidx_len);
+        if (idx < next || in[i] >= 0x80) {
+            return -1;
+        }
+        put_varint(w, (uint64_t)(idx - next) << 7 | in[i]);
+        next = idx + 1;
+    }
+
+    return 0;
+}
+
+static int dec_sparse(bc_reader_t *r, uint8_t *out, uint32_t len)
+{
+    uint8_t k, sidx_len;
+    uint64_t v, idx, next = 0;
+    uint32_t i;
+
+    out[0] = get_byte(r);
+    k = K_FROM_ID(out[0]);
+    sidx_len = (k + 7) / 8;
+    if (!IS_SPARSE_BMP(out) || k == 0 || k > 31 || (len - 1) % (sidx_len + 1) != 0) {
+        return -1;
+    }
+
+    for (i = 1; i < len && !r->err; i += sidx_len + 1) {
+        v = get_varint(r);
+        idx = next + (v >> 7);
+        if (idx >= (1ULL << k)) {
+            return -1;
+        }
+        out[i] = v & 0x7f;
+        sparse_int_to_bytes(out, i + 1, sidx_len, (int)idx);
+        next = idx + 1;
+    }
+
+    return r->err ? -1 : 0;
+}
+
+static int enc_explicit(const uint8_t *in, uint32_t len, bc_writer_t *w)
+{
+    uint64_t h, prev = 0;
+    uint32_t i, j;
+
+    if ((len - 1) % 8 != 0) {
+        return -1;
+    }
+
+    put_byte(w, in[0]);
+    for (i = 1; i < len; i += 8) {
+        for (h = 0, j = 8; j > 0; j--) {
+            h = (h << 8) | in[i + j - 1];
+        }
+        if (i > 1 && h <= prev) {
+            return -1;
+        }
+        put_varint(w, i > 1 ? h - prev - 1 : h);
+        prev = h;
+    }
+
+    return 0;
+}
+
+static int dec_explicit(bc_reader_t *r, uint8_t *out, uint32_t len)
+{
+    uint64_t h = 0;
+    uint32_t i, j;
+
+    out[0] = get_byte(r);
+    if ((len - 1) % 8 != 0) {
+        return -1;
+    }
+
+    for (i = 1; i < len && !r->err; i += 8) {
+        h = i > 1 ? h + 1 + get_varint(r) : get_varint(r);
+        for (j = 0; j < 8; j++) {
+            out[i + j] = (uint8_t)(h >> (j * 8));
+        }
+    }
+
+    return r->err ? -1 : 0;
+}
+
+static int enc_bits(const uint8_t *in, uint32_t len, bc_writer_t *w)
+{
+    uint64_t ones = 0, nbits = (uint64_t)len * 8;
+    uint32_t i, next = 0;
+    uint8_t inv, b;
+
+    for (i = 0; i < len; i++) {
+        for (b = in[i]; b; b &= b - 1) {
+            ones++;
+        }
+    }
+    // positions of the less common bits are stored
+    inv = ones * 2 > nbits;
+
+    put_byte(w, inv);
+    put_varint(w, inv ? nbits - ones : ones);
+    for (i = 0; i < nbits; i++) {
+        if (((in[i >> 3] >> (i & 7)) & 1) != inv) {
+            put_varint(w, i - next);
+            next = i + 1;
+        }
+    }
+
+    return 0;
+}
+
+static int dec_bits(bc_reader_t *r, uint8_t *out, uint32_t len)
+{
+    uint64_t n, i, v, pos = 0, nbits = (uint64_t)len * 8;
+    uint8_t inv;
+
+    inv = get_byte(r);
+    n = get_varint(r);
+    if (inv > 1 || n > nbits) {
+        return -1;
+    }
+
+    memset(out, inv ? 0xff : 0, len);
+    for (i = 0; i < n && !r->err; i++) {
+        v = get_varint(r);
+        if (v >= nbits - pos) {
+            return -1;
+        }
+        pos += v;
+        out[pos >> 3] ^= (uint8_t)(1 << (pos & 7));
+        pos++;
+    }
+
+    return r->err ? -1 : 0;
+}
+
+static int encode_mode(const uint8_t *in, uint32_t len, uint8_t mode, bc_writer_t *w)
+{
+    if (len == 0) {
+        return -1;
+    }
+
+    switch (mode) {
+        case BC_REGISTERS:
+            return enc_registers(in, len, w);
+        case BC_SPARSE:
+            return IS_SPARSE_BMP(in) ? enc_sparse(in, len, w) : -1;
+        case BC_EXPLICIT:
+            return IS_EXPLICIT_BMP(in) ? enc_explicit(in, len, w) : -1;
+        case BC_BITS:
+            return enc_bits(in, len, w);
+    }
+
+    return -1;
+}
+
+uint32_t bc_encode(const uint8_t *in, uint32_t len, uint8_t mode, uint8_t *out)
+{
+    bc_writer_t w = {NULL, 0, 0, 0};
+    uint32_t stored = 1 + varint_len(len) + len;
+
+    // dry run to get the compressed length first
+    if (encode_mode(in, len, mode, &w) || 1 + varint_len(len) + w.n >= stored) {
+        mode = BC_STORED;
+    }
+
+    w.p = out;
+    w.n = 0;
+    put_byte(&w, (uint8_t)(BC_VERSION << 4 | mode));
+    put_varint(&w, len);
+    if (mode == BC_STORED) {
+        if (out) {
+            memcpy(out + w.n, in, len);
+        }
+        w.n += len;
+    } else {
+        encode_mode(in, len, mode, &w);
+    }
+
+    return w.n;
+}
+
+int bc_decode(const uint8_t *in, uint32_t len, uint8_t *out, uint32_t *out_len)
+{
+    bc_reader_t r = {in, len, 0, 0, 0, 0};
+    uint8_t head = get_byte(&r);
+    uint32_t blen = (uint32_t)get_varint(&r);
+    int rc = -1;
+
+    if (r.err || head >> 4 != BC_VERSION || blen == 0) {
+        return -1;
+    }
+    if (!out) {
+        *out_len = blen;
+        return 0;
+    }
+    if (*out_len < blen) {
+        return -1;
+    }
+
+    switch (head & 0x0f) {
+        case BC_STORED:
+            if (len - r.off == blen) {
+                memcpy(out, in + r.off, blen);
+                r.off = len;
+                rc = 0;
+            }
+            break;
+        case BC_REGISTERS:
+            rc = dec_registers(&r, out, blen);
+            break;
+        case BC_SPARSE:
+            rc = dec_sparse(&r, out, blen);
+            break;
+        case BC_EXPLICIT:
+            rc = dec_explicit(&r, out, blen);
+            break;
+        case BC_BITS:
+            rc = dec_bits(&r, out, blen);
+            break;
+    }
+
+    // trailing garbage is taken as corruption
+    if (rc || r.err || r.off != len) {
+        return -1;
+    }
+    *out_len = blen;
+
+    return 0;
+}
+
+int bc_compress_bytes(const uint8_t *in, uint32_t len, uint8_t mode, uint8_t *out, uint32_t *out_len)
+{
+    uint32_t n;
+
+    if (!in || len <= 3 || !out_len || (in[0] & CCARD_FLAG_COMPRESSED)) {
+        return -1;
+    }
+
+    n = 3 + bc_encode(in + 3, len - 3, mode, NULL);
+    if (out) {
+        if (*out_len < n) {
+            return -1;
+        }
+        out[0] = in[0] | CCARD_FLAG_COMPRESSED;
+        out[1] = in[1];
+        out[2] = in[2];
+        bc_encode(in + 3, len - 3, mode, out + 3);
+    }
+    *out_len = n;
+
+    return 0;
+}
+
+uint8_t *bc_decompress_bytes(const uint8_t *in, uint32_t len, uint32_t *out_len)
+{
+    uint8_t *out;
+    uint32_t n;
+
+    if (!in || len <= 3 || !(in[0] & CCARD_FLAG_COMPRESSED) ||
+        bc_decode(in + 3, len - 3, NULL, &n)) {
+        return NULL;
+    }
+
+    out = (uint8_t *)malloc(n + 3);
+    if (!out) {
+        return NULL;
+    }
+    if (bc_decode(in + 3, len - 3, out + 3, &n)) {
+        free(out);
+        return NULL;
+    }
+    out[0] = in[0] & ~CCARD_FLAG_COMPRESSED;
+    out[1] = in[1];
+    out[2] = in[2];
+    *out_len = n + 3;
+
+    return out;
+}
+
+// vi:ft=c ts=4 sw=4 fdm=marker et
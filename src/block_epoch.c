@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <string.h>
+#include "block_epoch.h"
+
+// Clear block b and stamp it with the current epoch
+static void be_clear(blk_epoch_t *be, uint8_t *M, uint32_t b)
+{
+    uint32_t off = b << BE_SHIFT;
+    uint32_t n = be->len - off;
+
+    if (n > (1U << BE_SHIFT)) {
+        n = 1U << BE_SHIFT;
+    }
+    memset(M + off, 0, n);
+    be->stamps[b] = be->epoch;
+    be->stale--;
+}
+
+blk_epoch_t *be_init(uint32_t len, const ccard_allocator_t *alloc)
+{
+    blk_epoch_t *be;
+
+    if (!alloc) {
+        alloc = ccard_get_allocator();
+    }
+
+    be = (blk_epoch_t *)ccard_malloc(alloc, sizeof(blk_epoch_t));
+    if (!be) {
+        return NULL;
+    }
+
+    be->alloc = alloc;
+    be->len = len;
+    be->blocks = (len + (1U << BE_SHIFT) - 1) >> BE_SHIFT;
+    be->stamps = (uint32_t *)ccard_calloc(alloc, be->blocks ? be->blocks : 1,
+                                          sizeof(uint32_t));
+    if (!be->stamps) {
+        ccard_free(alloc, be);
+        return NULL;
+    }
+    be->epoch = 0;
+    be->stale = 0;
+
+    return be;
+}
+
+void be_reset(blk_epoch_t *be, uint8_t *M)
+{
+    if (++be->epoch == 0) {
+        // stamps of old epochs would look up to date again
+        memset(M, 0, be->len);
+        memset(be->stamps, 0, sizeof(uint32_t) * be->blocks);
+        be->stale = 0;
+        return;
+    }
+
+    be->stale = be->blocks;
+}
+
+void be_touch(blk_epoch_t *be, uint8_t *M, uint32_t i)
+{
+    if (BE_STALE(be, i)) {
+        be_clear(be, M, i >> BE_SHIFT);
+    }
+}
+
+void be_flush(blk_epoch_t *be, uint8_t *M)
+{
+    uint32_t b;
+
+    for (b = 0; be->stale && b < be->blocks; b++) {
+        if (be->stamps[b] != be->epoch) {
+            be_clear(be, M, b);
+        }
+    }
+}
+
+void be_sync(blk_epoch_t *be)
+{
+    uint32_t b;
+
+    if (be->stale) {
+        for (b = 0; b < be->blocks; b++) {
+            be->stamps[b] = be->epoch;
+        }
+        be->stale = 0;
+    }
+}
+
+int be_fini(blk_epoch_t *be)
+{
+    if (be) {
+        ccard_free(be->alloc, be->stamps);
+        ccard_free(be->alloc, be);
+        return 0;
+    }
+
+    return -1;
+}
+
+// vi:ft=c ts=4 sw=4 fdm=marker et
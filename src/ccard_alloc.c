@@ -0,0 +1,794 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "ccard_alloc.h"
+
+/* alignment of memory carved from arena */
+#define ARENA_ALIGN 16
+/* default bytes of arena block */
+#define ARENA_BLOCK_SIZE 65536
+/* header of each chunk carved from arena, holding its size */
+#define CHUNK_HDR ARENA_ALIGN
+/* no chunk carved from block yet */
+#define NO_CHUNK ((size_t)-1)
+
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/* bytes of slab */
+#define SLAB_SIZE 65536
+/* smallest size class */
+#define SLAB_MIN 16
+/* number of size classes, from SLAB_MIN to SLAB_MAX bytes */
+#define SLAB_CLASSES 10
+#define SLAB_MAX (SLAB_MIN << (SLAB_CLASSES - 1))
+
+/* bytes of huge page */
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+/* memory policy binding to the given nodes, see mbind(2) */
+#define HUGE_MPOL_BIND 2
+
+typedef struct arena_block_s {
+    struct arena_block_s *next;
+    size_t size;    // bytes for chunks
+    size_t used;    // bytes carved
+    size_t last;    // offset of the latest chunk, NO_CHUNK if none
+} arena_block_t;
+
+struct ccard_arena_s {
+    ccard_allocator_t alloc;        // allocator carving from this arena
+    const ccard_allocator_t *parent;    // allocator of blocks
+    size_t block_size;
+    size_t total;                   // bytes of all blocks
+    arena_block_t *cur;             // block being carved
+    arena_block_t *first;           // block kept by ccard_arena_reset
+    arena_block_t *blocks;          // all blocks, newest first
+};
+
+typedef struct slab_page_s {
+    struct slab_page_s *next;
+} slab_page_t;
+
+// header of allocation passed to the parent allocator, before chunk header
+typedef struct slab_large_s {
+    struct slab_large_s *prev;
+    struct slab_large_s *next;
+    size_t size;
+} slab_large_t;
+
+// header of allocation of huge page allocator, before the returned memory
+typedef struct huge_hdr_s {
+    size_t size;    // bytes requested
+    size_t map_len; // bytes of mapping, 0 if got from the parent allocator
+} huge_hdr_t;
+
+struct ccard_huge_s {
+    ccard_allocator_t alloc;        // allocator mapping huge pages
+    const ccard_allocator_t *parent;    // allocator of small allocations
+    size_t threshold;               // bytes from which memory is mapped
+    int node;                       // NUMA node to bind to, -1 if none
+    int flags;                      // CCARD_HUGE_*
+    size_t mapped;                  // bytes of live mappings
+};
+
+struct ccard_slab_s {
+    ccard_allocator_t alloc;        // allocator carving from this slab
+    const ccard_allocator_t *parent;    // allocator of slabs
+    size_t total;                   // bytes of slabs and large allocations
+    size_t live;                    // bytes of chunks in use
+    size_t used;                    // bytes carved from the newest slab
+    slab_page_t *pages;             // all slabs, newest first
+    void *free_list[SLAB_CLASSES];  // freed chunks of each size class
+    slab_large_t *large;            // large allocations
+};
+
+static void *std_malloc(void *opaque, size_t size)
+{
+    (void)opaque;
+    return malloc(size);
+}
+
+static void *std_realloc(void *opaque, void *ptr, size_t size)
+{
+    (void)opaque;
+    return realloc(ptr, size);
+}
+
+static void std_free(void *opaque, void *ptr)
+{
+    (void)opaque;
+    free(ptr);
+}
+
+static const ccard_allocator_t std_allocator = {
+    std_malloc,
+    std_realloc,
+    std_free,
+    NULL
+};
+
+static const ccard_allocator_t *global_allocator = &std_allocator;
+
+void ccard_set_allocator(const ccard_allocator_t *alloc)
+{
+    global_allocator = alloc ? alloc : &std_allocator;
+}
+
+const ccard_allocator_t *ccard_get_allocator(void)
+{
+    return global_allocator;
+}
+
+void *ccard_malloc(const ccard_allocator_t *alloc, size_t size)
+{
+    if (!alloc) {
+        alloc = global_allocator;
+    }
+
+    return alloc->malloc_fn(alloc->opaque, size);
+}
+
+void *ccard_calloc(const ccard_allocator_t *alloc, size_t n, size_t size)
+{
+    void *ptr;
+
+    if (size && n > SIZE_MAX / size) {
+        return NULL;
+    }
+
+    ptr = ccard_malloc(alloc, n * size);
+    if (ptr) {
+        memset(ptr, 0, n * size);
+    }
+
+    return ptr;
+}
+
+void *ccard_realloc(const ccard_allocator_t *alloc, void *ptr, size_t size)
+{
+    if (!alloc) {
+        alloc = global_allocator;
+    }
+
+    return alloc->realloc_fn(alloc->opaque, ptr, size);
+}
+
+void ccard_free(const ccard_allocator_t *alloc, void *ptr)
+{
+    if (!alloc) {
+        alloc = global_allocator;
+    }
+
+    if (ptr) {
+        alloc->free_fn(alloc->opaque, ptr);
+    }
+}
+
+void *ccard_copy(const ccard_allocator_t *alloc, void *dst, const void *src,
+                 size_t size)
+{
+    void *p;
+
+    if (!src || size == 0) {
+        ccard_free(alloc, dst);
+        return NULL;
+    }
+
+    p = ccard_realloc(alloc, dst, size);
+    if (!p) {
+        ccard_free(alloc, dst);
+        return NULL;
+    }
+    memcpy(p, src, size);
+
+    return p;
+}
+
+static uint8_t *block_data(arena_block_t *blk)
+{
+    return (uint8_t *)blk + ALIGN_UP(sizeof(arena_block_t));
+}
+
+static arena_block_t *block_new(ccard_arena_t *arena, size_t size)
+{
+    arena_block_t *blk;
+
+    blk = (arena_block_t *)ccard_malloc(arena->parent,
+                                        ALIGN_UP(sizeof(arena_block_t)) + size);
+    if (!blk) {
+        return NULL;
+    }
+    blk->size = size;
+    blk->used = 0;
+    blk->last = NO_CHUNK;
+    blk->next = arena->blocks;
+    arena->blocks = blk;
+    arena->total += size;
+
+    return blk;
+}
+
+// Carve a chunk of size bytes, the block must have room for it
+static void *block_carve(arena_block_t *blk, size_t size)
+{
+    uint8_t *chunk = block_data(blk) + blk->used;
+
+    *(size_t *)chunk = size;
+    blk->last = blk->used;
+    blk->used += CHUNK_HDR + ALIGN_UP(size);
+
+    return chunk + CHUNK_HDR;
+}
+
+// Check if ptr is the latest chunk carved from the current block
+static int is_last_chunk(const ccard_arena_t *arena, const void *ptr)
+{
+    arena_block_t *blk = arena->cur;
+
+    return blk->last != NO_CHUNK
+        && (const uint8_t *)ptr == block_data(blk) + blk->last + CHUNK_HDR;
+}
+
+static void *arena_malloc(void *opaque, size_t size)
+{
+    ccard_arena_t *arena = (ccard_arena_t *)opaque;
+    size_t need = CHUNK_HDR + ALIGN_UP(size);
+    arena_block_t *blk = arena->cur;
+
+    if (size > SIZE_MAX / 2) {
+        return NULL;
+    }
+
+    if (need > arena->block_size / 4) {
+        // large chunk gets a block of its own, the current one is kept
+        blk = block_new(arena, need);
+    } else if (blk->used + need > blk->size) {
+        blk = block_new(arena, arena->block_size);
+        if (blk) {
+            arena->cur = blk;
+        }
+    }
+
+    return blk ? block_carve(blk, size) : NULL;
+}
+
+static void *arena_realloc(void *opaque, void *ptr, size_t size)
+{
+    ccard_arena_t *arena = (ccard_arena_t *)opaque;
+    arena_block_t *blk = arena->cur;
+    size_t old;
+    void *p;
+
+    if (!ptr) {
+        return arena_malloc(opaque, size);
+    }
+
+    old = *(size_t *)((uint8_t *)ptr - CHUNK_HDR);
+    if (is_last_chunk(arena, ptr)
+        && size <= SIZE_MAX / 2
+        && blk->last + CHUNK_HDR + ALIGN_UP(size) <= blk->size) {
+        // the latest chunk grows or shrinks in place
+        *(size_t *)((uint8_t *)ptr - CHUNK_HDR) = size;
+        blk->used = blk->last + CHUNK_HDR + ALIGN_UP(size);
+        return ptr;
+    }
+
+    p = arena_malloc(opaque, size);
+    if (p) {
+        memcpy(p, ptr, old < size ? old : size);
+    }
+
+    return p;
+}
+
+static void arena_free(void *opaque, void *ptr)
+{
+    ccard_arena_t *arena = (ccard_arena_t *)opaque;
+
+    // only the latest chunk is given back, the rest wait for reset
+    if (is_last_chunk(arena, ptr)) {
+        arena->cur->used = arena->cur->last;
+        arena->cur->last = NO_CHUNK;
+    }
+}
+
+ccard_arena_t *ccard_arena_init(size_t block_size)
+{
+    const ccard_allocator_t *parent = ccard_get_allocator();
+    ccard_arena_t *arena;
+
+    if (!block_size) {
+        block_size = ARENA_BLOCK_SIZE;
+    }
+    if (block_size < 4 * CHUNK_HDR || block_size > SIZE_MAX / 4) {
+        return NULL;
+    }
+
+    arena = (ccard_arena_t *)ccard_malloc(parent, sizeof(ccard_arena_t));
+    if (!arena) {
+        return NULL;
+    }
+    arena->alloc.malloc_fn = arena_malloc;
+    arena->alloc.realloc_fn = arena_realloc;
+    arena->alloc.free_fn = arena_free;
+    arena->alloc.opaque = arena;
+    arena->parent = parent;
+    arena->block_size = ALIGN_UP(block_size);
+    arena->total = 0;
+    arena->blocks = NULL;
+    arena->first = arena->cur = block_new(arena, arena->block_size);
+    if (!arena->first) {
+        ccard_free(parent, arena);
+        return NULL;
+    }
+
+    return arena;
+}
+
+const ccard_allocator_t *ccard_arena_allocator(ccard_arena_t *arena)
+{
+    return &arena->alloc;
+}
+
+size_t ccard_arena_size(const ccard_arena_t *arena)
+{
+    return arena->total;
+}
+
+int ccard_arena_reset(ccard_arena_t *arena)
+{
+    arena_block_t *blk, *next;
+
+    if (!arena) {
+        return -1;
+    }
+
+    for (blk = arena->blocks; blk; blk = next) {
+        next = blk->next;
+        if (blk != arena->first) {
+            ccard_free(arena->parent, blk);
+        }
+    }
+
+    arena->first->next = NULL;
+    arena->first->used = 0;
+    arena->first->last = NO_CHUNK;
+    arena->blocks = arena->cur = arena->first;
+    arena->total = arena->first->size;
+
+    return 0;
+}
+
+int ccard_arena_fini(ccard_arena_t *arena)
+{
+    arena_block_t *blk, *next;
+
+    if (!arena) {
+        return -1;
+    }
+
+    for (blk = arena->blocks; blk; blk = next) {
+        next = blk->next;
+        ccard_free(arena->parent, blk);
+    }
+    ccard_free(arena->parent, arena);
+
+    return 0;
+}
+
+static uint8_t *page_data(slab_page_t *page)
+{
+    return (uint8_t *)page + ALIGN_UP(sizeof(slab_page_t));
+}
+
+static uint32_t size_class(size_t size)
+{
+    uint32_t cls = 0;
+
+    while ((size_t)SLAB_MIN << cls < size) {
+        cls++;
+    }
+
+    return cls;
+}
+
+static void *large_malloc(ccard_slab_t *slab, size_t size)
+{
+    size_t hdr = ALIGN_UP(sizeof(slab_large_t)) + CHUNK_HDR;
+    slab_large_t *l;
+    uint8_t *chunk;
+
+    if (size > SIZE_MAX - hdr) {
+        return NULL;
+    }
+
+    l = (slab_large_t *)ccard_malloc(slab->parent, hdr + size);
+    if (!l) {
+        return NULL;
+    }
+    l->size = size;
+    l->prev = NULL;
+    l->next = slab->large;
+    if (slab->large) {
+        slab->large->prev = l;
+    }
+    slab->large = l;
+    slab->total += size;
+    slab->live += size;
+
+    chunk = (uint8_t *)l + ALIGN_UP(sizeof(slab_large_t));
+    *(size_t *)chunk = size;
+
+    return chunk + CHUNK_HDR;
+}
+
+static void large_free(ccard_slab_t *slab, void *ptr)
+{
+    slab_large_t *l = (slab_large_t *)((uint8_t *)ptr - CHUNK_HDR
+                                       - ALIGN_UP(sizeof(slab_large_t)));
+
+    if (l->prev) {
+        l->prev->next = l->next;
+    } else {
+        slab->large = l->next;
+    }
+    if (l->next) {
+        l->next->prev = l->prev;
+    }
+    slab->total -= l->size;
+    slab->live -= l->size;
+    ccard_free(slab->parent, l);
+}
+
+static void *slab_malloc(void *opaque, size_t size)
+{
+    ccard_slab_t *slab = (ccard_slab_t *)opaque;
+    uint32_t cls;
+    size_t need;
+    uint8_t *chunk;
+    slab_page_t *page;
+
+    if (size > SLAB_MAX) {
+        return large_malloc(slab, size);
+    }
+
+    cls = size_class(size);
+    slab->live += (size_t)SLAB_MIN << cls;
+    if (slab->free_list[cls]) {
+        chunk = (uint8_t *)slab->free_list[cls];
+        slab->free_list[cls] = *(void **)chunk;
+        return chunk;
+    }
+
+    need = CHUNK_HDR + ((size_t)SLAB_MIN << cls);
+    if (!slab->pages || slab->used + need > SLAB_SIZE) {
+        page = (slab_page_t *)ccard_malloc(slab->parent,
+                                           ALIGN_UP(sizeof(slab_page_t))
+                                           + SLAB_SIZE);
+        if (!page) {
+            slab->live -= (size_t)SLAB_MIN << cls;
+            return NULL;
+        }
+        page->next = slab->pages;
+        slab->pages = page;
+        slab->used = 0;
+        slab->total += SLAB_SIZE;
+    }
+
+    chunk = page_data(slab->pages) + slab->used;
+    *(size_t *)chunk = (size_t)SLAB_MIN << cls;
+    slab->used += need;
+
+    return chunk + CHUNK_HDR;
+}
+
+static void slab_free(void *opaque, void *ptr)
+{
+    ccard_slab_t *slab = (ccard_slab_t *)opaque;
+    size_t cap = *(size_t *)((uint8_t *)ptr - CHUNK_HDR);
+    uint32_t cls;
+
+    if (cap > SLAB_MAX) {
+        large_free(slab, ptr);
+        return;
+    }
+
+    cls = size_class(cap);
+    slab->live -= cap;
+    *(void **)ptr = slab->free_list[cls];
+    slab->free_list[cls] = ptr;
+}
+
+static void *slab_realloc(void *opaque, void *ptr, size_t size)
+{
+    size_t cap, want;
+    void *p;
+
+    if (!ptr) {
+        return slab_malloc(opaque, size);
+    }
+
+    // chunks keep their size class when shrinking
+    cap = *(size_t *)((uint8_t *)ptr - CHUNK_HDR);
+    if (size <= cap && (cap <= SLAB_MAX || size > SLAB_MAX)) {
+        return ptr;
+    }
+
+    // large chunks grow geometrically, so that growing by a few bytes at a
+    // time doesn't copy them every time
+    want = size;
+    if (size > SLAB_MAX && size > cap && size - cap < cap / 2) {
+        want = cap + cap / 2;
+    }
+
+    p = slab_malloc(opaque, want);
+    if (p) {
+        memcpy(p, ptr, cap < size ? cap : size);
+        slab_free(opaque, ptr);
+    }
+
+    return p;
+}
+
+ccard_slab_t *ccard_slab_init(void)
+{
+    const ccard_allocator_t *parent = ccard_get_allocator();
+    ccard_slab_t *slab;
+
+    slab = (ccard_slab_t *)ccard_calloc(parent, 1, sizeof(ccard_slab_t));
+    if (!slab) {
+        return NULL;
+    }
+    slab->alloc.malloc_fn = slab_malloc;
+    slab->alloc.realloc_fn = slab_realloc;
+    slab->alloc.free_fn = slab_free;
+    slab->alloc.opaque = slab;
+    slab->parent = parent;
+
+    return slab;
+}
+
+const ccard_allocator_t *ccard_slab_allocator(ccard_slab_t *slab)
+{
+    return &slab->alloc;
+}
+
+size_t ccard_slab_size(const ccard_slab_t *slab)
+{
+    return slab->total;
+}
+
+size_t ccard_slab_used(const ccard_slab_t *slab)
+{
+    return slab->live;
+}
+
+int ccard_slab_reset(ccard_slab_t *slab)
+{
+    slab_page_t *page, *next;
+    uint32_t i;
+
+    if (!slab) {
+        return -1;
+    }
+
+    for (page = slab->pages; page; page = next) {
+        next = page->next;
+        ccard_free(slab->parent, page);
+    }
+    while (slab->large) {
+        large_free(slab, (uint8_t *)slab->large
+                   + ALIGN_UP(sizeof(slab_large_t)) + CHUNK_HDR);
+    }
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        slab->free_list[i] = NULL;
+    }
+    slab->pages = NULL;
+    slab->used = 0;
+    slab->total = 0;
+    slab->live = 0;
+
+    return 0;
+}
+
+// Bind mapping to the NUMA node, best effort as memory works either way
+static void huge_bind(ccard_huge_t *huge, void *p, size_t len)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long mask;
+
+    if (huge->node >= 0) {
+        mask = 1UL << huge->node;
+        syscall(SYS_mbind, p, len, HUGE_MPOL_BIND, &mask,
+                sizeof(mask) * 8, 0);
+    }
+#else
+    (void)huge;
+    (void)p;
+    (void)len;
+#endif
+}
+
+// Map len bytes, a multiple of huge page size, aligned to huge page
+static uint8_t *huge_map(ccard_huge_t *huge, size_t len)
+{
+    uint8_t *p = (uint8_t *)MAP_FAILED, *start;
+
+#ifdef MAP_HUGETLB
+    if (huge->flags & CCARD_HUGE_HUGETLB) {
+        // fails if no huge pages are reserved, then try transparent ones
+        p = (uint8_t *)mmap(NULL, len, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+
+    if (p == (uint8_t *)MAP_FAILED) {
+        // map one more page to trim the range to huge page boundaries,
+        // transparent huge pages only cover aligned ranges
+        p = (uint8_t *)mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == (uint8_t *)MAP_FAILED) {
+            return NULL;
+        }
+        start = (uint8_t *)(((uintptr_t)p + HUGE_PAGE_SIZE - 1)
+                            & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        if (start > p) {
+            munmap(p, start - p);
+        }
+        if (p + HUGE_PAGE_SIZE > start) {
+            munmap(start + len, p + HUGE_PAGE_SIZE - start);
+        }
+        p = start;
+#ifdef MADV_HUGEPAGE
+        madvise(p, len, MADV_HUGEPAGE);
+#endif
+    }
+
+    // before any page is touched
+    huge_bind(huge, p, len);
+    huge->mapped += len;
+
+    return p;
+}
+
+static void *huge_malloc(void *opaque, size_t size)
+{
+    ccard_huge_t *huge = (ccard_huge_t *)opaque;
+    huge_hdr_t *hdr;
+    size_t len;
+
+    if (size > SIZE_MAX - HUGE_PAGE_SIZE * 2) {
+        return NULL;
+    }
+
+    if (size < huge->threshold) {
+        hdr = (huge_hdr_t *)ccard_malloc(huge->parent, CHUNK_HDR + size);
+        if (!hdr) {
+            return NULL;
+        }
+        hdr->map_len = 0;
+    } else {
+        len = (CHUNK_HDR + size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        hdr = (huge_hdr_t *)huge_map(huge, len);
+        if (!hdr) {
+            return NULL;
+        }
+        hdr->map_len = len;
+    }
+    hdr->size = size;
+
+    return (uint8_t *)hdr + CHUNK_HDR;
+}
+
+static void huge_free(void *opaque, void *ptr)
+{
+    ccard_huge_t *huge = (ccard_huge_t *)opaque;
+    huge_hdr_t *hdr = (huge_hdr_t *)((uint8_t *)ptr - CHUNK_HDR);
+
+    if (hdr->map_len) {
+        huge->mapped -= hdr->map_len;
+        munmap(hdr, hdr->map_len);
+    } else {
+        ccard_free(huge->parent, hdr);
+    }
+}
+
+static void *huge_realloc(void *opaque, void *ptr, size_t size)
+{
+    ccard_huge_t *huge = (ccard_huge_t *)opaque;
+    huge_hdr_t *hdr;
+    void *p;
+
+    if (!ptr) {
+        return huge_malloc(opaque, size);
+    }
+
+    hdr = (huge_hdr_t *)((uint8_t *)ptr - CHUNK_HDR);
+    if (hdr->map_len && CHUNK_HDR + size <= hdr->map_len) {
+        // fits in the mapping
+        hdr->size = size;
+        return ptr;
+    }
+
+    if (!hdr->map_len && size < huge->threshold) {
+        hdr = (huge_hdr_t *)ccard_realloc(huge->parent, hdr, CHUNK_HDR + size);
+        if (!hdr) {
+            return NULL;
+        }
+        hdr->size = size;
+        return (uint8_t *)hdr + CHUNK_HDR;
+    }
+
+    // moved between the parent allocator and mappings, or a larger mapping
+    p = huge_malloc(opaque, size);
+    if (p) {
+        memcpy(p, ptr, hdr->size < size ? hdr->size : size);
+        huge_free(opaque, ptr);
+    }
+
+    return p;
+}
+
+ccard_huge_t *ccard_huge_init(size_t threshold, int node, int flags)
+{
+    const ccard_allocator_t *parent = ccard_get_allocator();
+    ccard_huge_t *huge;
+
+    if (node < -1 || node >= (int)(sizeof(unsigned long) * 8)) {
+        return NULL;
+    }
+
+    huge = (ccard_huge_t *)ccard_calloc(parent, 1, sizeof(ccard_huge_t));
+    if (!huge) {
+        return NULL;
+    }
+    huge->alloc.malloc_fn = huge_malloc;
+    huge->alloc.realloc_fn = huge_realloc;
+    huge->alloc.free_fn = huge_free;
+    huge->alloc.opaque = huge;
+    huge->parent = parent;
+    huge->threshold = threshold ? threshold : HUGE_PAGE_SIZE;
+    huge->node = node;
+    huge->flags = flags;
+
+    return huge;
+}
+
+const ccard_allocator_t *ccard_huge_allocator(ccard_huge_t *huge)
+{
+    return &huge->alloc;
+}
+
+size_t ccard_huge_mapped(const ccard_huge_t *huge)
+{
+    return huge->mapped;
+}
+
+int ccard_huge_fini(ccard_huge_t *huge)
+{
+    if (!huge) {
+        return -1;
+    }
+
+    ccard_free(huge->parent, huge);
+
+    return 0;
+}
+
+int ccard_slab_fini(ccard_slab_t *slab)
+{
+    if (!slab) {
+        return -1;
+    }
+
+    ccard_slab_reset(slab);
+    ccard_free(slab->parent, slab);
+
+    return 0;
+}
+
+// vi:ft=c ts=4 sw=4 fdm=marker et
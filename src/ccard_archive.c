@@ -0,0 +1,127 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "ccard_archive.h"
+
+/* length of the record length prefix */
+static const uint32_t REC_HDR_LEN = 4;
+
+static int
+write_fully(int fd, const uint8_t *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int
+ccard_archive_append(int fd, const void *buf, uint32_t len)
+{
+    uint8_t hdr[4];
+
+    if (!buf || len <= 3) {
+        return CCARD_ERR_INVALID_ARGUMENT;
+    }
+
+    /* little-endian record length */
+    hdr[0] = len & 0xff;
+    hdr[1] = (len >> 8) & 0xff;
+    hdr[2] = (len >> 16) & 0xff;
+    hdr[3] = (len >> 24) & 0xff;
+
+    if (write_fully(fd, hdr, REC_HDR_LEN)
+        || write_fully(fd, (const uint8_t *)buf, len)) {
+        return CCARD_ERR_IO;
+    }
+
+    return CCARD_OK;
+}
+
+int
+ccard_archive_merge(void *ctx, const ccard_algo_t *algo, const char *path)
+{
+    int fd;
+    int rc = CCARD_OK;
+    struct stat st;
+    const uint8_t *base;
+    size_t off, size;
+    uint32_t len;
+
+    if (!ctx || !algo || !path) {
+        return CCARD_ERR_INVALID_ARGUMENT;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return CCARD_ERR_IO;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return CCARD_ERR_IO;
+    }
+
+    size = (size_t)st.st_size;
+    if (size == 0) {
+        /* empty archive, nothing to merge */
+        close(fd);
+        return CCARD_OK;
+    }
+
+    base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return CCARD_ERR_IO;
+    }
+
+    /* records are visited only once from head to tail */
+    posix_madvise((void *)base, size, POSIX_MADV_SEQUENTIAL);
+
+    for (off = 0; off < size; off += REC_HDR_LEN + len) {
+        if (size - off < REC_HDR_LEN) {
+            rc = CCARD_ERR_IO;
+            break;
+        }
+
+        len = (uint32_t)base[off]
+              | ((uint32_t)base[off + 1] << 8)
+              | ((uint32_t)base[off + 2] << 16)
+              | ((uint32_t)base[off + 3] << 24);
+        if (size - off - REC_HDR_LEN < len) {
+            /* truncated record */
+            rc = CCARD_ERR_IO;
+            break;
+        }
+
+        if (algo->merge_bytes(ctx, base + off + REC_HDR_LEN, len, NULL)) {
+            rc = CCARD_ERR_MERGE_FAILED;
+            break;
+        }
+    }
+
+    munmap((void *)base, size);
+
+    return rc;
+}
+
+/* vi:ft=c ts=4 sw=4 fdm=marker et
+ * */
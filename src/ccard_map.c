@@ -0,0 +1,761 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "murmurhash.h"
+#include "ccard_map.h"
+
+/* initial slots number, power of 2 */
+static const uint32_t INITIAL_SLOTS = 16;
+
+/* length of the record length prefix in spill file, same as ccard_archive */
+static const uint32_t REC_HDR_LEN = 4;
+
+/* no group is kept from spilling */
+static const uint32_t KEEP_NONE = UINT32_MAX;
+
+typedef struct map_group_s {
+    uint64_t hash;      /* hash value of key */
+    uint8_t *key;       /* copy of key, carved from slab */
+    uint32_t len;       /* length of key */
+    void *ctx;          /* counter context, carved from slab, NULL if spilled */
+    uint32_t prev;      /* more recently used group index + 1, 0 if none */
+    uint32_t next;      /* less recently used group index + 1, 0 if none */
+    uint64_t off;       /* offset of spilled bytes in spill file */
+    uint32_t blen;      /* length of spilled bytes, 0 if not spilled */
+} map_group_t;
+
+struct ccard_map_s {
+    int err;
+    const ccard_algo_t *algo;
+    uint8_t k;
+    uint8_t opt;
+    const ccard_allocator_t *alloc; /* allocator of map, groups and slots */
+    ccard_slab_t *slab;             /* allocator of keys and counters */
+    map_group_t *groups;            /* groups in the order of creation */
+    uint32_t g_cnt;                 /* number of groups */
+    uint32_t g_size;                /* capacity of groups */
+    uint32_t *slots;                /* group index + 1, 0 if empty */
+    uint32_t s_size;                /* slots number, power of 2 */
+    uint32_t lru_head;              /* most recently used group index + 1 */
+    uint32_t lru_tail;              /* least recently used group index + 1 */
+    size_t budget;                  /* bytes of slab in use to spill above */
+    int fd;                         /* spill file, -1 if spilling is off */
+    char *path;                     /* path of spill file */
+    uint64_t spill_end;             /* bytes written to spill file */
+    uint32_t spilled;               /* number of spilled groups */
+};
+
+static uint64_t
+key_hash(const void *key, uint32_t len)
+{
+    return murmurhash64_no_seed((void *)key, len);
+}
+
+static uint32_t
+key_slot(const ccard_map_t *map, uint64_t h)
+{
+    return (uint32_t)(h >> 32) & (map->s_size - 1);
+}
+
+static int
+key_equal(const map_group_t *g, const void *key, uint32_t len)
+{
+    return g->len == len && (!len || !memcmp(g->key, key, len));
+}
+
+static int
+grow_slots(ccard_map_t *map)
+{
+    uint32_t *slots, i, j, size = map->s_size * 2;
+
+    slots = (uint32_t *)ccard_calloc(map->alloc, size, sizeof(uint32_t));
+    if (!slots) {
+        return -1;
+    }
+
+    ccard_free(map->alloc, map->slots);
+    map->slots = slots;
+    map->s_size = size;
+    for (i = 0; i < map->g_cnt; i++) {
+        j = key_slot(map, map->groups[i].hash);
+        while (slots[j]) {
+            j = (j + 1) & (size - 1);
+        }
+        slots[j] = i + 1;
+    }
+
+    return 0;
+}
+
+static void
+lru_unlink(ccard_map_t *map, uint32_t i)
+{
+    map_group_t *g = &map->groups[i];
+
+    if (g->prev) {
+        map->groups[g->prev - 1].next = g->next;
+    } else {
+        map->lru_head = g->next;
+    }
+    if (g->next) {
+        map->groups[g->next - 1].prev = g->prev;
+    } else {
+        map->lru_tail = g->prev;
+    }
+    g->prev = g->next = 0;
+}
+
+static void
+lru_push(ccard_map_t *map, uint32_t i)
+{
+    map_group_t *g = &map->groups[i];
+
+    g->prev = 0;
+    g->next = map->lru_head;
+    if (map->lru_head) {
+        map->groups[map->lru_head - 1].prev = i + 1;
+    } else {
+        map->lru_tail = i + 1;
+    }
+    map->lru_head = i + 1;
+}
+
+static int
+pwrite_fully(int fd, const uint8_t *buf, size_t len, uint64_t off)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = pwrite(fd, buf, len, (off_t)off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+
+    return 0;
+}
+
+static int
+pread_fully(int fd, uint8_t *buf, size_t len, uint64_t off)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = pread(fd, buf, len, (off_t)off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+
+    return 0;
+}
+
+/**
+ * Create a counter from serialized bytes, carved from slab.
+ * */
+static void *
+ctx_from_bytes(ccard_map_t *map, const void *buf, uint32_t len)
+{
+    const ccard_allocator_t *alloc = ccard_slab_allocator(map->slab);
+    void *ctx;
+
+    ctx = map->algo->raw_init_alloc(NULL, map->k, map->opt, alloc);
+    if (!ctx) {
+        map->err = CCARD_ERR_INVALID_CTX;
+        return NULL;
+    }
+    if (map->algo->merge_bytes(ctx, buf, len, NULL)) {
+        map->algo->fini(ctx);
+        map->err = CCARD_ERR_MERGE_FAILED;
+        return NULL;
+    }
+
+    return ctx;
+}
+
+/**
+ * Spill a batch of the least recently used groups but keep, they are
+ * serialized to one buffer and appended to spill file by one write.
+ * Returns number of spilled groups or -1.
+ * */
+static int64_t
+spill_batch(ccard_map_t *map, uint32_t keep, size_t target)
+{
+    size_t used = ccard_slab_used(map->slab), size = 0, cap = 0;
+    uint8_t *buf = NULL, *p;
+    uint32_t i, len, n = 0;
+    uint64_t off;
+    map_group_t *g;
+
+    for (i = map->lru_tail; i && i - 1 != keep && used > target;
+         i = map->groups[i - 1].prev) {
+        g = &map->groups[i - 1];
+        if (map->algo->get_bytes(g->ctx, NULL, &len)) {
+            break;
+        }
+        if (size + REC_HDR_LEN + len > cap) {
+            cap = (size + REC_HDR_LEN + len) * 2;
+            p = (uint8_t *)ccard_realloc(map->alloc, buf, cap);
+            if (!p) {
+                break;
+            }
+            buf = p;
+        }
+        if (map->algo->get_bytes(g->ctx, buf + size + REC_HDR_LEN, &len)) {
+            break;
+        }
+
+        /* little-endian record length */
+        p = buf + size;
+        p[0] = len & 0xff;
+        p[1] = (len >> 8) & 0xff;
+        p[2] = (len >> 16) & 0xff;
+        p[3] = (len >> 24) & 0xff;
+        size += REC_HDR_LEN + len;
+
+        /* serialized length is close to the memory it takes */
+        used -= used < len ? used : len;
+        n++;
+    }
+
+    if (n == 0) {
+        ccard_free(map->alloc, buf);
+        return 0;
+    }
+
+    if (pwrite_fully(map->fd, buf, size, map->spill_end)) {
+        ccard_free(map->alloc, buf);
+        map->err = CCARD_ERR_IO;
+        return -1;
+    }
+
+    /* release groups only after their bytes are written */
+    for (p = buf, off = map->spill_end; n > 0; n--) {
+        i = map->lru_tail - 1;
+        g = &map->groups[i];
+        len = (uint32_t)p[0] | ((uint32_t)p[1] << 8)
+              | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+        g->off = off + REC_HDR_LEN;
+        g->blen = len;
+        map->algo->fini(g->ctx);
+        g->ctx = NULL;
+        lru_unlink(map, i);
+        map->spilled++;
+        p += REC_HDR_LEN + len;
+        off += REC_HDR_LEN + len;
+    }
+    map->spill_end = off;
+
+    ccard_free(map->alloc, buf);
+    return 1;
+}
+
+/**
+ * Spill cold groups if the budget is exceeded, down to 7/8 of it so that
+ * spills are done in large batches.
+ * */
+static int
+enforce_budget(ccard_map_t *map, uint32_t keep)
+{
+    size_t target;
+    int64_t rc;
+
+    if (map->fd < 0 || ccard_slab_used(map->slab) <= map->budget) {
+        return 0;
+    }
+
+    target = map->budget - map->budget / 8;
+    while (ccard_slab_used(map->slab) > target) {
+        rc = spill_batch(map, keep, target);
+        if (rc <= 0) {
+            return (int)rc;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Make a group resident and the most recently used one, spilled groups are
+ * read back from spill file.
+ * */
+static int
+open_group(ccard_map_t *map, uint32_t i)
+{
+    map_group_t *g = &map->groups[i];
+    uint8_t *buf;
+    void *ctx;
+
+    if (g->ctx) {
+        if (map->lru_head != i + 1) {
+            lru_unlink(map, i);
+            lru_push(map, i);
+        }
+        return 0;
+    }
+
+    buf = (uint8_t *)ccard_malloc(map->alloc, g->blen);
+    if (!buf) {
+        map->err = CCARD_ERR_INVALID_CTX;
+        return -1;
+    }
+    if (pread_fully(map->fd, buf, g->blen, g->off)) {
+        ccard_free(map->alloc, buf);
+        map->err = CCARD_ERR_IO;
+        return -1;
+    }
+    ctx = ctx_from_bytes(map, buf, g->blen);
+    ccard_free(map->alloc, buf);
+    if (!ctx) {
+        return -1;
+    }
+
+    /* bytes left in spill file are dead until the map is reset */
+    g->ctx = ctx;
+    g->blen = 0;
+    map->spilled--;
+    lru_push(map, i);
+
+    return 0;
+}
+
+/**
+ * Create a group at the given empty slot, returns its index or -1.
+ * */
+static int64_t
+add_group(ccard_map_t *map, uint32_t slot, uint64_t h, const void *key,
+          uint32_t len)
+{
+    const ccard_allocator_t *alloc = ccard_slab_allocator(map->slab);
+    map_group_t *g;
+
+    if (map->g_cnt == map->g_size) {
+        uint32_t size = map->g_size ? map->g_size * 2 : INITIAL_SLOTS;
+
+        g = (map_group_t *)ccard_realloc(map->alloc, map->groups,
+                                         sizeof(map_group_t) * size);
+        if (!g) {
+            return -1;
+        }
+        map->groups = g;
+        map->g_size = size;
+    }
+
+    g = &map->groups[map->g_cnt];
+    g->hash = h;
+    g->len = len;
+    g->key = (uint8_t *)ccard_malloc(alloc, len ? len : 1);
+    g->ctx = map->algo->raw_init_alloc(NULL, map->k, map->opt, alloc);
+    if (!g->key || !g->ctx) {
+        if (g->ctx) {
+            map->algo->fini(g->ctx);
+        }
+        ccard_free(alloc, g->key);
+        return -1;
+    }
+    if (len) {
+        memcpy(g->key, key, len);
+    }
+    g->blen = 0;
+
+    map->slots[slot] = ++map->g_cnt;
+    lru_push(map, map->g_cnt - 1);
+    return map->g_cnt - 1;
+}
+
+/**
+ * Look up a group, returns its index, or -1 if it's not found and not
+ * created.
+ * */
+static int64_t
+find_group(ccard_map_t *map, const void *key, uint32_t len, int create)
+{
+    uint64_t h = key_hash(key, len);
+    uint32_t i = key_slot(map, h);
+    map_group_t *g;
+
+    while (map->slots[i]) {
+        g = &map->groups[map->slots[i] - 1];
+        if (g->hash == h && key_equal(g, key, len)) {
+            return map->slots[i] - 1;
+        }
+        i = (i + 1) & (map->s_size - 1);
+    }
+
+    if (!create) {
+        return -1;
+    }
+
+    /* keep load factor no more than 3/4 */
+    if ((map->g_cnt + 1) * 4 > map->s_size * 3) {
+        if (grow_slots(map)) {
+            return -1;
+        }
+        i = key_slot(map, h);
+        while (map->slots[i]) {
+            i = (i + 1) & (map->s_size - 1);
+        }
+    }
+
+    return add_group(map, i, h, key, len);
+}
+
+ccard_map_t *
+ccard_map_init(const ccard_algo_t *algo, uint8_t k, uint8_t opt)
+{
+    const ccard_allocator_t *alloc = ccard_get_allocator();
+    ccard_map_t *map;
+    void *ctx;
+
+    if (!algo || !algo->raw_init_alloc) {
+        return NULL;
+    }
+
+    /* make sure counters could be created with the given arguments */
+    ctx = algo->raw_init(NULL, k, opt);
+    if (!ctx) {
+        return NULL;
+    }
+    algo->fini(ctx);
+
+    map = (ccard_map_t *)ccard_calloc(alloc, 1, sizeof(ccard_map_t));
+    if (!map) {
+        return NULL;
+    }
+    map->alloc = alloc;
+    map->algo = algo;
+    map->k = k;
+    map->opt = opt;
+    map->s_size = INITIAL_SLOTS;
+    map->fd = -1;
+    map->slots = (uint32_t *)ccard_calloc(alloc, map->s_size,
+                                          sizeof(uint32_t));
+    map->slab = ccard_slab_init();
+    if (!map->slots || !map->slab) {
+        ccard_map_fini(map);
+        return NULL;
+    }
+    map->err = CCARD_OK;
+
+    return map;
+}
+
+int
+ccard_map_set_budget(ccard_map_t *map, size_t budget, const char *path)
+{
+    size_t len;
+
+    if (!map) {
+        return -1;
+    }
+
+    if (!budget || (map->fd < 0 && !path)) {
+        map->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    if (map->fd < 0) {
+        len = strlen(path);
+        map->path = (char *)ccard_malloc(map->alloc, len + 1);
+        if (!map->path) {
+            map->err = CCARD_ERR_INVALID_CTX;
+            return -1;
+        }
+        memcpy(map->path, path, len + 1);
+
+        map->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (map->fd < 0) {
+            ccard_free(map->alloc, map->path);
+            map->path = NULL;
+            map->err = CCARD_ERR_IO;
+            return -1;
+        }
+    }
+    map->budget = budget;
+
+    map->err = CCARD_OK;
+    return enforce_budget(map, KEEP_NONE);
+}
+
+void *
+ccard_map_get(ccard_map_t *map, const void *key, uint32_t len, int create)
+{
+    int64_t i;
+
+    if (!map || (!key && len)) {
+        return NULL;
+    }
+
+    i = find_group(map, key, len, create);
+    if (i < 0 || open_group(map, (uint32_t)i)
+        || enforce_budget(map, (uint32_t)i)) {
+        return NULL;
+    }
+
+    return map->groups[i].ctx;
+}
+
+int
+ccard_map_offer(ccard_map_t *map, const void *key, uint32_t klen,
+                const void *buf, uint32_t len)
+{
+    int64_t i;
+    int rc;
+
+    if (!map) {
+        return -1;
+    }
+
+    if (!key && klen) {
+        map->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    i = find_group(map, key, klen, 1);
+    if (i < 0) {
+        map->err = CCARD_ERR_INVALID_CTX;
+        return -1;
+    }
+    if (open_group(map, (uint32_t)i)) {
+        return -1;
+    }
+
+    rc = map->algo->offer(map->groups[i].ctx, buf, len);
+    if (rc < 0) {
+        map->err = map->algo->errnum(map->groups[i].ctx);
+        return -1;
+    }
+
+    map->err = CCARD_OK;
+    return enforce_budget(map, (uint32_t)i) ? -1 : rc;
+}
+
+int64_t
+ccard_map_offer_batch(ccard_map_t *map, uint32_t n, const void *const *keys,
+                      const uint32_t *klens, const void *const *bufs,
+                      const uint32_t *lens)
+{
+    int64_t i = -1, affected = 0;
+    uint32_t j;
+    int rc;
+
+    if (!map) {
+        return -1;
+    }
+
+    if (n && (!keys || !klens || !bufs || !lens)) {
+        map->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    for (j = 0; j < n; j++) {
+        if (!keys[j] && klens[j]) {
+            map->err = CCARD_ERR_INVALID_ARGUMENT;
+            return -1;
+        }
+
+        /* consecutive pairs of the same group are looked up once */
+        if (i < 0 || !key_equal(&map->groups[i], keys[j], klens[j])) {
+            i = find_group(map, keys[j], klens[j], 1);
+            if (i < 0) {
+                map->err = CCARD_ERR_INVALID_CTX;
+                return -1;
+            }
+            if (open_group(map, (uint32_t)i)) {
+                return -1;
+            }
+        }
+
+        rc = map->algo->offer(map->groups[i].ctx, bufs[j], lens[j]);
+        if (rc < 0) {
+            map->err = map->algo->errnum(map->groups[i].ctx);
+            return -1;
+        }
+        affected += rc;
+
+        /* the current group is the most recently used one, kept resident */
+        if (enforce_budget(map, (uint32_t)i)) {
+            return -1;
+        }
+    }
+
+    map->err = CCARD_OK;
+    return affected;
+}
+
+uint32_t
+ccard_map_size(const ccard_map_t *map)
+{
+    return map ? map->g_cnt : 0;
+}
+
+uint32_t
+ccard_map_spilled(const ccard_map_t *map)
+{
+    return map ? map->spilled : 0;
+}
+
+int
+ccard_map_next(ccard_map_t *map, uint32_t *pos, const void **key,
+               uint32_t *len, void **ctx)
+{
+    map_group_t *g;
+
+    if (!map || !pos || *pos >= map->g_cnt) {
+        return 0;
+    }
+
+    /* errors stop iteration, see ccard_map_errnum */
+    map->err = CCARD_OK;
+    if (ctx && (open_group(map, *pos) || enforce_budget(map, *pos))) {
+        return 0;
+    }
+
+    g = &map->groups[(*pos)++];
+    if (key) {
+        *key = g->key;
+    }
+    if (len) {
+        *len = g->len;
+    }
+    if (ctx) {
+        *ctx = g->ctx;
+    }
+
+    return 1;
+}
+
+int
+ccard_map_card(ccard_map_t *map, int64_t *cards)
+{
+    const uint8_t *base = NULL;
+    map_group_t *g;
+    uint32_t i;
+    void *ctx;
+    int rc = 0;
+
+    if (!map) {
+        return -1;
+    }
+
+    if (map->g_cnt && !cards) {
+        map->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    if (map->spilled) {
+        base = mmap(NULL, map->spill_end, PROT_READ, MAP_PRIVATE, map->fd, 0);
+        if (base == MAP_FAILED) {
+            map->err = CCARD_ERR_IO;
+            return -1;
+        }
+    }
+
+    map->err = CCARD_OK;
+    for (i = 0; i < map->g_cnt && !rc; i++) {
+        g = &map->groups[i];
+        if (g->ctx) {
+            cards[i] = map->algo->card(g->ctx);
+            if (cards[i] < 0) {
+                map->err = map->algo->errnum(g->ctx);
+                rc = -1;
+            }
+            continue;
+        }
+
+        /* spilled groups are counted from the mapped file without being
+         * made resident, so the budget holds */
+        ctx = ctx_from_bytes(map, base + g->off, g->blen);
+        if (!ctx) {
+            rc = -1;
+            continue;
+        }
+        cards[i] = map->algo->card(ctx);
+        if (cards[i] < 0) {
+            map->err = map->algo->errnum(ctx);
+            rc = -1;
+        }
+        map->algo->fini(ctx);
+    }
+
+    if (base) {
+        munmap((void *)base, map->spill_end);
+    }
+
+    return rc;
+}
+
+int
+ccard_map_reset(ccard_map_t *map)
+{
+    if (!map) {
+        return -1;
+    }
+
+    /* keys and counters are all in the slab */
+    ccard_slab_reset(map->slab);
+    memset(map->slots, 0, sizeof(uint32_t) * map->s_size);
+    map->g_cnt = 0;
+    map->lru_head = map->lru_tail = 0;
+    map->spilled = 0;
+    map->spill_end = 0;
+    if (map->fd >= 0 && ftruncate(map->fd, 0)) {
+        map->err = CCARD_ERR_IO;
+        return -1;
+    }
+
+    map->err = CCARD_OK;
+    return 0;
+}
+
+int
+ccard_map_fini(ccard_map_t *map)
+{
+    if (!map) {
+        return -1;
+    }
+
+    if (map->fd >= 0) {
+        close(map->fd);
+        unlink(map->path);
+        ccard_free(map->alloc, map->path);
+    }
+    ccard_slab_fini(map->slab);
+    ccard_free(map->alloc, map->groups);
+    ccard_free(map->alloc, map->slots);
+    ccard_free(map->alloc, map);
+
+    return 0;
+}
+
+int
+ccard_map_errnum(ccard_map_t *map)
+{
+    if (map) {
+        return map->err;
+    }
+
+    return CCARD_ERR_INVALID_CTX;
+}
+
+/* vi:ft=c ts=4 sw=4 fdm=marker et
+ * */
@@ -0,0 +1,488 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "murmurhash.h"
+#include "ccard_pack.h"
+
+/* length of the header, also alignment of records */
+#define PACK_HDR_LEN 64
+
+/* length of an index entry */
+#define PACK_ENT_LEN 32
+
+static const uint8_t PACK_MAGIC[8] = {'C', 'C', 'A', 'R', 'D', 'P', 'A', 'K'};
+
+static const uint32_t PACK_VERSION = 1;
+
+typedef struct pack_entry_s {
+    uint64_t off;           /* offset of record */
+    uint64_t key_off;       /* offset of key in keys */
+    uint32_t klen;          /* length of key */
+    uint32_t len;           /* length of record */
+    uint32_t sum;           /* checksum of record */
+    const uint8_t *key;     /* key in memory, set before sorting */
+} pack_entry_t;
+
+struct ccard_pack_writer_s {
+    const ccard_allocator_t *alloc;
+    int fd;
+    int err;                /* first error of ccard_pack_add */
+    uint64_t end;           /* end of the last record */
+    pack_entry_t *ents;     /* entries in the order of adding */
+    uint32_t e_cnt;         /* number of entries */
+    uint32_t e_size;        /* capacity of entries */
+    uint8_t *keys;          /* keys in the order of adding */
+    size_t k_len;           /* bytes of keys */
+    size_t k_size;          /* capacity of keys */
+};
+
+struct ccard_pack_s {
+    const ccard_allocator_t *alloc;
+    const uint8_t *base;    /* the mapping */
+    size_t size;            /* length of the mapping */
+    uint32_t count;         /* number of records */
+    const uint8_t *index;   /* index entries */
+    const uint8_t *keys;    /* keys */
+    uint64_t k_len;         /* bytes of keys */
+};
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static void
+put64(uint8_t *p, uint64_t v)
+{
+    put32(p, (uint32_t)v);
+    put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+    return (uint32_t)p[0]
+           | ((uint32_t)p[1] << 8)
+           | ((uint32_t)p[2] << 16)
+           | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t
+get64(const uint8_t *p)
+{
+    return (uint64_t)get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+static uint32_t
+checksum(const void *buf, uint32_t len)
+{
+    return murmurhash((void *)buf, len, 0);
+}
+
+static int
+pwrite_fully(int fd, const uint8_t *buf, size_t len, uint64_t off)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = pwrite(fd, buf, len, (off_t)off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+
+    return 0;
+}
+
+static int
+key_cmp(const uint8_t *a, uint32_t alen, const uint8_t *b, uint32_t blen)
+{
+    uint32_t n = alen < blen ? alen : blen;
+    int c = n ? memcmp(a, b, n) : 0;
+
+    if (c) {
+        return c;
+    }
+    return alen < blen ? -1 : (alen > blen);
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+    const pack_entry_t *x = (const pack_entry_t *)a;
+    const pack_entry_t *y = (const pack_entry_t *)b;
+
+    return key_cmp(x->key, x->klen, y->key, y->klen);
+}
+
+static void
+writer_release(ccard_pack_writer_t *w)
+{
+    close(w->fd);
+    ccard_free(w->alloc, w->ents);
+    ccard_free(w->alloc, w->keys);
+    ccard_free(w->alloc, w);
+}
+
+ccard_pack_writer_t *
+ccard_pack_create(const char *path)
+{
+    const ccard_allocator_t *alloc = ccard_get_allocator();
+    ccard_pack_writer_t *w;
+
+    if (!path) {
+        return NULL;
+    }
+
+    w = (ccard_pack_writer_t *)ccard_calloc(alloc, 1,
+                                            sizeof(ccard_pack_writer_t));
+    if (!w) {
+        return NULL;
+    }
+    w->alloc = alloc;
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+        ccard_free(alloc, w);
+        return NULL;
+    }
+    /* the header is written by ccard_pack_finish */
+    w->end = PACK_HDR_LEN;
+    w->err = CCARD_OK;
+
+    return w;
+}
+
+int
+ccard_pack_add(ccard_pack_writer_t *w, const void *key, uint32_t klen,
+               const void *buf, uint32_t len)
+{
+    pack_entry_t *e;
+    uint64_t off;
+
+    if (!w || (!key && klen) || !buf || len <= 3) {
+        return CCARD_ERR_INVALID_ARGUMENT;
+    }
+    if (w->err != CCARD_OK) {
+        return w->err;
+    }
+
+    if (w->e_cnt == w->e_size) {
+        uint32_t size = w->e_size ? w->e_size * 2 : 64;
+        pack_entry_t *ents = (pack_entry_t *)ccard_realloc(
+                                 w->alloc, w->ents, size * sizeof(pack_entry_t));
+
+        if (!ents) {
+            return CCARD_ERR_INVALID_CTX;
+        }
+        w->ents = ents;
+        w->e_size = size;
+    }
+    if (!w->keys || w->k_len + klen > w->k_size) {
+        size_t size = w->k_size ? w->k_size : 1024;
+        uint8_t *keys;
+
+        while (size < w->k_len + klen) {
+            size *= 2;
+        }
+        keys = (uint8_t *)ccard_realloc(w->alloc, w->keys, size);
+        if (!keys) {
+            return CCARD_ERR_INVALID_CTX;
+        }
+        w->keys = keys;
+        w->k_size = size;
+    }
+
+    /* gap before the aligned offset is left as a hole, read as zeros */
+    off = (w->end + PACK_HDR_LEN - 1) & ~(uint64_t)(PACK_HDR_LEN - 1);
+    if (pwrite_fully(w->fd, (const uint8_t *)buf, len, off)) {
+        w->err = CCARD_ERR_IO;
+        return w->err;
+    }
+    w->end = off + len;
+
+    e = &w->ents[w->e_cnt++];
+    e->off = off;
+    e->key_off = w->k_len;
+    e->klen = klen;
+    e->len = len;
+    e->sum = checksum(buf, len);
+    if (klen) {
+        memcpy(w->keys + w->k_len, key, klen);
+    }
+    w->k_len += klen;
+
+    return CCARD_OK;
+}
+
+int
+ccard_pack_finish(ccard_pack_writer_t *w)
+{
+    uint8_t hdr[PACK_HDR_LEN];
+    uint8_t *index, *p, *keys;
+    uint64_t index_off;
+    size_t index_len, k_off;
+    uint32_t i;
+    int rc;
+
+    if (!w) {
+        return CCARD_ERR_INVALID_ARGUMENT;
+    }
+    if (w->err != CCARD_OK) {
+        rc = w->err;
+        writer_release(w);
+        return rc;
+    }
+
+    for (i = 0; i < w->e_cnt; i++) {
+        w->ents[i].key = w->keys + w->ents[i].key_off;
+    }
+    if (w->e_cnt) {
+        qsort(w->ents, w->e_cnt, sizeof(pack_entry_t), entry_cmp);
+    }
+
+    /* index and keys are written at once, keys in the order of index */
+    index_len = (size_t)w->e_cnt * PACK_ENT_LEN;
+    if (index_len + w->k_len > UINT32_MAX) {
+        writer_release(w);
+        return CCARD_ERR_INVALID_ARGUMENT;
+    }
+    index = (uint8_t *)ccard_malloc(w->alloc, index_len + w->k_len + 1);
+    if (!index) {
+        writer_release(w);
+        return CCARD_ERR_INVALID_CTX;
+    }
+    keys = index + index_len;
+    for (i = 0, k_off = 0; i < w->e_cnt; i++) {
+        pack_entry_t *e = &w->ents[i];
+
+        if (i > 0 && !entry_cmp(e - 1, e)) {
+            /* duplicate key */
+            ccard_free(w->alloc, index);
+            writer_release(w);
+            return CCARD_ERR_INVALID_ARGUMENT;
+        }
+
+        p = index + (size_t)i * PACK_ENT_LEN;
+        put64(p, e->off);
+        put64(p + 8, k_off);
+        put32(p + 16, e->klen);
+        put32(p + 20, e->len);
+        put32(p + 24, e->sum);
+        put32(p + 28, 0);
+        if (e->klen) {
+            memcpy(keys + k_off, e->key, e->klen);
+        }
+        k_off += e->klen;
+    }
+
+    index_off = (w->end + PACK_HDR_LEN - 1) & ~(uint64_t)(PACK_HDR_LEN - 1);
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, PACK_MAGIC, sizeof(PACK_MAGIC));
+    put32(hdr + 8, PACK_VERSION);
+    put32(hdr + 12, w->e_cnt);
+    put64(hdr + 16, index_off);
+    put64(hdr + 24, w->k_len);
+    put32(hdr + 32, checksum(index, (uint32_t)(index_len + w->k_len)));
+
+    /* the header goes last, so an unfinished pack has no magic */
+    rc = CCARD_OK;
+    if ((index_len + w->k_len
+         && pwrite_fully(w->fd, index, index_len + w->k_len, index_off))
+        || (index_len + w->k_len == 0 && ftruncate(w->fd, (off_t)index_off))
+        || pwrite_fully(w->fd, hdr, sizeof(hdr), 0)) {
+        rc = CCARD_ERR_IO;
+    }
+
+    ccard_free(w->alloc, index);
+    writer_release(w);
+
+    return rc;
+}
+
+ccard_pack_t *
+ccard_pack_open(const char *path)
+{
+    const ccard_allocator_t *alloc = ccard_get_allocator();
+    ccard_pack_t *pack;
+    const uint8_t *base, *p;
+    struct stat st;
+    uint64_t index_off, k_len, index_len, off;
+    size_t size;
+    uint32_t count, i, len;
+    int fd;
+
+    if (!path) {
+        return NULL;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < PACK_HDR_LEN) {
+        close(fd);
+        return NULL;
+    }
+
+    size = (size_t)st.st_size;
+    base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    count = get32(base + 12);
+    index_off = get64(base + 16);
+    k_len = get64(base + 24);
+    index_len = (uint64_t)count * PACK_ENT_LEN;
+    if (memcmp(base, PACK_MAGIC, sizeof(PACK_MAGIC))
+        || get32(base + 8) != PACK_VERSION
+        || index_off < PACK_HDR_LEN || index_off > size
+        || index_len > size - index_off
+        || k_len != size - index_off - index_len
+        || index_len + k_len > UINT32_MAX
+        || checksum(base + index_off, (uint32_t)(index_len + k_len))
+           != get32(base + 32)) {
+        munmap((void *)base, size);
+        return NULL;
+    }
+
+    /* bounds are checked once here, so that lookups could trust them */
+    for (i = 0; i < count; i++) {
+        p = base + index_off + (uint64_t)i * PACK_ENT_LEN;
+        off = get64(p);
+        len = get32(p + 20);
+        if (off < PACK_HDR_LEN || off % PACK_HDR_LEN || len <= 3
+            || off > index_off || len > index_off - off
+            || get64(p + 8) > k_len || get32(p + 16) > k_len - get64(p + 8)) {
+            munmap((void *)base, size);
+            return NULL;
+        }
+    }
+
+    pack = (ccard_pack_t *)ccard_malloc(alloc, sizeof(ccard_pack_t));
+    if (!pack) {
+        munmap((void *)base, size);
+        return NULL;
+    }
+    pack->alloc = alloc;
+    pack->base = base;
+    pack->size = size;
+    pack->count = count;
+    pack->index = base + index_off;
+    pack->keys = pack->index + index_len;
+    pack->k_len = k_len;
+
+    /* point queries touch a few pages only */
+    posix_madvise((void *)base, size, POSIX_MADV_RANDOM);
+
+    return pack;
+}
+
+uint32_t
+ccard_pack_size(const ccard_pack_t *pack)
+{
+    return pack ? pack->count : 0;
+}
+
+static int
+entry_record(const ccard_pack_t *pack, const uint8_t *p, const void **buf,
+             uint32_t *len)
+{
+    const uint8_t *rec = pack->base + get64(p);
+    uint32_t rlen = get32(p + 20);
+
+    if (checksum(rec, rlen) != get32(p + 24)) {
+        return CCARD_ERR_IO;
+    }
+    *buf = rec;
+    *len = rlen;
+
+    return CCARD_OK;
+}
+
+int
+ccard_pack_find(const ccard_pack_t *pack, const void *key, uint32_t klen,
+                const void **buf, uint32_t *len)
+{
+    uint32_t lo, hi, mid;
+    const uint8_t *p;
+    int c;
+
+    if (!pack || (!key && klen) || !buf || !len) {
+        return CCARD_ERR_INVALID_ARGUMENT;
+    }
+
+    lo = 0;
+    hi = pack->count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        p = pack->index + (size_t)mid * PACK_ENT_LEN;
+        c = key_cmp(pack->keys + get64(p + 8), get32(p + 16),
+                    (const uint8_t *)key, klen);
+        if (c == 0) {
+            return entry_record(pack, p, buf, len);
+        }
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return 1;
+}
+
+int
+ccard_pack_get(const ccard_pack_t *pack, uint32_t i, const void **key,
+               uint32_t *klen, const void **buf, uint32_t *len)
+{
+    const uint8_t *p;
+
+    if (!pack || i >= pack->count || !buf || !len) {
+        return CCARD_ERR_INVALID_ARGUMENT;
+    }
+
+    p = pack->index + (size_t)i * PACK_ENT_LEN;
+    if (key) {
+        *key = pack->keys + get64(p + 8);
+    }
+    if (klen) {
+        *klen = get32(p + 16);
+    }
+
+    return entry_record(pack, p, buf, len);
+}
+
+int
+ccard_pack_close(ccard_pack_t *pack)
+{
+    if (!pack) {
+        return -1;
+    }
+
+    munmap((void *)pack->base, pack->size);
+    ccard_free(pack->alloc, pack);
+
+    return 0;
+}
+
+/* vi:ft=c ts=4 sw=4 fdm=marker et
+ * */
@@ -0,0 +1,330 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include "ccard_sharded.h"
+
+/* bytes of a cache line, shards don't share them */
+#define LINE_SIZE 64
+
+typedef struct sharded_shard_s {
+    void *ctx;          /* counter context of the shard */
+    uint64_t stamp;     /* number of offers which affected the shard */
+    uint32_t busy;      /* 1 while a thread offers to or merges the shard */
+    uint8_t pad[LINE_SIZE - sizeof(void *) - sizeof(uint64_t) -
+                sizeof(uint32_t)];
+} sharded_shard_t;
+
+struct ccard_sharded_s {
+    int err;
+    const ccard_algo_t *algo;
+    int flags;
+    const ccard_allocator_t *alloc; /* allocator of the sketch and shards */
+    sharded_shard_t *shards;        /* shards aligned to LINE_SIZE */
+    void *shards_mem;               /* allocated memory holding shards */
+    uint32_t n;                     /* number of shards */
+    uint32_t merging;               /* 1 while merged is being used */
+    void *merged;                   /* context all shards are merged to */
+    uint64_t stamp;                 /* sum of shard stamps when merged */
+    int64_t card;                   /* cardinality of merged */
+    int valid;                      /* 1 if merged is up to date with stamp */
+};
+
+/**
+ * Get ordinal of the calling thread, threads are numbered the first time
+ * they ask.
+ * */
+static uint32_t
+thread_slot(void)
+{
+    static uint32_t next = 0;
+    static __thread uint32_t slot = 0;  /* slot + 1, 0 if not assigned */
+
+    if (!slot) {
+        slot = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) + 1;
+    }
+    return slot - 1;
+}
+
+static void
+spin_lock(uint32_t *flag)
+{
+    while (__atomic_exchange_n(flag, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static int
+try_lock(uint32_t *flag)
+{
+    return !__atomic_load_n(flag, __ATOMIC_RELAXED) &&
+           !__atomic_exchange_n(flag, 1, __ATOMIC_ACQUIRE);
+}
+
+static void
+unlock(uint32_t *flag)
+{
+    __atomic_store_n(flag, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Take the shard of the calling thread, or the next free one if it's held
+ * by another thread.
+ * */
+static sharded_shard_t *
+take_shard(ccard_sharded_t *s)
+{
+    uint32_t i, j;
+    int cpu = -1;
+
+    if (s->flags & CCARD_SHARDED_CPU) {
+        cpu = sched_getcpu();
+    }
+    i = (cpu >= 0 ? (uint32_t)cpu : thread_slot()) % s->n;
+
+    for (j = 0; ; j++) {
+        if (try_lock(&s->shards[i].busy)) {
+            return &s->shards[i];
+        }
+        if (++i == s->n) {
+            i = 0;
+        }
+        if (j % s->n == s->n - 1) {
+            /* all shards are held, more threads than shards are offering */
+            sched_yield();
+        }
+    }
+}
+
+/**
+ * Merge all shards to the merged context, unless none of them was modified
+ * since the last merge. The caller holds the merging flag.
+ * */
+static int
+refresh(ccard_sharded_t *s)
+{
+    sharded_shard_t *sh;
+    uint64_t stamp = 0;
+    uint32_t i;
+    int rc;
+
+    for (i = 0; i < s->n; i++) {
+        stamp += __atomic_load_n(&s->shards[i].stamp, __ATOMIC_ACQUIRE);
+    }
+    if (s->valid && stamp == s->stamp) {
+        return 0;
+    }
+
+    /* offers after the stamps were summed make the next call merge again */
+    s->valid = 0;
+    if (s->algo->reset(s->merged) != 0) {
+        s->err = s->algo->errnum(s->merged);
+        return -1;
+    }
+    for (i = 0; i < s->n; i++) {
+        sh = &s->shards[i];
+        spin_lock(&sh->busy);
+        rc = s->algo->merge(s->merged, sh->ctx, NULL);
+        unlock(&sh->busy);
+        if (rc != 0) {
+            s->err = s->algo->errnum(s->merged);
+            return -1;
+        }
+    }
+
+    s->card = s->algo->card(s->merged);
+    if (s->card < 0) {
+        s->err = s->algo->errnum(s->merged);
+        return -1;
+    }
+    s->stamp = stamp;
+    s->valid = 1;
+
+    return 0;
+}
+
+ccard_sharded_t *
+ccard_sharded_init(const ccard_algo_t *algo, uint8_t k, uint8_t opt,
+                   uint32_t shards, int flags)
+{
+    const ccard_allocator_t *alloc = ccard_get_allocator();
+    ccard_sharded_t *s;
+    long cpus;
+    uint32_t i;
+
+    if (!algo || !algo->raw_init_alloc) {
+        return NULL;
+    }
+
+    if (!shards) {
+        cpus = sysconf(_SC_NPROCESSORS_CONF);
+        shards = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+
+    s = (ccard_sharded_t *)ccard_calloc(alloc, 1, sizeof(ccard_sharded_t));
+    if (!s) {
+        return NULL;
+    }
+    s->alloc = alloc;
+    s->algo = algo;
+    s->flags = flags;
+
+    /* shards are aligned by hand, the allocator only aligns to words */
+    s->shards_mem = ccard_calloc(alloc, 1, sizeof(sharded_shard_t) * shards +
+                                 LINE_SIZE);
+    if (!s->shards_mem) {
+        ccard_sharded_fini(s);
+        return NULL;
+    }
+    s->shards = (sharded_shard_t *)(void *)((uint8_t *)s->shards_mem +
+                LINE_SIZE - (uintptr_t)s->shards_mem % LINE_SIZE);
+
+    s->merged = algo->raw_init_alloc(NULL, k, opt, alloc);
+    if (!s->merged) {
+        ccard_sharded_fini(s);
+        return NULL;
+    }
+    for (i = 0; i < shards; i++) {
+        s->shards[i].ctx = algo->raw_init_alloc(NULL, k, opt, alloc);
+        if (!s->shards[i].ctx) {
+            ccard_sharded_fini(s);
+            return NULL;
+        }
+        s->n++;
+    }
+    s->err = CCARD_OK;
+
+    return s;
+}
+
+uint32_t
+ccard_sharded_size(const ccard_sharded_t *s)
+{
+    return s ? s->n : 0;
+}
+
+int
+ccard_sharded_offer(ccard_sharded_t *s, const void *buf, uint32_t len)
+{
+    sharded_shard_t *sh;
+    int rc;
+
+    if (!s) {
+        return -1;
+    }
+
+    sh = take_shard(s);
+    rc = s->algo->offer(sh->ctx, buf, len);
+    if (rc > 0) {
+        /* the shard is held, so only the reader sees the stamp racing */
+        __atomic_store_n(&sh->stamp, sh->stamp + 1, __ATOMIC_RELEASE);
+    } else if (rc < 0) {
+        s->err = s->algo->errnum(sh->ctx);
+    }
+    unlock(&sh->busy);
+
+    return rc;
+}
+
+int64_t
+ccard_sharded_card(ccard_sharded_t *s)
+{
+    int64_t card = -1;
+
+    if (!s) {
+        return -1;
+    }
+
+    spin_lock(&s->merging);
+    if (refresh(s) == 0) {
+        card = s->card;
+    }
+    unlock(&s->merging);
+
+    return card;
+}
+
+int
+ccard_sharded_get_bytes(ccard_sharded_t *s, void *buf, uint32_t *len)
+{
+    int rc = -1;
+
+    if (!s) {
+        return -1;
+    }
+
+    spin_lock(&s->merging);
+    if (refresh(s) == 0) {
+        rc = s->algo->get_bytes(s->merged, buf, len);
+        if (rc != 0) {
+            s->err = s->algo->errnum(s->merged);
+        }
+    }
+    unlock(&s->merging);
+
+    return rc;
+}
+
+int
+ccard_sharded_reset(ccard_sharded_t *s)
+{
+    sharded_shard_t *sh;
+    uint32_t i;
+    int rc = 0;
+
+    if (!s) {
+        return -1;
+    }
+
+    spin_lock(&s->merging);
+    for (i = 0; i < s->n; i++) {
+        sh = &s->shards[i];
+        spin_lock(&sh->busy);
+        if (s->algo->reset(sh->ctx) != 0) {
+            s->err = s->algo->errnum(sh->ctx);
+            rc = -1;
+        }
+        __atomic_store_n(&sh->stamp, sh->stamp + 1, __ATOMIC_RELEASE);
+        unlock(&sh->busy);
+    }
+    s->valid = 0;
+    unlock(&s->merging);
+
+    return rc;
+}
+
+int
+ccard_sharded_fini(ccard_sharded_t *s)
+{
+    uint32_t i;
+
+    if (!s) {
+        return -1;
+    }
+
+    for (i = 0; i < s->n; i++) {
+        s->algo->fini(s->shards[i].ctx);
+    }
+    if (s->merged) {
+        s->algo->fini(s->merged);
+    }
+    ccard_free(s->alloc, s->shards_mem);
+    ccard_free(s->alloc, s);
+
+    return 0;
+}
+
+int
+ccard_sharded_errnum(ccard_sharded_t *s)
+{
+    if (s) {
+        return s->err;
+    }
+
+    return CCARD_ERR_INVALID_CTX;
+}
+
+/* vi:ft=c ts=4 sw=4 fdm=marker et
+ * */
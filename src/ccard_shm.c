@@ -0,0 +1,170 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "ccard_shm.h"
+
+/* times and interval of waiting for a segment to be initialized */
+static const int INIT_WAITS = 1000;
+static const long INIT_WAIT_NS = 1000000;
+
+static void
+wait_init(void)
+{
+    struct timespec ts = {0, INIT_WAIT_NS};
+
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * Map an existing segment once it has been sized and its header has been
+ * written by the creator.
+ * */
+static uint8_t *
+attach(int fd, const uint8_t *buf, uint32_t len)
+{
+    struct stat st;
+    uint8_t *addr;
+    int i;
+
+    for (i = 0; ; i++) {
+        if (fstat(fd, &st) != 0) {
+            return NULL;
+        }
+        if ((uint64_t)st.st_size == len) {
+            break;
+        }
+        if (st.st_size != 0 || i == INIT_WAITS) {
+            return NULL;
+        }
+        wait_init();
+    }
+
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+
+    for (i = 0; __atomic_load_n(&addr[0], __ATOMIC_ACQUIRE) == 0; i++) {
+        if (i == INIT_WAITS) {
+            munmap(addr, len);
+            return NULL;
+        }
+        wait_init();
+    }
+
+    if (memcmp(addr, buf, 3)) {
+        munmap(addr, len);
+        return NULL;
+    }
+
+    return addr;
+}
+
+void *
+ccard_shm_open(const char *name, const void *obuf, uint32_t len)
+{
+    const uint8_t *buf = (const uint8_t *)obuf;
+    uint8_t *addr;
+    int fd;
+
+    if (!name || !buf || len <= 3 || buf[0] == 0) {
+        return NULL;
+    }
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        if (errno != EEXIST) {
+            return NULL;
+        }
+        fd = shm_open(name, O_RDWR, 0600);
+        if (fd < 0) {
+            return NULL;
+        }
+        addr = attach(fd, buf, len);
+        close(fd);
+        return addr;
+    }
+
+    if (ftruncate(fd, (off_t)len) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    /* the algorithm byte is published last, see attach */
+    memcpy(addr + 1, buf + 1, len - 1);
+    __atomic_store_n(&addr[0], buf[0], __ATOMIC_RELEASE);
+
+    return addr;
+}
+
+int
+ccard_shm_close(void *addr, uint32_t len)
+{
+    if (!addr) {
+        return -1;
+    }
+
+    return munmap(addr, len) ? -1 : 0;
+}
+
+int
+ccard_shm_unlink(const char *name)
+{
+    if (!name) {
+        return -1;
+    }
+
+    return shm_unlink(name) ? -1 : 0;
+}
+
+uint8_t
+ccard_shm_max(uint8_t *buf, uint32_t len, uint32_t i, uint8_t v)
+{
+    uint8_t *p = buf + i;
+    uint32_t *w = (uint32_t *)(void *)(p - ((uintptr_t)p & 3));
+    uint32_t old, val;
+    uint8_t b[4], r;
+
+    if ((uint8_t *)w < buf || (uint8_t *)(w + 1) > buf + len) {
+        /* the word is out of the buffer, swap the byte alone */
+        r = __atomic_load_n(p, __ATOMIC_RELAXED);
+        while (r < v && !__atomic_compare_exchange_n(p, &r, v, 1,
+                                                     __ATOMIC_RELAXED,
+                                                     __ATOMIC_RELAXED)) {
+        }
+        return r;
+    }
+
+    old = __atomic_load_n(w, __ATOMIC_RELAXED);
+    for (;;) {
+        /* bytes are picked out by memcpy, regardless of endianness */
+        memcpy(b, &old, 4);
+        r = b[(uintptr_t)p & 3];
+        if (r >= v) {
+            return r;
+        }
+        b[(uintptr_t)p & 3] = v;
+        memcpy(&val, b, 4);
+        if (__atomic_compare_exchange_n(w, &old, val, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+            return r;
+        }
+    }
+}
+
+/* vi:ft=c ts=4 sw=4 fdm=marker et
+ * */
@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "sparse_bitmap.h"
+#include "explicit_set.h"
+
+/* initial slots number */
+static const uint32_t INITIAL_SIZE = 8;
+
+// Fibonacci hashing, so that 32-bit hash values are spread over the table
+static uint32_t es_slot(const exp_set_t *es, uint64_t h)
+{
+    return (uint32_t)((h * 0x9e3779b97f4a7c15ULL) >> 32) & (es->size - 1);
+}
+
+// Insert a non-zero hash value which isn't in the set, the table must have room
+static void es_put(exp_set_t *es, uint64_t h)
+{
+    uint32_t i = es_slot(es, h);
+
+    while (es->H[i]) {
+        i = (i + 1) & (es->size - 1);
+    }
+    es->H[i] = h;
+}
+
+static int es_grow(exp_set_t *es)
+{
+    uint64_t *H = es->H;
+    uint32_t i, size = es->size;
+
+    es->H = (uint64_t *)ccard_calloc(es->alloc, size * 2, sizeof(uint64_t));
+    if (!es->H) {
+        es->H = H;
+        return -1;
+    }
+    es->size = size * 2;
+
+    for (i = 0; i < size; i++) {
+        if (H[i]) {
+            es_put(es, H[i]);
+        }
+    }
+    ccard_free(es->alloc, H);
+
+    return 0;
+}
+
+static int cmp_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+exp_set_t *es_init(uint32_t limit, const ccard_allocator_t *alloc)
+{
+    exp_set_t *es;
+
+    if (!alloc) {
+        alloc = ccard_get_allocator();
+    }
+
+    es = (exp_set_t *)ccard_malloc(alloc, sizeof(exp_set_t));
+    if (!es) {
+        return NULL;
+    }
+
+    es->alloc = alloc;
+    es->H = (uint64_t *)ccard_calloc(alloc, INITIAL_SIZE, sizeof(uint64_t));
+    if (!es->H) {
+        ccard_free(alloc, es);
+        return NULL;
+    }
+    es->size = INITIAL_SIZE;
+    es->count = 0;
+    es->limit = limit;
+    es->zero = 0;
+
+    return es;
+}
+
+int es_add(exp_set_t *es, uint64_t h)
+{
+    uint32_t i;
+
+    if (!es) {
+        return -1;
+    }
+
+    if (h == 0) {
+        if (es->zero) {
+            return 0;
+        }
+        if (es->count >= es->limit) {
+            return -1;
+        }
+        es->zero = 1;
+        es->count++;
+        return 1;
+    }
+
+    for (i = es_slot(es, h); es->H[i]; i = (i + 1) & (es->size - 1)) {
+        if (es->H[i] == h) {
+            return 0;
+        }
+    }
+
+    if (es->count >= es->limit) {
+        return -1;
+    }
+
+    // keep load factor under 3/4
+    if ((es->count + 1) * 4 > es->size * 3) {
+        if (es_grow(es)) {
+            return -1;
+        }
+        es_put(es, h);
+    } else {
+        es->H[i] = h;
+    }
+    es->count++;
+
+    return 1;
+}
+
+int es_next(const exp_set_t *es, uint32_t *pos, uint64_t *h)
+{
+    // position 0 is hash value 0, slot i is position i + 1
+    if (*pos == 0) {
+        (*pos)++;
+        if (es->zero) {
+            *h = 0;
+            return 1;
+        }
+    }
+
+    for (; *pos <= es->size; (*pos)++) {
+        if (es->H[*pos - 1]) {
+            *h = es->H[*pos - 1];
+            (*pos)++;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+uint32_t es_dump(const exp_set_t *es, uint8_t k, uint8_t *out)
+{
+    uint64_t *hs, h;
+    uint32_t i, j, pos = 0;
+
+    if (out) {
+        hs = (uint64_t *)ccard_malloc(es->alloc,
+                                      sizeof(uint64_t) * (es->count + 1));
+        for (i = 0; es_next(es, &pos, &h); i++) {
+            hs[i] = h;
+        }
+        qsort(hs, es->count, sizeof(uint64_t), cmp_uint64);
+
+        out[0] = MAKE_EXPLICIT_ID(k);
+        for (i = 0; i < es->count; i++) {
+            for (j = 0; j < 8; j++) {
+                out[1 + i * 8 + j] = (hs[i] >> (j * 8)) & 0xff;
+            }
+        }
+        ccard_free(es->alloc, hs);
+    }
+
+    return 1 + es->count * 8;
+}
+
+int es_verify(const uint8_t *in, uint32_t len, uint8_t hl)
+{
+    uint8_t k;
+    uint32_t i, n;
+
+    if (len == 0 || !IS_EXPLICIT_BMP(in) || (len - 1) % 8 != 0) {
+        return -1;
+    }
+
+    k = K_FROM_EXPLICIT_ID(in[0]);
+    if (k == 0 || k > 31) {
+        return -1;
+    }
+
+    // hash values must be strictly ascending, so they are distinct
+    n = (len - 1) / 8;
+    for (i = 1; i < n; i++) {
+        if (es_hash_at(in, i) <= es_hash_at(in, i - 1)) {
+            return -1;
+        }
+    }
+
+    // the largest one must fit in hash length, or its bucket index overflows
+    if (n > 0 && hl < 64 && es_hash_at(in, n - 1) >> hl) {
+        return -1;
+    }
+
+    return k;
+}
+
+uint64_t es_hash_at(const uint8_t *in, uint32_t i)
+{
+    uint64_t h = 0;
+    int j;
+
+    for (j = 7; j >= 0; j--) {
+        h = (h << 8) | in[1 + i * 8 + j];
+    }
+
+    return h;
+}
+
+int es_reset(exp_set_t *es)
+{
+    if (!es) {
+        return -1;
+    }
+
+    memset(es->H, 0, sizeof(uint64_t) * es->size);
+    es->count = 0;
+    es->zero = 0;
+
+    return 0;
+}
+
+exp_set_t *es_copy(exp_set_t *dst, const exp_set_t *src,
+                   const ccard_allocator_t *alloc)
+{
+    uint64_t *H;
+
+    if (!src) {
+        es_fini(dst);
+        return NULL;
+    }
+
+    if (!dst) {
+        dst = es_init(src->limit, alloc);
+        if (!dst) {
+            return NULL;
+        }
+    }
+
+    if (dst->size != src->size) {
+        H = (uint64_t *)ccard_realloc(dst->alloc, dst->H,
+                                      sizeof(uint64_t) * src->size);
+        if (!H) {
+            es_fini(dst);
+            return NULL;
+        }
+        dst->H = H;
+    }
+
+    memcpy(dst->H, src->H, sizeof(uint64_t) * src->size);
+    dst->size = src->size;
+    dst->count = src->count;
+    dst->limit = src->limit;
+    dst->zero = src->zero;
+
+    return dst;
+}
+
+int es_fini(exp_set_t *es)
+{
+    if (es) {
+        ccard_free(es->alloc, es->H);
+        ccard_free(es->alloc, es);
+        return 0;
+    }
+
+    return -1;
+}
+
+// vi:ft=c ts=4 sw=4 fdm=marker et
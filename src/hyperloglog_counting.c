@@ -5,15 +5,57 @@
 #include <math.h>
 #include "murmurhash.h"
 #include "lookup3hash.h"
+#include "register_set.h"
+#include "explicit_set.h"
+#include "bitmap_codec.h"
+#include "block_epoch.h"
+#include "ccard_shm.h"
 #include "hyperloglog_counting.h"
 
+/* 4-bit offset marking register value is in exception table */
+#define HLL4_EXC 15
+#define IS_HLL4(ctx) ((ctx)->rs && (ctx)->rs->width == 4)
+#define IS_SPARSE(ctx) (!(ctx)->rs && IS_SPARSE_BMP((ctx)->M))
+
+/* register whose value exceeds 4-bit offset */
+struct hll_exc_s {
+    uint32_t idx;
+    uint8_t r;
+};
+
 struct hll_cnt_ctx_s {
     int err;
     uint8_t log2m;
     uint32_t m;
     double alphaMM;
     uint8_t hf;
-    uint8_t M[1];
+    uint32_t epoch;
+    uint8_t *dirty;
+    reg_set_t *rs;      // packed registers, NULL if M is used
+    uint8_t *M;
+    // 4-bit registers are offsets from base, see hll4_get
+    uint8_t base;
+    uint32_t n_base;    // number of registers equal to base
+    uint32_t n_exc;
+    struct hll_exc_s *exc;  // exceptions sorted by index
+    uint8_t width;      // register width, applied when converted to dense
+    uint32_t bmp_len;   // length of M if it's a sparse bitmap
+    exp_set_t *es;      // explicit hash values, M is an empty sparse bitmap
+                        // if it's not NULL
+    uint8_t view;       // VIEW_* if M is borrowed from caller
+    const ccard_allocator_t *alloc; // allocator of the context
+    blk_epoch_t *be;    // block stamps if reset is lazy, only dense unpacked
+                        // registers may have stale blocks
+    uint8_t conc;       // 1 if registers are raised atomically, see
+                        // hll_cnt_set_concurrent
+};
+
+// context views, see hll_cnt_view_init
+enum {
+    VIEW_NONE,
+    VIEW_RDONLY,
+    VIEW_WRITABLE,
+    VIEW_SHARED
 };
 
 static const double POW_2_32 = 4294967296.0;
@@ -36,37 +78,8 @@ static uint8_t num_of_trail_zeros(uint64_t i)
     return n - (uint8_t)((i << 1) >> 63);
 }
 
-hll_cnt_ctx_t *hll_cnt_raw_init(const void *obuf, uint32_t len_or_k, uint8_t hf)
+static double calc_alpha_mm(uint8_t log2m, uint32_t m)
 {
-    hll_cnt_ctx_t *ctx;
-    uint8_t *buf = (uint8_t *)obuf;
-    uint8_t log2m = buf ? num_of_trail_zeros(len_or_k) : len_or_k;
-    uint32_t m = pow(2, log2m);
-
-    if (len_or_k == 0) {
-        // invalid buffer length or k
-        return NULL;
-    }
-
-    if (buf) {
-        // initial bitmap was given
-        if (len_or_k != (uint32_t)(1 << log2m)) {
-            // invalid buffer size, its length must be a power of 2
-            return NULL;
-        }
-
-        ctx = (hll_cnt_ctx_t *)malloc(sizeof(hll_cnt_ctx_t) + m - 1);
-        memcpy(ctx->M, buf, m);
-    } else {
-        // k was given
-        ctx = (hll_cnt_ctx_t *)malloc(sizeof(hll_cnt_ctx_t) + m - 1);
-        memset(ctx->M, 0, m);
-    }
-    ctx->err = CCARD_OK;
-    ctx->log2m = log2m;
-    ctx->m = m;
-    ctx->hf = hf;
-
     /*
      * Description of the following magical numbers:
      *
@@ -102,335 +115,2062 @@ hll_cnt_ctx_t *hll_cnt_raw_init(const void *obuf, uint32_t len_or_k, uint8_t hf)
      **/
     switch (log2m) {
         case 4:
-            ctx->alphaMM = 0.673 * m * m;
-            break;
+            return 0.673 * m * m;
         case 5:
-            ctx->alphaMM = 0.697 * m * m;
-            break;
+            return 0.697 * m * m;
         case 6:
-            ctx->alphaMM = 0.709 * m * m;
-            break;
+            return 0.709 * m * m;
         default:
-            ctx->alphaMM = (0.7213 / (1 + 1.079 / m)) * m * m;
+            return (0.7213 / (1 + 1.079 / m)) * m * m;
     }
-
-    return ctx;
 }
 
-hll_cnt_ctx_t *hll_cnt_init(const void *obuf, uint32_t len_or_k, uint8_t hf)
+/**
+ * Get the effective bit length of hash values produced by the given hash
+ * function, should be kept consistent with hll_cnt_offer.
+ * */
+static uint8_t hash_len(uint8_t hf)
 {
-    uint8_t *buf = (uint8_t *)obuf;
-
-    if (buf) {
-        // initial bitmap was given
-        if(len_or_k <= 3) {
-            return NULL;
-        }
-
-        uint32_t data_segment_size = len_or_k - 3;
-        uint8_t log2m = num_of_trail_zeros(data_segment_size);
-
-        if (buf[0] != CCARD_ALGO_HYPERLOGLOG ||
-            buf[1] != hf ||
-            buf[2] != log2m) {
-
-            // counting algorithm, hash function or length not match
-            return NULL;
-        }
+    switch (hf) {
+        case CCARD_HASH_LOOKUP3:
+        case CCARD_HASH_MURMUR64:
+            return 64;
+        case CCARD_HASH_MURMUR:
+        default:
+            return 32;
+    }
+}
 
-        return hll_cnt_raw_init(buf + 3, data_segment_size, hf);
+/**
+ * Hash an element with the given hash function, only the lowest hash_len(hf)
+ * bits are effective.
+ * */
+static uint64_t hash_value(uint8_t hf, const void *buf, uint32_t len)
+{
+    switch (hf) {
+        case CCARD_HASH_LOOKUP3:
+            return lookup3ycs64_2((const char *)buf);
+        case CCARD_HASH_MURMUR64:
+            return (uint64_t)murmurhash64_no_seed((void *)buf, len);
+        case CCARD_HASH_MURMUR:
+        default:
+            /* default to use murmurhash function */
+            return (uint64_t)murmurhash((void *)buf, len, -1);
     }
+}
 
-    return hll_cnt_raw_init(NULL, len_or_k, hf);
+/**
+ * Get the register value of hash value x with hl effective bits, whose
+ * highest log2m bits are the bucket index: number of trailing zeros of the
+ * remaining bits plus 1.
+ * */
+static uint8_t hash_rank(uint64_t x, uint8_t log2m, uint8_t hl)
+{
+    return (uint8_t)(num_of_trail_zeros(x << (log2m + 64 - hl)) - (log2m + 64 - hl) + 1);
 }
 
-int64_t hll_cnt_card(hll_cnt_ctx_t *ctx)
+/**
+ * Recompute the value of bucket idx in a bitmap with 2^log2m buckets after
+ * dropping the lowest d bits of bucket index.
+ *
+ * Bucket value is the number of trailing zeros of the lowest (hl - log2m)
+ * hash bits plus 1. The dropped index bits are prepended to those bits, so
+ * the value only changes if all of them were zeros.
+ * */
+static uint8_t fold_register(uint8_t hl, uint8_t log2m, uint8_t d,
+                             uint32_t idx, uint8_t r)
 {
-    double sum = 0, estimate, zeros = 0;
-    uint32_t j, z;
+    uint32_t low;
 
-    if (!ctx) {
-        return -1;
+    if (r > hl - log2m) {
+        low = idx & ((1U << d) - 1);
+        r = hl - log2m + (low ? num_of_trail_zeros(low) : d) + 1;
     }
-    ctx->err = CCARD_OK;
 
-    for (j = 0; j < ctx->m; j++) {
-        sum += pow(2, (-1 * ctx->M[j]));
-    }
+    return r;
+}
 
-    estimate = ctx->alphaMM * (1 / sum);
+// Clear blocks left stale by lazy reset, before registers are read as a whole
+static void lazy_flush(hll_cnt_ctx_t *ctx)
+{
+    if (ctx->be && ctx->be->stale) {
+        be_flush(ctx->be, ctx->M);
+    }
+}
 
-    if (estimate <= (5.0 / 2.0) * ctx->m) {
-        /*
-         * Small range correction:
-         * Empty buckets may be too many, using linear counting estimator
-         * instead.
-         * */
-        for (z = 0; z < ctx->m; z++) {
-            if (ctx->M[z] == 0) {
-                zeros++;
-            }
+// Sum dense registers like hll_cnt_card, registers in stale blocks are zeros
+static void lazy_sum(hll_cnt_ctx_t *ctx, double *sum, uint32_t *zeros)
+{
+    uint32_t j, b, end;
+
+    for (b = 0; b < ctx->m; b = end) {
+        end = b + (1U << BE_SHIFT) < ctx->m ? b + (1U << BE_SHIFT) : ctx->m;
+        if (BE_STALE(ctx->be, b)) {
+            *sum += end - b;
+            *zeros += end - b;
+            continue;
+        }
+        for (j = b; j < end; j++) {
+            *sum += pow(2, (-1 * ctx->M[j]));
+            *zeros += ctx->M[j] == 0;
         }
-        return (int64_t)round(ctx->m * log(ctx->m / zeros));
-    } else if (estimate <= (1.0 / 30.0) * POW_2_32) {
-        /* Intermediate range - no correction */
-        return (int64_t)round(estimate);
-    } else {
-        /* Large range correction */
-        return (int64_t)round((NEGATIVE_POW_2_32 * log(1.0 - (estimate / POW_2_32))));
     }
 }
 
-int hll_cnt_offer(hll_cnt_ctx_t *ctx, const void *buf, uint32_t len)
+/**
+ * Get register width specified by options, 8 means not packed.
+ * */
+static uint8_t opt_width(uint8_t opt)
 {
-    int modified = 0;
-    uint64_t x, j;
-    uint8_t r, hl;
-
-    if (!ctx) {
-        return -1;
+    switch (opt & CCARD_OPT_REG_MASK) {
+        case CCARD_OPT_REG6:
+            return 6;
+        case CCARD_OPT_REG5:
+            return 5;
+        case CCARD_OPT_REG4:
+            return 4;
+        default:
+            return 8;
     }
+}
 
-    switch (ctx->hf) {
-        case CCARD_HASH_LOOKUP3:
-            x = lookup3ycs64_2((const char *)buf);
-            hl = 64;
-            break;
-        case CCARD_HASH_MURMUR64:
-            x = (uint64_t)murmurhash64_no_seed((void *)buf, len);
-            hl = 64;
-            break;
-        case CCARD_HASH_MURMUR:
-        default:
-            /* default to use murmurhash function */
-            x = (uint64_t)murmurhash((void *)buf, len, -1);
-            hl = 32;
+/*
+ * 4-bit registers (like HLL_4 of DataSketches) store offsets from the
+ * minimum value of all registers. Offsets not less than 15 are marked as 15
+ * and the actual values are kept in a sorted exception table. As register
+ * values concentrate around log2(n/m), exceptions are rare.
+ *
+ * Once no register equals the minimum, the minimum is increased and all
+ * offsets are rebased.
+ * */
+
+// Get position of register j in exception table, or the position to insert it
+static uint32_t hll4_exc_search(hll_cnt_ctx_t *ctx, uint32_t j)
+{
+    uint32_t begin = 0, end = ctx->n_exc, mid;
+
+    while (begin < end) {
+        mid = (begin + end) >> 1;
+        if (ctx->exc[mid].idx < j) {
+            begin = mid + 1;
+        } else {
+            end = mid;
+        }
     }
 
-    j = x >> (hl - ctx->log2m);
-    r = (uint8_t)(num_of_trail_zeros(x << (ctx->log2m + 64 - hl)) - (ctx->log2m + 64 - hl) + 1);
-    if (ctx->M[j] < r) {
-        ctx->M[j] = r;
+    return begin;
+}
+
+static uint8_t hll4_get(hll_cnt_ctx_t *ctx, uint32_t j)
+{
+    uint32_t v;
 
-        modified = 1;
+    rs_get(ctx->rs, j, &v);
+    if (v == HLL4_EXC) {
+        return ctx->exc[hll4_exc_search(ctx, j)].r;
     }
 
-    ctx->err = CCARD_OK;
-    return modified;
+    return ctx->base + v;
 }
 
-int hll_cnt_get_raw_bytes(hll_cnt_ctx_t *ctx, void *buf, uint32_t *len)
+// Set value of register j, in offset or in exception table accordingly
+static void hll4_put(hll_cnt_ctx_t *ctx, uint32_t j, uint8_t r)
 {
-    uint8_t *out = (uint8_t *)buf;
+    uint32_t v, pos;
 
-    if (!ctx || !len || (buf && *len < ctx->m)) {
-        return -1;
-    }
+    rs_get(ctx->rs, j, &v);
+    pos = v == HLL4_EXC ? hll4_exc_search(ctx, j) : 0;
 
-    if (out) {
-        memcpy(out, ctx->M, ctx->m);
+    if (r - ctx->base < HLL4_EXC) {
+        if (v == HLL4_EXC) {
+            // move out of exception table
+            memmove(ctx->exc + pos, ctx->exc + pos + 1,
+                    sizeof(struct hll_exc_s) * (ctx->n_exc - pos - 1));
+            ctx->n_exc--;
+        }
+        rs_set(ctx->rs, j, r - ctx->base);
+        return;
     }
-    *len = ctx->m;
 
-    return 0;
+    if (v != HLL4_EXC) {
+        // insert into exception table
+        pos = hll4_exc_search(ctx, j);
+        ctx->exc = (struct hll_exc_s *)ccard_realloc(ctx->alloc, ctx->exc,
+                   sizeof(struct hll_exc_s) * (ctx->n_exc + 1));
+        memmove(ctx->exc + pos + 1, ctx->exc + pos,
+                sizeof(struct hll_exc_s) * (ctx->n_exc - pos));
+        ctx->exc[pos].idx = j;
+        ctx->n_exc++;
+        rs_set(ctx->rs, j, HLL4_EXC);
+    }
+    ctx->exc[pos].r = r;
 }
 
-int hll_cnt_get_bytes(hll_cnt_ctx_t *ctx, void *buf, uint32_t *len)
+// Increase base while no register equals it
+static void hll4_rebase(hll_cnt_ctx_t *ctx)
 {
-    /*
-     +--------------+---------+------------------------------+-----------+
-     | algorithm[1] | hash[1] | bitmap length(base-2 log)[1] | bitmap[n] |
-     +--------------+---------+------------------------------+-----------+
-     */
-    uint8_t algo = CCARD_ALGO_HYPERLOGLOG;
-    uint8_t *out = (uint8_t *)buf;
+    uint32_t j, v, i;
+
+    while (ctx->n_base == 0) {
+        ctx->base++;
+        for (j = 0; j < ctx->m; j++) {
+            rs_get(ctx->rs, j, &v);
+            if (v != HLL4_EXC) {
+                // all offsets are at least 1 here
+                rs_set(ctx->rs, j, v - 1);
+                if (v == 1) {
+                    ctx->n_base++;
+                }
+            }
+        }
 
-    if (!ctx || !len || (buf && *len < ctx->m + 3)) {
-        return -1;
+        // exceptions within offset range again
+        for (i = ctx->n_exc; i > 0; i--) {
+            if (ctx->exc[i - 1].r - ctx->base < HLL4_EXC) {
+                hll4_put(ctx, ctx->exc[i - 1].idx, ctx->exc[i - 1].r);
+            }
+        }
     }
+}
 
-    if (buf) {
-        out[0] = algo;
-        out[1] = ctx->hf;
-        out[2] = ctx->log2m;
-        memcpy(&out[3], ctx->M, ctx->m);
+// Raise register j to r, which must be greater than the current value
+static void hll4_raise(hll_cnt_ctx_t *ctx, uint32_t j, uint8_t r)
+{
+    if (hll4_get(ctx, j) == ctx->base) {
+        ctx->n_base--;
     }
-    *len = ctx->m + 3;
-
-    return 0;
+    hll4_put(ctx, j, r);
+    hll4_rebase(ctx);
 }
 
-int hll_cnt_merge(hll_cnt_ctx_t *ctx, hll_cnt_ctx_t *tbm, ...)
+// Replace registers of context with 4-bit ones holding values in M
+static void hll4_build(hll_cnt_ctx_t *ctx, const uint8_t *M)
 {
-    va_list vl;
-    hll_cnt_ctx_t *bm;
-    uint32_t i;
+    uint32_t j;
 
-    if (!ctx) {
-        return -1;
+    ctx->rs = rs_init_alloc(ctx->m, 4, NULL, 0, ctx->alloc);
+    ctx->base = 255;
+    for (j = 0; j < ctx->m; j++) {
+        if (M[j] < ctx->base) {
+            ctx->base = M[j];
+        }
     }
 
-    if (tbm) {
-        /* Cannot merge bitmap of different sizes or different hash functions */
-        if ((tbm->m != ctx->m) || (tbm->hf != ctx->hf)) {
-            ctx->err = CCARD_ERR_MERGE_FAILED;
-            return -1;
+    ctx->n_base = 0;
+    ctx->n_exc = 0;
+    for (j = 0; j < ctx->m; j++) {
+        hll4_put(ctx, j, M[j]);
+        if (M[j] == ctx->base) {
+            ctx->n_base++;
         }
+    }
+}
 
-        for (i = 1; i < ctx->m; i++) {
-            if (tbm->M[i] > ctx->M[i]) {
-                ctx->M[i] = tbm->M[i];
-            }
-        }
+// Sum 2^-value of all registers and count zero ones
+static void hll4_sum(hll_cnt_ctx_t *ctx, double *sum, uint32_t *zeros)
+{
+    uint32_t i, z;
+    double s;
+
+    // exceptions were summed as offset 15 by rs_sum
+    rs_sum(ctx->rs, &s, &z);
+    s = ldexp(s - ctx->n_exc * ldexp(1.0, -HLL4_EXC), -ctx->base);
+    for (i = 0; i < ctx->n_exc; i++) {
+        s += ldexp(1.0, -ctx->exc[i].r);
+    }
 
-        va_start(vl, tbm);
-        while ((bm = va_arg(vl, hll_cnt_ctx_t *)) != NULL) {
-            if ((tbm->m != ctx->m) || (tbm->hf != ctx->hf)) {
-                ctx->err = CCARD_ERR_MERGE_FAILED;
-                return -1;
-            }
+    *sum = s;
+    *zeros = ctx->base == 0 ? z : 0;
+}
 
-            for (i = 1; i < ctx->m; i++) {
-                if (bm->M[i] > ctx->M[i]) {
-                    ctx->M[i] = bm->M[i];
-                }
+// Merge 4-bit registers of bm with the same base to context word by word
+static void hll4_merge(hll_cnt_ctx_t *ctx, hll_cnt_ctx_t *bm)
+{
+    double s;
+    uint32_t i, pos;
+
+    // maximum of offsets is the offset of maximum, exceptions are kept as 15
+    rs_merge(ctx->rs, bm->rs);
+    for (i = 0; i < bm->n_exc; i++) {
+        pos = hll4_exc_search(ctx, bm->exc[i].idx);
+        if (pos < ctx->n_exc && ctx->exc[pos].idx == bm->exc[i].idx) {
+            if (bm->exc[i].r > ctx->exc[pos].r) {
+                ctx->exc[pos].r = bm->exc[i].r;
             }
+            continue;
         }
-        va_end(vl);
+
+        // register became an exception, clear the merged marker first
+        rs_set(ctx->rs, bm->exc[i].idx, 0);
+        hll4_put(ctx, bm->exc[i].idx, bm->exc[i].r);
     }
 
-    ctx->err = CCARD_OK;
-    return 0;
+    // offsets equal to 0 are registers equal to base
+    rs_sum(ctx->rs, &s, &ctx->n_base);
+    hll4_rebase(ctx);
 }
 
-int hll_cnt_merge_raw_bytes(hll_cnt_ctx_t *ctx, const void *buf, uint32_t len, ...)
+/*
+ * Sparse bitmap is the same as the one of adaptive counting (see
+ * adp_cnt_raw_init), non-empty buckets are kept in M sorted by index until
+ * it gets as large as the dense registers.
+ * */
+
+// Max length of sparse bitmap, it's converted to dense registers beyond that
+static uint32_t sparse_max_len(hll_cnt_ctx_t *ctx)
 {
-    va_list vl;
-    uint8_t *in;
-    hll_cnt_ctx_t *bctx;
+    return (uint64_t)ctx->m * ctx->width / 8;
+}
 
-    if (!ctx) {
+// Get k of a sparse bitmap, or -1 if it's corrupted
+static int sparse_verify(const uint8_t *in, uint32_t len)
+{
+    uint8_t k = K_FROM_ID(in[0]), sidx_len = (k + 7) / 8;
+    uint32_t i;
+    int64_t idx, last = -1;
+
+    if (k == 0 || k > 31 || (len - 1) % (sidx_len + 1) != 0) {
         return -1;
     }
 
-    if (buf) {
-        in = (uint8_t *)buf;
-        /* Cannot merge bitmap of different sizes */
-        if (ctx->m != len) {
-            ctx->err = CCARD_ERR_MERGE_FAILED;
+    for (i = 1; i < len; i += sidx_len + 1) {
+        idx = (uint32_t)sparse_bytes_to_int(in, i + 1, sidx_len);
+        if (idx >= (1LL << k) || idx <= last) {
             return -1;
         }
+        last = idx;
+    }
 
-        bctx = hll_cnt_raw_init(in, ctx->m, ctx->hf);
-        hll_cnt_merge(ctx, bctx, NULL);
-        hll_cnt_fini(bctx);
-
-        va_start(vl, len);
-        while ((in = (uint8_t *)va_arg(vl, const void *)) != NULL) {
-            len = va_arg(vl, uint32_t);
-
-            if (ctx->m != len) {
-                ctx->err = CCARD_ERR_MERGE_FAILED;
-                return -1;
-            }
+    return k;
+}
 
-            bctx = hll_cnt_raw_init(in, ctx->m, ctx->hf);
-            hll_cnt_merge(ctx, bctx, NULL);
-            hll_cnt_fini(bctx);
+// Get offset of bucket j in sparse bitmap, or the offset to insert it
+static uint32_t sparse_search(hll_cnt_ctx_t *ctx, uint32_t j, int *found)
+{
+    uint8_t sidx_len = (ctx->log2m + 7) / 8;
+    uint32_t step = sidx_len + 1, n = (ctx->bmp_len - 1) / step;
+    uint32_t lo = 0, hi = n, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if ((uint32_t)sparse_bytes_to_int(ctx->M, mid * step + 2, sidx_len) < j) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        va_end(vl);
     }
 
-    ctx->err = CCARD_OK;
-    return 0;
+    *found = lo < n &&
+             (uint32_t)sparse_bytes_to_int(ctx->M, lo * step + 2, sidx_len) == j;
+    return lo * step + 1;
 }
 
-int hll_cnt_merge_bytes(hll_cnt_ctx_t *ctx, const void *buf, uint32_t len, ...)
+static uint8_t sparse_get(hll_cnt_ctx_t *ctx, uint32_t j)
 {
-    va_list vl;
-    uint8_t *in;
-    hll_cnt_ctx_t *bctx;
+    int found;
+    uint32_t off = sparse_search(ctx, j, &found);
 
-    if (!ctx) {
-        return -1;
+    return found ? ctx->M[off] : 0;
+}
+
+/**
+ * Raise bucket j of sparse bitmap to r. Returns 1 if raised, 0 if not, or -1
+ * if there's no room for a new bucket.
+ * */
+static int sparse_raise(hll_cnt_ctx_t *ctx, uint32_t j, uint8_t r)
+{
+    uint8_t sidx_len = (ctx->log2m + 7) / 8;
+    uint32_t step = sidx_len + 1, off;
+    int found;
+
+    off = sparse_search(ctx, j, &found);
+    if (found || r == 0) {
+        if (found && ctx->M[off] < r) {
+            ctx->M[off] = r;
+            return 1;
+        }
+        return 0;
     }
 
-    if (buf) {
-        in = (uint8_t *)buf;
-        /* Cannot merge bitmap of different sizes,
-        different hash functions or different algorithms */
-        if ((ctx->m + 3 != len) ||
-            (in[0] != CCARD_ALGO_HYPERLOGLOG) ||
-            (in[1] != ctx->hf)) {
+    if (ctx->bmp_len + step > sparse_max_len(ctx)) {
+        return -1;
+    }
 
-            ctx->err = CCARD_ERR_MERGE_FAILED;
-            return -1;
-        }
+    // make room for the new bucket
+    ctx->M = (uint8_t *)ccard_realloc(ctx->alloc, ctx->M, ctx->bmp_len + step);
+    memmove(ctx->M + off + step, ctx->M + off, ctx->bmp_len - off);
+    ctx->M[off] = r;
+    sparse_int_to_bytes(ctx->M, off + 1, sidx_len, j);
+    ctx->bmp_len += step;
 
-        bctx = hll_cnt_init(in, len, ctx->hf);
-        hll_cnt_merge(ctx, bctx, NULL);
-        hll_cnt_fini(bctx);
+    return 1;
+}
 
-        va_start(vl, len);
-        while ((in = (uint8_t *)va_arg(vl, const void *)) != NULL) {
-            len = va_arg(vl, uint32_t);
+static void sparse_sum(hll_cnt_ctx_t *ctx, double *sum, uint32_t *zeros)
+{
+    uint32_t i, step = (ctx->log2m + 7) / 8 + 1;
 
-            if ((ctx->m + 3 != len) ||
-                (in[0] != CCARD_ALGO_HYPERLOGLOG) ||
-                (in[1] != ctx->hf)) {
+    *zeros = ctx->m - (ctx->bmp_len - 1) / step;
+    *sum = *zeros;
+    for (i = 1; i < ctx->bmp_len; i += step) {
+        *sum += pow(2, -1 * ctx->M[i]);
+    }
+}
 
-                ctx->err = CCARD_ERR_MERGE_FAILED;
-                return -1;
-            }
+// Convert sparse bitmap to registers of the width set by hll_cnt_pack
+static void sparse_to_dense(hll_cnt_ctx_t *ctx)
+{
+    uint8_t sidx_len = (ctx->log2m + 7) / 8;
+    uint8_t *M = (uint8_t *)ccard_calloc(ctx->alloc, 1, ctx->m);
+    uint32_t i;
 
-            bctx = hll_cnt_init(in, len, ctx->hf);
-            hll_cnt_merge(ctx, bctx, NULL);
-            hll_cnt_fini(bctx);
-        }
-        va_end(vl);
+    for (i = 1; i < ctx->bmp_len; i += sidx_len + 1) {
+        M[sparse_bytes_to_int(ctx->M, i + 1, sidx_len)] = ctx->M[i];
     }
 
-    ctx->err = CCARD_OK;
-    return 0;
+    ccard_free(ctx->alloc, ctx->M);
+    ctx->M = M;
+    ctx->bmp_len = ctx->m;
+
+    if (ctx->width != 8) {
+        hll_cnt_pack(ctx, ctx->width);
+    }
 }
 
-int hll_cnt_reset(hll_cnt_ctx_t *ctx)
+static uint8_t get_register(hll_cnt_ctx_t *ctx, uint32_t j)
 {
-    if (!ctx) {
-        return -1;
+    uint32_t v;
+
+    if (IS_HLL4(ctx)) {
+        return hll4_get(ctx, j);
     }
 
-    ctx->err = CCARD_OK;
-    memset(ctx->M, 0, ctx->m);
+    if (ctx->rs) {
+        rs_get(ctx->rs, j, &v);
+        return v;
+    }
 
-    return 0;
+    if (IS_SPARSE(ctx)) {
+        return sparse_get(ctx, j);
+    }
+
+    return ctx->M[j];
 }
 
-int hll_cnt_fini(hll_cnt_ctx_t *ctx)
+/**
+ * Set bucket j of context to r.
+ *
+ * @note 4-bit registers could only be raised.
+ * */
+static void put_register(hll_cnt_ctx_t *ctx, uint32_t j, uint8_t r)
 {
-    if (ctx) {
-        free(ctx);
-        return 0;
+    if (IS_HLL4(ctx)) {
+        hll4_raise(ctx, j, r);
+    } else if (ctx->rs) {
+        rs_set(ctx->rs, j, r);
+    } else {
+        ctx->M[j] = r;
     }
-
-    return -1;
 }
 
-int hll_cnt_errnum(hll_cnt_ctx_t *ctx)
+/**
+ * Copy all registers to out as bytes.
+ * */
+static void copy_registers(hll_cnt_ctx_t *ctx, uint8_t *out)
 {
-    if (ctx) {
-        return ctx->err;
+    uint32_t j;
+
+    if (IS_SPARSE(ctx)) {
+        memset(out, 0, ctx->m);
+        for (j = 1; j < ctx->bmp_len; j += (ctx->log2m + 7) / 8 + 1) {
+            out[sparse_bytes_to_int(ctx->M, j + 1, (ctx->log2m + 7) / 8)] = ctx->M[j];
+        }
+        return;
     }
 
-    return CCARD_ERR_INVALID_CTX;
+    if (!ctx->rs) {
+        memcpy(out, ctx->M, ctx->m);
+        return;
+    }
+
+    for (j = 0; j < ctx->m; j++) {
+        out[j] = get_register(ctx, j);
+    }
 }
 
-const char *hll_cnt_errstr(int err)
+/**
+ * Raise bucket j of context to r, the bucket is marked as modified for the
+ * next delta. Values exceeding packed register width are saturated. Sparse
+ * bitmap is converted to dense registers once it's full.
+ * */
+static int set_register(hll_cnt_ctx_t *ctx, uint32_t j, uint8_t r)
+{
+    int raised;
+
+    if (ctx->view == VIEW_SHARED) {
+        // registers of a shared view are raised by other processes as well
+        return ccard_shm_max(ctx->M - 3, ctx->m + 3, j + 3, r) < r;
+    }
+
+    if (ctx->conc) {
+        // registers are raised by other threads as well
+        if (ccard_shm_max(ctx->M, ctx->m, j, r) >= r) {
+            return 0;
+        }
+        if (ctx->dirty) {
+            __atomic_fetch_or(&ctx->dirty[j >> 3], (uint8_t)(1 << (j & 7)),
+                              __ATOMIC_RELAXED);
+        }
+        return 1;
+    }
+
+    if (IS_SPARSE(ctx)) {
+        raised = sparse_raise(ctx, j, r);
+        if (raised >= 0) {
+            return raised;
+        }
+        sparse_to_dense(ctx);
+    }
+
+    if (ctx->rs && !IS_HLL4(ctx) && r >= (1 << ctx->rs->width)) {
+        r = (1 << ctx->rs->width) - 1;
+    }
+
+    if (ctx->be && !ctx->rs) {
+        be_touch(ctx->be, ctx->M, j);
+    }
+
+    if (get_register(ctx, j) < r) {
+        put_register(ctx, j, r);
+        if (ctx->dirty) {
+            ctx->dirty[j >> 3] |= 1 << (j & 7);
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Merge raw bitmap with 2^log2m buckets to context. The bitmap will be folded
+ * on the fly if it has higher precision than the context. Sparse context is
+ * converted to dense first.
+ *
+ * @note log2m must not be less than the one of context.
+ * */
+static void merge_registers(hll_cnt_ctx_t *ctx, const uint8_t *M, uint8_t log2m)
+{
+    uint8_t d = log2m - ctx->log2m;
+    uint8_t hl = hash_len(ctx->hf);
+    uint32_t i, j;
+    uint8_t r;
+
+    if (IS_SPARSE(ctx)) {
+        sparse_to_dense(ctx);
+    }
+
+    if (d == 0) {
+        for (i = 0; i < ctx->m; i++) {
+            set_register(ctx, i, M[i]);
+        }
+        return;
+    }
+
+    for (i = 0; i < (1U << log2m); i++) {
+        if (M[i] == 0) {
+            continue;
+        }
+
+        r = fold_register(hl, log2m, d, i, M[i]);
+        j = i >> d;
+        set_register(ctx, j, r);
+    }
+}
+
+/**
+ * Merge sparse bitmap verified by sparse_verify to context. The bitmap will
+ * be folded on the fly if it has higher precision than the context. Sparse
+ * context stays sparse if the merged bitmap isn't too large.
+ *
+ * @note k of the bitmap must not be less than log2m of context.
+ * */
+static void merge_sparse(hll_cnt_ctx_t *ctx, const uint8_t *in, uint32_t len)
+{
+    uint8_t log2m = K_FROM_ID(in[0]), d = log2m - ctx->log2m;
+    uint8_t hl = hash_len(ctx->hf);
+    uint8_t in_len = (log2m + 7) / 8, sidx_len = (ctx->log2m + 7) / 8;
+    uint32_t step = sidx_len + 1, i = 1, off = 1, n = 1, j, last = 0;
+    uint8_t *M, r;
+
+    if (!IS_SPARSE(ctx)) {
+        for (i = 1; i < len; i += in_len + 1) {
+            j = sparse_bytes_to_int(in, i + 1, in_len);
+            set_register(ctx, j >> d, fold_register(hl, log2m, d, j, in[i]));
+        }
+        return;
+    }
+
+    // merge two sorted bitmaps, folded indexes of in are still sorted
+    M = (uint8_t *)ccard_malloc(ctx->alloc, ctx->bmp_len + (len - 1) / (in_len + 1) * step);
+    M[0] = MAKE_SPARSE_ID(ctx->log2m);
+    while (off < ctx->bmp_len || i < len) {
+        j = i < len ? (uint32_t)sparse_bytes_to_int(in, i + 1, in_len) : 0;
+        if (i >= len || (off < ctx->bmp_len &&
+            (uint32_t)sparse_bytes_to_int(ctx->M, off + 1, sidx_len) <= j >> d)) {
+            j = sparse_bytes_to_int(ctx->M, off + 1, sidx_len);
+            r = ctx->M[off];
+            off += step;
+        } else {
+            r = fold_register(hl, log2m, d, j, in[i]);
+            j >>= d;
+            i += in_len + 1;
+        }
+
+        if (n > 1 && j == last) {
+            if (M[n - step] < r) {
+                M[n - step] = r;
+            }
+            continue;
+        }
+        M[n] = r;
+        sparse_int_to_bytes(M, n + 1, sidx_len, j);
+        n += step;
+        last = j;
+    }
+
+    ccard_free(ctx->alloc, ctx->M);
+    ctx->M = (uint8_t *)ccard_realloc(ctx->alloc, M, n);
+    ctx->bmp_len = n;
+    if (n > sparse_max_len(ctx)) {
+        sparse_to_dense(ctx);
+    }
+}
+
+/**
+ * Merge another context to context.
+ *
+ * @note log2m of bm must not be less than the one of context.
+ * */
+static void merge_context(hll_cnt_ctx_t *ctx, hll_cnt_ctx_t *bm)
+{
+    uint8_t *M;
+
+    if (IS_SPARSE(bm)) {
+        merge_sparse(ctx, bm->M, bm->bmp_len);
+        return;
+    }
+
+    if (!bm->rs) {
+        merge_registers(ctx, bm->M, bm->log2m);
+        return;
+    }
+
+    if (ctx->rs && !ctx->dirty && bm->log2m == ctx->log2m &&
+        bm->rs->width == ctx->rs->width &&
+        (!IS_HLL4(ctx) || bm->base == ctx->base)) {
+        // both packed in the same way, merge word by word
+        if (IS_HLL4(ctx)) {
+            hll4_merge(ctx, bm);
+        } else {
+            rs_merge(ctx->rs, bm->rs);
+        }
+        return;
+    }
+
+    M = (uint8_t *)ccard_malloc(ctx->alloc, bm->m);
+    copy_registers(bm, M);
+    merge_registers(ctx, M, bm->log2m);
+    ccard_free(ctx->alloc, M);
+}
+
+/**
+ * Encode buckets to be sent in a delta as sparse bitmap, see
+ * hll_cnt_get_delta. All non-empty buckets are encoded if full is 1,
+ * otherwise only those marked in dirty bitmap. Returns length of the sparse
+ * bitmap, nothing is written if out is NULL.
+ * */
+static uint32_t delta_encode_sparse(hll_cnt_ctx_t *ctx, int full, uint8_t *out)
+{
+    uint32_t i, off = 1;
+    uint8_t r, sidx_len = (ctx->log2m + 7) / 8;
+
+    if (IS_SPARSE(ctx)) {
+        // modified buckets aren't tracked for sparse bitmap, see
+        // hll_cnt_get_delta
+        if (out) {
+            memcpy(out, ctx->M, ctx->bmp_len);
+        }
+        return ctx->bmp_len;
+    }
+
+    if (out) {
+        out[0] = MAKE_SPARSE_ID(ctx->log2m);
+    }
+    for (i = 0; i < ctx->m; i++) {
+        if (!full && !ctx->dirty[i >> 3]) {
+            // skip 8 clean buckets at once
+            i |= 7;
+            continue;
+        }
+        r = get_register(ctx, i);
+        if (r == 0 ||
+            (!full && !(ctx->dirty[i >> 3] & (1 << (i & 7))))) {
+            continue;
+        }
+
+        if (out) {
+            out[off] = r;
+            sparse_int_to_bytes(out, off + 1, sidx_len, i);
+        }
+        off += sidx_len + 1;
+    }
+
+    return off;
+}
+
+// Max number of explicit hash values, they take no more memory than registers
+static uint32_t explicit_limit(hll_cnt_ctx_t *ctx)
+{
+    return (uint64_t)ctx->m * ctx->width / 64;
+}
+
+static void explicit_to_registers(hll_cnt_ctx_t *ctx);
+
+/**
+ * Raise the bucket of hash value x, or add x to explicit hash values if
+ * they are still kept. Returns 1 if modified, otherwise 0.
+ * */
+static int offer_hash(hll_cnt_ctx_t *ctx, uint64_t x)
+{
+    uint8_t r, hl = hash_len(ctx->hf);
+    uint64_t j;
+    int rc;
+
+    if (ctx->es) {
+        rc = es_add(ctx->es, x);
+        if (rc >= 0) {
+            return rc;
+        }
+        // explicit hash values take too much memory, count with registers
+        explicit_to_registers(ctx);
+    }
+
+    j = x >> (hl - ctx->log2m);
+    r = hash_rank(x, ctx->log2m, hl);
+    return set_register(ctx, j, r);
+}
+
+// Replay all explicit hash values to registers and drop them
+static void explicit_to_registers(hll_cnt_ctx_t *ctx)
+{
+    exp_set_t *es = ctx->es;
+    uint32_t pos = 0;
+    uint64_t h;
+
+    ctx->es = NULL;
+    while (es_next(es, &pos, &h)) {
+        offer_hash(ctx, h);
+    }
+    es_fini(es);
+}
+
+/**
+ * Merge all hash values of explicit bitmap verified by es_verify. Hash values
+ * don't depend on log2m, so the context is never folded.
+ * */
+static void explicit_merge_bytes(hll_cnt_ctx_t *ctx, const uint8_t *in, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < (len - 1) / 8; i++) {
+        offer_hash(ctx, es_hash_at(in, i));
+    }
+}
+
+static void explicit_merge(hll_cnt_ctx_t *ctx, const exp_set_t *es)
+{
+    uint32_t pos = 0;
+    uint64_t h;
+
+    while (es_next(es, &pos, &h)) {
+        offer_hash(ctx, h);
+    }
+}
+
+// Lower the limit of explicit hash values after log2m or width is changed
+static void explicit_check(hll_cnt_ctx_t *ctx)
+{
+    if (ctx->es) {
+        ctx->es->limit = explicit_limit(ctx);
+        if (ctx->es->count > ctx->es->limit) {
+            explicit_to_registers(ctx);
+        }
+    }
+}
+
+// Convert to dense unpacked registers, which could be raised atomically
+static int concurrent_prepare(hll_cnt_ctx_t *ctx)
+{
+    ctx->width = 8;
+    if (ctx->es) {
+        explicit_to_registers(ctx);
+    }
+    if (IS_SPARSE(ctx)) {
+        sparse_to_dense(ctx);
+    }
+
+    return hll_cnt_pack(ctx, 8);
+}
+
+hll_cnt_ctx_t *hll_cnt_raw_init(const void *obuf, uint32_t len_or_k, uint8_t hf)
+{
+    return hll_cnt_raw_init_alloc(obuf, len_or_k, hf, ccard_get_allocator());
+}
+
+hll_cnt_ctx_t *hll_cnt_raw_init_alloc(const void *obuf, uint32_t len_or_k, uint8_t hf,
+                                      const ccard_allocator_t *alloc)
+{
+    hll_cnt_ctx_t *ctx;
+    uint8_t *buf = (uint8_t *)obuf;
+    uint8_t log2m = buf ? num_of_trail_zeros(len_or_k) : len_or_k;
+    uint32_t m, len = 0;
+    int k;
+
+    if (len_or_k == 0) {
+        // invalid buffer length or k
+        return NULL;
+    }
+
+    if (!alloc) {
+        alloc = ccard_get_allocator();
+    }
+
+    if (buf && IS_EXPLICIT_BMP(buf)) {
+        // initial bitmap is explicit one, see explicit_set.h
+        k = es_verify(buf, len_or_k, hash_len(HF(hf)));
+        if (k == -1) {
+            return NULL;
+        }
+        ctx = hll_cnt_raw_init_alloc(NULL, k, hf | CCARD_OPT_EXPLICIT, alloc);
+        explicit_merge_bytes(ctx, buf, len_or_k);
+        return ctx;
+    }
+
+    if (buf && IS_SPARSE_BMP(buf)) {
+        // initial bitmap is sparse one
+        k = sparse_verify(buf, len_or_k);
+        if (k == -1) {
+            return NULL;
+        }
+        log2m = k;
+        len = len_or_k;
+    } else if (buf) {
+        // initial bitmap is normal one
+        if (len_or_k != (uint32_t)(1 << log2m)) {
+            // invalid buffer size, its length must be a power of 2
+            return NULL;
+        }
+        len = len_or_k;
+    } else if (hf & (CCARD_OPT_SPARSE | CCARD_OPT_EXPLICIT)) {
+        // create sparse bitmap with only ID byte, explicit hash values are
+        // converted to sparse bitmap first
+        len = 1;
+    } else {
+        // k was given
+        len = 1U << log2m;
+    }
+
+    m = pow(2, log2m);
+    ctx = (hll_cnt_ctx_t *)ccard_malloc(alloc, sizeof(hll_cnt_ctx_t));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->alloc = alloc;
+    ctx->M = (uint8_t *)ccard_malloc(alloc, len);
+    if (!ctx->M) {
+        ccard_free(alloc, ctx);
+        return NULL;
+    }
+    if (buf) {
+        memcpy(ctx->M, buf, len);
+    } else if (len == 1) {
+        ctx->M[0] = MAKE_SPARSE_ID(log2m);
+    } else {
+        memset(ctx->M, 0, m);
+    }
+    ctx->bmp_len = len;
+    ctx->err = CCARD_OK;
+    ctx->log2m = log2m;
+    ctx->m = m;
+    ctx->epoch = 0;
+    ctx->dirty = NULL;
+    ctx->rs = NULL;
+    ctx->n_exc = 0;
+    ctx->exc = NULL;
+    ctx->hf = HF(hf);
+    ctx->width = opt_width(hf);
+    ctx->alphaMM = calc_alpha_mm(log2m, m);
+    ctx->es = !buf && (hf & CCARD_OPT_EXPLICIT) ?
+              es_init(explicit_limit(ctx), alloc) : NULL;
+    ctx->view = VIEW_NONE;
+    ctx->be = NULL;
+    ctx->conc = 0;
+
+    if (IS_SPARSE(ctx) && ctx->bmp_len > sparse_max_len(ctx)) {
+        sparse_to_dense(ctx);
+    } else if (!IS_SPARSE(ctx) && ctx->width != 8) {
+        hll_cnt_pack(ctx, ctx->width);
+    }
+
+    return ctx;
+}
+
+hll_cnt_ctx_t *hll_cnt_init(const void *obuf, uint32_t len_or_k, uint8_t hf)
+{
+    return hll_cnt_init_alloc(obuf, len_or_k, hf, ccard_get_allocator());
+}
+
+hll_cnt_ctx_t *hll_cnt_init_alloc(const void *obuf, uint32_t len_or_k, uint8_t hf,
+                                  const ccard_allocator_t *alloc)
+{
+    uint8_t *buf = (uint8_t *)obuf;
+
+    if (buf) {
+        // initial bitmap was given
+        if(len_or_k <= 3) {
+            return NULL;
+        }
+
+        if (buf[0] & CCARD_FLAG_COMPRESSED) {
+            // compressed bitmap, initialize with the decoded one
+            uint32_t plen;
+            uint8_t *plain = bc_decompress_bytes(buf, len_or_k, &plen);
+            hll_cnt_ctx_t *ctx = plain ? hll_cnt_init_alloc(plain, plen, hf, alloc) : NULL;
+
+            free(plain);
+            return ctx;
+        }
+
+        uint32_t data_segment_size = len_or_k - 3;
+        uint8_t log2m = num_of_trail_zeros(data_segment_size);
+
+        if (IS_EXPLICIT_BMP(buf + 3)) {
+            // explicit bitmap, get k from the 1st byte of bitmap
+            log2m = K_FROM_EXPLICIT_ID(buf[3]);
+        } else if (IS_SPARSE_BMP(buf + 3)) {
+            // sparse bitmap, get k from the 1st byte of bitmap
+            log2m = K_FROM_ID(buf[3]);
+        }
+
+        if (buf[0] != CCARD_ALGO_HYPERLOGLOG ||
+            buf[1] != HF(hf) ||
+            buf[2] != log2m) {
+
+            // counting algorithm, hash function or length not match
+            return NULL;
+        }
+
+        return hll_cnt_raw_init_alloc(buf + 3, data_segment_size, hf, alloc);
+    }
+
+    return hll_cnt_raw_init_alloc(NULL, len_or_k, hf, alloc);
+}
+
+hll_cnt_ctx_t *hll_cnt_view_init(const void *obuf, uint32_t len, uint8_t flags)
+{
+    hll_cnt_ctx_t *ctx;
+    uint8_t *buf = (uint8_t *)obuf;
+    uint8_t log2m;
+
+    if (!buf || len <= 3 || IS_SPARSE_BMP(buf + 3)) {
+        // only normal serialized bitmap could be borrowed
+        return NULL;
+    }
+
+    log2m = num_of_trail_zeros(len - 3);
+    if (len - 3 != (uint32_t)(1 << log2m) ||
+        buf[0] != CCARD_ALGO_HYPERLOGLOG ||
+        buf[2] != log2m) {
+        return NULL;
+    }
+
+    ctx = (hll_cnt_ctx_t *)ccard_malloc(NULL, sizeof(hll_cnt_ctx_t));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->alloc = ccard_get_allocator();
+    ctx->M = buf + 3;
+    ctx->bmp_len = len - 3;
+    ctx->err = CCARD_OK;
+    ctx->log2m = log2m;
+    ctx->m = len - 3;
+    ctx->epoch = 0;
+    ctx->dirty = NULL;
+    ctx->rs = NULL;
+    ctx->n_exc = 0;
+    ctx->exc = NULL;
+    ctx->hf = buf[1];
+    ctx->width = 8;
+    ctx->alphaMM = calc_alpha_mm(log2m, ctx->m);
+    ctx->es = NULL;
+    if ((flags & CCARD_VIEW_SHARED) == CCARD_VIEW_SHARED) {
+        ctx->view = VIEW_SHARED;
+    } else if (flags & CCARD_VIEW_WRITABLE) {
+        ctx->view = VIEW_WRITABLE;
+    } else {
+        ctx->view = VIEW_RDONLY;
+    }
+    ctx->be = NULL;
+    ctx->conc = 0;
+
+    return ctx;
+}
+
+hll_cnt_ctx_t *hll_cnt_clone(hll_cnt_ctx_t *src)
+{
+    hll_cnt_ctx_t *ctx;
+
+    if (!src) {
+        return NULL;
+    }
+
+    ctx = (hll_cnt_ctx_t *)ccard_calloc(src->alloc, 1, sizeof(hll_cnt_ctx_t));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->alloc = src->alloc;
+    ctx->view = VIEW_NONE;
+
+    if (hll_cnt_copy_into(ctx, src) != 0) {
+        hll_cnt_fini(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+int hll_cnt_copy_into(hll_cnt_ctx_t *dst, hll_cnt_ctx_t *src)
+{
+    hll_cnt_ctx_t old;
+    uint32_t blen;
+
+    if (!dst || !src) {
+        return -1;
+    }
+
+    if (dst->view) {
+        dst->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    dst->err = CCARD_OK;
+    if (dst == src) {
+        return 0;
+    }
+
+    lazy_flush(src);
+
+    // take scalars and estimator state as they are, then copy buffers over
+    // the ones of dst, which are resized only if the sizes differ
+    old = *dst;
+    *dst = *src;
+    dst->err = CCARD_OK;
+    dst->view = VIEW_NONE;
+    dst->alloc = old.alloc;
+
+    blen = IS_SPARSE(src) ? src->bmp_len : src->m;
+    dst->M = (uint8_t *)ccard_copy(dst->alloc, old.M, src->M, blen);
+    dst->dirty = (uint8_t *)ccard_copy(dst->alloc, old.dirty, src->dirty, (src->m + 7) / 8);
+    dst->exc = (struct hll_exc_s *)ccard_copy(dst->alloc, old.exc, src->exc,
+                                              sizeof(struct hll_exc_s) * src->n_exc);
+    dst->rs = rs_copy(old.rs, src->rs, dst->alloc);
+    dst->es = es_copy(old.es, src->es, dst->alloc);
+
+    // registers are all up to date, stamps are kept for later resets
+    dst->be = old.be;
+    if (dst->be && dst->be->len != dst->m) {
+        be_fini(dst->be);
+        dst->be = be_init(dst->m, dst->alloc);
+    } else if (dst->be) {
+        be_sync(dst->be);
+    }
+
+    // concurrent mode belongs to dst
+    dst->conc = 0;
+
+    if ((src->M && !dst->M) || (src->dirty && !dst->dirty) ||
+        (src->n_exc && !dst->exc) || (src->rs && !dst->rs) ||
+        (src->es && !dst->es) || (old.be && !dst->be)) {
+        dst->err = CCARD_ERR_INVALID_CTX;
+        return -1;
+    }
+
+    if (old.conc) {
+        concurrent_prepare(dst);
+        dst->conc = 1;
+    }
+
+    return 0;
+}
+
+int hll_cnt_load_bytes(hll_cnt_ctx_t *ctx, const void *buf, uint32_t len)
+{
+    const uint8_t *in = (const uint8_t *)buf;
+    hll_cnt_ctx_t *tmp;
+    uint32_t epoch;
+    uint8_t width;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    if (ctx->view) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (!in || len <= 3) {
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    if (len == ctx->m + 3 && in[0] == CCARD_ALGO_HYPERLOGLOG &&
+        in[1] == ctx->hf && in[2] == ctx->log2m && !IS_SPARSE_BMP(in + 3) &&
+        !ctx->rs && !ctx->es && !IS_SPARSE(ctx)) {
+        // normal bitmap of the same shape, overwrite registers in place
+        memcpy(ctx->M, in + 3, ctx->m);
+        if (ctx->be) {
+            be_sync(ctx->be);
+        }
+    } else {
+        tmp = hll_cnt_init_alloc(in, len, ctx->hf, ctx->alloc);
+        if (!tmp) {
+            ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+            return -1;
+        }
+
+        epoch = ctx->epoch;
+        width = ctx->width;
+        if (hll_cnt_copy_into(ctx, tmp) != 0) {
+            hll_cnt_fini(tmp);
+            return -1;
+        }
+        hll_cnt_fini(tmp);
+
+        ctx->epoch = epoch;
+        if (ctx->width != width) {
+            hll_cnt_pack(ctx, width);
+        }
+    }
+
+    // buckets raised since the last delta are unknown
+    ccard_free(ctx->alloc, ctx->dirty);
+    ctx->dirty = NULL;
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int64_t hll_cnt_card(hll_cnt_ctx_t *ctx)
+{
+    double sum = 0, estimate, zeros = 0;
+    uint32_t j, z, packed_zeros = 0;
+
+    if (!ctx) {
+        return -1;
+    }
+    ctx->err = CCARD_OK;
+
+    if (ctx->es) {
+        // exact count of explicit hash values
+        return ctx->es->count;
+    }
+
+    if (IS_HLL4(ctx)) {
+        hll4_sum(ctx, &sum, &packed_zeros);
+    } else if (IS_SPARSE(ctx)) {
+        sparse_sum(ctx, &sum, &packed_zeros);
+    } else if (ctx->rs) {
+        rs_sum(ctx->rs, &sum, &packed_zeros);
+    } else if (ctx->be && ctx->be->stale) {
+        lazy_sum(ctx, &sum, &packed_zeros);
+    } else {
+        for (j = 0; j < ctx->m; j++) {
+            sum += pow(2, (-1 * ctx->M[j]));
+        }
+    }
+
+    estimate = ctx->alphaMM * (1 / sum);
+
+    if (estimate <= (5.0 / 2.0) * ctx->m) {
+        /*
+         * Small range correction:
+         * Empty buckets may be too many, using linear counting estimator
+         * instead.
+         * */
+        if (ctx->rs || IS_SPARSE(ctx) || (ctx->be && ctx->be->stale)) {
+            zeros = packed_zeros;
+        } else {
+            for (z = 0; z < ctx->m; z++) {
+                if (ctx->M[z] == 0) {
+                    zeros++;
+                }
+            }
+        }
+        return (int64_t)round(ctx->m * log(ctx->m / zeros));
+    } else if (estimate <= (1.0 / 30.0) * POW_2_32) {
+        /* Intermediate range - no correction */
+        return (int64_t)round(estimate);
+    } else {
+        /* Large range correction */
+        return (int64_t)round((NEGATIVE_POW_2_32 * log(1.0 - (estimate / POW_2_32))));
+    }
+}
+
+int hll_cnt_offer(hll_cnt_ctx_t *ctx, const void *buf, uint32_t len)
+{
+    int modified = 0;
+    uint64_t x;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    x = hash_value(ctx->hf, buf, len);
+    modified = offer_hash(ctx, x);
+
+    // not written unless changed, threads offering concurrently would
+    // otherwise contend on the cache line
+    if (ctx->err != CCARD_OK) {
+        ctx->err = CCARD_OK;
+    }
+    return modified;
+}
+
+int hll_cnt_get_raw_bytes(hll_cnt_ctx_t *ctx, void *buf, uint32_t *len)
+{
+    uint8_t *out = (uint8_t *)buf;
+    uint32_t blen;
+
+    if (!ctx || !len) {
+        return -1;
+    }
+
+    lazy_flush(ctx);
+
+    blen = IS_SPARSE(ctx) ? ctx->bmp_len : ctx->m;
+    if (ctx->es) {
+        blen = es_dump(ctx->es, ctx->log2m, NULL);
+    }
+    if (buf && *len < blen) {
+        return -1;
+    }
+
+    if (out && ctx->es) {
+        es_dump(ctx->es, ctx->log2m, out);
+    } else if (out && IS_SPARSE(ctx)) {
+        memcpy(out, ctx->M, blen);
+    } else if (out) {
+        copy_registers(ctx, out);
+    }
+    *len = blen;
+
+    return 0;
+}
+
+int hll_cnt_get_bytes(hll_cnt_ctx_t *ctx, void *buf, uint32_t *len)
+{
+    /*
+     +--------------+---------+------------------------------+-----------+
+     | algorithm[1] | hash[1] | bitmap length(base-2 log)[1] | bitmap[n] |
+     +--------------+---------+------------------------------+-----------+
+     */
+    uint8_t algo = CCARD_ALGO_HYPERLOGLOG;
+    uint8_t *out = (uint8_t *)buf;
+    uint32_t blen;
+
+    if (!ctx || !len) {
+        return -1;
+    }
+
+    lazy_flush(ctx);
+
+    blen = IS_SPARSE(ctx) ? ctx->bmp_len : ctx->m;
+    if (ctx->es) {
+        blen = es_dump(ctx->es, ctx->log2m, NULL);
+    }
+    if (buf && *len < blen + 3) {
+        return -1;
+    }
+
+    if (buf) {
+        out[0] = algo;
+        out[1] = ctx->hf;
+        out[2] = ctx->log2m;
+        if (ctx->es) {
+            es_dump(ctx->es, ctx->log2m, &out[3]);
+        } else if (IS_SPARSE(ctx)) {
+            memcpy(&out[3], ctx->M, blen);
+        } else {
+            copy_registers(ctx, &out[3]);
+        }
+    }
+    *len = blen + 3;
+
+    return 0;
+}
+
+int hll_cnt_get_iov(hll_cnt_ctx_t *ctx, uint8_t *hdr, struct iovec *iov)
+{
+    if (!ctx || !hdr || !iov) {
+        return -1;
+    }
+
+    if (ctx->es || ctx->rs) {
+        // explicit hash values and packed registers are expanded by
+        // hll_cnt_get_bytes only
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    lazy_flush(ctx);
+
+    hdr[0] = CCARD_ALGO_HYPERLOGLOG;
+    hdr[1] = ctx->hf;
+    hdr[2] = ctx->log2m;
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = 3;
+    iov[1].iov_base = ctx->M;
+    iov[1].iov_len = IS_SPARSE(ctx) ? ctx->bmp_len : ctx->m;
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int hll_cnt_get_compressed_bytes(hll_cnt_ctx_t *ctx, void *buf, uint32_t *len)
+{
+    uint8_t *tmp, mode;
+    uint32_t tlen;
+    int rc;
+
+    if (!ctx || !len || hll_cnt_get_bytes(ctx, NULL, &tlen)) {
+        return -1;
+    }
+
+    tmp = (uint8_t *)ccard_malloc(ctx->alloc, tlen);
+    if (!tmp) {
+        return -1;
+    }
+    hll_cnt_get_bytes(ctx, tmp, &tlen);
+    if (IS_EXPLICIT_BMP(tmp + 3)) {
+        mode = BC_EXPLICIT;
+    } else if (IS_SPARSE_BMP(tmp + 3)) {
+        mode = BC_SPARSE;
+    } else {
+        mode = BC_REGISTERS;
+    }
+    rc = bc_compress_bytes(tmp, tlen, mode, (uint8_t *)buf, len);
+    ccard_free(ctx->alloc, tmp);
+
+    return rc;
+}
+
+int hll_cnt_merge(hll_cnt_ctx_t *ctx, hll_cnt_ctx_t *tbm, ...)
+{
+    va_list vl;
+    hll_cnt_ctx_t *bm;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    lazy_flush(ctx);
+
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (tbm) {
+        va_start(vl, tbm);
+        for (bm = tbm; bm != NULL; bm = va_arg(vl, hll_cnt_ctx_t *)) {
+            /* Cannot merge bitmap of different hash functions */
+            if (bm->hf != ctx->hf) {
+                va_end(vl);
+                ctx->err = CCARD_ERR_MERGE_FAILED;
+                return -1;
+            }
+
+            /* Explicit hash values are merged as they are */
+            if (bm->es) {
+                explicit_merge(ctx, bm->es);
+                continue;
+            }
+            lazy_flush(bm);
+            if (ctx->es) {
+                explicit_to_registers(ctx);
+            }
+
+            /* Bitmap of different sizes will be folded to the lower one */
+            if (bm->log2m < ctx->log2m && hll_cnt_fold(ctx, bm->log2m)) {
+                // views can't be folded
+                va_end(vl);
+                return -1;
+            }
+            merge_context(ctx, bm);
+        }
+        va_end(vl);
+    }
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int hll_cnt_merge_raw_bytes(hll_cnt_ctx_t *ctx, const void *buf, uint32_t len, ...)
+{
+    va_list vl;
+    const uint8_t *in;
+    int first;
+    uint8_t log2m;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    lazy_flush(ctx);
+
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (buf) {
+        va_start(vl, len);
+        for (in = buf, first = 1; in != NULL;
+             in = va_arg(vl, const uint8_t *), first = 0) {
+            if (!first) {
+                len = va_arg(vl, uint32_t);
+            }
+
+            if (len > 0 && IS_EXPLICIT_BMP(in)) {
+                if (es_verify(in, len, hash_len(ctx->hf)) == -1) {
+                    va_end(vl);
+                    ctx->err = CCARD_ERR_MERGE_FAILED;
+                    return -1;
+                }
+                explicit_merge_bytes(ctx, in, len);
+                continue;
+            }
+            if (ctx->es) {
+                explicit_to_registers(ctx);
+            }
+
+            /* Cannot merge bitmap whose length isn't a power of 2, or
+            corrupted sparse bitmap */
+            log2m = num_of_trail_zeros(len);
+            if (len > 0 && IS_SPARSE_BMP(in)) {
+                log2m = sparse_verify(in, len);
+            }
+            if (len == 0 || log2m == (uint8_t)-1 ||
+                (!IS_SPARSE_BMP(in) && len != (uint32_t)(1 << log2m))) {
+                va_end(vl);
+                ctx->err = CCARD_ERR_MERGE_FAILED;
+                return -1;
+            }
+
+            if (log2m < ctx->log2m && hll_cnt_fold(ctx, log2m)) {
+                // views can't be folded
+                va_end(vl);
+                return -1;
+            }
+            if (IS_SPARSE_BMP(in)) {
+                merge_sparse(ctx, in, len);
+            } else {
+                merge_registers(ctx, in, log2m);
+            }
+        }
+        va_end(vl);
+    }
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+/**
+ * Merge serialized bytes got by hll_cnt_get_compressed_bytes to context.
+ * */
+static int merge_compressed_bytes(hll_cnt_ctx_t *ctx, const uint8_t *in, uint32_t len)
+{
+    uint32_t plen;
+    uint8_t *plain = bc_decompress_bytes(in, len, &plen);
+    int rc = plain ? hll_cnt_merge_bytes(ctx, plain, plen, NULL) : -1;
+
+    free(plain);
+    return rc;
+}
+
+int hll_cnt_merge_bytes(hll_cnt_ctx_t *ctx, const void *buf, uint32_t len, ...)
+{
+    va_list vl;
+    const uint8_t *in;
+    int first;
+    uint8_t log2m;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    lazy_flush(ctx);
+
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (buf) {
+        va_start(vl, len);
+        for (in = buf, first = 1; in != NULL;
+             in = va_arg(vl, const uint8_t *), first = 0) {
+            if (!first) {
+                len = va_arg(vl, uint32_t);
+            }
+
+            if (len > 3 && (in[0] & CCARD_FLAG_COMPRESSED)) {
+                if (merge_compressed_bytes(ctx, in, len)) {
+                    va_end(vl);
+                    ctx->err = CCARD_ERR_MERGE_FAILED;
+                    return -1;
+                }
+                continue;
+            }
+
+            if (len > 3 && IS_EXPLICIT_BMP(in + 3)) {
+                if (in[0] != CCARD_ALGO_HYPERLOGLOG || in[1] != ctx->hf ||
+                    es_verify(in + 3, len - 3, hash_len(ctx->hf)) != in[2]) {
+                    va_end(vl);
+                    ctx->err = CCARD_ERR_MERGE_FAILED;
+                    return -1;
+                }
+                explicit_merge_bytes(ctx, in + 3, len - 3);
+                continue;
+            }
+            if (ctx->es) {
+                explicit_to_registers(ctx);
+            }
+
+            /* Cannot merge bitmap of invalid sizes,
+            different hash functions or different algorithms */
+            log2m = len > 3 ? num_of_trail_zeros(len - 3) : 0;
+            if (len > 3 && IS_SPARSE_BMP(in + 3)) {
+                log2m = sparse_verify(in + 3, len - 3);
+            }
+            if ((len <= 3) ||
+                (log2m == (uint8_t)-1) ||
+                (!IS_SPARSE_BMP(in + 3) && len - 3 != (uint32_t)(1 << log2m)) ||
+                (in[0] != CCARD_ALGO_HYPERLOGLOG) ||
+                (in[1] != ctx->hf) ||
+                (in[2] != log2m)) {
+
+                va_end(vl);
+                ctx->err = CCARD_ERR_MERGE_FAILED;
+                return -1;
+            }
+
+            if (log2m < ctx->log2m && hll_cnt_fold(ctx, log2m)) {
+                // views can't be folded
+                va_end(vl);
+                return -1;
+            }
+            if (IS_SPARSE_BMP(in + 3)) {
+                merge_sparse(ctx, in + 3, len - 3);
+            } else {
+                merge_registers(ctx, in + 3, log2m);
+            }
+        }
+        va_end(vl);
+    }
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int hll_cnt_fold(hll_cnt_ctx_t *ctx, uint8_t new_k)
+{
+    uint8_t d, hl, r, v, *M;
+    uint32_t i, j, n;
+    reg_set_t *rs;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    if (new_k == 0 || new_k > ctx->log2m) {
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    if (new_k < ctx->log2m && ctx->view) {
+        // borrowed bitmap can't be resized
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (ctx->be) {
+        // stamps are renewed for the folded registers
+        lazy_flush(ctx);
+        be_fini(ctx->be);
+        ctx->be = be_init(1U << new_k, ctx->alloc);
+    }
+
+    if (ctx->es) {
+        // explicit hash values don't depend on log2m
+        ctx->M[0] = MAKE_SPARSE_ID(new_k);
+        ctx->log2m = new_k;
+        ctx->m = 1 << new_k;
+        ctx->alphaMM = calc_alpha_mm(ctx->log2m, ctx->m);
+        explicit_check(ctx);
+
+        ctx->err = CCARD_OK;
+        return 0;
+    }
+
+    if (IS_SPARSE(ctx)) {
+        // merge the sparse bitmap to an empty one with lower precision
+        M = ctx->M;
+        n = ctx->bmp_len;
+        ctx->M = (uint8_t *)ccard_malloc(ctx->alloc, 1);
+        ctx->M[0] = MAKE_SPARSE_ID(new_k);
+        ctx->bmp_len = 1;
+        ctx->log2m = new_k;
+        ctx->m = 1 << new_k;
+        ctx->alphaMM = calc_alpha_mm(ctx->log2m, ctx->m);
+        merge_sparse(ctx, M, n);
+        ccard_free(ctx->alloc, M);
+
+        ctx->err = CCARD_OK;
+        return 0;
+    }
+
+    if (IS_HLL4(ctx)) {
+        // offsets can't be lowered in place, fold registers in bytes instead
+        hll_cnt_pack(ctx, 8);
+        hll_cnt_fold(ctx, new_k);
+        return hll_cnt_pack(ctx, 4);
+    }
+
+    d = ctx->log2m - new_k;
+    hl = hash_len(ctx->hf);
+    n = 1U << d;
+
+    /*
+     * Fold in place. Bucket j of the folded bitmap only depends on original
+     * buckets [j*n, (j+1)*n), which are never before bucket j, so they won't
+     * be overwritten before being read.
+     * */
+    for (j = 0; j < (1U << new_k); j++) {
+        v = 0;
+        for (i = j * n; i < (j + 1) * n; i++) {
+            r = get_register(ctx, i);
+            if (r == 0) {
+                continue;
+            }
+
+            r = fold_register(hl, ctx->log2m, d, i, r);
+            if (r > v) {
+                v = r;
+            }
+        }
+        put_register(ctx, j, v);
+    }
+
+    if (ctx->rs) {
+        // clear dropped registers sharing words with the remaining ones
+        for (i = 1U << new_k; i < ctx->m; i++) {
+            put_register(ctx, i, 0);
+        }
+        ctx->rs->count = 1U << new_k;
+        ctx->rs->size = (ctx->rs->count + 32 / ctx->rs->width - 1) /
+                        (32 / ctx->rs->width);
+
+        // move the remaining words to a register set of the folded size
+        rs = rs_init_alloc(ctx->rs->count, ctx->rs->width, ctx->rs->M,
+                           ctx->rs->size, ctx->alloc);
+        if (rs) {
+            rs_fini(ctx->rs);
+            ctx->rs = rs;
+        }
+    } else {
+        // release buckets dropped by folding, kept if that fails
+        M = (uint8_t *)ccard_realloc(ctx->alloc, ctx->M, 1U << new_k);
+        if (M) {
+            ctx->M = M;
+        }
+        ctx->bmp_len = 1U << new_k;
+    }
+
+    ctx->log2m = new_k;
+    ctx->m = 1 << new_k;
+
+    // bucket indexes changed, the next delta will be a full one
+    ccard_free(ctx->alloc, ctx->dirty);
+    ctx->dirty = NULL;
+    ctx->alphaMM = calc_alpha_mm(ctx->log2m, ctx->m);
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int hll_cnt_get_delta(hll_cnt_ctx_t *ctx, uint32_t since_epoch, void *buf, uint32_t *len)
+{
+    /*
+     +--------------------+---------+------------------------------+-----------+
+     | algorithm|DELTA[1] | hash[1] | bitmap length(base-2 log)[1] | bitmap[n] |
+     +--------------------+---------+------------------------------+-----------+
+
+     bitmap is a sparse one (see adp_cnt_raw_init) holding only the buckets
+     raised since the given epoch, or a normal one if that is shorter.
+     Explicit bitmap is always a full one.
+     */
+    uint8_t *out = (uint8_t *)buf;
+    uint32_t blen;
+    int full;
+
+    if (!ctx || !len) {
+        return -1;
+    }
+
+    lazy_flush(ctx);
+
+    full = !ctx->dirty || since_epoch != ctx->epoch;
+    blen = delta_encode_sparse(ctx, full, NULL);
+    if (blen >= ctx->m) {
+        blen = ctx->m;
+    }
+    if (ctx->es) {
+        blen = es_dump(ctx->es, ctx->log2m, NULL);
+    }
+
+    if (out && *len < blen + 3) {
+        return -1;
+    }
+
+    if (out) {
+        out[0] = CCARD_ALGO_HYPERLOGLOG | CCARD_FLAG_DELTA;
+        out[1] = ctx->hf;
+        out[2] = ctx->log2m;
+        if (ctx->es) {
+            es_dump(ctx->es, ctx->log2m, out + 3);
+        } else if (blen < ctx->m) {
+            delta_encode_sparse(ctx, full, out + 3);
+        } else {
+            copy_registers(ctx, out + 3);
+        }
+
+        // track buckets modified from now on, sparse bitmap is always sent
+        // as a whole like adp_cnt_get_delta
+        if (ctx->dirty) {
+            memset(ctx->dirty, 0, (ctx->m + 7) / 8);
+        } else if (!IS_SPARSE(ctx)) {
+            ctx->dirty = (uint8_t *)ccard_calloc(ctx->alloc, 1, (ctx->m + 7) / 8);
+        }
+        ctx->epoch++;
+    }
+    *len = blen + 3;
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int hll_cnt_apply_delta(hll_cnt_ctx_t *ctx, const void *buf, uint32_t len)
+{
+    const uint8_t *in = (const uint8_t *)buf;
+    uint8_t log2m;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    lazy_flush(ctx);
+
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    /* Cannot apply delta of invalid sizes,
+    different hash functions or different algorithms */
+    if (!in || len <= 3 ||
+        in[0] != (CCARD_ALGO_HYPERLOGLOG | CCARD_FLAG_DELTA) ||
+        in[1] != ctx->hf ||
+        in[2] == 0 || in[2] > 31) {
+
+        ctx->err = CCARD_ERR_MERGE_FAILED;
+        return -1;
+    }
+
+    log2m = in[2];
+    if (IS_EXPLICIT_BMP(in + 3)) {
+        if (es_verify(in + 3, len - 3, hash_len(ctx->hf)) != log2m) {
+            ctx->err = CCARD_ERR_MERGE_FAILED;
+            return -1;
+        }
+        explicit_merge_bytes(ctx, in + 3, len - 3);
+
+        ctx->err = CCARD_OK;
+        return 0;
+    }
+
+    if (ctx->es) {
+        explicit_to_registers(ctx);
+    }
+    if (!IS_SPARSE_BMP(in + 3)) {
+        // normal bitmap
+        if (len - 3 != (uint32_t)(1 << log2m)) {
+            ctx->err = CCARD_ERR_MERGE_FAILED;
+            return -1;
+        }
+
+        if (log2m < ctx->log2m && hll_cnt_fold(ctx, log2m)) {
+            // views can't be folded
+            return -1;
+        }
+        merge_registers(ctx, in + 3, log2m);
+
+        ctx->err = CCARD_OK;
+        return 0;
+    }
+
+    // sparse bitmap, validate all buckets before merging any of them
+    if (sparse_verify(in + 3, len - 3) != log2m) {
+        ctx->err = CCARD_ERR_MERGE_FAILED;
+        return -1;
+    }
+
+    if (log2m < ctx->log2m && hll_cnt_fold(ctx, log2m)) {
+        // views can't be folded
+        return -1;
+    }
+    merge_sparse(ctx, in + 3, len - 3);
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int64_t hll_cnt_epoch(hll_cnt_ctx_t *ctx)
+{
+    if (!ctx) {
+        return -1;
+    }
+
+    ctx->err = CCARD_OK;
+    return ctx->epoch;
+}
+
+int hll_cnt_pack(hll_cnt_ctx_t *ctx, uint8_t width)
+{
+    uint8_t *M;
+    uint32_t j;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    lazy_flush(ctx);
+
+    if (width != 4 && width != 5 && width != 6 && width != 8) {
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    if (ctx->view && width != 8) {
+        // borrowed bitmap can't be packed
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (ctx->conc && width != 8) {
+        // packed registers can't be raised atomically
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    ctx->width = width;
+    explicit_check(ctx);
+    if (IS_SPARSE(ctx) || width == (ctx->rs ? ctx->rs->width : 8)) {
+        // sparse bitmap is packed when converted to dense, see set_register
+        ctx->err = CCARD_OK;
+        return 0;
+    }
+
+    M = (uint8_t *)ccard_malloc(ctx->alloc, ctx->m);
+    copy_registers(ctx, M);
+
+    // release current registers
+    if (ctx->rs) {
+        rs_fini(ctx->rs);
+        ctx->rs = NULL;
+        ccard_free(ctx->alloc, ctx->exc);
+        ctx->exc = NULL;
+        ctx->n_exc = 0;
+    } else {
+        ccard_free(ctx->alloc, ctx->M);
+    }
+    ctx->M = NULL;
+
+    if (width == 8) {
+        ctx->M = M;
+    } else {
+        if (width == 4) {
+            hll4_build(ctx, M);
+        } else {
+            ctx->rs = rs_init_alloc(ctx->m, width, NULL, 0, ctx->alloc);
+            for (j = 0; j < ctx->m; j++) {
+                // saturate values exceeding register width
+                rs_set(ctx->rs, j, M[j] < (1 << width) ? M[j] : (1 << width) - 1);
+            }
+        }
+        ccard_free(ctx->alloc, M);
+    }
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int hll_cnt_reset(hll_cnt_ctx_t *ctx)
+{
+    if (!ctx) {
+        return -1;
+    }
+
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    ctx->err = CCARD_OK;
+    if (ctx->rs) {
+        memset(ctx->rs->M, 0, sizeof(uint32_t) * ctx->rs->size);
+        ctx->base = 0;
+        ctx->n_base = ctx->m;
+        ctx->n_exc = 0;
+    } else if (IS_SPARSE(ctx)) {
+        ctx->M = (uint8_t *)ccard_realloc(ctx->alloc, ctx->M, 1);
+        ctx->bmp_len = 1;
+    } else if (ctx->be) {
+        be_reset(ctx->be, ctx->M);
+    } else {
+        memset(ctx->M, 0, ctx->m);
+    }
+    if (ctx->es) {
+        es_reset(ctx->es);
+    }
+
+    return 0;
+}
+
+int hll_cnt_set_lazy_reset(hll_cnt_ctx_t *ctx, int on)
+{
+    if (!ctx) {
+        return -1;
+    }
+
+    if (ctx->view) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (on && ctx->conc) {
+        // stamps can't be touched atomically with registers
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    ctx->err = CCARD_OK;
+    if (on && !ctx->be) {
+        ctx->be = be_init(ctx->m, ctx->alloc);
+        if (!ctx->be) {
+            ctx->err = CCARD_ERR_INVALID_CTX;
+            return -1;
+        }
+    } else if (!on && ctx->be) {
+        lazy_flush(ctx);
+        be_fini(ctx->be);
+        ctx->be = NULL;
+    }
+
+    return 0;
+}
+
+int hll_cnt_set_concurrent(hll_cnt_ctx_t *ctx, int on)
+{
+    if (!ctx) {
+        return -1;
+    }
+
+    if (ctx->view) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (on && ctx->be) {
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    ctx->conc = 0;
+    if (on) {
+        if (concurrent_prepare(ctx) != 0) {
+            return -1;
+        }
+        ctx->conc = 1;
+    }
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int hll_cnt_fini(hll_cnt_ctx_t *ctx)
+{
+    if (ctx) {
+        be_fini(ctx->be);
+        ccard_free(ctx->alloc, ctx->dirty);
+        if (!ctx->view) {
+            ccard_free(ctx->alloc, ctx->M);
+        }
+        rs_fini(ctx->rs);
+        ccard_free(ctx->alloc, ctx->exc);
+        es_fini(ctx->es);
+        ccard_free(ctx->alloc, ctx);
+        return 0;
+    }
+
+    return -1;
+}
+
+int hll_cnt_errnum(hll_cnt_ctx_t *ctx)
+{
+    if (ctx) {
+        return ctx->err;
+    }
+
+    return CCARD_ERR_INVALID_CTX;
+}
+
+const char *hll_cnt_errstr(int err)
 {
     static const char *msg[] = {
         "No error",
         "Invalid algorithm context",
         "Merge bitmap failed",
+        "Invalid argument",
+        "I/O error",
+        "Not allowed on view",
+        "Out of memory",
         NULL
     };
 
@@ -441,4 +2181,260 @@ const char *hll_cnt_errstr(int err)
     return "Invalid error number";
 }
 
+// virtual hyperloglog sharing a register pool among keys, see vhll_cnt_init
+struct vhll_cnt_ctx_s {
+    int err;
+    uint8_t log2m;      // base-2 log of registers number of the pool
+    uint32_t m;
+    double alphaMM;
+    uint8_t log2s;      // base-2 log of virtual registers number of a key
+    uint32_t s;
+    double alphaSS;
+    uint8_t hf;
+    uint8_t *M;         // the register pool
+    double noise;       // estimate of the whole pool
+    uint8_t noise_valid;    // 0 if registers were raised since noise
+    const ccard_allocator_t *alloc; // allocator of the context
+};
+
+// max base-2 log of registers number of the pool
+#define VHLL_MAX_LOG2M 31
+
+/**
+ * Estimate from the harmonic sum of m registers, of which zeros are 0, with
+ * the same range corrections as hll_cnt_card.
+ * */
+static double range_estimate(double alpha_mm, uint32_t m, double sum, uint32_t zeros)
+{
+    double estimate = alpha_mm / sum;
+
+    if (estimate <= (5.0 / 2.0) * m) {
+        return zeros ? m * log((double)m / zeros) : estimate;
+    } else if (estimate <= (1.0 / 30.0) * POW_2_32) {
+        return estimate;
+    }
+
+    return NEGATIVE_POW_2_32 * log(1.0 - (estimate / POW_2_32));
+}
+
+// finalizer of 64-bit murmurhash3
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+
+    return x;
+}
+
+/**
+ * Get the pool register of virtual register i of the key whose hash value is
+ * kh.
+ * */
+static uint32_t vhll_index(const vhll_cnt_ctx_t *ctx, uint64_t kh, uint32_t i)
+{
+    return (uint32_t)(mix64(kh ^ ((uint64_t)(i + 1) * 0x9e3779b97f4a7c15ULL))
+                      & (ctx->m - 1));
+}
+
+static void vhll_update_noise(vhll_cnt_ctx_t *ctx)
+{
+    double sum = 0;
+    uint32_t j, zeros = 0;
+
+    if (ctx->noise_valid) {
+        return;
+    }
+
+    for (j = 0; j < ctx->m; j++) {
+        sum += pow(2, -1 * ctx->M[j]);
+        zeros += ctx->M[j] == 0;
+    }
+    ctx->noise = range_estimate(ctx->alphaMM, ctx->m, sum, zeros);
+    ctx->noise_valid = 1;
+}
+
+vhll_cnt_ctx_t *vhll_cnt_init(uint8_t log2m, uint8_t log2s, uint8_t hf)
+{
+    return vhll_cnt_init_alloc(log2m, log2s, hf, ccard_get_allocator());
+}
+
+vhll_cnt_ctx_t *vhll_cnt_init_alloc(uint8_t log2m, uint8_t log2s, uint8_t hf,
+                                    const ccard_allocator_t *alloc)
+{
+    vhll_cnt_ctx_t *ctx;
+
+    if (log2s < 4 || log2s > 16 || log2m <= log2s || log2m > VHLL_MAX_LOG2M) {
+        return NULL;
+    }
+
+    ctx = (vhll_cnt_ctx_t *)ccard_calloc(alloc, 1, sizeof(vhll_cnt_ctx_t));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->alloc = alloc ? alloc : ccard_get_allocator();
+    ctx->log2m = log2m;
+    ctx->m = 1U << log2m;
+    ctx->alphaMM = calc_alpha_mm(log2m, ctx->m);
+    ctx->log2s = log2s;
+    ctx->s = 1U << log2s;
+    ctx->alphaSS = calc_alpha_mm(log2s, ctx->s);
+    ctx->hf = HF(hf);
+
+    // pages of a large pool are zero-filled by the system on first touch
+    ctx->M = (uint8_t *)ccard_calloc(ctx->alloc, ctx->m, sizeof(uint8_t));
+    if (!ctx->M) {
+        ccard_free(ctx->alloc, ctx);
+        return NULL;
+    }
+    ctx->err = CCARD_OK;
+
+    return ctx;
+}
+
+int vhll_cnt_offer(vhll_cnt_ctx_t *ctx, const void *key, uint32_t klen,
+                   const void *buf, uint32_t len)
+{
+    uint64_t x, kh;
+    uint32_t i, j;
+    uint8_t r;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    if (!key && klen) {
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    // the element hash is mixed with the key, otherwise the same element of
+    // different keys gets the same register value and biases the noise; then
+    // bucket index and value are got like hll_cnt_offer with 2^log2s buckets,
+    // and the bucket is mapped to the pool by key
+    kh = murmurhash64_no_seed((void *)key, klen);
+    x = mix64(hash_value(ctx->hf, buf, len) ^ mix64(kh));
+    i = (uint32_t)(x >> (64 - ctx->log2s));
+    r = hash_rank(x, ctx->log2s, 64);
+    j = vhll_index(ctx, kh, i);
+
+    ctx->err = CCARD_OK;
+    if (ctx->M[j] >= r) {
+        return 0;
+    }
+    ctx->M[j] = r;
+    ctx->noise_valid = 0;
+
+    return 1;
+}
+
+int64_t vhll_cnt_card(vhll_cnt_ctx_t *ctx, const void *key, uint32_t klen)
+{
+    double sum = 0, ns, n;
+    uint32_t i, zeros = 0;
+    uint64_t kh;
+    uint8_t r;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    if (!key && klen) {
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    kh = murmurhash64_no_seed((void *)key, klen);
+    for (i = 0; i < ctx->s; i++) {
+        r = ctx->M[vhll_index(ctx, kh, i)];
+        sum += pow(2, -1 * r);
+        zeros += r == 0;
+    }
+    ns = range_estimate(ctx->alphaSS, ctx->s, sum, zeros);
+
+    /*
+     * Virtual registers of a key are raised by other keys sharing the pool
+     * as well. Such noise is uniform over the pool, so the share of it is
+     * subtracted:
+     *
+     *  n = m*s/(m-s) * (ns/s - nm/m)
+     *
+     * where ns is the estimate of virtual registers, nm is the estimate of
+     * the whole pool.
+     * */
+    vhll_update_noise(ctx);
+    n = (double)ctx->m * ctx->s / (ctx->m - ctx->s)
+        * (ns / ctx->s - ctx->noise / ctx->m);
+
+    ctx->err = CCARD_OK;
+    return n > 0 ? (int64_t)round(n) : 0;
+}
+
+int64_t vhll_cnt_card_total(vhll_cnt_ctx_t *ctx)
+{
+    if (!ctx) {
+        return -1;
+    }
+
+    vhll_update_noise(ctx);
+
+    ctx->err = CCARD_OK;
+    return (int64_t)round(ctx->noise);
+}
+
+int vhll_cnt_reset(vhll_cnt_ctx_t *ctx)
+{
+    if (!ctx) {
+        return -1;
+    }
+
+    memset(ctx->M, 0, ctx->m);
+    ctx->noise_valid = 0;
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int vhll_cnt_fini(vhll_cnt_ctx_t *ctx)
+{
+    if (ctx) {
+        ccard_free(ctx->alloc, ctx->M);
+        ccard_free(ctx->alloc, ctx);
+        return 0;
+    }
+
+    return -1;
+}
+
+int vhll_cnt_errnum(vhll_cnt_ctx_t *ctx)
+{
+    if (ctx) {
+        return ctx->err;
+    }
+
+    return CCARD_ERR_INVALID_CTX;
+}
+
+static ccard_algo_t hll_algo_def = {
+    .raw_init = (void *(*)(const void *, uint32_t, uint8_t))hll_cnt_raw_init,
+    .init = (void *(*)(const void *, uint32_t, uint8_t))hll_cnt_init,
+    .card = (int64_t (*)(void *))hll_cnt_card,
+    .offer = (int (*)(void *, const void *, uint32_t))hll_cnt_offer,
+    .reset = (int (*)(void *))hll_cnt_reset,
+    .get_raw_bytes = (int (*)(void *, void *, uint32_t *))hll_cnt_get_raw_bytes,
+    .get_bytes = (int (*)(void *, void *, uint32_t *))hll_cnt_get_bytes,
+    .merge = (int (*)(void *, void *, ...))hll_cnt_merge,
+    .merge_raw_bytes = (int (*)(void *, const void *, uint32_t, ...))hll_cnt_merge_raw_bytes,
+    .merge_bytes = (int (*)(void *, const void *, uint32_t, ...))hll_cnt_merge_bytes,
+    .fini = (int (*)(void *))hll_cnt_fini,
+    .errnum = (int (*)(void *))hll_cnt_errnum,
+    .errstr = hll_cnt_errstr,
+    .raw_init_alloc = (void *(*)(const void *, uint32_t, uint8_t,
+                                 const ccard_allocator_t *))hll_cnt_raw_init_alloc
+};
+
+ccard_algo_t *hll_algo = &hll_algo_def;
+
 // vi:ft=c ts=4 sw=4 fdm=marker et
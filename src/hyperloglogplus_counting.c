@@ -5,6 +5,10 @@
 #include <math.h>
 #include "ccard_common.h"
 #include "murmurhash.h"
+#include "register_set.h"
+#include "explicit_set.h"
+#include "bitmap_codec.h"
+#include "ccard_shm.h"
 #include "hyperloglogplus_counting.h"
 
 struct hllp_cnt_ctx_s {
@@ -13,9 +17,37 @@ struct hllp_cnt_ctx_s {
     uint32_t m;
     double alphaMM;
     uint8_t hf;
-    uint8_t M[1];
+    uint32_t epoch;
+    uint8_t *dirty;
+    reg_set_t *rs;      // packed registers, NULL if M is used
+    uint8_t *M;
+    uint8_t width;      // register width, applied when converted to dense
+    // sparse representation, neither rs nor M is used if sparse is set
+    uint8_t sparse;
+    uint8_t *S;         // sorted list of encoded hashes, see sparse_next
+    uint32_t s_len;     // bytes used by S
+    uint32_t s_cnt;     // number of entries in S
+    uint32_t *T;        // temporary buffer of unsorted encoded hashes
+    uint32_t t_cnt;
+    uint32_t t_size;
+    exp_set_t *es;      // explicit hash values, nothing else is used if set
+    uint8_t view;       // VIEW_* if M is borrowed from caller
+    const ccard_allocator_t *alloc; // allocator of the context
+    uint8_t conc;       // 1 if registers are raised atomically, see
+                        // hllp_cnt_set_concurrent
 };
 
+// context views, see hllp_cnt_view_init
+enum {
+    VIEW_NONE,
+    VIEW_RDONLY,
+    VIEW_WRITABLE,
+    VIEW_SHARED
+};
+
+// precision of hashes kept in sparse representation
+#define SPARSE_P 25
+
 // threshold and bias data taken from google's bias correction data set:  https://docs.google.com/document/d/1gyjfMHy43U9OWBXxfaeG-3MjGzejW1dlpyMwEYAAWEI/view?fullscreen#
 double thresholdData[15] = {10, 20, 40, 80, 220, 400, 900, 1800, 3100, 6500, 15500, 20000, 50000, 120000, 350000};
 
@@ -172,38 +204,8 @@ static uint8_t num_of_leading_zeros(uint64_t i)
     return n;
 }
 
-hllp_cnt_ctx_t *hllp_cnt_raw_init(const void *obuf, uint32_t len_or_k)
+static double calc_alpha_mm(uint8_t log2m, uint32_t m)
 {
-    hllp_cnt_ctx_t *ctx;
-    uint8_t *buf = (uint8_t *)obuf;
-    uint8_t log2m = buf ? num_of_trail_zeros(len_or_k) : len_or_k;
-    uint32_t m = 1 << log2m;
-    uint8_t hf = CCARD_HASH_MURMUR64;
-
-    if (len_or_k == 0) {
-        // invalid buffer length or k
-        return NULL;
-    }
-
-    if (buf) {
-        // initial bitmap was given
-        if (len_or_k != (uint32_t)(1 << log2m)) {
-            // invalid buffer size, its length must be a power of 2
-            return NULL;
-        }
-
-        ctx = (hllp_cnt_ctx_t *)malloc(sizeof(hllp_cnt_ctx_t) + m - 1);
-        memcpy(ctx->M, buf, m);
-    } else {
-        // k was given
-        ctx = (hllp_cnt_ctx_t *)malloc(sizeof(hllp_cnt_ctx_t) + m - 1);
-        memset(ctx->M, 0, m);
-    }
-    ctx->err = CCARD_OK;
-    ctx->log2m = log2m;
-    ctx->m = m;
-    ctx->hf = hf;
-
     /*
      * Description of the following magical numbers:
      *
@@ -239,355 +241,1886 @@ hllp_cnt_ctx_t *hllp_cnt_raw_init(const void *obuf, uint32_t len_or_k)
      **/
     switch (log2m) {
         case 4:
-            ctx->alphaMM = 0.673 * m * m;
-            break;
+            return 0.673 * m * m;
         case 5:
-            ctx->alphaMM = 0.697 * m * m;
-            break;
+            return 0.697 * m * m;
         case 6:
-            ctx->alphaMM = 0.709 * m * m;
-            break;
+            return 0.709 * m * m;
         default:
-            ctx->alphaMM = (0.7213 / (1 + 1.079 / m)) * m * m;
+            return (0.7213 / (1 + 1.079 / m)) * m * m;
     }
-
-    return ctx;
 }
 
-hllp_cnt_ctx_t *hllp_cnt_init(const void *obuf, uint32_t len_or_k)
+/**
+ * Recompute the value of bucket idx in a bitmap with 2^log2m buckets after
+ * dropping the lowest d bits of bucket index.
+ *
+ * Bucket value is the number of leading zeros of hash bits after the highest
+ * log2m ones plus 1. The dropped index bits are prepended to those bits, so
+ * the value is determined by them unless all of them are zeros.
+ * */
+static uint8_t fold_register(uint8_t d, uint32_t idx, uint8_t r)
 {
-    uint8_t *buf = (uint8_t *)obuf;
-    uint8_t hf = CCARD_HASH_MURMUR64;
+    uint32_t low = idx & ((1U << d) - 1);
 
-    if (buf) {
-        // initial bitmap was given
-        if(len_or_k <= 3) {
-            return NULL;
-        }
+    if (low) {
+        return num_of_leading_zeros(low) - (64 - d) + 1;
+    }
 
-        uint32_t data_segment_size = len_or_k - 3;
-        uint8_t log2m = num_of_trail_zeros(data_segment_size);
+    return r + d;
+}
 
-        if (buf[0] != CCARD_ALGO_HYPERLOGLOGPLUS ||
-            buf[1] != hf ||
-            buf[2] != log2m) {
+/**
+ * Get register width specified by options, 8 means not packed.
+ * */
+static uint8_t opt_width(uint8_t opt)
+{
+    switch (opt & CCARD_OPT_REG_MASK) {
+        case CCARD_OPT_REG6:
+            return 6;
+        case CCARD_OPT_REG5:
+            return 5;
+        default:
+            return 8;
+    }
+}
 
-            // counting algorithm, hash function or length not match
-            return NULL;
-        }
+static uint8_t get_register(hllp_cnt_ctx_t *ctx, uint32_t j)
+{
+    uint32_t v;
 
-        return hllp_cnt_raw_init(buf + 3, data_segment_size);
+    if (ctx->rs) {
+        rs_get(ctx->rs, j, &v);
+        return v;
     }
 
-    return hllp_cnt_raw_init(NULL, len_or_k);
+    return ctx->M[j];
 }
 
-int64_t hllp_cnt_card(hllp_cnt_ctx_t *ctx)
+static void put_register(hllp_cnt_ctx_t *ctx, uint32_t j, uint8_t r)
 {
-    double sum = 0, estimate, estimateP, zeros = 0;
-    uint32_t j, z;
-
-    if (!ctx) {
-        return -1;
+    if (ctx->rs) {
+        rs_set(ctx->rs, j, r);
+    } else {
+        ctx->M[j] = r;
     }
+}
 
-    // Bias correction is suitable for 2^4 to 2^18 buckets
-    if (ctx->log2m < 4 || ctx->log2m > 18) {
-        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
-        return -1;
-    }
+/**
+ * Copy all registers to out as bytes.
+ * */
+static void copy_registers(hllp_cnt_ctx_t *ctx, uint8_t *out)
+{
+    uint32_t j;
 
-    ctx->err = CCARD_OK;
+    if (!ctx->rs) {
+        memcpy(out, ctx->M, ctx->m);
+        return;
+    }
 
     for (j = 0; j < ctx->m; j++) {
-        sum += 1.0 / (1 << ctx->M[j]);
+        out[j] = get_register(ctx, j);
     }
+}
 
-    estimate = ctx->alphaMM * (1 / sum);
-    if (estimate <= 5 * ctx->m) {
-        estimate = estimate - compute_bias(estimate, ctx->log2m);
+/**
+ * Raise bucket j of context to r, the bucket is marked as modified for the
+ * next delta. Values exceeding packed register width are saturated.
+ * */
+static int set_register(hllp_cnt_ctx_t *ctx, uint32_t j, uint8_t r)
+{
+    if (ctx->view == VIEW_SHARED) {
+        // registers of a shared view are raised by other processes as well
+        return ccard_shm_max(ctx->M - 3, ctx->m + 3, j + 3, r) < r;
     }
 
-    for (z = 0; z < ctx->m; z++) {
-        if (ctx->M[z] == 0) {
-            zeros++;
+    if (ctx->conc) {
+        // registers are raised by other threads as well
+        if (ccard_shm_max(ctx->M, ctx->m, j, r) >= r) {
+            return 0;
+        }
+        if (ctx->dirty) {
+            __atomic_fetch_or(&ctx->dirty[j >> 3], (uint8_t)(1 << (j & 7)),
+                              __ATOMIC_RELAXED);
         }
+        return 1;
     }
 
-    if (zeros > 0) {
-        estimateP = round(ctx->m * log(ctx->m / zeros));
-    } else {
-        estimateP = estimate;
+    if (ctx->rs && r >= (1 << ctx->rs->width)) {
+        r = (1 << ctx->rs->width) - 1;
     }
 
-    if (estimateP <= thresholdData[ctx->log2m - 4]) {
-        // Use Linear Counting
-        return (int64_t)estimateP;
+    if (get_register(ctx, j) < r) {
+        put_register(ctx, j, r);
+        if (ctx->dirty) {
+            ctx->dirty[j >> 3] |= 1 << (j & 7);
+        }
+        return 1;
     }
 
-    // Use Bias-Correncted HyperLogLog Counting
-    return (int64_t)estimate;
+    return 0;
 }
 
-int hllp_cnt_offer(hllp_cnt_ctx_t *ctx, const void *buf, uint32_t len)
+/**
+ * Iterator over encoded hashes of sparse representation, they are either in
+ * a varint-delta coded list or in a sorted array.
+ * */
+struct sparse_iter_s {
+    const uint8_t *buf;
+    const uint32_t *arr;
+    uint32_t len;       // bytes of buf or entries of arr
+    uint32_t off;
+    uint32_t k;         // current encoded hash
+};
+
+static void sparse_iter_list(struct sparse_iter_s *it, const uint8_t *buf, uint32_t len)
 {
-    int modified = 0;
-    uint64_t x, j;
-    uint8_t r;
+    it->buf = buf;
+    it->arr = NULL;
+    it->len = len;
+    it->off = 0;
+    it->k = 0;
+}
 
-    if (!ctx) {
-        return -1;
+static void sparse_iter_array(struct sparse_iter_s *it, const uint32_t *arr, uint32_t n)
+{
+    it->buf = NULL;
+    it->arr = arr;
+    it->len = n;
+    it->off = 0;
+    it->k = 0;
+}
+
+/**
+ * Move iterator to the next encoded hash. Returns 1 if there's one, 0 at the
+ * end, or -1 if the list is corrupted, i.e. truncated, not strictly
+ * increasing or overflowed.
+ *
+ * Each entry of the list is coded as varint of the idx' delta and the flag
+ * bit, followed by rank' if the flag is set, see sparse_encode.
+ * */
+static int sparse_next(struct sparse_iter_s *it)
+{
+    uint32_t v = 0, sidx, first = it->off == 0;
+    uint8_t b, shift = 0;
+
+    if (it->off >= it->len) {
+        return 0;
     }
 
-    x = (uint64_t)murmurhash64_no_seed((void *)buf, len);
+    if (it->arr) {
+        it->k = it->arr[it->off++];
+        return 1;
+    }
 
-    j = x >> (64 - ctx->log2m);
-    r = (uint8_t)(num_of_leading_zeros((x << ctx->log2m) | (1 << (ctx->log2m - 1))) + 1);
-    if (ctx->M[j] < r) {
-        ctx->M[j] = r;
+    do {
+        if (it->off >= it->len || shift > 28) {
+            return -1;
+        }
+        b = it->buf[it->off++];
+        v |= (uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
 
-        modified = 1;
+    sidx = (it->k >> 7) + (v >> 1);
+    if ((!first && (v >> 1) == 0) || sidx >= (1U << SPARSE_P)) {
+        return -1;
     }
 
-    ctx->err = CCARD_OK;
-    return modified;
+    it->k = sidx << 7;
+    if (v & 1) {
+        if (it->off >= it->len || it->buf[it->off] > 0x3f) {
+            return -1;
+        }
+        it->k |= (it->buf[it->off++] << 1) | 1;
+    }
+
+    return 1;
 }
 
-int hllp_cnt_get_raw_bytes(hllp_cnt_ctx_t *ctx, void *buf, uint32_t *len)
+/**
+ * Count entries of a varint-delta coded list, -1 is returned if it's
+ * corrupted.
+ * */
+static int64_t sparse_validate(const uint8_t *buf, uint32_t len)
 {
-    uint8_t *out = (uint8_t *)buf;
-
-    if (!ctx || !len || (buf && *len < ctx->m)) {
-        return -1;
-    }
+    struct sparse_iter_s it;
+    int64_t n = 0;
+    int ret;
 
-    if (out) {
-        memcpy(out, ctx->M, ctx->m);
+    sparse_iter_list(&it, buf, len);
+    while ((ret = sparse_next(&it)) > 0) {
+        n++;
     }
-    *len = ctx->m;
 
-    return 0;
+    return ret < 0 ? -1 : n;
 }
 
-int hllp_cnt_get_bytes(hllp_cnt_ctx_t *ctx, void *buf, uint32_t *len)
+/**
+ * Append encoded hash k to the list after the one prev, returns bytes
+ * written.
+ * */
+static uint32_t sparse_put(uint8_t *out, uint32_t prev, uint32_t k)
 {
-    /*
-     +--------------+---------+------------------------------+-----------+
-     | algorithm[1] | hash[1] | bitmap length(base-2 log)[1] | bitmap[n] |
-     +--------------+---------+------------------------------+-----------+
-     */
-    uint8_t algo = CCARD_ALGO_HYPERLOGLOGPLUS;
-    uint8_t *out = (uint8_t *)buf;
+    uint32_t n = 0, v = (((k >> 7) - (prev >> 7)) << 1) | (k & 1);
 
-    if (!ctx || !len || (buf && *len < ctx->m + 3)) {
-        return -1;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
     }
+    out[n++] = (uint8_t)v;
 
-    if (buf) {
-        out[0] = algo;
-        out[1] = ctx->hf;
-        out[2] = ctx->log2m;
-        memcpy(&out[3], ctx->M, ctx->m);
+    if (k & 1) {
+        out[n++] = (k >> 1) & 0x3f;
     }
-    *len = ctx->m + 3;
 
-    return 0;
+    return n;
 }
 
-int hllp_cnt_merge(hllp_cnt_ctx_t *ctx, hllp_cnt_ctx_t *tbm, ...)
+/**
+ * Encode hash x with SPARSE_P bits of index. The rank is only kept when it
+ * can't be told from the extra index bits, i.e. they are all zero:
+ *
+ *      idx'[25] | 0[7]                  extra index bits not all zero
+ *      idx'[25] | rank'[6] | 1[1]       otherwise
+ *
+ * Encoded hashes are ordered by idx' and then by rank', so the greatest one
+ * of the same idx' is the one to keep.
+ * */
+static uint32_t sparse_encode(uint64_t x, uint8_t log2m)
 {
-    va_list vl;
-    hllp_cnt_ctx_t *bm;
-    uint32_t i;
+    uint32_t sidx = (uint32_t)(x >> (64 - SPARSE_P));
+    uint8_t r;
 
-    if (!ctx) {
-        return -1;
+    if (sidx & ((1U << (SPARSE_P - log2m)) - 1)) {
+        return sidx << 7;
     }
 
-    if (tbm) {
-        /* Cannot merge bitmap of different sizes or different hash functions */
-        if ((tbm->m != ctx->m) || (tbm->hf != ctx->hf)) {
-            ctx->err = CCARD_ERR_MERGE_FAILED;
-            return -1;
-        }
-        for (i = 1; i < ctx->m; i++) {
-            if (tbm->M[i] > ctx->M[i]) {
-                ctx->M[i] = tbm->M[i];
-            }
-        }
-
-        va_start(vl, tbm);
-        while ((bm = va_arg(vl, hllp_cnt_ctx_t *)) != NULL) {
-            if ((tbm->m != ctx->m) || (tbm->hf != ctx->hf)) {
-                ctx->err = CCARD_ERR_MERGE_FAILED;
-                return -1;
-            }
+    r = (uint8_t)(num_of_leading_zeros((x << SPARSE_P) | (1ULL << (SPARSE_P - 1))) + 1);
+    return (sidx << 7) | (r << 1) | 1;
+}
 
-            for (i = 1; i < ctx->m; i++) {
-                if (bm->M[i] > ctx->M[i]) {
-                    ctx->M[i] = bm->M[i];
-                }
-            }
-        }
-        va_end(vl);
+/**
+ * Decode hash k encoded by sparse_encode to bucket idx and its rank with
+ * 2^log2m buckets, log2m must not be greater than the one used to encode it.
+ * */
+static uint8_t sparse_decode(uint32_t k, uint8_t log2m, uint32_t *idx)
+{
+    uint32_t sidx = k >> 7;
+    uint8_t d = SPARSE_P - log2m;
+    uint64_t low = sidx & ((1U << d) - 1);
+
+    *idx = sidx >> d;
+    if (low) {
+        // leading zeros of the extra index bits
+        return num_of_leading_zeros(low << (64 - d)) + 1;
     }
 
-    ctx->err = CCARD_OK;
-    return 0;
+    return ((k >> 1) & 0x3f) + d;
 }
 
-int hllp_cnt_merge_raw_bytes(hllp_cnt_ctx_t *ctx, const void *buf, uint32_t len, ...)
+static int cmp_uint32(const void *a, const void *b)
 {
-    va_list vl;
-    uint8_t *in;
-    hllp_cnt_ctx_t *bctx;
-    int result;
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
 
-    if (!ctx) {
-        return -1;
-    }
+    return x < y ? -1 : x > y;
+}
 
-    if (buf) {
-        in = (uint8_t *)buf;
-        /* Cannot merge bitmap of different sizes */
-        if (ctx->m != len) {
-            ctx->err = CCARD_ERR_MERGE_FAILED;
-            return -1;
+/**
+ * Merge encoded hashes of iterator b with at most n entries into the sorted
+ * list of context. Only the greatest one of the same idx' is kept.
+ * */
+static void sparse_union(hllp_cnt_ctx_t *ctx, struct sparse_iter_s *b, uint32_t n)
+{
+    struct sparse_iter_s a;
+    uint8_t *out;
+    uint32_t k, last = 0, prev = 0, off = 0, cnt = 0;
+    int ra, rb;
+
+    // each entry takes 5 bytes at most
+    out = (uint8_t *)ccard_malloc(ctx->alloc, 5 * ((uint64_t)ctx->s_cnt + n) + 1);
+
+    sparse_iter_list(&a, ctx->S, ctx->s_len);
+    ra = sparse_next(&a);
+    rb = sparse_next(b);
+    while (ra > 0 || rb > 0) {
+        if (rb <= 0 || (ra > 0 && a.k <= b->k)) {
+            k = a.k;
+            ra = sparse_next(&a);
+        } else {
+            k = b->k;
+            rb = sparse_next(b);
         }
 
-        bctx = hllp_cnt_raw_init(in, len);
-        if(bctx == NULL) {
-            ctx->err = CCARD_ERR_MERGE_FAILED;
-            return -1;
+        if (cnt > 0 && (k >> 7) == (last >> 7)) {
+            // merged hashes are in order, the later one is greater
+            last = k;
+            continue;
         }
-        result = hllp_cnt_merge(ctx, bctx, NULL);
-        hllp_cnt_fini(bctx);
-        if(result != CCARD_OK) {
-            ctx->err = CCARD_ERR_MERGE_FAILED;
-            return -1;
-        }
-
-        va_start(vl, len);
-        while ((in = (uint8_t *)va_arg(vl, const void *)) != NULL) {
-            len = va_arg(vl, uint32_t);
-
-            if (ctx->m != len) {
-                ctx->err = CCARD_ERR_MERGE_FAILED;
-                return -1;
-            }
-
-            bctx = hllp_cnt_raw_init(in, len);
-            if(bctx == NULL) {
-                ctx->err = CCARD_ERR_MERGE_FAILED;
-                return -1;
-            }
-            result = hllp_cnt_merge(ctx, bctx, NULL);
-            hllp_cnt_fini(bctx);
-            if(result != CCARD_OK) {
-                ctx->err = CCARD_ERR_MERGE_FAILED;
-                return -1;
-            }
+        if (cnt > 0) {
+            off += sparse_put(out + off, prev, last);
+            prev = last;
         }
-        va_end(vl);
+        last = k;
+        cnt++;
+    }
+    if (cnt > 0) {
+        off += sparse_put(out + off, prev, last);
     }
 
-    ctx->err = CCARD_OK;
-    return 0;
+    ccard_free(ctx->alloc, ctx->S);
+    ctx->S = (uint8_t *)ccard_realloc(ctx->alloc, out, off + 1);
+    ctx->s_len = off;
+    ctx->s_cnt = cnt;
 }
 
-int hllp_cnt_merge_bytes(hllp_cnt_ctx_t *ctx, const void *buf, uint32_t len, ...)
+/**
+ * Raise buckets of a dense context by encoded hashes of the iterator.
+ * */
+static void sparse_merge_registers(hllp_cnt_ctx_t *ctx, struct sparse_iter_s *it)
 {
-    va_list vl;
-    uint8_t *in;
-    hllp_cnt_ctx_t *bctx;
-    int result;
+    uint32_t idx;
+    uint8_t r;
 
-    if (!ctx) {
-        return -1;
+    while (sparse_next(it) > 0) {
+        r = sparse_decode(it->k, ctx->log2m, &idx);
+        set_register(ctx, idx, r);
     }
-    if (buf) {
-        in = (uint8_t *)buf;
-        /* Cannot merge bitmap of different sizes,
-        different hash functions or different algorithms */
-        if ((ctx->m + 3 != len) ||
-            (in[0] != CCARD_ALGO_HYPERLOGLOGPLUS) ||
-            (in[1] != ctx->hf)) {
-
-            ctx->err = CCARD_ERR_MERGE_FAILED;
-            return -1;
-        }
+}
 
-        bctx = hllp_cnt_init(in, len);
-        if(bctx == NULL) {
-            ctx->err = CCARD_ERR_MERGE_FAILED;
-            return -1;
-        }
-        result = hllp_cnt_merge(ctx, bctx, NULL);
-        hllp_cnt_fini(bctx);
+/**
+ * Convert sparse context to the dense one, with registers of the width set
+ * by hllp_cnt_pack.
+ * */
+static void sparse_to_dense(hllp_cnt_ctx_t *ctx)
+{
+    struct sparse_iter_s it;
 
-        if(result != CCARD_OK) {
-            ctx->err = CCARD_ERR_MERGE_FAILED;
-            return -1;
-        }
+    ctx->sparse = 0;
+    ctx->M = (uint8_t *)ccard_calloc(ctx->alloc, 1, ctx->m);
 
-        va_start(vl, len);
-        while ((in = (uint8_t *)va_arg(vl, const void *)) != NULL) {
-            len = va_arg(vl, uint32_t);
+    sparse_iter_list(&it, ctx->S, ctx->s_len);
+    sparse_merge_registers(ctx, &it);
+    sparse_iter_array(&it, ctx->T, ctx->t_cnt);
+    sparse_merge_registers(ctx, &it);
 
-            if ((ctx->m + 3 != len) ||
-                (in[0] != CCARD_ALGO_HYPERLOGLOGPLUS) ||
-                (in[1] != ctx->hf)) {
+    ccard_free(ctx->alloc, ctx->S);
+    ccard_free(ctx->alloc, ctx->T);
+    ctx->S = NULL;
+    ctx->T = NULL;
+    ctx->s_len = ctx->s_cnt = 0;
+    ctx->t_cnt = ctx->t_size = 0;
 
-                ctx->err = CCARD_ERR_MERGE_FAILED;
-                return -1;
-            }
+    if (ctx->width != 8) {
+        hllp_cnt_pack(ctx, ctx->width);
+    }
+}
 
-            bctx = hllp_cnt_init(in, len);
-            if(bctx == NULL) {
-                ctx->err = CCARD_ERR_MERGE_FAILED;
-                return -1;
-            }
-            result = hllp_cnt_merge(ctx, bctx, NULL);
-            hllp_cnt_fini(bctx);
-            if(result != CCARD_OK) {
-                ctx->err = CCARD_ERR_MERGE_FAILED;
-                break;
-            }
-        }
-        va_end(vl);
-        if(ctx->err != CCARD_OK) {
-            return -1;
-        }
+/**
+ * Convert sparse context to the dense one once the sorted list gets larger.
+ * */
+static void sparse_check(hllp_cnt_ctx_t *ctx)
+{
+    if (ctx->sparse && ctx->s_len > (uint64_t)ctx->m * ctx->width / 8) {
+        sparse_to_dense(ctx);
     }
-    ctx->err = CCARD_OK;
-    return 0;
 }
 
-int hllp_cnt_reset(hllp_cnt_ctx_t *ctx)
+/**
+ * Merge the temporary buffer into the sorted list, the context may be
+ * converted to dense after that.
+ * */
+static void sparse_flush(hllp_cnt_ctx_t *ctx)
 {
-    if (!ctx) {
-        return -1;
+    struct sparse_iter_s it;
+
+    if (!ctx->sparse || ctx->t_cnt == 0) {
+        return;
     }
 
-    ctx->err = CCARD_OK;
-    memset(ctx->M, 0, ctx->m);
+    qsort(ctx->T, ctx->t_cnt, sizeof(uint32_t), cmp_uint32);
+    sparse_iter_array(&it, ctx->T, ctx->t_cnt);
+    sparse_union(ctx, &it, ctx->t_cnt);
+    ctx->t_cnt = 0;
 
-    return 0;
+    sparse_check(ctx);
 }
 
-int hllp_cnt_fini(hllp_cnt_ctx_t *ctx)
+/**
+ * Merge a varint-delta coded list of n entries, see sparse_validate, to
+ * context in any representation.
+ * */
+static void sparse_merge_list(hllp_cnt_ctx_t *ctx, const uint8_t *buf, uint32_t len, uint32_t n)
 {
-    if (ctx) {
-        free(ctx);
-        return 0;
-    }
+    struct sparse_iter_s it;
 
-    return -1;
+    sparse_iter_list(&it, buf, len);
+    if (ctx->sparse) {
+        sparse_union(ctx, &it, n);
+        sparse_check(ctx);
+    } else {
+        sparse_merge_registers(ctx, &it);
+    }
 }
 
-int hllp_cnt_errnum(hllp_cnt_ctx_t *ctx)
+/**
+ * Merge raw bitmap with 2^log2m buckets to context. The bitmap will be folded
+ * on the fly if it has higher precision than the context. Sparse context is
+ * converted to dense first.
+ *
+ * @note log2m must not be less than the one of context.
+ * */
+static void merge_registers(hllp_cnt_ctx_t *ctx, const uint8_t *M, uint8_t log2m)
 {
-    if (ctx) {
+    uint8_t d = log2m - ctx->log2m;
+    uint32_t i, j;
+    uint8_t r;
+
+    if (ctx->sparse) {
+        sparse_to_dense(ctx);
+    }
+
+    if (d == 0) {
+        for (i = 0; i < ctx->m; i++) {
+            set_register(ctx, i, M[i]);
+        }
+        return;
+    }
+
+    for (i = 0; i < (1U << log2m); i++) {
+        if (M[i] == 0) {
+            continue;
+        }
+
+        r = fold_register(d, i, M[i]);
+        j = i >> d;
+        set_register(ctx, j, r);
+    }
+}
+
+/**
+ * Merge another context to context.
+ *
+ * @note log2m of bm must not be less than the one of context.
+ * */
+static void merge_context(hllp_cnt_ctx_t *ctx, hllp_cnt_ctx_t *bm)
+{
+    uint8_t *M;
+
+    sparse_flush(bm);
+    if (bm->sparse) {
+        sparse_merge_list(ctx, bm->S, bm->s_len, bm->s_cnt);
+        return;
+    }
+
+    if (ctx->sparse) {
+        sparse_to_dense(ctx);
+    }
+
+    if (!bm->rs) {
+        merge_registers(ctx, bm->M, bm->log2m);
+        return;
+    }
+
+    if (ctx->rs && !ctx->dirty && bm->log2m == ctx->log2m &&
+        bm->rs->width == ctx->rs->width) {
+        // both packed in the same way, merge word by word
+        rs_merge(ctx->rs, bm->rs);
+        return;
+    }
+
+    M = (uint8_t *)ccard_malloc(ctx->alloc, bm->m);
+    copy_registers(bm, M);
+    merge_registers(ctx, M, bm->log2m);
+    ccard_free(ctx->alloc, M);
+}
+
+/**
+ * Encode buckets to be sent in a delta as sparse bitmap, see
+ * hllp_cnt_get_delta. All non-empty buckets are encoded if full is 1,
+ * otherwise only those marked in dirty bitmap. Returns length of the sparse
+ * bitmap, nothing is written if out is NULL.
+ * */
+static uint32_t delta_encode_sparse(hllp_cnt_ctx_t *ctx, int full, uint8_t *out)
+{
+    uint32_t i, off = 1;
+    uint8_t r, sidx_len = (ctx->log2m + 7) / 8;
+
+    if (out) {
+        out[0] = MAKE_SPARSE_ID(ctx->log2m);
+    }
+    for (i = 0; i < ctx->m; i++) {
+        if (!full && !ctx->dirty[i >> 3]) {
+            // skip 8 clean buckets at once
+            i |= 7;
+            continue;
+        }
+        r = get_register(ctx, i);
+        if (r == 0 ||
+            (!full && !(ctx->dirty[i >> 3] & (1 << (i & 7))))) {
+            continue;
+        }
+
+        if (out) {
+            out[off] = r;
+            sparse_int_to_bytes(out, off + 1, sidx_len, i);
+        }
+        off += sidx_len + 1;
+    }
+
+    return off;
+}
+
+// Max number of explicit hash values, they take no more memory than registers
+static uint32_t explicit_limit(hllp_cnt_ctx_t *ctx)
+{
+    return (uint64_t)ctx->m * ctx->width / 64;
+}
+
+static void explicit_to_registers(hllp_cnt_ctx_t *ctx);
+
+/**
+ * Count hash value x, or add it to explicit hash values if they are still
+ * kept. Returns 1 if modified, otherwise 0.
+ * */
+static int offer_hash(hllp_cnt_ctx_t *ctx, uint64_t x)
+{
+    uint64_t j;
+    uint8_t r;
+    int rc;
+
+    if (ctx->es) {
+        rc = es_add(ctx->es, x);
+        if (rc >= 0) {
+            return rc;
+        }
+        // explicit hash values take too much memory, count with registers
+        explicit_to_registers(ctx);
+    }
+
+    if (ctx->sparse && ctx->t_cnt == ctx->t_size) {
+        if (ctx->t_size < ctx->m / 16) {
+            // grow the temporary buffer up to 1/4 of dense bitmap size
+            ctx->t_size = ctx->t_size ? ctx->t_size * 2 : 16;
+            ctx->T = (uint32_t *)ccard_realloc(ctx->alloc, ctx->T, sizeof(uint32_t) * ctx->t_size);
+        } else {
+            sparse_flush(ctx);
+        }
+    }
+
+    if (ctx->sparse) {
+        // whether it's a new one isn't known until the buffer is flushed
+        ctx->T[ctx->t_cnt++] = sparse_encode(x, ctx->log2m);
+        return 1;
+    }
+
+    j = x >> (64 - ctx->log2m);
+    r = (uint8_t)(num_of_leading_zeros((x << ctx->log2m) | (1 << (ctx->log2m - 1))) + 1);
+    return set_register(ctx, j, r);
+}
+
+// Replay all explicit hash values to registers and drop them
+static void explicit_to_registers(hllp_cnt_ctx_t *ctx)
+{
+    exp_set_t *es = ctx->es;
+    uint32_t pos = 0;
+    uint64_t h;
+
+    ctx->es = NULL;
+    while (es_next(es, &pos, &h)) {
+        offer_hash(ctx, h);
+    }
+    es_fini(es);
+}
+
+/**
+ * Merge all hash values of explicit bitmap verified by es_verify. Hash values
+ * don't depend on log2m, so the context is never folded.
+ * */
+static void explicit_merge_bytes(hllp_cnt_ctx_t *ctx, const uint8_t *in, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < (len - 1) / 8; i++) {
+        offer_hash(ctx, es_hash_at(in, i));
+    }
+}
+
+static void explicit_merge(hllp_cnt_ctx_t *ctx, const exp_set_t *es)
+{
+    uint32_t pos = 0;
+    uint64_t h;
+
+    while (es_next(es, &pos, &h)) {
+        offer_hash(ctx, h);
+    }
+}
+
+// Lower the limit of explicit hash values after log2m or width is changed
+static void explicit_check(hllp_cnt_ctx_t *ctx)
+{
+    if (ctx->es) {
+        ctx->es->limit = explicit_limit(ctx);
+        if (ctx->es->count > ctx->es->limit) {
+            explicit_to_registers(ctx);
+        }
+    }
+}
+
+// Convert to dense unpacked registers, which could be raised atomically
+static int concurrent_prepare(hllp_cnt_ctx_t *ctx)
+{
+    ctx->width = 8;
+    if (ctx->es) {
+        explicit_to_registers(ctx);
+    }
+    if (ctx->sparse) {
+        sparse_to_dense(ctx);
+    }
+
+    return hllp_cnt_pack(ctx, 8);
+}
+
+hllp_cnt_ctx_t *hllp_cnt_raw_init(const void *obuf, uint32_t len_or_k)
+{
+    return hllp_cnt_raw_init_opt(obuf, len_or_k, 0);
+}
+
+hllp_cnt_ctx_t *hllp_cnt_raw_init_opt(const void *obuf, uint32_t len_or_k, uint8_t opt)
+{
+    return hllp_cnt_raw_init_alloc(obuf, len_or_k, opt, ccard_get_allocator());
+}
+
+hllp_cnt_ctx_t *hllp_cnt_raw_init_alloc(const void *obuf, uint32_t len_or_k, uint8_t opt,
+                                        const ccard_allocator_t *alloc)
+{
+    hllp_cnt_ctx_t *ctx;
+    uint8_t *buf = (uint8_t *)obuf;
+    uint8_t log2m = buf ? num_of_trail_zeros(len_or_k) : len_or_k;
+    uint32_t m;
+    uint8_t hf = CCARD_HASH_MURMUR64;
+    uint8_t sparse = 0;
+    int64_t n = 0;
+
+    if (len_or_k == 0) {
+        // invalid buffer length or k
+        return NULL;
+    }
+
+    if (!alloc) {
+        alloc = ccard_get_allocator();
+    }
+
+    if (buf && IS_EXPLICIT_BMP(buf)) {
+        // explicit hash values were given, see explicit_set.h
+        n = es_verify(buf, len_or_k, 64);
+        if (n < 0) {
+            return NULL;
+        }
+        ctx = hllp_cnt_raw_init_alloc(NULL, n, opt | CCARD_OPT_EXPLICIT, alloc);
+        if (ctx) {
+            explicit_merge_bytes(ctx, buf, len_or_k);
+        }
+        return ctx;
+    }
+
+    if (buf && IS_SPARSE_BMP(buf)) {
+        // sparse representation was given
+        log2m = K_FROM_ID(buf[0]);
+        n = sparse_validate(buf + 1, len_or_k - 1);
+        if (n < 0) {
+            return NULL;
+        }
+        sparse = 1;
+    } else if (!buf && (opt & CCARD_OPT_SPARSE)) {
+        sparse = 1;
+    } else if (!buf && (opt & CCARD_OPT_EXPLICIT) && log2m >= 4 && log2m <= 18) {
+        // explicit hash values are converted to sparse representation first
+        // if it's suitable
+        sparse = 1;
+    }
+
+    if (sparse && (log2m < 4 || log2m > 18)) {
+        // sparse representation is only for precisions bias correction is
+        // suitable for
+        return NULL;
+    }
+
+    m = 1 << log2m;
+    ctx = (hllp_cnt_ctx_t *)ccard_malloc(alloc, sizeof(hllp_cnt_ctx_t));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->alloc = alloc;
+    // registers of sparse context are allocated when converted to dense
+    ctx->M = NULL;
+    if (buf && !sparse) {
+        // initial bitmap was given
+        if (len_or_k != (uint32_t)(1 << log2m)) {
+            // invalid buffer size, its length must be a power of 2
+            ccard_free(alloc, ctx);
+            return NULL;
+        }
+
+        ctx->M = (uint8_t *)ccard_malloc(alloc, m);
+        memcpy(ctx->M, buf, m);
+    } else if (!sparse) {
+        // k was given
+        ctx->M = (uint8_t *)ccard_malloc(alloc, m);
+        memset(ctx->M, 0, m);
+    }
+    ctx->err = CCARD_OK;
+    ctx->log2m = log2m;
+    ctx->m = m;
+    ctx->epoch = 0;
+    ctx->dirty = NULL;
+    ctx->rs = NULL;
+    ctx->hf = hf;
+    ctx->alphaMM = calc_alpha_mm(log2m, m);
+    ctx->width = opt_width(opt);
+    ctx->sparse = sparse;
+    ctx->S = NULL;
+    ctx->s_len = ctx->s_cnt = 0;
+    ctx->T = NULL;
+    ctx->t_cnt = ctx->t_size = 0;
+    ctx->es = !buf && (opt & CCARD_OPT_EXPLICIT) ?
+              es_init(explicit_limit(ctx), alloc) : NULL;
+    ctx->view = VIEW_NONE;
+    ctx->conc = 0;
+
+    if (sparse && buf) {
+        sparse_merge_list(ctx, buf + 1, len_or_k - 1, n);
+    } else if (!sparse && ctx->width != 8) {
+        hllp_cnt_pack(ctx, ctx->width);
+    }
+
+    return ctx;
+}
+
+hllp_cnt_ctx_t *hllp_cnt_init(const void *obuf, uint32_t len_or_k)
+{
+    return hllp_cnt_init_alloc(obuf, len_or_k, ccard_get_allocator());
+}
+
+hllp_cnt_ctx_t *hllp_cnt_init_alloc(const void *obuf, uint32_t len_or_k,
+                                    const ccard_allocator_t *alloc)
+{
+    uint8_t *buf = (uint8_t *)obuf;
+    uint8_t hf = CCARD_HASH_MURMUR64;
+
+    if (buf) {
+        // initial bitmap was given
+        if(len_or_k <= 3) {
+            return NULL;
+        }
+
+        if (buf[0] & CCARD_FLAG_COMPRESSED) {
+            // compressed bitmap, initialize with the decoded one
+            uint32_t plen;
+            uint8_t *plain = bc_decompress_bytes(buf, len_or_k, &plen);
+            hllp_cnt_ctx_t *ctx = plain ? hllp_cnt_init_alloc(plain, plen, alloc) : NULL;
+
+            free(plain);
+            return ctx;
+        }
+
+        uint32_t data_segment_size = len_or_k - 3;
+        uint8_t log2m = num_of_trail_zeros(data_segment_size);
+
+        if (IS_EXPLICIT_BMP(buf + 3)) {
+            log2m = K_FROM_EXPLICIT_ID(buf[3]);
+        } else if (IS_SPARSE_BMP(buf + 3)) {
+            log2m = K_FROM_ID(buf[3]);
+        }
+
+        if (buf[0] != CCARD_ALGO_HYPERLOGLOGPLUS ||
+            buf[1] != hf ||
+            buf[2] != log2m) {
+
+            // counting algorithm, hash function or length not match
+            return NULL;
+        }
+
+        return hllp_cnt_raw_init_alloc(buf + 3, data_segment_size, 0, alloc);
+    }
+
+    return hllp_cnt_raw_init_alloc(NULL, len_or_k, 0, alloc);
+}
+
+hllp_cnt_ctx_t *hllp_cnt_view_init(const void *obuf, uint32_t len, uint8_t flags)
+{
+    hllp_cnt_ctx_t *ctx;
+    uint8_t *buf = (uint8_t *)obuf;
+    uint8_t log2m;
+
+    if (!buf || len < 16 + 3 || IS_SPARSE_BMP(buf + 3)) {
+        // only normal serialized bitmap could be borrowed
+        return NULL;
+    }
+
+    log2m = num_of_trail_zeros(len - 3);
+    if (len - 3 != (uint32_t)(1 << log2m) ||
+        buf[0] != CCARD_ALGO_HYPERLOGLOGPLUS ||
+        buf[1] != CCARD_HASH_MURMUR64 ||
+        buf[2] != log2m) {
+        return NULL;
+    }
+
+    ctx = (hllp_cnt_ctx_t *)ccard_malloc(NULL, sizeof(hllp_cnt_ctx_t));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->alloc = ccard_get_allocator();
+    ctx->M = buf + 3;
+    ctx->err = CCARD_OK;
+    ctx->log2m = log2m;
+    ctx->m = len - 3;
+    ctx->epoch = 0;
+    ctx->dirty = NULL;
+    ctx->rs = NULL;
+    ctx->hf = buf[1];
+    ctx->alphaMM = calc_alpha_mm(log2m, ctx->m);
+    ctx->width = 8;
+    ctx->sparse = 0;
+    ctx->S = NULL;
+    ctx->s_len = ctx->s_cnt = 0;
+    ctx->T = NULL;
+    ctx->t_cnt = ctx->t_size = 0;
+    ctx->es = NULL;
+    ctx->conc = 0;
+    if ((flags & CCARD_VIEW_SHARED) == CCARD_VIEW_SHARED) {
+        ctx->view = VIEW_SHARED;
+    } else if (flags & CCARD_VIEW_WRITABLE) {
+        ctx->view = VIEW_WRITABLE;
+    } else {
+        ctx->view = VIEW_RDONLY;
+    }
+
+    return ctx;
+}
+
+hllp_cnt_ctx_t *hllp_cnt_clone(hllp_cnt_ctx_t *src)
+{
+    hllp_cnt_ctx_t *ctx;
+
+    if (!src) {
+        return NULL;
+    }
+
+    ctx = (hllp_cnt_ctx_t *)ccard_calloc(src->alloc, 1, sizeof(hllp_cnt_ctx_t));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->alloc = src->alloc;
+    ctx->view = VIEW_NONE;
+
+    if (hllp_cnt_copy_into(ctx, src) != 0) {
+        hllp_cnt_fini(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+int hllp_cnt_copy_into(hllp_cnt_ctx_t *dst, hllp_cnt_ctx_t *src)
+{
+    hllp_cnt_ctx_t old;
+
+    if (!dst || !src) {
+        return -1;
+    }
+
+    if (dst->view) {
+        dst->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    dst->err = CCARD_OK;
+    if (dst == src) {
+        return 0;
+    }
+
+    // only the sorted list is copied
+    sparse_flush(src);
+
+    // take scalars as they are, then copy buffers over the ones of dst, which
+    // are resized only if the sizes differ
+    old = *dst;
+    *dst = *src;
+    dst->err = CCARD_OK;
+    dst->view = VIEW_NONE;
+    dst->alloc = old.alloc;
+
+    dst->M = (uint8_t *)ccard_copy(dst->alloc, old.M, src->M, src->m);
+    dst->dirty = (uint8_t *)ccard_copy(dst->alloc, old.dirty, src->dirty, (src->m + 7) / 8);
+    dst->S = (uint8_t *)ccard_copy(dst->alloc, old.S, src->S, src->s_len);
+    dst->rs = rs_copy(old.rs, src->rs, dst->alloc);
+    dst->es = es_copy(old.es, src->es, dst->alloc);
+    dst->T = old.T;
+    dst->t_cnt = 0;
+    dst->t_size = old.t_size;
+
+    // concurrent mode belongs to dst
+    dst->conc = 0;
+
+    if ((src->M && !dst->M) || (src->dirty && !dst->dirty) ||
+        (src->s_len && !dst->S) || (src->rs && !dst->rs) ||
+        (src->es && !dst->es)) {
+        dst->err = CCARD_ERR_INVALID_CTX;
+        return -1;
+    }
+
+    if (old.conc) {
+        concurrent_prepare(dst);
+        dst->conc = 1;
+    }
+
+    return 0;
+}
+
+int hllp_cnt_load_bytes(hllp_cnt_ctx_t *ctx, const void *buf, uint32_t len)
+{
+    const uint8_t *in = (const uint8_t *)buf;
+    hllp_cnt_ctx_t *tmp;
+    uint32_t epoch;
+    uint8_t width;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    if (ctx->view) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (!in || len <= 3) {
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    if (len == ctx->m + 3 && in[0] == CCARD_ALGO_HYPERLOGLOGPLUS &&
+        in[1] == ctx->hf && in[2] == ctx->log2m && !IS_SPARSE_BMP(in + 3) &&
+        ctx->M && !ctx->rs && !ctx->sparse && !ctx->es) {
+        // normal bitmap of the same shape, overwrite registers in place
+        memcpy(ctx->M, in + 3, ctx->m);
+    } else {
+        tmp = hllp_cnt_init_alloc(in, len, ctx->alloc);
+        if (!tmp) {
+            ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+            return -1;
+        }
+
+        epoch = ctx->epoch;
+        width = ctx->width;
+        if (hllp_cnt_copy_into(ctx, tmp) != 0) {
+            hllp_cnt_fini(tmp);
+            return -1;
+        }
+        hllp_cnt_fini(tmp);
+
+        ctx->epoch = epoch;
+        if (ctx->width != width) {
+            hllp_cnt_pack(ctx, width);
+        }
+    }
+
+    // buckets raised since the last delta are unknown
+    ccard_free(ctx->alloc, ctx->dirty);
+    ctx->dirty = NULL;
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int64_t hllp_cnt_card(hllp_cnt_ctx_t *ctx)
+{
+    double sum = 0, estimate, estimateP, zeros = 0;
+    uint32_t j, z, packed_zeros = 0;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    // Bias correction is suitable for 2^4 to 2^18 buckets
+    if (ctx->log2m < 4 || ctx->log2m > 18) {
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    ctx->err = CCARD_OK;
+
+    if (ctx->es) {
+        // exact count of explicit hash values
+        return ctx->es->count;
+    }
+
+    sparse_flush(ctx);
+    if (ctx->sparse) {
+        // Use Linear Counting with 2^SPARSE_P buckets
+        sum = (double)(1U << SPARSE_P);
+        return (int64_t)round(sum * log(sum / (sum - ctx->s_cnt)));
+    }
+
+    if (ctx->rs) {
+        rs_sum(ctx->rs, &sum, &packed_zeros);
+    } else {
+        for (j = 0; j < ctx->m; j++) {
+            sum += 1.0 / (1 << ctx->M[j]);
+        }
+    }
+
+    estimate = ctx->alphaMM * (1 / sum);
+    if (estimate <= 5 * ctx->m) {
+        estimate = estimate - compute_bias(estimate, ctx->log2m);
+    }
+
+    if (ctx->rs) {
+        zeros = packed_zeros;
+    } else {
+        for (z = 0; z < ctx->m; z++) {
+            if (ctx->M[z] == 0) {
+                zeros++;
+            }
+        }
+    }
+
+    if (zeros > 0) {
+        estimateP = round(ctx->m * log(ctx->m / zeros));
+    } else {
+        estimateP = estimate;
+    }
+
+    if (estimateP <= thresholdData[ctx->log2m - 4]) {
+        // Use Linear Counting
+        return (int64_t)estimateP;
+    }
+
+    // Use Bias-Correncted HyperLogLog Counting
+    return (int64_t)estimate;
+}
+
+int hllp_cnt_offer(hllp_cnt_ctx_t *ctx, const void *buf, uint32_t len)
+{
+    int modified = 0;
+    uint64_t x;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    x = (uint64_t)murmurhash64_no_seed((void *)buf, len);
+    modified = offer_hash(ctx, x);
+
+    // not written unless changed, threads offering concurrently would
+    // otherwise contend on the cache line
+    if (ctx->err != CCARD_OK) {
+        ctx->err = CCARD_OK;
+    }
+    return modified;
+}
+
+int hllp_cnt_get_raw_bytes(hllp_cnt_ctx_t *ctx, void *buf, uint32_t *len)
+{
+    uint8_t *out = (uint8_t *)buf;
+
+    if (!ctx || !len) {
+        return -1;
+    }
+
+    if (ctx->es) {
+        if (out && *len < es_dump(ctx->es, ctx->log2m, NULL)) {
+            return -1;
+        }
+        *len = es_dump(ctx->es, ctx->log2m, out);
+        return 0;
+    }
+
+    sparse_flush(ctx);
+    if (ctx->sparse) {
+        /*
+         +-------+----------------------------------------+
+         | ID[1] | sorted encoded hashes, varint-delta[n] |
+         +-------+----------------------------------------+
+         */
+        if (out && *len < ctx->s_len + 1) {
+            return -1;
+        }
+
+        if (out) {
+            out[0] = MAKE_SPARSE_ID(ctx->log2m);
+            // S isn't allocated until the first value is offered
+            if (ctx->s_len) {
+                memcpy(out + 1, ctx->S, ctx->s_len);
+            }
+        }
+        *len = ctx->s_len + 1;
+
+        return 0;
+    }
+
+    if (out && *len < ctx->m) {
+        return -1;
+    }
+
+    if (out) {
+        copy_registers(ctx, out);
+    }
+    *len = ctx->m;
+
+    return 0;
+}
+
+int hllp_cnt_get_bytes(hllp_cnt_ctx_t *ctx, void *buf, uint32_t *len)
+{
+    /*
+     +--------------+---------+------------------------------+-----------+
+     | algorithm[1] | hash[1] | bitmap length(base-2 log)[1] | bitmap[n] |
+     +--------------+---------+------------------------------+-----------+
+     */
+    uint8_t algo = CCARD_ALGO_HYPERLOGLOGPLUS;
+    uint8_t *out = (uint8_t *)buf;
+    uint32_t blen;
+
+    if (!ctx || !len) {
+        return -1;
+    }
+
+    // bitmap is the same as hllp_cnt_get_raw_bytes
+    blen = buf ? *len - 3 : 0;
+    if ((buf && *len < 3) || hllp_cnt_get_raw_bytes(ctx, buf ? &out[3] : NULL, &blen)) {
+        return -1;
+    }
+
+    if (buf) {
+        out[0] = algo;
+        out[1] = ctx->hf;
+        out[2] = ctx->log2m;
+    }
+    *len = blen + 3;
+
+    return 0;
+}
+
+int hllp_cnt_get_iov(hllp_cnt_ctx_t *ctx, uint8_t *hdr, struct iovec *iov)
+{
+    if (!ctx || !hdr || !iov) {
+        return -1;
+    }
+
+    if (ctx->es || ctx->rs) {
+        // explicit hash values and packed registers are expanded by
+        // hllp_cnt_get_bytes only
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    sparse_flush(ctx);
+
+    hdr[0] = CCARD_ALGO_HYPERLOGLOGPLUS;
+    hdr[1] = ctx->hf;
+    hdr[2] = ctx->log2m;
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = 3;
+    if (ctx->sparse) {
+        // the sorted list is stored without its ID byte
+        hdr[3] = MAKE_SPARSE_ID(ctx->log2m);
+        iov[0].iov_len = 4;
+        iov[1].iov_base = ctx->S;
+        iov[1].iov_len = ctx->s_len;
+    } else {
+        iov[1].iov_base = ctx->M;
+        iov[1].iov_len = ctx->m;
+    }
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int hllp_cnt_get_compressed_bytes(hllp_cnt_ctx_t *ctx, void *buf, uint32_t *len)
+{
+    uint8_t *tmp, mode;
+    uint32_t tlen;
+    int rc;
+
+    if (!ctx || !len || hllp_cnt_get_bytes(ctx, NULL, &tlen)) {
+        return -1;
+    }
+
+    tmp = (uint8_t *)ccard_malloc(ctx->alloc, tlen);
+    if (!tmp) {
+        return -1;
+    }
+    hllp_cnt_get_bytes(ctx, tmp, &tlen);
+    // sparse list is varint-encoded already
+    if (IS_EXPLICIT_BMP(tmp + 3)) {
+        mode = BC_EXPLICIT;
+    } else if (IS_SPARSE_BMP(tmp + 3)) {
+        mode = BC_STORED;
+    } else {
+        mode = BC_REGISTERS;
+    }
+    rc = bc_compress_bytes(tmp, tlen, mode, (uint8_t *)buf, len);
+    ccard_free(ctx->alloc, tmp);
+
+    return rc;
+}
+
+/**
+ * Merge sparse representation got by hllp_cnt_get_raw_bytes to context.
+ * */
+static int merge_sparse_bytes(hllp_cnt_ctx_t *ctx, const uint8_t *in, uint32_t len)
+{
+    uint8_t log2m = K_FROM_ID(in[0]);
+    int64_t n = sparse_validate(in + 1, len - 1);
+
+    if (n < 0 || log2m < 4 || log2m > 18) {
+        return -1;
+    }
+
+    if (log2m < ctx->log2m && hllp_cnt_fold(ctx, log2m)) {
+        // views can't be folded
+        return -1;
+    }
+    sparse_merge_list(ctx, in + 1, len - 1, n);
+
+    return 0;
+}
+
+int hllp_cnt_merge(hllp_cnt_ctx_t *ctx, hllp_cnt_ctx_t *tbm, ...)
+{
+    va_list vl;
+    hllp_cnt_ctx_t *bm;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (tbm) {
+        va_start(vl, tbm);
+        for (bm = tbm; bm != NULL; bm = va_arg(vl, hllp_cnt_ctx_t *)) {
+            /* Cannot merge bitmap of different hash functions or too low
+             * precision */
+            if ((bm->hf != ctx->hf) || (bm->log2m < 4)) {
+                va_end(vl);
+                ctx->err = CCARD_ERR_MERGE_FAILED;
+                return -1;
+            }
+
+            /* Explicit hash values are merged as they are */
+            if (bm->es) {
+                explicit_merge(ctx, bm->es);
+                continue;
+            }
+            if (ctx->es) {
+                explicit_to_registers(ctx);
+            }
+
+            /* Bitmap of different sizes will be folded to the lower one */
+            if (bm->log2m < ctx->log2m && hllp_cnt_fold(ctx, bm->log2m)) {
+                // views can't be folded
+                va_end(vl);
+                return -1;
+            }
+            merge_context(ctx, bm);
+        }
+        va_end(vl);
+    }
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int hllp_cnt_merge_raw_bytes(hllp_cnt_ctx_t *ctx, const void *buf, uint32_t len, ...)
+{
+    va_list vl;
+    const uint8_t *in;
+    int first;
+    uint8_t log2m;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (buf) {
+        va_start(vl, len);
+        for (in = buf, first = 1; in != NULL;
+             in = va_arg(vl, const uint8_t *), first = 0) {
+            if (!first) {
+                len = va_arg(vl, uint32_t);
+            }
+
+            if (len > 0 && IS_EXPLICIT_BMP(in)) {
+                if (es_verify(in, len, 64) == -1) {
+                    va_end(vl);
+                    ctx->err = CCARD_ERR_MERGE_FAILED;
+                    return -1;
+                }
+                explicit_merge_bytes(ctx, in, len);
+                continue;
+            }
+            if (ctx->es) {
+                explicit_to_registers(ctx);
+            }
+
+            if (len > 0 && IS_SPARSE_BMP(in)) {
+                if (merge_sparse_bytes(ctx, in, len)) {
+                    va_end(vl);
+                    ctx->err = CCARD_ERR_MERGE_FAILED;
+                    return -1;
+                }
+                continue;
+            }
+
+            /* Cannot merge bitmap whose length isn't a power of 2 */
+            log2m = num_of_trail_zeros(len);
+            if (len < 16 || len != (uint32_t)(1 << log2m)) {
+                va_end(vl);
+                ctx->err = CCARD_ERR_MERGE_FAILED;
+                return -1;
+            }
+
+            if (log2m < ctx->log2m && hllp_cnt_fold(ctx, log2m)) {
+                // views can't be folded
+                va_end(vl);
+                return -1;
+            }
+            merge_registers(ctx, in, log2m);
+        }
+        va_end(vl);
+    }
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+/**
+ * Merge serialized bytes got by hllp_cnt_get_compressed_bytes to context.
+ * */
+static int merge_compressed_bytes(hllp_cnt_ctx_t *ctx, const uint8_t *in, uint32_t len)
+{
+    uint32_t plen;
+    uint8_t *plain = bc_decompress_bytes(in, len, &plen);
+    int rc = plain ? hllp_cnt_merge_bytes(ctx, plain, plen, NULL) : -1;
+
+    free(plain);
+    return rc;
+}
+
+int hllp_cnt_merge_bytes(hllp_cnt_ctx_t *ctx, const void *buf, uint32_t len, ...)
+{
+    va_list vl;
+    const uint8_t *in;
+    int first;
+    uint8_t log2m;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (buf) {
+        va_start(vl, len);
+        for (in = buf, first = 1; in != NULL;
+             in = va_arg(vl, const uint8_t *), first = 0) {
+            if (!first) {
+                len = va_arg(vl, uint32_t);
+            }
+
+            if (len > 3 && (in[0] & CCARD_FLAG_COMPRESSED)) {
+                if (merge_compressed_bytes(ctx, in, len)) {
+                    va_end(vl);
+                    ctx->err = CCARD_ERR_MERGE_FAILED;
+                    return -1;
+                }
+                continue;
+            }
+
+            if (len > 3 && IS_EXPLICIT_BMP(in + 3)) {
+                if (in[0] != CCARD_ALGO_HYPERLOGLOGPLUS || in[1] != ctx->hf ||
+                    es_verify(in + 3, len - 3, 64) != in[2]) {
+                    va_end(vl);
+                    ctx->err = CCARD_ERR_MERGE_FAILED;
+                    return -1;
+                }
+                explicit_merge_bytes(ctx, in + 3, len - 3);
+                continue;
+            }
+            if (ctx->es) {
+                explicit_to_registers(ctx);
+            }
+
+            if (len > 3 && IS_SPARSE_BMP(in + 3)) {
+                if (in[0] != CCARD_ALGO_HYPERLOGLOGPLUS ||
+                    in[1] != ctx->hf ||
+                    in[2] != K_FROM_ID(in[3]) ||
+                    merge_sparse_bytes(ctx, in + 3, len - 3)) {
+
+                    va_end(vl);
+                    ctx->err = CCARD_ERR_MERGE_FAILED;
+                    return -1;
+                }
+                continue;
+            }
+
+            /* Cannot merge bitmap of invalid sizes,
+            different hash functions or different algorithms */
+            log2m = len > 3 ? num_of_trail_zeros(len - 3) : 0;
+            if ((len < 16 + 3) ||
+                (len - 3 != (uint32_t)(1 << log2m)) ||
+                (in[0] != CCARD_ALGO_HYPERLOGLOGPLUS) ||
+                (in[1] != ctx->hf) ||
+                (in[2] != log2m)) {
+
+                va_end(vl);
+                ctx->err = CCARD_ERR_MERGE_FAILED;
+                return -1;
+            }
+
+            if (log2m < ctx->log2m && hllp_cnt_fold(ctx, log2m)) {
+                // views can't be folded
+                va_end(vl);
+                return -1;
+            }
+            merge_registers(ctx, in + 3, log2m);
+        }
+        va_end(vl);
+    }
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int hllp_cnt_fold(hllp_cnt_ctx_t *ctx, uint8_t new_k)
+{
+    uint8_t d, r, v;
+    uint32_t i, j, n;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    // Bias correction is suitable for 2^4 to 2^18 buckets
+    if (new_k < 4 || new_k > ctx->log2m) {
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    if (new_k < ctx->log2m && ctx->view) {
+        // borrowed bitmap can't be resized
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (ctx->sparse) {
+        // encoded hashes could be decoded with any lower precision
+        ctx->log2m = new_k;
+        ctx->m = 1 << new_k;
+        ctx->alphaMM = calc_alpha_mm(ctx->log2m, ctx->m);
+        sparse_check(ctx);
+        explicit_check(ctx);
+
+        ctx->err = CCARD_OK;
+        return 0;
+    }
+
+    d = ctx->log2m - new_k;
+    n = 1U << d;
+
+    /*
+     * Fold in place. Bucket j of the folded bitmap only depends on original
+     * buckets [j*n, (j+1)*n), which are never before bucket j, so they won't
+     * be overwritten before being read.
+     * */
+    for (j = 0; j < (1U << new_k); j++) {
+        v = 0;
+        for (i = j * n; i < (j + 1) * n; i++) {
+            r = get_register(ctx, i);
+            if (r == 0) {
+                continue;
+            }
+
+            r = fold_register(d, i, r);
+            if (r > v) {
+                v = r;
+            }
+        }
+        put_register(ctx, j, v);
+    }
+
+    if (ctx->rs) {
+        // clear dropped registers sharing words with the remaining ones
+        for (i = 1U << new_k; i < ctx->m; i++) {
+            put_register(ctx, i, 0);
+        }
+        ctx->rs->count = 1U << new_k;
+        ctx->rs->size = (ctx->rs->count + 32 / ctx->rs->width - 1) /
+                        (32 / ctx->rs->width);
+    }
+
+    ctx->log2m = new_k;
+    ctx->m = 1 << new_k;
+
+    // bucket indexes changed, the next delta will be a full one
+    ccard_free(ctx->alloc, ctx->dirty);
+    ctx->dirty = NULL;
+    ctx->alphaMM = calc_alpha_mm(ctx->log2m, ctx->m);
+    explicit_check(ctx);
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int hllp_cnt_get_delta(hllp_cnt_ctx_t *ctx, uint32_t since_epoch, void *buf, uint32_t *len)
+{
+    /*
+     +--------------------+---------+------------------------------+-----------+
+     | algorithm|DELTA[1] | hash[1] | bitmap length(base-2 log)[1] | bitmap[n] |
+     +--------------------+---------+------------------------------+-----------+
+
+     bitmap is a sparse one (see adp_cnt_raw_init) holding only the buckets
+     raised since the given epoch, or a normal one if that is shorter.
+     Explicit bitmap is always a full one.
+     */
+    uint8_t *out = (uint8_t *)buf;
+    uint32_t blen;
+    int full, ret;
+    hllp_cnt_ctx_t dense;
+    struct sparse_iter_s it;
+
+    if (!ctx || !len) {
+        return -1;
+    }
+
+    if (ctx->es) {
+        blen = es_dump(ctx->es, ctx->log2m, NULL);
+        if (out && *len < blen + 3) {
+            return -1;
+        }
+
+        if (out) {
+            out[0] = CCARD_ALGO_HYPERLOGLOGPLUS | CCARD_FLAG_DELTA;
+            out[1] = ctx->hf;
+            out[2] = ctx->log2m;
+            es_dump(ctx->es, ctx->log2m, out + 3);
+            ctx->epoch++;
+        }
+        *len = blen + 3;
+
+        ctx->err = CCARD_OK;
+        return 0;
+    }
+
+    sparse_flush(ctx);
+    if (ctx->sparse) {
+        // modified buckets aren't tracked, take a full delta of the dense
+        // copy instead
+        dense = *ctx;
+        dense.sparse = 0;
+        dense.dirty = NULL;
+        dense.M = (uint8_t *)ccard_calloc(ctx->alloc, 1, ctx->m);
+        sparse_iter_list(&it, ctx->S, ctx->s_len);
+        sparse_merge_registers(&dense, &it);
+
+        ret = hllp_cnt_get_delta(&dense, since_epoch, buf, len);
+        ctx->epoch = dense.epoch;
+        ctx->err = dense.err;
+        ccard_free(ctx->alloc, dense.dirty);
+        ccard_free(ctx->alloc, dense.M);
+        return ret;
+    }
+
+    full = !ctx->dirty || since_epoch != ctx->epoch;
+    blen = delta_encode_sparse(ctx, full, NULL);
+    if (blen >= ctx->m) {
+        blen = ctx->m;
+    }
+
+    if (out && *len < blen + 3) {
+        return -1;
+    }
+
+    if (out) {
+        out[0] = CCARD_ALGO_HYPERLOGLOGPLUS | CCARD_FLAG_DELTA;
+        out[1] = ctx->hf;
+        out[2] = ctx->log2m;
+        if (blen < ctx->m) {
+            delta_encode_sparse(ctx, full, out + 3);
+        } else {
+            copy_registers(ctx, out + 3);
+        }
+
+        // track buckets modified from now on
+        if (ctx->dirty) {
+            memset(ctx->dirty, 0, (ctx->m + 7) / 8);
+        } else {
+            ctx->dirty = (uint8_t *)ccard_calloc(ctx->alloc, 1, (ctx->m + 7) / 8);
+        }
+        ctx->epoch++;
+    }
+    *len = blen + 3;
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int hllp_cnt_apply_delta(hllp_cnt_ctx_t *ctx, const void *buf, uint32_t len)
+{
+    const uint8_t *in = (const uint8_t *)buf;
+    uint8_t log2m, sidx_len, r;
+    uint32_t i, idx;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    /* Cannot apply delta of invalid sizes,
+    different hash functions or different algorithms */
+    if (!in || len <= 3 ||
+        in[0] != (CCARD_ALGO_HYPERLOGLOGPLUS | CCARD_FLAG_DELTA) ||
+        in[1] != ctx->hf ||
+        in[2] < 4 || in[2] > 31) {
+
+        ctx->err = CCARD_ERR_MERGE_FAILED;
+        return -1;
+    }
+
+    log2m = in[2];
+    if (IS_EXPLICIT_BMP(in + 3)) {
+        if (es_verify(in + 3, len - 3, 64) != log2m) {
+            ctx->err = CCARD_ERR_MERGE_FAILED;
+            return -1;
+        }
+        explicit_merge_bytes(ctx, in + 3, len - 3);
+
+        ctx->err = CCARD_OK;
+        return 0;
+    }
+
+    if (ctx->es) {
+        explicit_to_registers(ctx);
+    }
+    if (ctx->sparse) {
+        sparse_to_dense(ctx);
+    }
+    if (!IS_SPARSE_BMP(in + 3)) {
+        // normal bitmap
+        if (len - 3 != (uint32_t)(1 << log2m)) {
+            ctx->err = CCARD_ERR_MERGE_FAILED;
+            return -1;
+        }
+
+        if (log2m < ctx->log2m && hllp_cnt_fold(ctx, log2m)) {
+            // views can't be folded
+            return -1;
+        }
+        merge_registers(ctx, in + 3, log2m);
+
+        ctx->err = CCARD_OK;
+        return 0;
+    }
+
+    // sparse bitmap, validate all buckets before merging any of them
+    sidx_len = (log2m + 7) / 8;
+    if (K_FROM_ID(in[3]) != log2m || (len - 4) % (sidx_len + 1) != 0) {
+        ctx->err = CCARD_ERR_MERGE_FAILED;
+        return -1;
+    }
+    for (i = 4; i < len; i += sidx_len + 1) {
+        idx = sparse_bytes_to_int(in, i + 1, sidx_len);
+        if (idx >= (1U << log2m)) {
+            ctx->err = CCARD_ERR_MERGE_FAILED;
+            return -1;
+        }
+    }
+
+    if (log2m < ctx->log2m && hllp_cnt_fold(ctx, log2m)) {
+        // views can't be folded
+        return -1;
+    }
+    for (i = 4; i < len; i += sidx_len + 1) {
+        idx = sparse_bytes_to_int(in, i + 1, sidx_len);
+        r = in[i];
+        if (log2m > ctx->log2m) {
+            r = fold_register(log2m - ctx->log2m, idx, r);
+            idx >>= log2m - ctx->log2m;
+        }
+        set_register(ctx, idx, r);
+    }
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int64_t hllp_cnt_epoch(hllp_cnt_ctx_t *ctx)
+{
+    if (!ctx) {
+        return -1;
+    }
+
+    ctx->err = CCARD_OK;
+    return ctx->epoch;
+}
+
+int hllp_cnt_pack(hllp_cnt_ctx_t *ctx, uint8_t width)
+{
+    reg_set_t *rs = NULL;
+    uint8_t *M = NULL;
+    uint8_t r;
+    uint32_t j;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    if (width != 5 && width != 6 && width != 8) {
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    if (ctx->view && width != 8) {
+        // borrowed bitmap can't be packed
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (ctx->conc && width != 8) {
+        // packed registers can't be raised atomically
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    ctx->width = width;
+    explicit_check(ctx);
+    if (ctx->sparse) {
+        // applied when converted to dense
+        ctx->err = CCARD_OK;
+        return 0;
+    }
+
+    if (width == (ctx->rs ? ctx->rs->width : 8)) {
+        ctx->err = CCARD_OK;
+        return 0;
+    }
+
+    if (width == 8) {
+        M = (uint8_t *)ccard_malloc(ctx->alloc, ctx->m);
+        copy_registers(ctx, M);
+    } else {
+        rs = rs_init_alloc(ctx->m, width, NULL, 0, ctx->alloc);
+        for (j = 0; j < ctx->m; j++) {
+            r = get_register(ctx, j);
+            // saturate values exceeding register width
+            rs_set(rs, j, r < (1 << width) ? r : (1 << width) - 1);
+        }
+    }
+
+    ccard_free(ctx->alloc, ctx->M);
+    rs_fini(ctx->rs);
+    ctx->M = M;
+    ctx->rs = rs;
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int hllp_cnt_reset(hllp_cnt_ctx_t *ctx)
+{
+    if (!ctx) {
+        return -1;
+    }
+
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    ctx->err = CCARD_OK;
+    if (ctx->es) {
+        es_reset(ctx->es);
+    }
+    if (ctx->sparse) {
+        ccard_free(ctx->alloc, ctx->S);
+        ctx->S = NULL;
+        ctx->s_len = ctx->s_cnt = 0;
+        ctx->t_cnt = 0;
+    } else if (ctx->rs) {
+        memset(ctx->rs->M, 0, sizeof(uint32_t) * ctx->rs->size);
+    } else {
+        memset(ctx->M, 0, ctx->m);
+    }
+
+    return 0;
+}
+
+int hllp_cnt_set_concurrent(hllp_cnt_ctx_t *ctx, int on)
+{
+    if (!ctx) {
+        return -1;
+    }
+
+    if (ctx->view) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    ctx->conc = 0;
+    if (on) {
+        if (concurrent_prepare(ctx) != 0) {
+            return -1;
+        }
+        ctx->conc = 1;
+    }
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int hllp_cnt_fini(hllp_cnt_ctx_t *ctx)
+{
+    if (ctx) {
+        ccard_free(ctx->alloc, ctx->dirty);
+        if (!ctx->view) {
+            ccard_free(ctx->alloc, ctx->M);
+        }
+        rs_fini(ctx->rs);
+        ccard_free(ctx->alloc, ctx->S);
+        ccard_free(ctx->alloc, ctx->T);
+        es_fini(ctx->es);
+        ccard_free(ctx->alloc, ctx);
+        return 0;
+    }
+
+    return -1;
+}
+
+int hllp_cnt_errnum(hllp_cnt_ctx_t *ctx)
+{
+    if (ctx) {
         return ctx->err;
     }
 
@@ -601,6 +2134,9 @@ const char *hllp_cnt_errstr(int err)
         "Invalid algorithm context",
         "Merge bitmap failed",
         "Invalid argument",
+        "I/O error",
+        "Not allowed on view",
+        "Out of memory",
         NULL
     };
 
@@ -611,4 +2147,46 @@ const char *hllp_cnt_errstr(int err)
     return "Invalid error number";
 }
 
+static void *hllp_algo_raw_init(const void *buf, uint32_t len_or_k, uint8_t opt)
+{
+    // HyperLogLog++ always uses 64-bit murmurhash, only sparse and register
+    // width options are accepted
+    return hllp_cnt_raw_init_opt(buf, len_or_k, opt);
+}
+
+static void *hllp_algo_init(const void *buf, uint32_t len_or_k, uint8_t opt)
+{
+    hllp_cnt_ctx_t *ctx;
+
+    if (!buf) {
+        return hllp_cnt_raw_init_opt(NULL, len_or_k, opt);
+    }
+
+    ctx = hllp_cnt_init(buf, len_or_k);
+    if (ctx) {
+        hllp_cnt_pack(ctx, opt_width(opt));
+    }
+    return ctx;
+}
+
+static ccard_algo_t hllp_algo_def = {
+    .raw_init = hllp_algo_raw_init,
+    .init = hllp_algo_init,
+    .card = (int64_t (*)(void *))hllp_cnt_card,
+    .offer = (int (*)(void *, const void *, uint32_t))hllp_cnt_offer,
+    .reset = (int (*)(void *))hllp_cnt_reset,
+    .get_raw_bytes = (int (*)(void *, void *, uint32_t *))hllp_cnt_get_raw_bytes,
+    .get_bytes = (int (*)(void *, void *, uint32_t *))hllp_cnt_get_bytes,
+    .merge = (int (*)(void *, void *, ...))hllp_cnt_merge,
+    .merge_raw_bytes = (int (*)(void *, const void *, uint32_t, ...))hllp_cnt_merge_raw_bytes,
+    .merge_bytes = (int (*)(void *, const void *, uint32_t, ...))hllp_cnt_merge_bytes,
+    .fini = (int (*)(void *))hllp_cnt_fini,
+    .errnum = (int (*)(void *))hllp_cnt_errnum,
+    .errstr = hllp_cnt_errstr,
+    .raw_init_alloc = (void *(*)(const void *, uint32_t, uint8_t,
+                                 const ccard_allocator_t *))hllp_cnt_raw_init_alloc
+};
+
+ccard_algo_t *hllp_algo = &hllp_algo_def;
+
 // vi:ft=c ts=4 sw=4 fdm=marker et
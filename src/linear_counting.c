@@ -5,6 +5,8 @@
 #include <math.h>
 #include "murmurhash.h"
 #include "lookup3hash.h"
+#include "bitmap_codec.h"
+#include "block_epoch.h"
 #include "linear_counting.h"
 
 struct lnr_cnt_ctx_s {
@@ -13,9 +15,28 @@ struct lnr_cnt_ctx_s {
     uint32_t length;
     uint32_t count;
     uint8_t hf;
-    uint8_t M[1];
+    uint8_t view;       // VIEW_* if M is borrowed from caller
+    uint8_t *M;         // bitmap, follows the context unless it's a view
+    const ccard_allocator_t *alloc; // allocator of the context
+    blk_epoch_t *be;    // block stamps if reset is lazy, see
+                        // lnr_cnt_set_lazy_reset
 };
 
+// context views, see lnr_cnt_view_init
+enum {
+    VIEW_NONE,
+    VIEW_RDONLY,
+    VIEW_WRITABLE
+};
+
+// Clear blocks left stale by lazy reset, before the bitmap is read as a whole
+static void lazy_flush(lnr_cnt_ctx_t *ctx)
+{
+    if (ctx->be) {
+        be_flush(ctx->be, ctx->M);
+    }
+}
+
 static uint8_t count_ones(uint8_t b)
 {
     uint8_t ones = 0;
@@ -41,6 +62,12 @@ static uint8_t calc_log2m(uint32_t m)
 }
 
 lnr_cnt_ctx_t *lnr_cnt_raw_init(const void *obuf, uint32_t len_or_k, uint8_t hf)
+{
+    return lnr_cnt_raw_init_alloc(obuf, len_or_k, hf, ccard_get_allocator());
+}
+
+lnr_cnt_ctx_t *lnr_cnt_raw_init_alloc(const void *obuf, uint32_t len_or_k, uint8_t hf,
+                                      const ccard_allocator_t *alloc)
 {
     lnr_cnt_ctx_t *ctx;
     uint8_t *buf = (uint8_t *)obuf;
@@ -51,6 +78,10 @@ lnr_cnt_ctx_t *lnr_cnt_raw_init(const void *obuf, uint32_t len_or_k, uint8_t hf)
         return NULL;
     }
 
+    if (!alloc) {
+        alloc = ccard_get_allocator();
+    }
+
     if (buf) {
         // initial bitmap was given
         if ((len_or_k & (len_or_k - 1)) != 0) {
@@ -58,7 +89,11 @@ lnr_cnt_ctx_t *lnr_cnt_raw_init(const void *obuf, uint32_t len_or_k, uint8_t hf)
             return NULL;
         }
 
-        ctx = (lnr_cnt_ctx_t *)malloc(sizeof(lnr_cnt_ctx_t) + len_or_k - 1);
+        ctx = (lnr_cnt_ctx_t *)ccard_malloc(alloc, sizeof(lnr_cnt_ctx_t) + len_or_k);
+        if (!ctx) {
+            return NULL;
+        }
+        ctx->M = (uint8_t *)(ctx + 1);
         ctx->m = len_or_k;
         ctx->length = 8 * ctx->m;
         ctx->count = ctx->length;
@@ -69,7 +104,11 @@ lnr_cnt_ctx_t *lnr_cnt_raw_init(const void *obuf, uint32_t len_or_k, uint8_t hf)
         }
     } else {
         // k was given
-        ctx = (lnr_cnt_ctx_t *)malloc(sizeof(lnr_cnt_ctx_t) + (1 << len_or_k) - 1);
+        ctx = (lnr_cnt_ctx_t *)ccard_malloc(alloc, sizeof(lnr_cnt_ctx_t) + (1 << len_or_k));
+        if (!ctx) {
+            return NULL;
+        }
+        ctx->M = (uint8_t *)(ctx + 1);
         ctx->m = (1 << len_or_k);
         ctx->length = 8 * ctx->m;
         ctx->count = ctx->length;
@@ -77,11 +116,20 @@ lnr_cnt_ctx_t *lnr_cnt_raw_init(const void *obuf, uint32_t len_or_k, uint8_t hf)
     }
     ctx->err = CCARD_OK;
     ctx->hf = hf;
+    ctx->view = VIEW_NONE;
+    ctx->alloc = alloc;
+    ctx->be = NULL;
 
     return ctx;
 }
 
 lnr_cnt_ctx_t *lnr_cnt_init(const void *obuf, uint32_t len_or_k, uint8_t hf)
+{
+    return lnr_cnt_init_alloc(obuf, len_or_k, hf, ccard_get_allocator());
+}
+
+lnr_cnt_ctx_t *lnr_cnt_init_alloc(const void *obuf, uint32_t len_or_k, uint8_t hf,
+                                  const ccard_allocator_t *alloc)
 {
     uint8_t *buf = (uint8_t *)obuf;
 
@@ -91,6 +139,16 @@ lnr_cnt_ctx_t *lnr_cnt_init(const void *obuf, uint32_t len_or_k, uint8_t hf)
             return NULL;
         }
 
+        if (buf[0] & CCARD_FLAG_COMPRESSED) {
+            // compressed bitmap, initialize with the decoded one
+            uint32_t plen;
+            uint8_t *plain = bc_decompress_bytes(buf, len_or_k, &plen);
+            lnr_cnt_ctx_t *ctx = plain ? lnr_cnt_init_alloc(plain, plen, hf, alloc) : NULL;
+
+            free(plain);
+            return ctx;
+        }
+
         uint32_t data_segment_size = len_or_k - 3;
         uint8_t log2m = calc_log2m(data_segment_size);
 
@@ -102,10 +160,146 @@ lnr_cnt_ctx_t *lnr_cnt_init(const void *obuf, uint32_t len_or_k, uint8_t hf)
             return NULL;
         }
 
-        return lnr_cnt_raw_init(buf + 3, data_segment_size, hf);
+        return lnr_cnt_raw_init_alloc(buf + 3, data_segment_size, hf, alloc);
+    }
+
+    return lnr_cnt_raw_init_alloc(NULL, len_or_k, hf, alloc);
+}
+
+lnr_cnt_ctx_t *lnr_cnt_view_init(const void *obuf, uint32_t len, uint8_t flags)
+{
+    lnr_cnt_ctx_t *ctx;
+    uint8_t *buf = (uint8_t *)obuf;
+    uint32_t i, m = len - 3;
+
+    if (!buf || len <= 3 || (m & (m - 1)) != 0 ||
+        buf[0] != CCARD_ALGO_LINEAR || buf[2] != calc_log2m(m)) {
+        // only normal serialized bitmap could be borrowed
+        return NULL;
+    }
+
+    ctx = (lnr_cnt_ctx_t *)ccard_malloc(NULL, sizeof(lnr_cnt_ctx_t));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->alloc = ccard_get_allocator();
+    ctx->M = buf + 3;
+    ctx->m = m;
+    ctx->length = 8 * m;
+    ctx->count = ctx->length;
+    for (i = 0; i < m; i++) {
+        ctx->count -= count_ones(ctx->M[i]);
+    }
+    ctx->err = CCARD_OK;
+    ctx->hf = buf[1];
+    ctx->view = (flags & CCARD_VIEW_WRITABLE) ? VIEW_WRITABLE : VIEW_RDONLY;
+    ctx->be = NULL;
+
+    return ctx;
+}
+
+lnr_cnt_ctx_t *lnr_cnt_clone(lnr_cnt_ctx_t *src)
+{
+    lnr_cnt_ctx_t *ctx;
+
+    if (!src) {
+        return NULL;
+    }
+
+    ctx = (lnr_cnt_ctx_t *)ccard_malloc(src->alloc, sizeof(lnr_cnt_ctx_t) + src->m);
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->M = (uint8_t *)(ctx + 1);
+    ctx->m = src->m;
+    ctx->view = VIEW_NONE;
+    ctx->alloc = src->alloc;
+    ctx->be = NULL;
+    lnr_cnt_copy_into(ctx, src);
+
+    return ctx;
+}
+
+int lnr_cnt_copy_into(lnr_cnt_ctx_t *dst, lnr_cnt_ctx_t *src)
+{
+    if (!dst || !src) {
+        return -1;
+    }
+
+    if (dst->view) {
+        dst->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (dst->m != src->m) {
+        // bitmap follows the context, it can't be resized
+        dst->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    dst->err = CCARD_OK;
+    if (dst == src) {
+        return 0;
+    }
+
+    lazy_flush(src);
+    memcpy(dst->M, src->M, src->m);
+    dst->length = src->length;
+    dst->count = src->count;
+    dst->hf = src->hf;
+    if (dst->be) {
+        be_sync(dst->be);
     }
 
-    return lnr_cnt_raw_init(NULL, len_or_k, hf);
+    return 0;
+}
+
+int lnr_cnt_load_bytes(lnr_cnt_ctx_t *ctx, const void *buf, uint32_t len)
+{
+    const uint8_t *in = (const uint8_t *)buf;
+    uint32_t i;
+
+    if (!ctx) {
+        return -1;
+    }
+
+    if (ctx->view) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    if (in && len > 3 && (in[0] & CCARD_FLAG_COMPRESSED)) {
+        // compressed bitmap, load the decoded one
+        uint32_t plen;
+        uint8_t *plain = bc_decompress_bytes(in, len, &plen);
+        int rc;
+
+        if (!plain) {
+            ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+            return -1;
+        }
+        rc = lnr_cnt_load_bytes(ctx, plain, plen);
+        free(plain);
+        return rc;
+    }
+
+    if (!in || len != ctx->m + 3 || in[0] != CCARD_ALGO_LINEAR ||
+        in[1] != ctx->hf || in[2] != calc_log2m(ctx->m)) {
+        ctx->err = CCARD_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    memcpy(ctx->M, in + 3, ctx->m);
+    if (ctx->be) {
+        be_sync(ctx->be);
+    }
+    ctx->count = ctx->length;
+    for (i = 0; i < ctx->m; i++) {
+        ctx->count -= count_ones(ctx->M[i]);
+    }
+
+    ctx->err = CCARD_OK;
+    return 0;
 }
 
 int64_t lnr_cnt_card(lnr_cnt_ctx_t *ctx)
@@ -128,6 +322,11 @@ int lnr_cnt_offer(lnr_cnt_ctx_t *ctx, const void *buf, uint32_t len)
         return -1;
     }
 
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
     switch (ctx->hf) {
         case CCARD_HASH_LOOKUP3:
             hash = lookup3ycs64_2((const char *)buf);
@@ -140,6 +339,9 @@ int lnr_cnt_offer(lnr_cnt_ctx_t *ctx, const void *buf, uint32_t len)
 
     bit = (uint32_t)((hash & 0xFFFFFFFF) % (uint64_t)ctx->length);
     i = bit / 8;
+    if (ctx->be) {
+        be_touch(ctx->be, ctx->M, i);
+    }
     b = ctx->M[i];
     mask = (uint8_t)(1 << (bit % 8));
     if ((mask & b) == 0) {
@@ -161,6 +363,7 @@ int lnr_cnt_get_raw_bytes(lnr_cnt_ctx_t *ctx, void *buf, uint32_t *len)
     }
 
     if (buf) {
+        lazy_flush(ctx);
         memcpy(out, ctx->M, ctx->m);
     }
     *len = ctx->m;
@@ -187,6 +390,7 @@ int lnr_cnt_get_bytes(lnr_cnt_ctx_t *ctx, void *buf, uint32_t *len)
         out[0] = algo;
         out[1] = ctx->hf;
         out[2] = log2m;
+        lazy_flush(ctx);
         memcpy(&out[3], ctx->M, ctx->m);
     }
     *len = ctx->m + 3;
@@ -194,44 +398,90 @@ int lnr_cnt_get_bytes(lnr_cnt_ctx_t *ctx, void *buf, uint32_t *len)
     return 0;
 }
 
+int lnr_cnt_get_iov(lnr_cnt_ctx_t *ctx, uint8_t *hdr, struct iovec *iov)
+{
+    if (!ctx || !hdr || !iov) {
+        return -1;
+    }
+
+    lazy_flush(ctx);
+
+    hdr[0] = CCARD_ALGO_LINEAR;
+    hdr[1] = ctx->hf;
+    hdr[2] = calc_log2m(ctx->m);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = 3;
+    iov[1].iov_base = ctx->M;
+    iov[1].iov_len = ctx->m;
+
+    ctx->err = CCARD_OK;
+    return 0;
+}
+
+int lnr_cnt_get_compressed_bytes(lnr_cnt_ctx_t *ctx, void *buf, uint32_t *len)
+{
+    uint8_t *tmp;
+    uint32_t tlen;
+    int rc;
+
+    if (!ctx || !len || lnr_cnt_get_bytes(ctx, NULL, &tlen)) {
+        return -1;
+    }
+
+    tmp = (uint8_t *)ccard_malloc(ctx->alloc, tlen);
+    if (!tmp) {
+        return -1;
+    }
+    lnr_cnt_get_bytes(ctx, tmp, &tlen);
+    rc = bc_compress_bytes(tmp, tlen, BC_BITS, (uint8_t *)buf, len);
+    ccard_free(ctx->alloc, tmp);
+
+    return rc;
+}
+
+/**
+ * Merge raw bitmap to context and update the number of empty bits.
+ * */
+static void merge_bitmap(lnr_cnt_ctx_t *ctx, const uint8_t *M)
+{
+    uint32_t i;
+
+    lazy_flush(ctx);
+    ctx->count = ctx->length;
+    for (i = 0; i < ctx->m; i++) {
+        ctx->M[i] |= M[i];
+        ctx->count -= count_ones(ctx->M[i]);
+    }
+}
+
 int lnr_cnt_merge(lnr_cnt_ctx_t *ctx, lnr_cnt_ctx_t *tbm, ...)
 {
     va_list vl;
     lnr_cnt_ctx_t *bm;
-    uint32_t i;
 
     if (!ctx) {
         return -1;
     }
 
-    if (tbm) {
-        /* Cannot merge bitmap of different sizes or different hash functions */
-        if ((tbm->m != ctx->m) || (tbm->hf != ctx->hf)) {
-            ctx->err = CCARD_ERR_MERGE_FAILED;
-            return -1;
-        }
-
-        for (i = 0; i < ctx->m; i++) {
-            ctx->M[i] |= tbm->M[i];
-        }
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
 
+    if (tbm) {
         va_start(vl, tbm);
-        while ((bm = va_arg(vl, lnr_cnt_ctx_t *)) != NULL) {
-            if ((tbm->m != ctx->m) || (tbm->hf != ctx->hf)) {
+        for (bm = tbm; bm != NULL; bm = va_arg(vl, lnr_cnt_ctx_t *)) {
+            /* Cannot merge bitmap of different sizes or different hash functions */
+            if ((bm->m != ctx->m) || (bm->hf != ctx->hf)) {
+                va_end(vl);
                 ctx->err = CCARD_ERR_MERGE_FAILED;
                 return -1;
             }
 
-            for (i = 1; i < ctx->m; i++) {
-                ctx->M[i] |= tbm->M[i];
-            }
+            lazy_flush(bm);
+            merge_bitmap(ctx, bm->M);
         }
         va_end(vl);
-
-        ctx->count = ctx->length;
-        for (i = 0; i < ctx->m; i++) {
-            ctx->count -= count_ones(ctx->M[i]);
-        }
     }
 
     ctx->err = CCARD_OK;
@@ -241,37 +491,34 @@ int lnr_cnt_merge(lnr_cnt_ctx_t *ctx, lnr_cnt_ctx_t *tbm, ...)
 int lnr_cnt_merge_raw_bytes(lnr_cnt_ctx_t *ctx, const void *buf, uint32_t len, ...)
 {
     va_list vl;
-    uint8_t *in;
-    lnr_cnt_ctx_t *bctx;
+    const uint8_t *in;
+    int first;
 
     if (!ctx) {
         return -1;
     }
 
-    if (buf) {
-        in = (uint8_t *)buf;
-        /* Cannot merge bitmap of different sizes */
-        if (ctx->m != len) {
-            ctx->err = CCARD_ERR_MERGE_FAILED;
-            return -1;
-        }
-
-        bctx = lnr_cnt_raw_init(in, ctx->m, ctx->hf);
-        lnr_cnt_merge(ctx, bctx, NULL);
-        lnr_cnt_fini(bctx);
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
 
+    if (buf) {
         va_start(vl, len);
-        while ((in = (uint8_t *)va_arg(vl, const void *)) != NULL) {
-            len = va_arg(vl, uint32_t);
+        for (in = buf, first = 1; in != NULL;
+             in = va_arg(vl, const uint8_t *), first = 0) {
+            if (!first) {
+                len = va_arg(vl, uint32_t);
+            }
 
+            /* Cannot merge bitmap of different sizes */
             if (ctx->m != len) {
+                va_end(vl);
                 ctx->err = CCARD_ERR_MERGE_FAILED;
                 return -1;
             }
 
-            bctx = lnr_cnt_raw_init(in, ctx->m, ctx->hf);
-            lnr_cnt_merge(ctx, bctx, NULL);
-            lnr_cnt_fini(bctx);
+            merge_bitmap(ctx, in);
         }
         va_end(vl);
     }
@@ -280,47 +527,63 @@ int lnr_cnt_merge_raw_bytes(lnr_cnt_ctx_t *ctx, const void *buf, uint32_t len, .
     return 0;
 }
 
+/**
+ * Merge serialized bytes got by lnr_cnt_get_compressed_bytes to context.
+ * */
+static int merge_compressed_bytes(lnr_cnt_ctx_t *ctx, const uint8_t *in, uint32_t len)
+{
+    uint32_t plen;
+    uint8_t *plain = bc_decompress_bytes(in, len, &plen);
+    int rc = plain ? lnr_cnt_merge_bytes(ctx, plain, plen, NULL) : -1;
+
+    free(plain);
+    return rc;
+}
+
 int lnr_cnt_merge_bytes(lnr_cnt_ctx_t *ctx, const void *buf, uint32_t len, ...)
 {
     va_list vl;
-    uint8_t *in;
-    lnr_cnt_ctx_t *bctx;
+    const uint8_t *in;
+    int first;
 
     if (!ctx) {
         return -1;
     }
 
-    if (buf) {
-        in = (uint8_t *)buf;
-        /* Cannot merge bitmap of different sizes,
-        different hash functions or different algorithms */
-        if ((ctx->m + 3 != len) ||
-            (in[0] != CCARD_ALGO_LINEAR) ||
-            (in[1] != ctx->hf)) {
-
-            ctx->err = CCARD_ERR_MERGE_FAILED;
-            return -1;
-        }
-
-        bctx = lnr_cnt_init(in, len, ctx->hf);
-        lnr_cnt_merge(ctx, bctx, NULL);
-        lnr_cnt_fini(bctx);
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
 
+    if (buf) {
         va_start(vl, len);
-        while ((in = (uint8_t *)va_arg(vl, const void *)) != NULL) {
-            len = va_arg(vl, uint32_t);
+        for (in = buf, first = 1; in != NULL;
+             in = va_arg(vl, const uint8_t *), first = 0) {
+            if (!first) {
+                len = va_arg(vl, uint32_t);
+            }
+
+            if (len > 3 && (in[0] & CCARD_FLAG_COMPRESSED)) {
+                if (merge_compressed_bytes(ctx, in, len)) {
+                    va_end(vl);
+                    ctx->err = CCARD_ERR_MERGE_FAILED;
+                    return -1;
+                }
+                continue;
+            }
 
+            /* Cannot merge bitmap of different sizes,
+            different hash functions or different algorithms */
             if ((ctx->m + 3 != len) ||
                 (in[0] != CCARD_ALGO_LINEAR) ||
                 (in[1] != ctx->hf)) {
 
+                va_end(vl);
                 ctx->err = CCARD_ERR_MERGE_FAILED;
                 return -1;
             }
 
-            bctx = lnr_cnt_init(in, len, ctx->hf);
-            lnr_cnt_merge(ctx, bctx, NULL);
-            lnr_cnt_fini(bctx);
+            merge_bitmap(ctx, in + 3);
         }
         va_end(vl);
     }
@@ -335,9 +598,45 @@ int lnr_cnt_reset(lnr_cnt_ctx_t *ctx)
         return -1;
     }
 
+    if (ctx->view == VIEW_RDONLY) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
     ctx->count = ctx->length;
     ctx->err = CCARD_OK;
-    memset(ctx->M, 0, ctx->m);
+    if (ctx->be) {
+        be_reset(ctx->be, ctx->M);
+    } else {
+        memset(ctx->M, 0, ctx->m);
+    }
+
+    return 0;
+}
+
+int lnr_cnt_set_lazy_reset(lnr_cnt_ctx_t *ctx, int on)
+{
+    if (!ctx) {
+        return -1;
+    }
+
+    if (ctx->view) {
+        ctx->err = CCARD_ERR_VIEW;
+        return -1;
+    }
+
+    ctx->err = CCARD_OK;
+    if (on && !ctx->be) {
+        ctx->be = be_init(ctx->m, ctx->alloc);
+        if (!ctx->be) {
+            ctx->err = CCARD_ERR_INVALID_CTX;
+            return -1;
+        }
+    } else if (!on && ctx->be) {
+        lazy_flush(ctx);
+        be_fini(ctx->be);
+        ctx->be = NULL;
+    }
 
     return 0;
 }
@@ -345,7 +644,8 @@ int lnr_cnt_reset(lnr_cnt_ctx_t *ctx)
 int lnr_cnt_fini(lnr_cnt_ctx_t *ctx)
 {
     if (ctx) {
-        free(ctx);
+        be_fini(ctx->be);
+        ccard_free(ctx->alloc, ctx);
         return 0;
     }
 
@@ -367,6 +667,10 @@ const char *lnr_cnt_errstr(int err)
         "No error",
         "Invalid algorithm context",
         "Merge bitmap failed",
+        "Invalid argument",
+        "I/O error",
+        "Not allowed on view",
+        "Out of memory",
         NULL
     };
 
@@ -377,5 +681,25 @@ const char *lnr_cnt_errstr(int err)
     return "Invalid error number";
 }
 
+static ccard_algo_t lnr_algo_def = {
+    .raw_init = (void *(*)(const void *, uint32_t, uint8_t))lnr_cnt_raw_init,
+    .init = (void *(*)(const void *, uint32_t, uint8_t))lnr_cnt_init,
+    .card = (int64_t (*)(void *))lnr_cnt_card,
+    .offer = (int (*)(void *, const void *, uint32_t))lnr_cnt_offer,
+    .reset = (int (*)(void *))lnr_cnt_reset,
+    .get_raw_bytes = (int (*)(void *, void *, uint32_t *))lnr_cnt_get_raw_bytes,
+    .get_bytes = (int (*)(void *, void *, uint32_t *))lnr_cnt_get_bytes,
+    .merge = (int (*)(void *, void *, ...))lnr_cnt_merge,
+    .merge_raw_bytes = (int (*)(void *, const void *, uint32_t, ...))lnr_cnt_merge_raw_bytes,
+    .merge_bytes = (int (*)(void *, const void *, uint32_t, ...))lnr_cnt_merge_bytes,
+    .fini = (int (*)(void *))lnr_cnt_fini,
+    .errnum = (int (*)(void *))lnr_cnt_errnum,
+    .errstr = lnr_cnt_errstr,
+    .raw_init_alloc = (void *(*)(const void *, uint32_t, uint8_t,
+                                 const ccard_allocator_t *))lnr_cnt_raw_init_alloc
+};
+
+ccard_algo_t *lnr_algo = &lnr_algo_def;
+
 // vi:ft=c ts=4 sw=4 fdm=marker et
 
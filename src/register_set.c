@@ -5,87 +5,228 @@
 #include <math.h>
 #include "register_set.h"
 
-static const uint32_t LOG2_BITS_PER_WORD = 6;
-
-static const uint32_t REGISTER_SIZE = 5;
+/* stream-lib compatible register width */
+static const uint8_t REGISTER_SIZE = 5;
+
+/* 2^-v for small register values */
+static const double POW_2_NEG[64] = {
+    0x1p-0, 0x1p-1, 0x1p-2, 0x1p-3, 0x1p-4, 0x1p-5, 0x1p-6, 0x1p-7,
+    0x1p-8, 0x1p-9, 0x1p-10, 0x1p-11, 0x1p-12, 0x1p-13, 0x1p-14, 0x1p-15,
+    0x1p-16, 0x1p-17, 0x1p-18, 0x1p-19, 0x1p-20, 0x1p-21, 0x1p-22, 0x1p-23,
+    0x1p-24, 0x1p-25, 0x1p-26, 0x1p-27, 0x1p-28, 0x1p-29, 0x1p-30, 0x1p-31,
+    0x1p-32, 0x1p-33, 0x1p-34, 0x1p-35, 0x1p-36, 0x1p-37, 0x1p-38, 0x1p-39,
+    0x1p-40, 0x1p-41, 0x1p-42, 0x1p-43, 0x1p-44, 0x1p-45, 0x1p-46, 0x1p-47,
+    0x1p-48, 0x1p-49, 0x1p-50, 0x1p-51, 0x1p-52, 0x1p-53, 0x1p-54, 0x1p-55,
+    0x1p-56, 0x1p-57, 0x1p-58, 0x1p-59, 0x1p-60, 0x1p-61, 0x1p-62, 0x1p-63
+};
+
+static uint32_t rs_regs_per_word(uint8_t width)
+{
+    return 32 / width;
+}
 
-static uint32_t rs_getbits(uint32_t count)
+static uint32_t rs_words(uint32_t count, uint8_t width)
 {
-    return (uint32_t)floor(count / LOG2_BITS_PER_WORD);
+    uint32_t per = rs_regs_per_word(width);
+
+    return count == 0 ? 1 : (count + per - 1) / per;
 }
 
 reg_set_t *rs_init(uint32_t count, uint32_t *values, uint32_t len)
 {
-    uint32_t bits = rs_getbits(count);
+    return rs_init_width(count, REGISTER_SIZE, values, len);
+}
+
+reg_set_t *rs_init_width(uint32_t count, uint8_t width,
+                         const uint32_t *values, uint32_t len)
+{
+    return rs_init_alloc(count, width, values, len, NULL);
+}
+
+reg_set_t *rs_init_alloc(uint32_t count, uint8_t width,
+                         const uint32_t *values, uint32_t len,
+                         const ccard_allocator_t *alloc)
+{
+    uint32_t size;
     reg_set_t *rs;
 
+    if (width == 0 || width > 8) {
+        return NULL;
+    }
+
+    size = rs_words(count, width);
+    if (values && len > size) {
+        return NULL;
+    }
+
+    if (!alloc) {
+        alloc = ccard_get_allocator();
+    }
+
+    rs = (reg_set_t *)ccard_malloc(alloc, sizeof(reg_set_t)
+                                   + sizeof(uint32_t) * (size - 1));
+    if (!rs) {
+        return NULL;
+    }
+    memset(rs->M, 0, sizeof(uint32_t) * size);
     if (values) {
-        rs = (reg_set_t *)malloc(sizeof(reg_set_t) + sizeof(uint32_t) * len - 1);
-        memcpy(rs->M, values, len);
-        rs->size = len;
-    } else {
-        if (bits == 0) {
-            rs = (reg_set_t *)malloc(sizeof(reg_set_t));
-            memset(rs->M, 0, 1);
-            rs->size = 1;
-        } else if (bits % 32 == 0) {
-            rs = (reg_set_t *)malloc(sizeof(reg_set_t) + sizeof(uint32_t) * bits - 1);
-            memset(rs->M, 0, bits);
-            rs->size = bits;
-        } else {
-            rs = (reg_set_t *)malloc(sizeof(reg_set_t) + sizeof(uint32_t) * bits);
-            memset(rs->M, 0, bits + 1);
-            rs->size = bits + 1;
-        }
+        memcpy(rs->M, values, sizeof(uint32_t) * len);
     }
 
     rs->count = count;
+    rs->size = size;
+    rs->width = width;
+    rs->alloc = alloc;
 
     return rs;
 }
 
 int rs_set(reg_set_t *rs, uint32_t pos, uint32_t value)
 {
-    if (!rs) {
+    if (!rs || pos >= rs->count) {
         return -1;
     }
 
-    uint32_t bucket_pos = (uint32_t)floor(pos / LOG2_BITS_PER_WORD);
-    uint32_t shift = REGISTER_SIZE * (pos - (bucket_pos * LOG2_BITS_PER_WORD));
-    rs->M[bucket_pos] = (rs->M[bucket_pos] & ~(0x1f << shift)) | (value << shift);
+    uint32_t per = rs_regs_per_word(rs->width);
+    uint32_t mask = (1U << rs->width) - 1;
+    uint32_t bucket_pos = pos / per;
+    uint32_t shift = rs->width * (pos - (bucket_pos * per));
+    rs->M[bucket_pos] = (rs->M[bucket_pos] & ~(mask << shift)) | ((value & mask) << shift);
 
     return 0;
 }
 
 int rs_get(reg_set_t *rs, uint32_t pos, uint32_t *value)
 {
-    if (!rs) {
+    if (!rs || !value || pos >= rs->count) {
+        return -1;
+    }
+
+    uint32_t per = rs_regs_per_word(rs->width);
+    uint32_t mask = (1U << rs->width) - 1;
+    uint32_t bucket_pos = pos / per;
+    uint32_t shift = rs->width * (pos - (bucket_pos * per));
+    *value = (rs->M[bucket_pos] >> shift) & mask;
+
+    return 0;
+}
+
+int rs_merge(reg_set_t *rs, const reg_set_t *other)
+{
+    uint32_t per, i, lo, hi, fill, x, y, t, ge, sel;
+
+    if (!rs || !other || rs->count != other->count ||
+        rs->width != other->width) {
         return -1;
     }
 
-    uint32_t bucket_pos = (uint32_t)floor(pos / LOG2_BITS_PER_WORD);
-    uint32_t shift = REGISTER_SIZE * (pos - (bucket_pos * LOG2_BITS_PER_WORD));
-    *value = (rs->M[bucket_pos] & (0x1f << shift)) >> shift;
+    /*
+     * Compare all registers in a word at once (SWAR). lo/hi have the lowest
+     * and the highest bit of every register set. With the highest bits of x
+     * forced to 1 and those of y forced to 0, subtraction in a register never
+     * borrows from the next one, and its highest bit tells if the lower bits
+     * of x are not less than those of y. Together with the highest bits it
+     * gives x >= y, which is spread to a full register mask to select.
+     */
+    per = rs_regs_per_word(rs->width);
+    fill = (1U << rs->width) - 1;
+    lo = 0;
+    for (i = 0; i < per; i++) {
+        lo |= 1U << (i * rs->width);
+    }
+    hi = lo << (rs->width - 1);
+
+    for (i = 0; i < rs->size; i++) {
+        x = rs->M[i];
+        y = other->M[i];
+        t = (x | hi) - (y & ~hi);
+        ge = ((x & ~y) | (~(x ^ y) & t)) & hi;
+        sel = (ge >> (rs->width - 1)) * fill;
+        rs->M[i] = (x & sel) | (y & ~sel);
+    }
 
     return 0;
 }
 
+int rs_sum(const reg_set_t *rs, double *sum, uint32_t *zeros)
+{
+    uint32_t per, mask, i, j, n, w, v;
+    uint32_t z = 0;
+    double s = 0;
+
+    if (!rs || !sum || !zeros) {
+        return -1;
+    }
+
+    per = rs_regs_per_word(rs->width);
+    mask = (1U << rs->width) - 1;
+    for (i = 0, n = 0; i < rs->size; i++) {
+        w = rs->M[i];
+        for (j = 0; j < per && n < rs->count; j++, n++) {
+            v = w & mask;
+            w >>= rs->width;
+            s += v < 64 ? POW_2_NEG[v] : ldexp(1.0, -(int)v);
+            z += v == 0;
+        }
+    }
+
+    *sum = s;
+    *zeros = z;
+    return 0;
+}
+
 int rs_bits(reg_set_t *rs, uint32_t *bits, uint32_t *len)
 {
-    if (!rs || !bits || (*len < rs->size)) {
+    if (!rs || !bits || !len || (*len < rs->size)) {
         return -1;
     }
 
-    memcpy(bits, rs->M, rs->size);
+    memcpy(bits, rs->M, sizeof(uint32_t) * rs->size);
     *len = rs->size;
 
     return 0;
 }
 
+reg_set_t *rs_copy(reg_set_t *dst, const reg_set_t *src,
+                   const ccard_allocator_t *alloc)
+{
+    reg_set_t *rs;
+
+    if (dst) {
+        alloc = dst->alloc;
+    } else if (!alloc) {
+        alloc = ccard_get_allocator();
+    }
+
+    if (!src) {
+        rs_fini(dst);
+        return NULL;
+    }
+
+    if (dst && dst->size == src->size) {
+        rs = dst;
+    } else {
+        rs = (reg_set_t *)ccard_realloc(alloc, dst, sizeof(reg_set_t)
+                                        + sizeof(uint32_t) * (src->size - 1));
+        if (!rs) {
+            rs_fini(dst);
+            return NULL;
+        }
+    }
+
+    memcpy(rs->M, src->M, sizeof(uint32_t) * src->size);
+    rs->count = src->count;
+    rs->size = src->size;
+    rs->width = src->width;
+    rs->alloc = alloc;
+
+    return rs;
+}
+
 int rs_fini(reg_set_t *rs)
 {
     if (rs) {
-        free(rs);
+        ccard_free(rs->alloc, rs);
         return 0;
     }
 
@@ -93,4 +234,3 @@ int rs_fini(reg_set_t *rs)
 }
 
 // vi:ft=c ts=4 sw=4 fdm=marker et
-
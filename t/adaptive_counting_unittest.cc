@@ -1,3 +1,6 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include "ccard_common.h"
 #include "adaptive_counting.h"
 #include "gtest/gtest.h"
@@ -180,6 +183,7 @@ TEST(AdaptiveCounting, Counting)
  * <li>Tbm1 that contains 10000 to 30000 be serialized as buf1</li>
  * <li>Tbm2 that contains 20000 to 40000 be serialized as buf2</li>
  * <li>Merges buf1 and buf2 into current context</li>
+ * <li>Merges buf1 twice in one call</li>
  * </ol>
  * */
 TEST(AdaptiveCounting, RawMerge)
@@ -220,6 +224,12 @@ TEST(AdaptiveCounting, RawMerge)
     printf("actual:40000, estimated: %9lu, error: %+7.2f%%\n",
            (long unsigned int)esti, (double)(esti - 40000) / 40000 * 100);
 
+    // the same buffer could be passed more than once
+    adp_cnt_reset(tbm2);
+    rc = adp_cnt_merge_raw_bytes(tbm2, buf1, len1, buf1, len1, NULL);
+    EXPECT_EQ(rc, 0);
+    EXPECT_EQ(adp_cnt_card(tbm2), adp_cnt_card(tbm1));
+
     rc = adp_cnt_fini(tbm2);
     EXPECT_EQ(rc, 0);
     rc = adp_cnt_fini(tbm1);
@@ -236,6 +246,7 @@ TEST(AdaptiveCounting, RawMerge)
  * <li>Tbm1 that contains 10000 to 30000 be serialized as buf1</li>
  * <li>Tbm2 that contains 20000 to 40000 be serialized as buf2</li>
  * <li>Merges buf1 and buf2 into current context</li>
+ * <li>Merges buf1 twice in one call</li>
  * </ol>
  * */
 TEST(AdaptiveCounting, Merge)
@@ -276,6 +287,12 @@ TEST(AdaptiveCounting, Merge)
     printf("actual:40000, estimated: %9lu, error: %+7.2f%%\n",
            (long unsigned int)esti, (double)(esti - 40000) / 40000 * 100);
 
+    // the same buffer could be passed more than once
+    adp_cnt_reset(tbm2);
+    rc = adp_cnt_merge_bytes(tbm2, buf1, len1, buf1, len1, NULL);
+    EXPECT_EQ(rc, 0);
+    EXPECT_EQ(adp_cnt_card(tbm2), adp_cnt_card(tbm1));
+
     rc = adp_cnt_fini(tbm2);
     EXPECT_EQ(rc, 0);
     rc = adp_cnt_fini(tbm1);
@@ -524,5 +541,960 @@ TEST(AdaptiveCounting, SparseDeserialize)
     EXPECT_EQ(adp_cnt_card(other), esti);
 }
 
-// vi:ft=c ts=4 sw=4 fdm=marker et
+/**
+ * Fold dense and sparse bitmaps to lower precision, the result should be
+ * identical to counting with lower precision directly.
+ * */
+TEST(AdaptiveCounting, Fold)
+{
+    uint8_t opts[] = {
+        CCARD_HASH_MURMUR,
+        CCARD_HASH_LOOKUP3,
+        CCARD_HASH_MURMUR | CCARD_OPT_SPARSE
+    };
+
+    for(size_t n = 0; n < sizeof(opts) / sizeof(opts[0]); n++) {
+        adp_cnt_ctx_t *ctx16 = adp_cnt_init(NULL, 16, opts[n]);
+        adp_cnt_ctx_t *ctx12 = adp_cnt_init(NULL, 12, opts[n]);
+
+        for(int64_t i = 1; i <= 3000; i++) {
+            adp_cnt_offer(ctx16, &i, sizeof(int64_t));
+            adp_cnt_offer(ctx12, &i, sizeof(int64_t));
+        }
+
+        EXPECT_EQ(adp_cnt_fold(ctx16, 17), -1);
+        EXPECT_EQ(adp_cnt_errnum(ctx16), CCARD_ERR_INVALID_ARGUMENT);
+        EXPECT_EQ(adp_cnt_fold(ctx16, 12), 0);
+
+        uint32_t len16 = 0, len12 = 0;
+        EXPECT_EQ(adp_cnt_get_bytes(ctx16, NULL, &len16), 0);
+        EXPECT_EQ(adp_cnt_get_bytes(ctx12, NULL, &len12), 0);
+        EXPECT_EQ(len16, len12);
+
+        uint8_t buf16[len16], buf12[len12];
+        EXPECT_EQ(adp_cnt_get_bytes(ctx16, buf16, &len16), 0);
+        EXPECT_EQ(adp_cnt_get_bytes(ctx12, buf12, &len12), 0);
+        EXPECT_EQ(memcmp(buf16, buf12, len12), 0);
+        EXPECT_EQ(adp_cnt_card(ctx16), adp_cnt_card(ctx12));
+
+        adp_cnt_fini(ctx16);
+        adp_cnt_fini(ctx12);
+    }
+}
+
+/**
+ * Merge bitmaps with different precision
+ * */
+TEST(AdaptiveCounting, MergeDifferentLength)
+{
+    adp_cnt_ctx_t *ctx = adp_cnt_init(NULL, 14, CCARD_HASH_MURMUR);
+    adp_cnt_ctx_t *tbm1 = adp_cnt_init(NULL, 16, CCARD_HASH_MURMUR);
+    adp_cnt_ctx_t *tbm2 = adp_cnt_init(NULL, 12, CCARD_HASH_MURMUR);
+    adp_cnt_ctx_t *expect = adp_cnt_init(NULL, 12, CCARD_HASH_MURMUR);
+    int64_t i;
+
+    for (i = 1; i <= 20000L; i++) {
+        adp_cnt_offer(ctx, &i, sizeof(int64_t));
+        adp_cnt_offer(expect, &i, sizeof(int64_t));
+    }
+    for (i = 10000L; i <= 30000L; i++) {
+        adp_cnt_offer(tbm1, &i, sizeof(int64_t));
+        adp_cnt_offer(expect, &i, sizeof(int64_t));
+    }
+    for (i = 20000L; i <= 40000L; i++) {
+        adp_cnt_offer(tbm2, &i, sizeof(int64_t));
+        adp_cnt_offer(expect, &i, sizeof(int64_t));
+    }
+
+    uint32_t len1 = (1 << 16) + 3, len2 = (1 << 12) + 3;
+    uint8_t *buf1 = (uint8_t *)malloc(len1), *buf2 = (uint8_t *)malloc(len2);
+    EXPECT_EQ(adp_cnt_get_bytes(tbm1, buf1, &len1), 0);
+    EXPECT_EQ(adp_cnt_get_bytes(tbm2, buf2, &len2), 0);
+
+    EXPECT_EQ(adp_cnt_merge_bytes(ctx, buf1, len1, buf2, len2, NULL), 0);
+    EXPECT_EQ(adp_cnt_card(ctx), adp_cnt_card(expect));
+
+    /* header must match the bitmap length */
+    buf1[2] = 15;
+    EXPECT_EQ(adp_cnt_merge_bytes(ctx, buf1, len1, NULL), -1);
+
+    free(buf2);
+    free(buf1);
+    adp_cnt_fini(expect);
+    adp_cnt_fini(tbm2);
+    adp_cnt_fini(tbm1);
+    adp_cnt_fini(ctx);
+}
+
+/**
+ * Replicate context by deltas.
+ *
+ * <ol>
+ * <li>The first delta carries all buckets</li>
+ * <li>The following deltas carry only buckets raised since the last one</li>
+ * <li>Delta since an unknown epoch carries all buckets again</li>
+ * <li>Delta with bucket indexes out of range or not ascending is
+ * rejected</li>
+ * </ol>
+ * */
+TEST(AdaptiveCounting, Delta)
+{
+    adp_cnt_ctx_t *ctx = adp_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR);
+    adp_cnt_ctx_t *replica = adp_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR);
+    uint32_t len, full_len, rlen = 1 << 14, clen = 1 << 14;
+    uint8_t *buf = (uint8_t *)malloc((1 << 14) + 3);
+    uint8_t *rbuf = (uint8_t *)malloc(rlen);
+    uint8_t *cbuf = (uint8_t *)malloc(clen);
+    int64_t i;
+
+    for (i = 1; i <= 20000; i++) {
+        adp_cnt_offer(ctx, &i, sizeof(int64_t));
+    }
+    EXPECT_EQ(adp_cnt_epoch(ctx), 0);
+    EXPECT_EQ(adp_cnt_get_delta(ctx, 0, NULL, &len), 0);
+    EXPECT_EQ(adp_cnt_epoch(ctx), 0);
+    EXPECT_EQ(adp_cnt_get_delta(ctx, 0, buf, &len), 0);
+    EXPECT_EQ(adp_cnt_epoch(ctx), 1);
+    EXPECT_EQ(len, (uint32_t)(1 << 14) + 3);
+    full_len = len;
+    EXPECT_EQ(adp_cnt_apply_delta(replica, buf, len), 0);
+    EXPECT_EQ(adp_cnt_card(replica), adp_cnt_card(ctx));
+
+    for (i = 20001; i <= 20100; i++) {
+        adp_cnt_offer(ctx, &i, sizeof(int64_t));
+    }
+    len = (1 << 14) + 3;
+    EXPECT_EQ(adp_cnt_get_delta(ctx, 1, buf, &len), 0);
+    EXPECT_LT(len, full_len / 10);
+    EXPECT_EQ(adp_cnt_apply_delta(replica, buf, len), 0);
+    EXPECT_EQ(adp_cnt_get_raw_bytes(ctx, cbuf, &clen), 0);
+    EXPECT_EQ(adp_cnt_get_raw_bytes(replica, rbuf, &rlen), 0);
+    EXPECT_EQ(clen, rlen);
+    EXPECT_EQ(memcmp(cbuf, rbuf, clen), 0);
+
+    /* nothing changed since epoch 2 */
+    len = (1 << 14) + 3;
+    EXPECT_EQ(adp_cnt_get_delta(ctx, 2, buf, &len), 0);
+    EXPECT_EQ(len, 4u);
+    EXPECT_EQ(adp_cnt_apply_delta(replica, buf, len), 0);
+
+    /* unknown epoch */
+    len = (1 << 14) + 3;
+    EXPECT_EQ(adp_cnt_get_delta(ctx, 1, buf, &len), 0);
+    EXPECT_EQ(len, full_len);
+    EXPECT_EQ(adp_cnt_apply_delta(replica, buf, len), 0);
+    EXPECT_EQ(adp_cnt_card(replica), adp_cnt_card(ctx));
+
+    /* serialized bitmap isn't a delta */
+    EXPECT_EQ(adp_cnt_get_bytes(ctx, buf, &len), 0);
+    EXPECT_EQ(adp_cnt_apply_delta(replica, buf, len), -1);
+    EXPECT_EQ(adp_cnt_errnum(replica), CCARD_ERR_MERGE_FAILED);
+
+    /* corrupted sparse delta, bucket 0xffff is beyond 2^14 buckets */
+    uint8_t bad[] = {CCARD_ALGO_ADAPTIVE | CCARD_FLAG_DELTA, CCARD_HASH_MURMUR,
+                     14, MAKE_SPARSE_ID(14), 1, 0xff, 0xff};
+    clen = 1 << 14;
+    EXPECT_EQ(adp_cnt_get_raw_bytes(replica, cbuf, &clen), 0);
+    EXPECT_EQ(adp_cnt_apply_delta(replica, bad, sizeof(bad)), -1);
+    EXPECT_EQ(adp_cnt_errnum(replica), CCARD_ERR_MERGE_FAILED);
+    EXPECT_EQ(adp_cnt_merge_raw_bytes(replica, bad + 3, sizeof(bad) - 3,
+                                      NULL), -1);
+    EXPECT_EQ(adp_cnt_raw_init(bad + 3, sizeof(bad) - 3, CCARD_HASH_MURMUR),
+              (adp_cnt_ctx_t *)NULL);
+
+    /* bucket indexes must be ascending */
+    uint8_t unsorted[] = {CCARD_ALGO_ADAPTIVE | CCARD_FLAG_DELTA,
+                          CCARD_HASH_MURMUR, 14, MAKE_SPARSE_ID(14),
+                          1, 2, 0, 1, 1, 0};
+    EXPECT_EQ(adp_cnt_apply_delta(replica, unsorted, sizeof(unsorted)), -1);
+    EXPECT_EQ(adp_cnt_errnum(replica), CCARD_ERR_MERGE_FAILED);
+    unsorted[8] = 3;
+    EXPECT_EQ(adp_cnt_apply_delta(replica, unsorted, sizeof(unsorted)), 0);
+    rlen = 1 << 14;
+    EXPECT_EQ(adp_cnt_get_raw_bytes(replica, rbuf, &rlen), 0);
+    EXPECT_EQ(rlen, clen);
+    cbuf[2] = cbuf[2] > 1 ? cbuf[2] : 1;
+    cbuf[3] = cbuf[3] > 1 ? cbuf[3] : 1;
+    EXPECT_EQ(memcmp(cbuf, rbuf, clen), 0);
+
+    free(cbuf);
+    free(rbuf);
+    free(buf);
+    adp_cnt_fini(replica);
+    adp_cnt_fini(ctx);
+}
+
+/**
+ * Convert between adaptive and hyperloglog counting.
+ *
+ * <ol>
+ * <li>Buckets should be identical to counting with the other algorithm</li>
+ * <li>Sparse bitmap should be expanded</li>
+ * <li>64-bit murmur hash function isn't supported by adaptive counting</li>
+ * </ol>
+ * */
+TEST(AdaptiveCounting, ConvertHyperloglog)
+{
+    uint8_t opts[] = {CCARD_HASH_MURMUR, CCARD_HASH_LOOKUP3,
+                      CCARD_HASH_LOOKUP3 | CCARD_OPT_SPARSE};
+    uint8_t abuf[1 << 12], hbuf[1 << 12];
+    uint32_t alen, hlen;
+
+    for (size_t n = 0; n < sizeof(opts); n++) {
+        adp_cnt_ctx_t *ctx = adp_cnt_raw_init(NULL, 12, opts[n]);
+        hll_cnt_ctx_t *expect = hll_cnt_raw_init(NULL, 12, opts[n]);
+
+        for (int64_t i = 1; i <= 100; i++) {
+            adp_cnt_offer(ctx, &i, sizeof(int64_t));
+            hll_cnt_offer(expect, &i, sizeof(int64_t));
+        }
+
+        hll_cnt_ctx_t *hll = adp_cnt_to_hll(ctx);
+        EXPECT_NE(hll, (hll_cnt_ctx_t *)NULL);
+        alen = sizeof(abuf);
+        hlen = sizeof(hbuf);
+        EXPECT_EQ(hll_cnt_get_raw_bytes(hll, abuf, &alen), 0);
+        EXPECT_EQ(hll_cnt_get_raw_bytes(expect, hbuf, &hlen), 0);
+        EXPECT_EQ(alen, hlen);
+        EXPECT_EQ(memcmp(abuf, hbuf, hlen), 0);
+
+        adp_cnt_ctx_t *back = adp_cnt_from_hll(expect);
+        EXPECT_NE(back, (adp_cnt_ctx_t *)NULL);
+        EXPECT_EQ(adp_cnt_card(back), adp_cnt_card(ctx));
+        for (int64_t i = 101; i <= 200; i++) {
+            adp_cnt_offer(ctx, &i, sizeof(int64_t));
+            adp_cnt_offer(back, &i, sizeof(int64_t));
+        }
+        EXPECT_EQ(adp_cnt_card(back), adp_cnt_card(ctx));
+
+        adp_cnt_fini(back);
+        hll_cnt_fini(hll);
+        hll_cnt_fini(expect);
+        adp_cnt_fini(ctx);
+    }
+
+    hll_cnt_ctx_t *hll = hll_cnt_raw_init(NULL, 12, CCARD_HASH_MURMUR64);
+    EXPECT_EQ(adp_cnt_from_hll(hll), (adp_cnt_ctx_t *)NULL);
+    EXPECT_EQ(adp_cnt_from_hll(NULL), (adp_cnt_ctx_t *)NULL);
+    hll_cnt_fini(hll);
+}
+
+/**
+ * Batched insertion on sparse bitmap
+ *
+ * <ol>
+ * <li>Offers the same items to a sparse and a normal ctx</li>
+ * <li>Offer results and estimations must be identical while new buckets are
+ * still pending</li>
+ * <li>Expanded sparse raw bytes must equal normal raw bytes</li>
+ * <li>Serialized sparse ctx must restore the same estimation</li>
+ * </ol>
+ * */
+TEST(AdaptiveCounting, SparsePending)
+{
+    int rc1, rc2;
+    int k = 12;
+    uint32_t i, len1, len2, off;
+    int64_t j;
+    uint8_t buf1[4096 * 3], buf2[4096 + 3], expand[4096];
+    adp_cnt_ctx_t *ctx1 = adp_cnt_init(NULL, k, CCARD_HASH_MURMUR | CCARD_OPT_SPARSE);
+    adp_cnt_ctx_t *ctx2 = adp_cnt_init(NULL, k, CCARD_HASH_MURMUR);
+    adp_cnt_ctx_t *ctx3;
+    EXPECT_NE(ctx1, (adp_cnt_ctx_t *)NULL);
+    EXPECT_NE(ctx2, (adp_cnt_ctx_t *)NULL);
+
+    for(j = 1; j <= 3000; j++) {
+        rc1 = adp_cnt_offer(ctx1, &j, sizeof(j));
+        rc2 = adp_cnt_offer(ctx2, &j, sizeof(j));
+        EXPECT_EQ(rc1, rc2);
+
+        if(j % 7 == 0) {
+            rc1 = adp_cnt_offer(ctx1, &j, sizeof(j));
+            EXPECT_EQ(rc1, 0);
+        }
+
+        if(j % 250 == 0) {
+            EXPECT_EQ(adp_cnt_card(ctx1), adp_cnt_card(ctx2));
+
+            len1 = sizeof(buf1);
+            len2 = sizeof(buf2);
+            EXPECT_EQ(adp_cnt_get_raw_bytes(ctx1, buf1, &len1), 0);
+            EXPECT_EQ(adp_cnt_get_raw_bytes(ctx2, buf2, &len2), 0);
+            EXPECT_EQ(len2, 1u << k);
+            if(IS_SPARSE_BMP(buf1)) {
+                memset(expand, 0, sizeof(expand));
+                for(off = 1; off < len1; off += 3) {
+                    if(off > 1) {
+                        EXPECT_LT(sparse_bytes_to_int(buf1, off - 2, 2),
+                                  sparse_bytes_to_int(buf1, off + 1, 2));
+                    }
+                    expand[sparse_bytes_to_int(buf1, off + 1, 2)] = buf1[off];
+                }
+                EXPECT_EQ(memcmp(expand, buf2, len2), 0);
+            } else {
+                EXPECT_EQ(len1, len2);
+                EXPECT_EQ(memcmp(buf1, buf2, len2), 0);
+            }
+
+            len1 = sizeof(buf1);
+            EXPECT_EQ(adp_cnt_get_bytes(ctx1, buf1, &len1), 0);
+            ctx3 = adp_cnt_init(buf1, len1, CCARD_HASH_MURMUR);
+            EXPECT_NE(ctx3, (adp_cnt_ctx_t *)NULL);
+            EXPECT_EQ(adp_cnt_card(ctx3), adp_cnt_card(ctx2));
+            adp_cnt_fini(ctx3);
+        }
+    }
+
+    /* converted to normal bitmap eventually */
+    len1 = sizeof(buf1);
+    EXPECT_EQ(adp_cnt_get_raw_bytes(ctx1, buf1, &len1), 0);
+    EXPECT_EQ(len1, 1u << k);
+    for(i = 0; i < len1; i++) {
+        EXPECT_EQ(buf1[i], buf2[i]);
+    }
+
+    adp_cnt_fini(ctx1);
+    adp_cnt_fini(ctx2);
+}
+
+/**
+ * Sparse bitmap with wide bucket indexes
+ *
+ * <ol>
+ * <li>Offers the same items to a sparse and a normal ctx with k = 20</li>
+ * <li>Serializes the sparse ctx between offers</li>
+ * <li>Folds both to k = 14 and compares raw bytes</li>
+ * </ol>
+ * */
+TEST(AdaptiveCounting, SparseWideIndex)
+{
+    int k = 20;
+    uint32_t len1, len2, off, idx;
+    int64_t j;
+    uint8_t *buf1, *buf2, *expand;
+    adp_cnt_ctx_t *ctx1 = adp_cnt_init(NULL, k, CCARD_HASH_MURMUR | CCARD_OPT_SPARSE);
+    adp_cnt_ctx_t *ctx2 = adp_cnt_init(NULL, k, CCARD_HASH_MURMUR);
+    EXPECT_NE(ctx1, (adp_cnt_ctx_t *)NULL);
+    EXPECT_NE(ctx2, (adp_cnt_ctx_t *)NULL);
+
+    for(j = 1; j <= 20000; j++) {
+        EXPECT_EQ(adp_cnt_offer(ctx1, &j, sizeof(j)),
+                  adp_cnt_offer(ctx2, &j, sizeof(j)));
+        if(j % 5000 == 0) {
+            EXPECT_EQ(adp_cnt_card(ctx1), adp_cnt_card(ctx2));
+            EXPECT_EQ(adp_cnt_get_bytes(ctx1, NULL, &len1), 0);
+            EXPECT_LT(len1, 1u << k);
+        }
+    }
+
+    EXPECT_EQ(adp_cnt_get_raw_bytes(ctx1, NULL, &len1), 0);
+    buf1 = (uint8_t *)malloc(len1);
+    EXPECT_EQ(adp_cnt_get_raw_bytes(ctx1, buf1, &len1), 0);
+    EXPECT_TRUE(IS_SPARSE_BMP(buf1));
+    expand = (uint8_t *)calloc(1, 1 << k);
+    for(off = 1; off < len1; off += 4) {
+        idx = sparse_bytes_to_int(buf1, off + 1, 3);
+        EXPECT_LT(idx, 1u << k);
+        expand[idx] = buf1[off];
+    }
+    len2 = 1 << k;
+    buf2 = (uint8_t *)malloc(len2);
+    EXPECT_EQ(adp_cnt_get_raw_bytes(ctx2, buf2, &len2), 0);
+    EXPECT_EQ(memcmp(expand, buf2, len2), 0);
+
+    EXPECT_EQ(adp_cnt_fold(ctx1, 14), 0);
+    EXPECT_EQ(adp_cnt_fold(ctx2, 14), 0);
+    EXPECT_EQ(adp_cnt_card(ctx1), adp_cnt_card(ctx2));
+    free(buf1);
+    EXPECT_EQ(adp_cnt_get_raw_bytes(ctx1, NULL, &len1), 0);
+    buf1 = (uint8_t *)malloc(len1);
+    EXPECT_EQ(adp_cnt_get_raw_bytes(ctx1, buf1, &len1), 0);
+    len2 = 1 << 14;
+    EXPECT_EQ(adp_cnt_get_raw_bytes(ctx2, buf2, &len2), 0);
+    if(IS_SPARSE_BMP(buf1)) {
+        memset(expand, 0, len2);
+        for(off = 1; off < len1; off += 3) {
+            expand[sparse_bytes_to_int(buf1, off + 1, 2)] = buf1[off];
+        }
+        EXPECT_EQ(memcmp(expand, buf2, len2), 0);
+    } else {
+        EXPECT_EQ(memcmp(buf1, buf2, len2), 0);
+    }
+
+    free(buf1);
+    free(buf2);
+    free(expand);
+    adp_cnt_fini(ctx1);
+    adp_cnt_fini(ctx2);
+}
+
+/**
+ * Exact counting with explicit hash values
+ *
+ * <ol>
+ * <li>ctx1 contains 1 to 200, ctx2 contains 101 to 300, both are exact</li>
+ * <li>Merged contexts and bitmaps stay explicit</li>
+ * <li>ctx1 is converted to buckets beyond the limit and gets the same bitmap
+ * as a sparse ctx</li>
+ * <li>Hash values exceeding 32 bits are rejected by 32-bit hash context</li>
+ * </ol>
+ * */
+TEST(AdaptiveCounting, Explicit)
+{
+    int k = 12;
+    int64_t i;
+    uint32_t len, len2;
+    uint8_t buf[8 * 512 + 4], buf2[4096 * 3];
+    uint8_t opt = CCARD_HASH_MURMUR | CCARD_OPT_EXPLICIT;
+    adp_cnt_ctx_t *ctx1 = adp_cnt_init(NULL, k, opt);
+    adp_cnt_ctx_t *ctx2 = adp_cnt_init(NULL, k, opt);
+    adp_cnt_ctx_t *ctx3 = adp_cnt_init(NULL, k, CCARD_HASH_MURMUR | CCARD_OPT_SPARSE);
+    adp_cnt_ctx_t *ctx4;
+    hll_cnt_ctx_t *hll;
+
+    for(i = 1; i <= 200; i++) {
+        EXPECT_EQ(adp_cnt_offer(ctx1, &i, sizeof(i)), 1);
+        EXPECT_EQ(adp_cnt_offer(ctx1, &i, sizeof(i)), 0);
+        adp_cnt_offer(ctx2, &i, sizeof(i));
+        adp_cnt_offer(ctx3, &i, sizeof(i));
+    }
+    adp_cnt_reset(ctx2);
+    for(i = 101; i <= 300; i++) {
+        adp_cnt_offer(ctx2, &i, sizeof(i));
+    }
+    EXPECT_EQ(adp_cnt_card(ctx1), 200);
+    EXPECT_EQ(adp_cnt_card(ctx2), 200);
+
+    len = sizeof(buf);
+    EXPECT_EQ(adp_cnt_get_bytes(ctx2, buf, &len), 0);
+    EXPECT_EQ(len, 3 + 1 + 8 * 200u);
+    EXPECT_TRUE(IS_EXPLICIT_BMP(buf + 3));
+    ctx4 = adp_cnt_init(buf, len, CCARD_HASH_MURMUR);
+    EXPECT_NE(ctx4, (adp_cnt_ctx_t *)NULL);
+    EXPECT_EQ(adp_cnt_card(ctx4), 200);
+    EXPECT_EQ(adp_cnt_merge(ctx4, ctx1, NULL), 0);
+    EXPECT_EQ(adp_cnt_card(ctx4), 300);
+    adp_cnt_fini(ctx4);
+
+    hll = adp_cnt_to_hll(ctx2);
+    EXPECT_EQ(hll_cnt_card(hll), 200);
+    hll_cnt_fini(hll);
+
+    EXPECT_EQ(adp_cnt_merge_bytes(ctx1, buf, len, NULL), 0);
+    EXPECT_EQ(adp_cnt_card(ctx1), 300);
+    len = sizeof(buf);
+    EXPECT_EQ(adp_cnt_get_raw_bytes(ctx1, buf, &len), 0);
+    EXPECT_EQ(len, 1 + 8 * 300u);
+
+    /* 2^12 / 8 hash values at most */
+    for(i = 201; i <= 1000; i++) {
+        adp_cnt_offer(ctx1, &i, sizeof(i));
+        adp_cnt_offer(ctx3, &i, sizeof(i));
+        if(i == 512) {
+            EXPECT_EQ(adp_cnt_card(ctx1), 512);
+        }
+    }
+    EXPECT_NE(adp_cnt_card(ctx1), 1000);
+    EXPECT_EQ(adp_cnt_card(ctx1), adp_cnt_card(ctx3));
+    len = sizeof(buf2);
+    len2 = sizeof(buf2);
+    EXPECT_EQ(adp_cnt_get_raw_bytes(ctx1, buf2, &len), 0);
+    EXPECT_TRUE(IS_SPARSE_BMP(buf2));
+    EXPECT_FALSE(IS_EXPLICIT_BMP(buf2));
+    EXPECT_EQ(adp_cnt_get_raw_bytes(ctx3, buf, &len2), 0);
+    EXPECT_EQ(len, len2);
+    EXPECT_EQ(memcmp(buf, buf2, len), 0);
+
+    /* hash value 2^32 has no bucket with 32-bit hash */
+    uint8_t bad[] = {CCARD_ALGO_ADAPTIVE, CCARD_HASH_MURMUR, 12,
+                     MAKE_EXPLICIT_ID(12), 0, 0, 0, 0, 1, 0, 0, 0};
+    EXPECT_EQ(adp_cnt_reset(ctx3), 0);
+    EXPECT_EQ(adp_cnt_merge_bytes(ctx3, bad, sizeof(bad), NULL), -1);
+    EXPECT_EQ(adp_cnt_errnum(ctx3), CCARD_ERR_MERGE_FAILED);
+    EXPECT_EQ(adp_cnt_merge_raw_bytes(ctx3, bad + 3, sizeof(bad) - 3, NULL), -1);
+    EXPECT_EQ(adp_cnt_errnum(ctx3), CCARD_ERR_MERGE_FAILED);
+    EXPECT_EQ(adp_cnt_init(bad, sizeof(bad), CCARD_HASH_MURMUR),
+              (adp_cnt_ctx_t *)NULL);
+    EXPECT_EQ(adp_cnt_card(ctx3), 0);
+
+    adp_cnt_fini(ctx1);
+    adp_cnt_fini(ctx2);
+    adp_cnt_fini(ctx3);
+}
+
+/**
+ * Tests compressed serialization.
+ *
+ * <ol>
+ * <li>Compressed bytes of sparse, explicit and normal bitmaps are smaller</li>
+ * <li>Contexts initialized from compressed bytes have the same estimate</li>
+ * <li>Compressed and plain bytes are merged together</li>
+ * </ol>
+ * */
+TEST(AdaptiveCounting, Compressed)
+{
+    int64_t i, esti;
+    uint32_t len, clen, elen;
+    uint8_t buf[3 + 4096], cbuf[3 + 4096 + 8], ebuf[3 + 1 + 8 * 64 + 8];
+    adp_cnt_ctx_t *ctx1 = adp_cnt_init(NULL, 12, CCARD_HASH_MURMUR | CCARD_OPT_SPARSE);
+    adp_cnt_ctx_t *ctx2 = adp_cnt_init(NULL, 12, CCARD_HASH_MURMUR | CCARD_OPT_EXPLICIT);
+    adp_cnt_ctx_t *ctx3 = adp_cnt_init(NULL, 12, CCARD_HASH_MURMUR);
+    adp_cnt_ctx_t *ctx4;
+
+    for(i = 1; i <= 200; i++) {
+        adp_cnt_offer(ctx1, &i, sizeof(i));
+    }
+    for(i = 1001; i <= 1050; i++) {
+        adp_cnt_offer(ctx2, &i, sizeof(i));
+    }
+    for(i = 2001; i <= 22000; i++) {
+        adp_cnt_offer(ctx3, &i, sizeof(i));
+    }
+
+    /* sparse */
+    len = sizeof(buf);
+    clen = sizeof(cbuf);
+    EXPECT_EQ(adp_cnt_get_bytes(ctx1, buf, &len), 0);
+    EXPECT_EQ(adp_cnt_get_compressed_bytes(ctx1, cbuf, &clen), 0);
+    EXPECT_EQ(cbuf[0], CCARD_ALGO_ADAPTIVE | CCARD_FLAG_COMPRESSED);
+    EXPECT_LT(clen, len);
+    ctx4 = adp_cnt_init(cbuf, clen, CCARD_HASH_MURMUR);
+    EXPECT_NE(ctx4, (adp_cnt_ctx_t *)NULL);
+    EXPECT_EQ(adp_cnt_card(ctx4), adp_cnt_card(ctx1));
+    adp_cnt_fini(ctx4);
+
+    /* explicit */
+    elen = sizeof(ebuf);
+    EXPECT_EQ(adp_cnt_get_compressed_bytes(ctx2, ebuf, &elen), 0);
+    EXPECT_LT(elen, 3 + 1 + 8 * 50u);
+
+    /* normal */
+    len = sizeof(buf);
+    clen = sizeof(cbuf);
+    EXPECT_EQ(adp_cnt_get_bytes(ctx3, buf, &len), 0);
+    EXPECT_EQ(len, 3 + 4096u);
+    EXPECT_EQ(adp_cnt_get_compressed_bytes(ctx3, NULL, &clen), 0);
+    EXPECT_LT(clen, len / 2);
+    EXPECT_EQ(adp_cnt_get_compressed_bytes(ctx3, cbuf, &clen), 0);
+    ctx4 = adp_cnt_init(cbuf, clen, CCARD_HASH_MURMUR);
+    EXPECT_NE(ctx4, (adp_cnt_ctx_t *)NULL);
+    esti = adp_cnt_card(ctx3);
+    EXPECT_EQ(adp_cnt_card(ctx4), esti);
+
+    EXPECT_EQ(adp_cnt_merge(ctx4, ctx1, ctx2, NULL), 0);
+    EXPECT_EQ(adp_cnt_merge_bytes(ctx1, cbuf, clen, ebuf, elen, buf, len, NULL), 0);
+    EXPECT_EQ(adp_cnt_card(ctx1), adp_cnt_card(ctx4));
+    EXPECT_GT(adp_cnt_card(ctx1), esti);
+
+    /* corrupted */
+    cbuf[clen - 1] ^= 0xff;
+    EXPECT_EQ(adp_cnt_merge_bytes(ctx4, buf, len, cbuf, clen - 1, NULL), -1);
+    EXPECT_EQ(adp_cnt_errnum(ctx4), CCARD_ERR_MERGE_FAILED);
+    EXPECT_EQ(adp_cnt_init(cbuf, clen - 1, CCARD_HASH_MURMUR), (adp_cnt_ctx_t *)NULL);
+
+    adp_cnt_fini(ctx4);
+    adp_cnt_fini(ctx3);
+    adp_cnt_fini(ctx2);
+    adp_cnt_fini(ctx1);
+}
+
+/**
+ * Tests views of borrowed bitmap.
+ *
+ * <ol>
+ * <li>Read-only view is estimated and merged from, but not updated</li>
+ * <li>Writable view updates the borrowed bitmap in place</li>
+ * <li>Only normal bitmap could be borrowed</li>
+ * </ol>
+ * */
+TEST(AdaptiveCounting, View)
+{
+    int64_t i;
+    uint32_t len, len2;
+    uint8_t buf[3 + 4096], buf2[3 + 4096];
+    adp_cnt_ctx_t *ctx1 = adp_cnt_init(NULL, 12, CCARD_HASH_MURMUR);
+    adp_cnt_ctx_t *ctx2 = adp_cnt_init(NULL, 12, CCARD_HASH_MURMUR);
+    adp_cnt_ctx_t *ctx4 = adp_cnt_init(NULL, 12, CCARD_HASH_MURMUR | CCARD_OPT_SPARSE);
+    adp_cnt_ctx_t *view, *ctx3;
+
+    for (i = 1; i <= 20000; i++) {
+        adp_cnt_offer(ctx1, &i, sizeof(i));
+    }
+    len = sizeof(buf);
+    EXPECT_EQ(adp_cnt_get_bytes(ctx1, buf, &len), 0);
+
+    view = adp_cnt_view_init(buf, len, CCARD_VIEW_RDONLY);
+    EXPECT_NE(view, (adp_cnt_ctx_t *)NULL);
+    EXPECT_EQ(adp_cnt_card(view), adp_cnt_card(ctx1));
+    EXPECT_EQ(adp_cnt_offer(view, &i, sizeof(i)), -1);
+    EXPECT_EQ(adp_cnt_errnum(view), CCARD_ERR_VIEW);
+    EXPECT_EQ(adp_cnt_reset(view), -1);
+    EXPECT_EQ(adp_cnt_merge(ctx2, view, NULL), 0);
+    EXPECT_EQ(adp_cnt_card(ctx2), adp_cnt_card(ctx1));
+    len2 = sizeof(buf2);
+    EXPECT_EQ(adp_cnt_get_bytes(view, buf2, &len2), 0);
+    EXPECT_EQ(len2, len);
+    EXPECT_EQ(memcmp(buf, buf2, len), 0);
+    EXPECT_EQ(adp_cnt_fini(view), 0);
+
+    view = adp_cnt_view_init(buf, len, CCARD_VIEW_WRITABLE);
+    EXPECT_NE(view, (adp_cnt_ctx_t *)NULL);
+    for (i = 20001; i <= 40000; i++) {
+        adp_cnt_offer(ctx1, &i, sizeof(i));
+        EXPECT_GE(adp_cnt_offer(view, &i, sizeof(i)), 0);
+    }
+    EXPECT_EQ(adp_cnt_card(view), adp_cnt_card(ctx1));
+    EXPECT_EQ(adp_cnt_fold(view, 10), -1);
+    EXPECT_EQ(adp_cnt_errnum(view), CCARD_ERR_VIEW);
+    ctx3 = adp_cnt_init(buf, len, CCARD_HASH_MURMUR);
+    EXPECT_EQ(adp_cnt_card(ctx3), adp_cnt_card(ctx1));
+    EXPECT_EQ(adp_cnt_reset(view), 0);
+    EXPECT_EQ(buf[3 + 100], 0);
+    EXPECT_EQ(adp_cnt_fini(view), 0);
+
+    /* sparse, compressed or corrupted bitmap */
+    len2 = sizeof(buf2);
+    EXPECT_EQ(adp_cnt_get_bytes(ctx4, buf2, &len2), 0);
+    EXPECT_EQ(adp_cnt_view_init(buf2, len2, CCARD_VIEW_RDONLY), (adp_cnt_ctx_t *)NULL);
+    adp_cnt_fini(ctx4);
+    buf[0] |= CCARD_FLAG_COMPRESSED;
+    EXPECT_EQ(adp_cnt_view_init(buf, len, CCARD_VIEW_RDONLY), (adp_cnt_ctx_t *)NULL);
+    buf[0] &= ~CCARD_FLAG_COMPRESSED;
+    EXPECT_EQ(adp_cnt_view_init(buf, len - 1, CCARD_VIEW_RDONLY), (adp_cnt_ctx_t *)NULL);
+
+    adp_cnt_fini(ctx3);
+    adp_cnt_fini(ctx2);
+    adp_cnt_fini(ctx1);
+}
 
+/**
+ * Tests lazy reset.
+ *
+ * <ol>
+ * <li>Counts the same as reset by clearing the whole bitmap</li>
+ * <li>Serialized and merged bitmaps have no values from before reset</li>
+ * <li>Lazy reset could be turned off and isn't allowed on views</li>
+ * </ol>
+ * */
+TEST(AdaptiveCounting, LazyReset)
+{
+    adp_cnt_ctx_t *ctx = adp_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR);
+    adp_cnt_ctx_t *ref = adp_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR);
+    adp_cnt_ctx_t *tbm, *view;
+    uint8_t *buf = (uint8_t *)malloc(16384 + 3);
+    uint8_t *rbuf = (uint8_t *)malloc(16384 + 3);
+    uint32_t i, n, v, len, rlen;
+
+    EXPECT_EQ(adp_cnt_set_lazy_reset(ctx, 1), 0);
+    for (n = 10; n <= 100000; n *= 10) {
+        EXPECT_EQ(adp_cnt_reset(ctx), 0);
+        EXPECT_EQ(adp_cnt_reset(ref), 0);
+        EXPECT_EQ(adp_cnt_card(ctx), 0);
+        for (i = 0; i < n; i++) {
+            v = i * 7 + n;
+            EXPECT_EQ(adp_cnt_offer(ctx, &v, sizeof(v)),
+                      adp_cnt_offer(ref, &v, sizeof(v)));
+        }
+        EXPECT_EQ(adp_cnt_card(ctx), adp_cnt_card(ref));
+
+        len = rlen = 16384 + 3;
+        EXPECT_EQ(adp_cnt_get_bytes(ctx, buf, &len), 0);
+        EXPECT_EQ(adp_cnt_get_bytes(ref, rbuf, &rlen), 0);
+        EXPECT_EQ(len, rlen);
+        EXPECT_EQ(memcmp(buf, rbuf, len), 0);
+    }
+
+    // stale blocks of merged context are zeros
+    adp_cnt_reset(ctx);
+    adp_cnt_reset(ref);
+    for (i = 0; i < 10; i++) {
+        adp_cnt_offer(ctx, &i, sizeof(i));
+        adp_cnt_offer(ref, &i, sizeof(i));
+    }
+    tbm = adp_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR);
+    EXPECT_EQ(adp_cnt_merge(tbm, ctx, NULL), 0);
+    EXPECT_EQ(adp_cnt_card(tbm), adp_cnt_card(ref));
+    adp_cnt_fini(tbm);
+
+    adp_cnt_reset(ctx);
+    EXPECT_EQ(adp_cnt_set_lazy_reset(ctx, 0), 0);
+    EXPECT_EQ(adp_cnt_card(ctx), 0);
+    len = 16384 + 3;
+    EXPECT_EQ(adp_cnt_get_bytes(ctx, buf, &len), 0);
+    view = adp_cnt_view_init(buf, len, CCARD_VIEW_WRITABLE);
+    ASSERT_NE(view, (adp_cnt_ctx_t *)NULL);
+    EXPECT_EQ(adp_cnt_set_lazy_reset(view, 1), -1);
+    EXPECT_EQ(adp_cnt_errnum(view), CCARD_ERR_VIEW);
+
+    adp_cnt_fini(view);
+    adp_cnt_fini(ctx);
+    adp_cnt_fini(ref);
+    free(buf);
+    free(rbuf);
+}
+
+/**
+ * Tests copying contexts.
+ *
+ * <ol>
+ * <li>Clone serializes the same as the original in any representation, and
+ * is independent of it</li>
+ * <li>Copy overwrites contexts of other representations and k</li>
+ * <li>Loaded bitmap counts the same as the context it was got from</li>
+ * <li>Views could be copied from but not overwritten</li>
+ * </ol>
+ * */
+TEST(AdaptiveCounting, Copy)
+{
+    uint8_t opts[] = {
+        CCARD_HASH_MURMUR,
+        CCARD_HASH_MURMUR | CCARD_OPT_SPARSE,
+        CCARD_HASH_MURMUR | CCARD_OPT_EXPLICIT
+    };
+    uint32_t n[] = {10, 300, 20000};
+    uint8_t *buf = (uint8_t *)malloc(4096 + 3);
+    uint8_t *cbuf = (uint8_t *)malloc(4096 + 3);
+    uint32_t i, j, v, len, clen;
+    adp_cnt_ctx_t *dst = adp_cnt_raw_init(NULL, 8, CCARD_HASH_MURMUR);
+    adp_cnt_ctx_t *ctx, *cp, *view;
+
+    for (i = 0; i < sizeof(opts); i++) {
+        for (j = 0; j < 3; j++) {
+            ctx = adp_cnt_raw_init(NULL, 12, opts[i]);
+            for (v = 0; v < n[j]; v++) {
+                adp_cnt_offer(ctx, &v, sizeof(v));
+            }
+            len = 4096 + 3;
+            EXPECT_EQ(adp_cnt_get_bytes(ctx, buf, &len), 0);
+
+            cp = adp_cnt_clone(ctx);
+            ASSERT_NE(cp, (adp_cnt_ctx_t *)NULL);
+            EXPECT_EQ(adp_cnt_card(cp), adp_cnt_card(ctx));
+            clen = 4096 + 3;
+            EXPECT_EQ(adp_cnt_get_bytes(cp, cbuf, &clen), 0);
+            EXPECT_EQ(clen, len);
+            EXPECT_EQ(memcmp(cbuf, buf, len), 0);
+            for (v = 0; v < 1000; v++) {
+                adp_cnt_offer(cp, &v, sizeof(v));
+            }
+            clen = 4096 + 3;
+            EXPECT_EQ(adp_cnt_get_bytes(ctx, cbuf, &clen), 0);
+            EXPECT_EQ(memcmp(cbuf, buf, len), 0);
+            adp_cnt_fini(cp);
+
+            // dst holds the previous context, of another representation
+            EXPECT_EQ(adp_cnt_copy_into(dst, ctx), 0);
+            EXPECT_EQ(adp_cnt_card(dst), adp_cnt_card(ctx));
+            clen = 4096 + 3;
+            EXPECT_EQ(adp_cnt_get_bytes(dst, cbuf, &clen), 0);
+            EXPECT_EQ(clen, len);
+            EXPECT_EQ(memcmp(cbuf, buf, len), 0);
+
+            cp = adp_cnt_raw_init(NULL, 12, opts[i]);
+            EXPECT_EQ(adp_cnt_load_bytes(cp, buf, len), 0);
+            EXPECT_EQ(adp_cnt_card(cp), adp_cnt_card(ctx));
+            adp_cnt_fini(cp);
+            adp_cnt_fini(ctx);
+        }
+    }
+
+    // in place load of normal bitmap, stale blocks are overwritten
+    ctx = adp_cnt_raw_init(NULL, 12, opts[0]);
+    for (v = 0; v < 5000; v++) {
+        adp_cnt_offer(ctx, &v, sizeof(v));
+    }
+    len = 4096 + 3;
+    EXPECT_EQ(adp_cnt_get_bytes(ctx, buf, &len), 0);
+    EXPECT_EQ(len, 4096u + 3);
+    EXPECT_EQ(adp_cnt_set_lazy_reset(dst, 1), 0);
+    EXPECT_EQ(adp_cnt_copy_into(dst, ctx), 0);
+    EXPECT_EQ(adp_cnt_set_lazy_reset(ctx, 1), 0);
+    EXPECT_EQ(adp_cnt_reset(ctx), 0);
+    EXPECT_EQ(adp_cnt_load_bytes(ctx, buf, len), 0);
+    EXPECT_EQ(adp_cnt_card(ctx), adp_cnt_card(dst));
+    EXPECT_EQ(adp_cnt_load_bytes(ctx, buf, 3), -1);
+    EXPECT_EQ(adp_cnt_errnum(ctx), CCARD_ERR_INVALID_ARGUMENT);
+
+    view = adp_cnt_view_init(buf, len, CCARD_VIEW_WRITABLE);
+    ASSERT_NE(view, (adp_cnt_ctx_t *)NULL);
+    EXPECT_EQ(adp_cnt_copy_into(view, ctx), -1);
+    EXPECT_EQ(adp_cnt_errnum(view), CCARD_ERR_VIEW);
+    EXPECT_EQ(adp_cnt_load_bytes(view, buf, len), -1);
+    cp = adp_cnt_clone(view);
+    ASSERT_NE(cp, (adp_cnt_ctx_t *)NULL);
+    EXPECT_EQ(adp_cnt_card(cp), adp_cnt_card(view));
+    EXPECT_EQ(adp_cnt_reset(cp), 0);
+    EXPECT_NE(adp_cnt_card(view), 0);
+
+    EXPECT_EQ(adp_cnt_copy_into(NULL, ctx), -1);
+    EXPECT_EQ(adp_cnt_clone(NULL), (adp_cnt_ctx_t *)NULL);
+    adp_cnt_fini(cp);
+    adp_cnt_fini(view);
+    adp_cnt_fini(ctx);
+    adp_cnt_fini(dst);
+    free(buf);
+    free(cbuf);
+}
+
+/**
+ * Tests getting serialized bitmap as I/O vector.
+ *
+ * <ol>
+ * <li>Header and bitmap are the same bytes as adp_cnt_get_bytes</li>
+ * <li>Bitmap points into the context instead of a copy</li>
+ * <li>Explicit bitmaps aren't stored as they are serialized</li>
+ * </ol>
+ * */
+TEST(AdaptiveCounting, Iov)
+{
+    uint8_t opts[] = {CCARD_HASH_MURMUR, CCARD_HASH_MURMUR | CCARD_OPT_SPARSE};
+    uint8_t hdr[CCARD_IOV_HDR_LEN];
+    uint8_t *buf = (uint8_t *)malloc(4096 + 3);
+    uint8_t fail_opts[] = {CCARD_HASH_MURMUR | CCARD_OPT_EXPLICIT};
+    struct iovec iov[2];
+    uint32_t i, j, v, len;
+
+    for (i = 0; i < sizeof(opts); i++) {
+        for (j = 10; j <= 10000; j *= 10) {
+            adp_cnt_ctx_t *ctx = adp_cnt_raw_init(NULL, 12, opts[i]);
+
+            for (v = 0; v < j; v++) {
+                adp_cnt_offer(ctx, &v, sizeof(v));
+            }
+            len = 4096 + 3;
+            EXPECT_EQ(adp_cnt_get_bytes(ctx, buf, &len), 0);
+            EXPECT_EQ(adp_cnt_get_iov(ctx, hdr, iov), 0);
+            ASSERT_EQ(iov[0].iov_len + iov[1].iov_len, len);
+            EXPECT_EQ(iov[0].iov_base, (void *)hdr);
+            EXPECT_EQ(memcmp(iov[0].iov_base, buf, iov[0].iov_len), 0);
+            EXPECT_EQ(memcmp(iov[1].iov_base, buf + iov[0].iov_len,
+                             iov[1].iov_len), 0);
+            adp_cnt_fini(ctx);
+        }
+    }
+
+    for (i = 0; i < sizeof(fail_opts); i++) {
+        adp_cnt_ctx_t *ctx = adp_cnt_raw_init(NULL, 12, fail_opts[i]);
+
+        EXPECT_EQ(adp_cnt_get_iov(ctx, hdr, iov), -1);
+        EXPECT_EQ(adp_cnt_errnum(ctx), CCARD_ERR_INVALID_ARGUMENT);
+        adp_cnt_fini(ctx);
+    }
+
+    EXPECT_EQ(adp_cnt_get_iov(NULL, hdr, iov), -1);
+    free(buf);
+}
+
+struct offer_range_s {
+    adp_cnt_ctx_t *ctx;
+    uint32_t from;
+    uint32_t to;
+};
+
+static void *offer_range(void *arg)
+{
+    struct offer_range_s *r = (struct offer_range_s *)arg;
+    uint32_t i;
+
+    for (i = r->from; i < r->to; i++) {
+        adp_cnt_offer(r->ctx, &i, sizeof(i));
+    }
+    return NULL;
+}
+
+/**
+ * Tests concurrent offers.
+ *
+ * <ol>
+ * <li>Threads offer overlapping ranges to one context without locks</li>
+ * <li>Result is identical to offering all values serially</li>
+ * <li>Sparse buckets are converted to the normal bitmap first</li>
+ * <li>Sums of buckets are reconciled on read and when turned off</li>
+ * <li>Lazy reset isn't allowed meanwhile, nor concurrent views</li>
+ * </ol>
+ * */
+TEST(AdaptiveCounting, Concurrent)
+{
+    adp_cnt_ctx_t *ctx = adp_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR | CCARD_OPT_SPARSE);
+    adp_cnt_ctx_t *ref = adp_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR | CCARD_OPT_SPARSE);
+    adp_cnt_ctx_t *view;
+    uint8_t *buf = (uint8_t *)malloc(16384 + 3);
+    uint8_t *rbuf = (uint8_t *)malloc(16384 + 3);
+    struct offer_range_s ranges[4];
+    pthread_t threads[4];
+    uint32_t i, len, rlen;
+
+    for (i = 0; i < 100; i++) {
+        adp_cnt_offer(ctx, &i, sizeof(i));
+        adp_cnt_offer(ref, &i, sizeof(i));
+    }
+    EXPECT_EQ(adp_cnt_set_concurrent(ctx, 1), 0);
+    EXPECT_EQ(adp_cnt_set_lazy_reset(ctx, 1), -1);
+    EXPECT_EQ(adp_cnt_errnum(ctx), CCARD_ERR_INVALID_ARGUMENT);
+    EXPECT_EQ(adp_cnt_card(ctx), adp_cnt_card(ref));
+    EXPECT_EQ(adp_cnt_card_loglog(ctx), adp_cnt_card_loglog(ref));
+
+    for (i = 0; i < 4; i++) {
+        ranges[i].ctx = ctx;
+        ranges[i].from = i * 50000;
+        ranges[i].to = i * 50000 + 80000;
+        ASSERT_EQ(pthread_create(&threads[i], NULL, offer_range, &ranges[i]), 0);
+    }
+    for (i = 0; i < 4; i++) {
+        ASSERT_EQ(pthread_join(threads[i], NULL), 0);
+    }
+    for (i = 0; i < 3 * 50000 + 80000; i++) {
+        adp_cnt_offer(ref, &i, sizeof(i));
+    }
+
+    len = rlen = 16384 + 3;
+    EXPECT_EQ(adp_cnt_get_bytes(ctx, buf, &len), 0);
+    EXPECT_EQ(adp_cnt_get_bytes(ref, rbuf, &rlen), 0);
+    EXPECT_EQ(len, rlen);
+    EXPECT_EQ(memcmp(buf, rbuf, len), 0);
+    EXPECT_EQ(adp_cnt_card(ctx), adp_cnt_card(ref));
+    EXPECT_EQ(adp_cnt_card_loglog(ctx), adp_cnt_card_loglog(ref));
+
+    printf("actual:230000, estimated: %9lu\n",
+           (long unsigned int)adp_cnt_card(ctx));
+
+    // copied bitmaps stay dense in a concurrent context
+    adp_cnt_reset(ref);
+    EXPECT_EQ(adp_cnt_copy_into(ctx, ref), 0);
+    EXPECT_EQ(adp_cnt_card(ctx), 0);
+    ranges[0].from = 0;
+    ranges[0].to = 1000;
+    ranges[1].from = 500;
+    ranges[1].to = 1500;
+    for (i = 0; i < 2; i++) {
+        ASSERT_EQ(pthread_create(&threads[i], NULL, offer_range, &ranges[i]), 0);
+    }
+    for (i = 0; i < 2; i++) {
+        ASSERT_EQ(pthread_join(threads[i], NULL), 0);
+    }
+    for (i = 0; i < 1500; i++) {
+        adp_cnt_offer(ref, &i, sizeof(i));
+    }
+    EXPECT_EQ(adp_cnt_card(ctx), adp_cnt_card(ref));
+    EXPECT_EQ(adp_cnt_card_loglog(ctx), adp_cnt_card_loglog(ref));
+
+    EXPECT_EQ(adp_cnt_set_concurrent(ctx, 0), 0);
+    EXPECT_EQ(adp_cnt_card(ctx), adp_cnt_card(ref));
+    EXPECT_EQ(adp_cnt_card_loglog(ctx), adp_cnt_card_loglog(ref));
+
+    len = 16384 + 3;
+    EXPECT_EQ(adp_cnt_get_bytes(ctx, buf, &len), 0);
+    view = adp_cnt_view_init(buf, len, CCARD_VIEW_WRITABLE);
+    ASSERT_NE(view, (adp_cnt_ctx_t *)NULL);
+    EXPECT_EQ(adp_cnt_set_concurrent(view, 1), -1);
+    EXPECT_EQ(adp_cnt_errnum(view), CCARD_ERR_VIEW);
+
+    adp_cnt_fini(view);
+    adp_cnt_fini(ctx);
+    adp_cnt_fini(ref);
+    free(buf);
+    free(rbuf);
+}
+
+
+// vi:ft=c ts=4 sw=4 fdm=marker et
@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ccard_common.h"
+#include "bitmap_codec.h"
+#include "gtest/gtest.h"
+
+static uint32_t roundtrip(const uint8_t *in, uint32_t len, uint8_t mode)
+{
+    uint32_t clen = bc_encode(in, len, mode, NULL), olen = 0;
+    uint8_t *cbuf = (uint8_t *)malloc(clen);
+    uint8_t *out = (uint8_t *)malloc(len);
+
+    EXPECT_EQ(bc_encode(in, len, mode, cbuf), clen);
+    EXPECT_EQ(bc_decode(cbuf, clen, NULL, &olen), 0);
+    EXPECT_EQ(olen, len);
+    EXPECT_EQ(bc_decode(cbuf, clen, out, &olen), 0);
+    EXPECT_EQ(memcmp(in, out, len), 0);
+
+    // truncated bytes are rejected
+    olen = len;
+    EXPECT_EQ(bc_decode(cbuf, clen - 1, out, &olen), -1);
+
+    free(out);
+    free(cbuf);
+    return clen;
+}
+
+/**
+ * Tests encoding registers.
+ *
+ * <ol>
+ * <li>Registers around the mean are packed with a few exceptions</li>
+ * <li>Long zero runs cost a few bytes</li>
+ * <li>Incompressible bitmaps are stored as they are</li>
+ * </ol>
+ * */
+TEST(BitmapCodecTest, Registers)
+{
+    uint8_t M[4096];
+    uint32_t i, clen;
+
+    srand(1);
+    for (i = 0; i < sizeof(M); i++) {
+        M[i] = 8 + rand() % 6;
+    }
+    M[7] = 40;
+    M[100] = 1;
+    M[200] = 0;
+    clen = roundtrip(M, sizeof(M), BC_REGISTERS);
+    EXPECT_LE(clen, sizeof(M) * 3 / 8 + 16);
+
+    memset(M + 1000, 0, 3000);
+    clen = roundtrip(M, sizeof(M), BC_REGISTERS);
+    EXPECT_LE(clen, 1096 * 3 / 8 + 32);
+
+    memset(M, 0, sizeof(M));
+    EXPECT_LE(roundtrip(M, sizeof(M), BC_REGISTERS), 16u);
+
+    for (i = 0; i < 64; i++) {
+        M[i] = rand() & 0xff;
+    }
+    clen = roundtrip(M, 64, BC_REGISTERS);
+    EXPECT_EQ(clen, 64u + 2);
+}
+
+/**
+ * Tests encoding sparse, explicit and bit array bitmaps.
+ *
+ * <ol>
+ * <li>Sparse bucket indexes are delta-varint encoded</li>
+ * <li>Explicit hash values are delta-varint encoded</li>
+ * <li>Positions of the less common bits are encoded</li>
+ * <li>Bitmaps of another format fall back to be stored</li>
+ * </ol>
+ * */
+TEST(BitmapCodecTest, Lists)
+{
+    uint8_t S[1 + 100 * 4], E[1 + 100 * 8], B[1024];
+    uint64_t h;
+    uint32_t i, j;
+
+    S[0] = MAKE_SPARSE_ID(20);
+    for (i = 0; i < 100; i++) {
+        S[1 + i * 4] = 1 + i % 30;
+        sparse_int_to_bytes(S, 2 + i * 4, 3, i * 9000);
+    }
+    EXPECT_LE(roundtrip(S, 1 + 100 * 4, BC_SPARSE), 1u + 100 * 3 + 4);
+
+    E[0] = MAKE_EXPLICIT_ID(14);
+    for (i = 0; i < 100; i++) {
+        h = (uint64_t)i << 40 | i;
+        for (j = 0; j < 8; j++) {
+            E[1 + i * 8 + j] = (h >> (j * 8)) & 0xff;
+        }
+    }
+    EXPECT_LE(roundtrip(E, sizeof(E), BC_EXPLICIT), 1u + 100 * 6 + 4);
+
+    memset(B, 0, sizeof(B));
+    B[3] = 0x81;
+    B[1000] = 0x10;
+    EXPECT_LE(roundtrip(B, sizeof(B), BC_BITS), 12u);
+    memset(B, 0xff, sizeof(B));
+    B[500] = 0xef;
+    EXPECT_LE(roundtrip(B, sizeof(B), BC_BITS), 8u);
+
+    EXPECT_EQ(roundtrip(E, sizeof(E), BC_SPARSE), sizeof(E) + 3);
+    EXPECT_EQ(roundtrip(S, 1 + 100 * 4, BC_EXPLICIT), 1u + 100 * 4 + 3);
+}
+
+/**
+ * Tests compressing serialized bytes.
+ *
+ * <ol>
+ * <li>Header is kept with CCARD_FLAG_COMPRESSED set</li>
+ * <li>Decompressed bytes are the same as the original ones</li>
+ * <li>Uncompressed or corrupted bytes are rejected</li>
+ * </ol>
+ * */
+TEST(BitmapCodecTest, Bytes)
+{
+    uint8_t buf[3 + 256], cbuf[3 + 256 + 8], *out;
+    uint32_t i, clen, olen;
+
+    buf[0] = CCARD_ALGO_HYPERLOGLOG;
+    buf[1] = CCARD_HASH_MURMUR;
+    buf[2] = 8;
+    for (i = 0; i < 256; i++) {
+        buf[3 + i] = 3 + i % 4;
+    }
+
+    EXPECT_EQ(bc_compress_bytes(buf, sizeof(buf), BC_REGISTERS, NULL, &clen), 0);
+    EXPECT_LT(clen, sizeof(buf) / 2);
+    olen = clen - 1;
+    EXPECT_EQ(bc_compress_bytes(buf, sizeof(buf), BC_REGISTERS, cbuf, &olen), -1);
+    EXPECT_EQ(bc_compress_bytes(buf, sizeof(buf), BC_REGISTERS, cbuf, &clen), 0);
+    EXPECT_EQ(cbuf[0], CCARD_ALGO_HYPERLOGLOG | CCARD_FLAG_COMPRESSED);
+    EXPECT_EQ(cbuf[1], CCARD_HASH_MURMUR);
+    EXPECT_EQ(cbuf[2], 8);
+    EXPECT_EQ(bc_compress_bytes(cbuf, clen, BC_REGISTERS, NULL, &olen), -1);
+
+    out = bc_decompress_bytes(cbuf, clen, &olen);
+    EXPECT_NE(out, (uint8_t *)NULL);
+    EXPECT_EQ(olen, sizeof(buf));
+    EXPECT_EQ(memcmp(out, buf, olen), 0);
+    free(out);
+
+    EXPECT_EQ(bc_decompress_bytes(buf, sizeof(buf), &olen), (uint8_t *)NULL);
+    cbuf[3] = 0xf0 | BC_REGISTERS;
+    EXPECT_EQ(bc_decompress_bytes(cbuf, clen, &olen), (uint8_t *)NULL);
+}
+
+// vi:ft=c ts=4 sw=4 fdm=marker et
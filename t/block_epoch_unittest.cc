@@ -0,0 +1,63 @@
+#include <stdlib.h>
+#include <string.h>
+#include "block_epoch.h"
+#include "gtest/gtest.h"
+
+/**
+ * Tests lazy reset of blocks.
+ *
+ * <ol>
+ * <li>Reset makes all blocks stale without clearing them</li>
+ * <li>Touching a byte clears its block only</li>
+ * <li>Flush clears all stale blocks, including the partial last one</li>
+ * </ol>
+ * */
+TEST(BlockEpochTest, Reset)
+{
+    uint32_t len = (3 << BE_SHIFT) + 10, i;
+    uint8_t *M = (uint8_t *)malloc(len);
+    blk_epoch_t *be = be_init(len, NULL);
+
+    ASSERT_NE(be, (blk_epoch_t *)NULL);
+    EXPECT_EQ(be->blocks, 4u);
+    EXPECT_EQ(be->stale, 0u);
+    memset(M, 0xff, len);
+    EXPECT_FALSE(BE_STALE(be, 0));
+
+    be_reset(be, M);
+    EXPECT_EQ(be->stale, 4u);
+    EXPECT_TRUE(BE_STALE(be, len - 1));
+    EXPECT_EQ(M[0], 0xff);
+
+    be_touch(be, M, (1 << BE_SHIFT) + 5);
+    EXPECT_EQ(be->stale, 3u);
+    EXPECT_FALSE(BE_STALE(be, 1 << BE_SHIFT));
+    EXPECT_EQ(M[1 << BE_SHIFT], 0);
+    EXPECT_EQ(M[(2 << BE_SHIFT) - 1], 0);
+    EXPECT_EQ(M[0], 0xff);
+    EXPECT_EQ(M[2 << BE_SHIFT], 0xff);
+    M[(1 << BE_SHIFT) + 5] = 7;
+    be_touch(be, M, (1 << BE_SHIFT) + 5);
+    EXPECT_EQ(M[(1 << BE_SHIFT) + 5], 7);
+
+    be_flush(be, M);
+    EXPECT_EQ(be->stale, 0u);
+    for (i = 0; i < len; i++) {
+        EXPECT_EQ(M[i], i == (1 << BE_SHIFT) + 5 ? 7 : 0);
+    }
+
+    // wrapped epoch clears the array at once
+    memset(M, 0xff, len);
+    be->epoch = UINT32_MAX;
+    be_reset(be, M);
+    EXPECT_EQ(be->stale, 0u);
+    for (i = 0; i < len; i++) {
+        EXPECT_EQ(M[i], 0);
+    }
+
+    EXPECT_EQ(be_fini(be), 0);
+    EXPECT_EQ(be_fini(NULL), -1);
+    free(M);
+}
+
+// vi:ft=c ts=4 sw=4 fdm=marker et
@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ccard_common.h"
+#include "ccard_alloc.h"
+#include "adaptive_counting.h"
+#include "hyperloglog_counting.h"
+#include "hyperloglogplus_counting.h"
+#include "linear_counting.h"
+#include "gtest/gtest.h"
+
+struct counter_s {
+    int live;
+    int total;
+    int limit;  // allocations fail once total reaches it, 0 for no limit
+};
+
+static void *counting_malloc(void *opaque, size_t size)
+{
+    struct counter_s *c = (struct counter_s *)opaque;
+
+    if (c->limit && c->total >= c->limit) {
+        return NULL;
+    }
+    c->live++;
+    c->total++;
+    return malloc(size);
+}
+
+static void *counting_realloc(void *opaque, void *ptr, size_t size)
+{
+    struct counter_s *c = (struct counter_s *)opaque;
+
+    if (!ptr) {
+        if (c->limit && c->total >= c->limit) {
+            return NULL;
+        }
+        c->live++;
+        c->total++;
+    }
+    return realloc(ptr, size);
+}
+
+static void counting_free(void *opaque, void *ptr)
+{
+    struct counter_s *c = (struct counter_s *)opaque;
+
+    c->live--;
+    free(ptr);
+}
+
+static void offer_all(void *ctx, ccard_algo_t *algo, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        algo->offer(ctx, &i, sizeof(i));
+    }
+}
+
+/**
+ * Tests global allocator.
+ *
+ * <ol>
+ * <li>Contexts of all algorithms get memory from the global allocator</li>
+ * <li>All memory is given back by fini, including sparse and explicit
+ * buckets</li>
+ * <li>Contexts keep their allocator after the global one is restored</li>
+ * </ol>
+ * */
+TEST(CCardAllocTest, Global)
+{
+    struct counter_s c = {0, 0, 0};
+    ccard_allocator_t alloc = {
+        counting_malloc, counting_realloc, counting_free, &c
+    };
+    ccard_algo_t *algos[] = {adp_algo, hll_algo, hllp_algo, lnr_algo};
+    uint8_t opts[] = {CCARD_OPT_SPARSE, CCARD_OPT_EXPLICIT, 0};
+    void *ctx;
+    uint32_t i, j;
+
+    ccard_set_allocator(&alloc);
+    EXPECT_EQ(ccard_get_allocator(), &alloc);
+
+    for (i = 0; i < sizeof(algos) / sizeof(algos[0]); i++) {
+        for (j = 0; j < sizeof(opts) / sizeof(opts[0]); j++) {
+            ctx = algos[i]->raw_init(NULL, 12, CCARD_HASH_MURMUR | opts[j]);
+            ASSERT_NE(ctx, (void *)NULL);
+            EXPECT_GT(c.live, 0);
+            offer_all(ctx, algos[i], 20000);
+            EXPECT_GT(algos[i]->card(ctx), 0);
+            algos[i]->fini(ctx);
+            EXPECT_EQ(c.live, 0);
+        }
+    }
+
+    ctx = hll_cnt_init(NULL, 10, CCARD_HASH_MURMUR);
+    ccard_set_allocator(NULL);
+    EXPECT_NE(ccard_get_allocator(), &alloc);
+    offer_all(ctx, hll_algo, 100);
+    EXPECT_GT(c.live, 0);
+    hll_cnt_fini((hll_cnt_ctx_t *)ctx);
+    EXPECT_EQ(c.live, 0);
+}
+
+/**
+ * Tests per-context allocator.
+ *
+ * <ol>
+ * <li>Given allocator is used instead of the global one</li>
+ * <li>Contexts initialized from serialized bitmaps use it as well</li>
+ * </ol>
+ * */
+TEST(CCardAllocTest, Context)
+{
+    struct counter_s c = {0, 0, 0};
+    ccard_allocator_t alloc = {
+        counting_malloc, counting_realloc, counting_free, &c
+    };
+    adp_cnt_ctx_t *adp = adp_cnt_raw_init_alloc(NULL, 10, CCARD_HASH_MURMUR,
+                                                &alloc);
+    hllp_cnt_ctx_t *hllp = hllp_cnt_raw_init_alloc(NULL, 10, CCARD_OPT_SPARSE,
+                                                   &alloc);
+    lnr_cnt_ctx_t *lnr = lnr_cnt_raw_init_alloc(NULL, 10, CCARD_HASH_MURMUR,
+                                                &alloc);
+    hll_cnt_ctx_t *hll = hll_cnt_raw_init_alloc(NULL, 10, CCARD_HASH_MURMUR,
+                                                NULL), *copy;
+    uint8_t buf[3 + 1024];
+    uint32_t len = sizeof(buf);
+    int live = c.live;
+
+    EXPECT_GE(live, 4);
+    offer_all(hll, hll_algo, 1000);
+    EXPECT_EQ(c.live, live);
+    offer_all(hllp, hllp_algo, 1000);
+    offer_all(adp, adp_algo, 1000);
+    offer_all(lnr, lnr_algo, 1000);
+
+    EXPECT_EQ(hll_cnt_get_bytes(hll, buf, &len), 0);
+    copy = hll_cnt_init_alloc(buf, len, CCARD_HASH_MURMUR, &alloc);
+    EXPECT_EQ(hll_cnt_card(copy), hll_cnt_card(hll));
+
+    adp_cnt_fini(adp);
+    hllp_cnt_fini(hllp);
+    lnr_cnt_fini(lnr);
+    hll_cnt_fini(copy);
+    hll_cnt_fini(hll);
+    EXPECT_EQ(c.live, 0);
+}
+
+/**
+ * Tests failed allocations while merging.
+ *
+ * <ol>
+ * <li>Merging bitmaps of higher precision fails if any allocation for
+ * folding them fails</li>
+ * <li>Memory allocated for the failed merge is given back</li>
+ * <li>Merge succeeds once allocations don't fail</li>
+ * </ol>
+ * */
+TEST(CCardAllocTest, MergeFailure)
+{
+    struct counter_s c = {0, 0, 0};
+    ccard_allocator_t alloc = {
+        counting_malloc, counting_realloc, counting_free, &c
+    };
+    adp_cnt_ctx_t *src = adp_cnt_raw_init(NULL, 12, CCARD_HASH_MURMUR);
+    adp_cnt_ctx_t *ctx;
+    uint8_t buf[1 << 12];
+    uint32_t len = sizeof(buf);
+    int n, live, rc = -1;
+
+    offer_all(src, adp_algo, 1000);
+    EXPECT_EQ(adp_cnt_get_raw_bytes(src, buf, &len), 0);
+
+    // let the n-th allocation of the merge fail, until none fails
+    for (n = 0; rc != 0; n++) {
+        ctx = adp_cnt_raw_init_alloc(NULL, 10, CCARD_HASH_MURMUR, &alloc);
+        ASSERT_NE(ctx, (adp_cnt_ctx_t *)NULL);
+        offer_all(ctx, adp_algo, 100);
+        live = c.live;
+        c.limit = c.total + n;
+        rc = adp_cnt_merge_raw_bytes(ctx, buf, len, NULL);
+        c.limit = 0;
+        if (rc != 0) {
+            EXPECT_EQ(adp_cnt_errnum(ctx), CCARD_ERR_MERGE_FAILED);
+            EXPECT_EQ(c.live, live);
+        } else {
+            EXPECT_GT(n, 0);
+            EXPECT_NEAR(adp_cnt_card(ctx), 1000, 100);
+        }
+        adp_cnt_fini(ctx);
+        EXPECT_EQ(c.live, 0);
+    }
+
+    adp_cnt_fini(src);
+}
+
+/**
+ * Tests failed allocation of concurrent mode.
+ *
+ * <ol>
+ * <li>Turning concurrent mode on fails if accumulators can't be
+ * allocated</li>
+ * <li>Context is left sparse as it was</li>
+ * </ol>
+ * */
+TEST(CCardAllocTest, ConcurrentFailure)
+{
+    struct counter_s c = {0, 0, 0};
+    ccard_allocator_t alloc = {
+        counting_malloc, counting_realloc, counting_free, &c
+    };
+    adp_cnt_ctx_t *ctx = adp_cnt_raw_init_alloc(NULL, 12,
+                                                CCARD_HASH_MURMUR |
+                                                CCARD_OPT_SPARSE, &alloc);
+    uint8_t buf[1 << 12];
+    uint32_t len = sizeof(buf);
+    int64_t card;
+    int live;
+
+    ASSERT_NE(ctx, (adp_cnt_ctx_t *)NULL);
+    offer_all(ctx, adp_algo, 100);
+    card = adp_cnt_card(ctx);
+    live = c.live;
+
+    c.limit = c.total;
+    EXPECT_EQ(adp_cnt_set_concurrent(ctx, 1), -1);
+    EXPECT_EQ(adp_cnt_errnum(ctx), CCARD_ERR_NOMEM);
+    EXPECT_STREQ(adp_cnt_errstr(adp_cnt_errnum(ctx)), "Out of memory");
+    EXPECT_EQ(c.live, live);
+    EXPECT_EQ(adp_cnt_get_raw_bytes(ctx, buf, &len), 0);
+    EXPECT_TRUE(IS_SPARSE_BMP(buf));
+    EXPECT_EQ(adp_cnt_card(ctx), card);
+
+    c.limit = 0;
+    EXPECT_EQ(adp_cnt_set_concurrent(ctx, 1), 0);
+    len = sizeof(buf);
+    EXPECT_EQ(adp_cnt_get_raw_bytes(ctx, buf, &len), 0);
+    EXPECT_FALSE(IS_SPARSE_BMP(buf));
+    EXPECT_EQ(adp_cnt_card(ctx), card);
+
+    adp_cnt_fini(ctx);
+    EXPECT_EQ(c.live, 0);
+}
+
+/**
+ * Tests bump arena.
+ *
+ * <ol>
+ * <li>Many contexts are carved from a few blocks</li>
+ * <li>Contexts in arena count like the normal ones</li>
+ * <li>The latest allocation grows in place and is given back on free</li>
+ * <li>Reset releases everything but the first block</li>
+ * </ol>
+ * */
+TEST(CCardAllocTest, Arena)
+{
+    ccard_arena_t *arena = ccard_arena_init(0);
+    const ccard_allocator_t *alloc;
+    hll_cnt_ctx_t *ctx[1000];
+    hll_cnt_ctx_t *ref = hll_cnt_init(NULL, 8, CCARD_HASH_MURMUR);
+    uint8_t *p, *q;
+    uint32_t i;
+
+    ASSERT_NE(arena, (ccard_arena_t *)NULL);
+    alloc = ccard_arena_allocator(arena);
+    EXPECT_EQ(ccard_arena_size(arena), 65536u);
+
+    for (i = 0; i < 1000; i++) {
+        ctx[i] = hll_cnt_init_alloc(NULL, 8, CCARD_HASH_MURMUR, alloc);
+        ASSERT_NE(ctx[i], (hll_cnt_ctx_t *)NULL);
+        offer_all(ctx[i], hll_algo, 100);
+    }
+    offer_all(ref, hll_algo, 100);
+    EXPECT_EQ(hll_cnt_card(ctx[999]), hll_cnt_card(ref));
+    EXPECT_LE(ccard_arena_size(arena), 1000u * 512);
+
+    p = (uint8_t *)ccard_malloc(alloc, 100);
+    memset(p, 1, 100);
+    q = (uint8_t *)ccard_realloc(alloc, p, 200);
+    EXPECT_EQ(p, q);
+    EXPECT_EQ(q[99], 1);
+    ccard_free(alloc, q);
+    EXPECT_EQ(ccard_malloc(alloc, 10), p);
+
+    // large allocations get blocks of their own
+    p = (uint8_t *)ccard_calloc(alloc, 1, 1 << 20);
+    ASSERT_NE(p, (uint8_t *)NULL);
+    EXPECT_EQ(p[(1 << 20) - 1], 0);
+
+    EXPECT_EQ(ccard_arena_reset(arena), 0);
+    EXPECT_EQ(ccard_arena_size(arena), 65536u);
+    ctx[0] = hll_cnt_init_alloc(NULL, 8, CCARD_HASH_MURMUR, alloc);
+    EXPECT_EQ(hll_cnt_card(ctx[0]), 0);
+    EXPECT_EQ(hll_cnt_fini(ctx[0]), 0);
+
+    EXPECT_EQ(ccard_arena_fini(arena), 0);
+    EXPECT_EQ(ccard_arena_reset(NULL), -1);
+    EXPECT_EQ(ccard_arena_fini(NULL), -1);
+    hll_cnt_fini(ref);
+}
+
+/**
+ * Tests slab allocator.
+ *
+ * <ol>
+ * <li>Chunks grow in place within their size class</li>
+ * <li>Freed chunks are reused</li>
+ * <li>Large allocations are kept apart and released by reset</li>
+ * </ol>
+ * */
+TEST(CCardAllocTest, Slab)
+{
+    ccard_slab_t *slab = ccard_slab_init();
+    const ccard_allocator_t *alloc;
+    hll_cnt_ctx_t *ctx, *ref;
+    uint8_t *p, *q, *r;
+    uint32_t i;
+
+    ASSERT_NE(slab, (ccard_slab_t *)NULL);
+    alloc = ccard_slab_allocator(slab);
+    EXPECT_EQ(ccard_slab_size(slab), 0u);
+
+    p = (uint8_t *)ccard_malloc(alloc, 20);
+    memset(p, 1, 20);
+    EXPECT_EQ(ccard_realloc(alloc, p, 32), p);
+    q = (uint8_t *)ccard_realloc(alloc, p, 33);
+    EXPECT_NE(q, p);
+    EXPECT_EQ(q[19], 1);
+    EXPECT_EQ(ccard_malloc(alloc, 30), p);
+    ccard_free(alloc, q);
+    EXPECT_EQ(ccard_malloc(alloc, 64), q);
+    EXPECT_EQ(ccard_slab_size(slab), 65536u);
+
+    r = (uint8_t *)ccard_calloc(alloc, 1, 100000);
+    ASSERT_NE(r, (uint8_t *)NULL);
+    EXPECT_EQ(r[99999], 0);
+    EXPECT_EQ(ccard_slab_size(slab), 65536u + 100000);
+    r = (uint8_t *)ccard_realloc(alloc, r, 100001);
+    EXPECT_EQ(ccard_slab_size(slab), 65536u + 150000);
+    EXPECT_EQ(ccard_realloc(alloc, r, 150000), r);
+    ccard_free(alloc, r);
+    EXPECT_EQ(ccard_slab_size(slab), 65536u);
+
+    // sparse counter grows bucket by bucket
+    ctx = hll_cnt_raw_init_alloc(NULL, 14,
+                                 CCARD_HASH_MURMUR | CCARD_OPT_SPARSE, alloc);
+    ref = hll_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR | CCARD_OPT_SPARSE);
+    for (i = 0; i < 5000; i++) {
+        hll_cnt_offer(ctx, &i, sizeof(i));
+        hll_cnt_offer(ref, &i, sizeof(i));
+    }
+    EXPECT_EQ(hll_cnt_card(ctx), hll_cnt_card(ref));
+    EXPECT_LE(ccard_slab_size(slab), 4u * 65536);
+    hll_cnt_fini(ref);
+
+    EXPECT_EQ(ccard_slab_reset(slab), 0);
+    EXPECT_EQ(ccard_slab_size(slab), 0u);
+    EXPECT_EQ(ccard_slab_fini(slab), 0);
+    EXPECT_EQ(ccard_slab_fini(NULL), -1);
+}
+
+/**
+ * Tests huge page allocator.
+ *
+ * <ol>
+ * <li>Small allocations are got from the global allocator</li>
+ * <li>Large bitmaps are mapped, and count the same</li>
+ * <li>Sparse bitmap converted to a large normal one moves to a mapping</li>
+ * <li>Mappings are released by fini</li>
+ * </ol>
+ * */
+TEST(CCardAllocTest, Huge)
+{
+    ccard_huge_t *huge = ccard_huge_init(1 << 20, 0, CCARD_HUGE_HUGETLB);
+    const ccard_allocator_t *alloc;
+    uint8_t *p;
+    void *ctx, *ref;
+
+    ASSERT_NE(huge, (ccard_huge_t *)NULL);
+    alloc = ccard_huge_allocator(huge);
+
+    p = (uint8_t *)ccard_malloc(alloc, 100);
+    EXPECT_EQ(ccard_huge_mapped(huge), 0u);
+    p = (uint8_t *)ccard_realloc(alloc, p, 3 << 20);
+    ASSERT_NE(p, (uint8_t *)NULL);
+    EXPECT_EQ(ccard_huge_mapped(huge), 4u << 20);
+    p[(3 << 20) - 1] = 1;
+    EXPECT_EQ(ccard_realloc(alloc, p, 2 << 20), p);
+    ccard_free(alloc, p);
+    EXPECT_EQ(ccard_huge_mapped(huge), 0u);
+
+    ctx = adp_algo->raw_init_alloc(NULL, 22, CCARD_HASH_MURMUR, alloc);
+    ref = adp_algo->raw_init(NULL, 22, CCARD_HASH_MURMUR);
+    EXPECT_GE(ccard_huge_mapped(huge), 4u << 20);
+    offer_all(ctx, adp_algo, 100000);
+    offer_all(ref, adp_algo, 100000);
+    EXPECT_EQ(adp_algo->card(ctx), adp_algo->card(ref));
+    adp_algo->fini(ctx);
+    adp_algo->fini(ref);
+    EXPECT_EQ(ccard_huge_mapped(huge), 0u);
+
+    ctx = hll_algo->raw_init_alloc(NULL, 21,
+                                   CCARD_HASH_MURMUR | CCARD_OPT_SPARSE, alloc);
+    EXPECT_EQ(ccard_huge_mapped(huge), 0u);
+    offer_all(ctx, hll_algo, 500000);
+    EXPECT_GE(ccard_huge_mapped(huge), 2u << 20);
+    hll_algo->fini(ctx);
+    EXPECT_EQ(ccard_huge_mapped(huge), 0u);
+
+    EXPECT_EQ(ccard_huge_fini(huge), 0);
+    EXPECT_EQ(ccard_huge_fini(NULL), -1);
+    EXPECT_EQ(ccard_huge_init(0, 1000, 0), (ccard_huge_t *)NULL);
+}
+
+/**
+ * Benchmarks offering to large bitmaps with and without huge pages.
+ *
+ * <p>
+ * Prints offers per second of adaptive and linear counters of k from 24 to
+ * 28, each offered 2^24 random values. It's disabled by default, run it by
+ * unittest --gtest_also_run_disabled_tests --gtest_filter='*Bench*'
+ * </p>
+ * */
+TEST(CCardAllocTest, DISABLED_HugeBench)
+{
+    ccard_algo_t *algos[] = {adp_algo, lnr_algo};
+    const char *names[] = {"adp", "lnr"};
+    ccard_huge_t *huge = ccard_huge_init(0, -1, 0);
+    struct timespec t0, t1;
+    uint64_t v, x = 88172645463325252ULL;
+    uint32_t a, k, h, i, n = 1 << 24;
+    void *ctx;
+    double secs;
+
+    for (a = 0; a < 2; a++) {
+        for (k = 24; k <= 28; k++) {
+            for (h = 0; h < 2; h++) {
+                ctx = algos[a]->raw_init_alloc(NULL, k, CCARD_HASH_MURMUR,
+                                               h ? ccard_huge_allocator(huge)
+                                                 : NULL);
+                ASSERT_NE(ctx, (void *)NULL);
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+                for (i = 0; i < n; i++) {
+                    // xorshift, values are distinct
+                    x ^= x << 13;
+                    x ^= x >> 7;
+                    x ^= x << 17;
+                    v = x;
+                    algos[a]->offer(ctx, &v, sizeof(v));
+                }
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+                printf("%s k=%u huge=%u: %.2f Mops/s\n", names[a], k, h,
+                       n / secs / 1e6);
+                algos[a]->fini(ctx);
+            }
+        }
+    }
+
+    ccard_huge_fini(huge);
+}
+
+// vi:ft=c ts=4 sw=4 fdm=marker et
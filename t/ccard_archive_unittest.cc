@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "ccard_common.h"
+#include "ccard_archive.h"
+#include "adaptive_counting.h"
+#include "hyperloglog_counting.h"
+#include "gtest/gtest.h"
+
+/**
+ * Tests merging archive of serialized bitmaps.
+ *
+ * <ol>
+ * <li>Write 10 bitmaps each contains 5000 distinct elements to archive</li>
+ * <li>Merge the whole archive into an empty context</li>
+ * <li>Result should be identical to merging bitmaps one by one</li>
+ * </ol>
+ * */
+TEST(CcardArchive, MergeHyperloglog)
+{
+    char path[] = "/tmp/ccard_archive_XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+
+    hll_cnt_ctx_t *ctx = hll_cnt_init(NULL, 12, CCARD_HASH_MURMUR);
+    hll_cnt_ctx_t *expect = hll_cnt_init(NULL, 12, CCARD_HASH_MURMUR);
+    uint32_t m = 1 << 14;
+    uint8_t *buf = (uint8_t *)malloc(m + 3);
+
+    for (int64_t n = 0; n < 10; n++) {
+        /* mix bitmaps of different precision */
+        hll_cnt_ctx_t *tbm = hll_cnt_init(NULL, n % 2 ? 14 : 12, CCARD_HASH_MURMUR);
+        for (int64_t i = n * 5000; i < (n + 1) * 5000; i++) {
+            hll_cnt_offer(tbm, &i, sizeof(int64_t));
+        }
+
+        uint32_t len = m + 3;
+        EXPECT_EQ(hll_cnt_get_bytes(tbm, buf, &len), 0);
+        EXPECT_EQ(ccard_archive_append(fd, buf, len), CCARD_OK);
+        EXPECT_EQ(hll_cnt_merge_bytes(expect, buf, len, NULL), 0);
+        hll_cnt_fini(tbm);
+    }
+    close(fd);
+
+    EXPECT_EQ(ccard_archive_merge(ctx, hll_algo, path), CCARD_OK);
+    EXPECT_EQ(hll_cnt_card(ctx), hll_cnt_card(expect));
+    printf("actual:50000, estimated: %9lu\n", (long unsigned int)hll_cnt_card(ctx));
+
+    /* truncated archive should be detected */
+    EXPECT_EQ(truncate(path, 100), 0);
+    EXPECT_EQ(ccard_archive_merge(ctx, hll_algo, path), CCARD_ERR_IO);
+
+    EXPECT_EQ(ccard_archive_merge(ctx, hll_algo, "/nonexistent/archive"), CCARD_ERR_IO);
+
+    unlink(path);
+    free(buf);
+    hll_cnt_fini(expect);
+    hll_cnt_fini(ctx);
+}
+
+/**
+ * Tests merging archive with both sparse and normal adaptive bitmaps.
+ * */
+TEST(CcardArchive, MergeAdaptive)
+{
+    char path[] = "/tmp/ccard_archive_XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+
+    adp_cnt_ctx_t *ctx = adp_cnt_init(NULL, 14, CCARD_HASH_MURMUR);
+    adp_cnt_ctx_t *expect = adp_cnt_init(NULL, 14, CCARD_HASH_MURMUR);
+    uint32_t m = 1 << 14;
+    uint8_t *buf = (uint8_t *)malloc(m + 3);
+
+    for (int64_t n = 0; n < 6; n++) {
+        adp_cnt_ctx_t *tbm = adp_cnt_init(NULL, 14, CCARD_HASH_MURMUR | CCARD_OPT_SPARSE);
+        for (int64_t i = n * 1000; i < n * 1000 + (n + 1) * 100; i++) {
+            adp_cnt_offer(tbm, &i, sizeof(int64_t));
+            adp_cnt_offer(expect, &i, sizeof(int64_t));
+        }
+
+        uint32_t len = m + 3;
+        EXPECT_EQ(adp_cnt_get_bytes(tbm, buf, &len), 0);
+        EXPECT_EQ(ccard_archive_append(fd, buf, len), CCARD_OK);
+        adp_cnt_fini(tbm);
+    }
+    close(fd);
+
+    EXPECT_EQ(ccard_archive_merge(ctx, adp_algo, path), CCARD_OK);
+    EXPECT_EQ(adp_cnt_card(ctx), adp_cnt_card(expect));
+
+    /* records of another hash function can't be merged */
+    adp_cnt_ctx_t *other = adp_cnt_init(NULL, 14, CCARD_HASH_LOOKUP3);
+    EXPECT_EQ(ccard_archive_merge(other, adp_algo, path), CCARD_ERR_MERGE_FAILED);
+    adp_cnt_fini(other);
+
+    unlink(path);
+    free(buf);
+    adp_cnt_fini(expect);
+    adp_cnt_fini(ctx);
+}
+
+// vi:ft=c ts=4 sw=4 fdm=marker et
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ccard_common.h"
+#include "ccard_map.h"
+#include "adaptive_counting.h"
+#include "hyperloglog_counting.h"
+#include "hyperloglogplus_counting.h"
+#include "linear_counting.h"
+#include "gtest/gtest.h"
+
+/**
+ * Tests offering to groups.
+ *
+ * <ol>
+ * <li>Each group counts like a standalone counter</li>
+ * <li>Groups are iterated in the order they were created</li>
+ * <li>Cardinalities of all groups are got at once</li>
+ * </ol>
+ * */
+TEST(CCardMapTest, Offer)
+{
+    ccard_algo_t *algos[] = {adp_algo, hll_algo, hllp_algo, lnr_algo};
+    uint8_t opts[] = {
+        CCARD_HASH_MURMUR | CCARD_OPT_SPARSE,
+        CCARD_HASH_MURMUR | CCARD_OPT_SPARSE,
+        CCARD_OPT_SPARSE,
+        CCARD_HASH_MURMUR
+    };
+    char key[16];
+    int64_t cards[100];
+    uint32_t i, j, pos, len;
+    const void *k;
+    void *ctx, *ref;
+
+    for (i = 0; i < sizeof(algos) / sizeof(algos[0]); i++) {
+        ccard_map_t *map = ccard_map_init(algos[i], 12, opts[i]);
+
+        ASSERT_NE(map, (ccard_map_t *)NULL);
+        // group j gets values 0..j*50
+        for (j = 0; j < 100 * 50; j++) {
+            uint32_t g = j % 100;
+
+            if (j / 100 > g * 50 / 100) {
+                continue;
+            }
+            snprintf(key, sizeof(key), "g%u", g);
+            EXPECT_GE(ccard_map_offer(map, key, strlen(key), &j, sizeof(j)), 0);
+        }
+        EXPECT_EQ(ccard_map_size(map), 100u);
+        EXPECT_EQ(ccard_map_card(map, cards), 0);
+
+        pos = 0;
+        for (j = 0; ccard_map_next(map, &pos, &k, &len, &ctx); j++) {
+            snprintf(key, sizeof(key), "g%u", j);
+            EXPECT_EQ(len, strlen(key));
+            EXPECT_EQ(memcmp(k, key, len), 0);
+            EXPECT_EQ(ccard_map_get(map, key, len, 0), ctx);
+            EXPECT_EQ(algos[i]->card(ctx), cards[j]);
+        }
+        EXPECT_EQ(j, 100u);
+
+        // the last group is compared with a standalone counter
+        ref = algos[i]->raw_init(NULL, 12, opts[i]);
+        for (j = 99; j < 100 * 50; j += 100) {
+            if (j / 100 <= 99 * 50 / 100) {
+                algos[i]->offer(ref, &j, sizeof(j));
+            }
+        }
+        EXPECT_EQ(cards[99], algos[i]->card(ref));
+        algos[i]->fini(ref);
+
+        EXPECT_EQ(ccard_map_get(map, "none", 4, 0), (void *)NULL);
+        EXPECT_EQ(ccard_map_fini(map), 0);
+    }
+}
+
+/**
+ * Tests offering batches.
+ *
+ * <ol>
+ * <li>Batch counts the same as offering one by one</li>
+ * <li>Empty group key is a valid group</li>
+ * <li>Invalid arguments are rejected</li>
+ * </ol>
+ * */
+TEST(CCardMapTest, Batch)
+{
+    ccard_map_t *map = ccard_map_init(hll_algo, 10, CCARD_HASH_MURMUR);
+    ccard_map_t *one = ccard_map_init(hll_algo, 10, CCARD_HASH_MURMUR);
+    const char *names[] = {"a", "bb", ""};
+    const void *keys[300], *bufs[300];
+    uint32_t klens[300], lens[300], vals[300], i;
+    int64_t cards[3], cards_one[3], affected = 0;
+
+    for (i = 0; i < 300; i++) {
+        // clustered by group
+        keys[i] = names[i / 100];
+        klens[i] = strlen(names[i / 100]);
+        vals[i] = i % 137;
+        bufs[i] = &vals[i];
+        lens[i] = sizeof(uint32_t);
+        affected += ccard_map_offer(one, keys[i], klens[i], bufs[i], lens[i]);
+    }
+
+    EXPECT_EQ(ccard_map_offer_batch(map, 300, keys, klens, bufs, lens),
+              affected);
+    EXPECT_EQ(ccard_map_size(map), 3u);
+    EXPECT_EQ(ccard_map_card(map, cards), 0);
+    EXPECT_EQ(ccard_map_card(one, cards_one), 0);
+    for (i = 0; i < 3; i++) {
+        EXPECT_EQ(cards[i], cards_one[i]);
+    }
+    EXPECT_NE(ccard_map_get(map, "", 0, 0), (void *)NULL);
+
+    keys[1] = NULL;
+    EXPECT_EQ(ccard_map_offer_batch(map, 2, keys, klens, bufs, lens), -1);
+    EXPECT_EQ(ccard_map_errnum(map), CCARD_ERR_INVALID_ARGUMENT);
+    EXPECT_EQ(ccard_map_offer_batch(map, 2, NULL, klens, bufs, lens), -1);
+    EXPECT_EQ(ccard_map_offer_batch(map, 0, NULL, NULL, NULL, NULL), 0);
+    EXPECT_EQ(ccard_map_errnum(map), CCARD_OK);
+
+    EXPECT_EQ(ccard_map_init(hll_algo, 0, CCARD_HASH_MURMUR),
+              (ccard_map_t *)NULL);
+    EXPECT_EQ(ccard_map_init(NULL, 10, CCARD_HASH_MURMUR),
+              (ccard_map_t *)NULL);
+
+    ccard_map_fini(map);
+    ccard_map_fini(one);
+}
+
+/**
+ * Tests many groups.
+ *
+ * <ol>
+ * <li>Table grows as groups are added</li>
+ * <li>Reset removes all groups and the map could be reused</li>
+ * </ol>
+ * */
+TEST(CCardMapTest, Reset)
+{
+    ccard_map_t *map = ccard_map_init(adp_algo, 14,
+                                      CCARD_HASH_MURMUR | CCARD_OPT_SPARSE);
+    int64_t *cards = (int64_t *)malloc(sizeof(int64_t) * 20000);
+    uint32_t i, j;
+
+    for (i = 0; i < 20000; i++) {
+        for (j = 0; j < 3; j++) {
+            ccard_map_offer(map, &i, sizeof(i), &j, sizeof(j));
+        }
+    }
+    EXPECT_EQ(ccard_map_size(map), 20000u);
+    EXPECT_EQ(ccard_map_card(map, cards), 0);
+    for (i = 0; i < 20000; i++) {
+        EXPECT_EQ(cards[i], 3);
+    }
+
+    EXPECT_EQ(ccard_map_reset(map), 0);
+    EXPECT_EQ(ccard_map_size(map), 0u);
+    i = 7;
+    EXPECT_EQ(ccard_map_get(map, &i, sizeof(i), 0), (void *)NULL);
+    EXPECT_EQ(ccard_map_offer(map, &i, sizeof(i), &i, sizeof(i)), 1);
+    EXPECT_EQ(ccard_map_card(map, cards), 0);
+    EXPECT_EQ(cards[0], 1);
+
+    free(cards);
+    EXPECT_EQ(ccard_map_fini(map), 0);
+    EXPECT_EQ(ccard_map_fini(NULL), -1);
+}
+
+/**
+ * Tests spilling groups to disk.
+ *
+ * <ol>
+ * <li>Memory of keys and counters is kept within the budget</li>
+ * <li>Spilled groups are read back on access and counted the same</li>
+ * <li>Spilled groups are counted from spill file by ccard_map_card</li>
+ * <li>Reset and fini clean the spill file up</li>
+ * </ol>
+ * */
+TEST(CCardMapTest, Spill)
+{
+    ccard_algo_t *algos[] = {adp_algo, hll_algo, hllp_algo, lnr_algo};
+    uint8_t opts[] = {
+        CCARD_HASH_MURMUR | CCARD_OPT_SPARSE,
+        CCARD_HASH_MURMUR,
+        CCARD_OPT_SPARSE,
+        CCARD_HASH_MURMUR
+    };
+    const char *path = "/tmp/ccard_map_spill.tmp";
+    int64_t cards[200], ref[200];
+    uint32_t i, j, pos, g;
+    void *ctx;
+
+    for (i = 0; i < sizeof(algos) / sizeof(algos[0]); i++) {
+        ccard_map_t *map = ccard_map_init(algos[i], 10, opts[i]);
+        ccard_map_t *all = ccard_map_init(algos[i], 10, opts[i]);
+
+        ASSERT_NE(map, (ccard_map_t *)NULL);
+        EXPECT_EQ(ccard_map_set_budget(map, 0, path), -1);
+        EXPECT_EQ(ccard_map_errnum(map), CCARD_ERR_INVALID_ARGUMENT);
+        EXPECT_EQ(ccard_map_set_budget(map, 32 * 1024, NULL), -1);
+        EXPECT_EQ(ccard_map_set_budget(map, 32 * 1024, path), 0);
+
+        // groups are revisited in rounds, so they are spilled and read back
+        for (j = 0; j < 200 * 40; j++) {
+            uint32_t v = j * 7;
+
+            g = (j * 13) % 200;
+            EXPECT_GE(ccard_map_offer(map, &g, sizeof(g), &v, sizeof(v)), 0);
+            ccard_map_offer(all, &g, sizeof(g), &v, sizeof(v));
+        }
+        EXPECT_EQ(ccard_map_size(map), 200u);
+        EXPECT_GT(ccard_map_spilled(map), 0u);
+        EXPECT_EQ(ccard_map_card(map, cards), 0);
+        EXPECT_EQ(ccard_map_card(all, ref), 0);
+        for (j = 0; j < 200; j++) {
+            EXPECT_EQ(cards[j], ref[j]);
+        }
+
+        pos = 0;
+        for (j = 0; ccard_map_next(map, &pos, NULL, NULL, &ctx); j++) {
+            EXPECT_EQ(algos[i]->card(ctx), ref[j]);
+        }
+        EXPECT_EQ(j, 200u);
+        EXPECT_EQ(ccard_map_errnum(map), CCARD_OK);
+
+        EXPECT_EQ(ccard_map_reset(map), 0);
+        EXPECT_EQ(ccard_map_spilled(map), 0u);
+        EXPECT_EQ(access(path, F_OK), 0);
+        EXPECT_EQ(ccard_map_fini(map), 0);
+        EXPECT_NE(access(path, F_OK), 0);
+        ccard_map_fini(all);
+    }
+}
+
+// vi:ft=c ts=4 sw=4 fdm=marker et
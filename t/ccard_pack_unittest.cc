@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "ccard_common.h"
+#include "ccard_pack.h"
+#include "adaptive_counting.h"
+#include "hyperloglog_counting.h"
+#include "hyperloglogplus_counting.h"
+#include "linear_counting.h"
+#include "gtest/gtest.h"
+
+/**
+ * Tests looking records of mixed algorithms up by key.
+ *
+ * <ol>
+ * <li>Records are added in no particular order and found by key</li>
+ * <li>Records start at 64 bytes aligned addresses</li>
+ * <li>Records are estimated by read-only views without copying</li>
+ * <li>Records are iterated in key order</li>
+ * </ol>
+ * */
+TEST(CcardPack, Find)
+{
+    ccard_algo_t *algos[] = {adp_algo, hll_algo, hllp_algo, lnr_algo};
+    uint8_t opts[] = {
+        CCARD_HASH_MURMUR | CCARD_OPT_SPARSE,
+        CCARD_HASH_MURMUR,
+        CCARD_OPT_SPARSE,
+        CCARD_HASH_MURMUR
+    };
+    uint8_t ids[] = {
+        CCARD_ALGO_ADAPTIVE,
+        CCARD_ALGO_HYPERLOGLOG,
+        CCARD_ALGO_HYPERLOGLOGPLUS,
+        CCARD_ALGO_LINEAR
+    };
+    const char *path = "/tmp/ccard_pack_find.tmp";
+    int64_t cards[400];
+    uint8_t *bytes = (uint8_t *)malloc((1 << 14) + 3);
+    char key[16], prev[16];
+    const void *buf, *k;
+    uint32_t i, j, len, klen;
+
+    ccard_pack_writer_t *w = ccard_pack_create(path);
+    ASSERT_NE(w, (ccard_pack_writer_t *)NULL);
+    for (i = 0; i < 400; i++) {
+        // keys are added out of order, record i counts i values
+        uint32_t n = (i * 7919) % 400;
+        void *ctx = algos[n % 4]->raw_init(NULL, n % 4 == 3 ? 12 : 10,
+                                           opts[n % 4]);
+
+        for (j = 0; j < n * 3; j++) {
+            algos[n % 4]->offer(ctx, &j, sizeof(j));
+        }
+        cards[n] = algos[n % 4]->card(ctx);
+        len = (1 << 14) + 3;
+        EXPECT_EQ(algos[n % 4]->get_bytes(ctx, bytes, &len), 0);
+        snprintf(key, sizeof(key), "key%u", n);
+        EXPECT_EQ(ccard_pack_add(w, key, strlen(key), bytes, len), CCARD_OK);
+        algos[n % 4]->fini(ctx);
+    }
+    EXPECT_EQ(ccard_pack_add(w, "x", 1, bytes, 3), CCARD_ERR_INVALID_ARGUMENT);
+    EXPECT_EQ(ccard_pack_finish(w), CCARD_OK);
+
+    ccard_pack_t *pack = ccard_pack_open(path);
+    ASSERT_NE(pack, (ccard_pack_t *)NULL);
+    EXPECT_EQ(ccard_pack_size(pack), 400u);
+
+    for (i = 0; i < 400; i++) {
+        snprintf(key, sizeof(key), "key%u", i);
+        ASSERT_EQ(ccard_pack_find(pack, key, strlen(key), &buf, &len), 0);
+        EXPECT_EQ((uintptr_t)buf % 64, 0u);
+        EXPECT_EQ(((const uint8_t *)buf)[0], ids[i % 4]);
+
+        void *ctx = algos[i % 4]->raw_init(NULL, i % 4 == 3 ? 12 : 10,
+                                           opts[i % 4]);
+        EXPECT_EQ(algos[i % 4]->merge_bytes(ctx, buf, len, NULL), 0);
+        EXPECT_EQ(algos[i % 4]->card(ctx), cards[i]);
+        algos[i % 4]->fini(ctx);
+    }
+
+    // normal bitmaps are borrowed by views straight from the mapping
+    snprintf(key, sizeof(key), "key%u", 1);
+    ASSERT_EQ(ccard_pack_find(pack, key, strlen(key), &buf, &len), 0);
+    hll_cnt_ctx_t *hll = hll_cnt_view_init(buf, len, CCARD_VIEW_RDONLY);
+    ASSERT_NE(hll, (hll_cnt_ctx_t *)NULL);
+    EXPECT_EQ(hll_cnt_card(hll), cards[1]);
+    hll_cnt_fini(hll);
+    snprintf(key, sizeof(key), "key%u", 3);
+    ASSERT_EQ(ccard_pack_find(pack, key, strlen(key), &buf, &len), 0);
+    lnr_cnt_ctx_t *lnr = lnr_cnt_view_init(buf, len, CCARD_VIEW_RDONLY);
+    ASSERT_NE(lnr, (lnr_cnt_ctx_t *)NULL);
+    EXPECT_EQ(lnr_cnt_card(lnr), cards[3]);
+    lnr_cnt_fini(lnr);
+
+    EXPECT_EQ(ccard_pack_find(pack, "key400", 6, &buf, &len), 1);
+    EXPECT_EQ(ccard_pack_find(pack, "key", 3, &buf, &len), 1);
+    EXPECT_EQ(ccard_pack_find(pack, "", 0, &buf, &len), 1);
+    EXPECT_EQ(ccard_pack_find(pack, NULL, 3, &buf, &len),
+              CCARD_ERR_INVALID_ARGUMENT);
+
+    for (i = 0; i < 400; i++) {
+        ASSERT_EQ(ccard_pack_get(pack, i, &k, &klen, &buf, &len), 0);
+        ASSERT_LT(klen, sizeof(key));
+        memcpy(key, k, klen);
+        key[klen] = '\0';
+        if (i > 0) {
+            EXPECT_GT(strcmp(key, prev), 0);
+        }
+        memcpy(prev, key, klen + 1);
+    }
+    EXPECT_EQ(ccard_pack_get(pack, 400, NULL, NULL, &buf, &len),
+              CCARD_ERR_INVALID_ARGUMENT);
+
+    EXPECT_EQ(ccard_pack_close(pack), 0);
+    EXPECT_EQ(ccard_pack_close(NULL), -1);
+    unlink(path);
+    free(bytes);
+}
+
+/**
+ * Tests rejecting invalid packs.
+ *
+ * <ol>
+ * <li>Duplicate keys fail the writer and leave the pack unfinished</li>
+ * <li>Corrupted records are detected by their checksums</li>
+ * <li>Corrupted index and truncated packs can't be opened</li>
+ * <li>Empty pack is valid</li>
+ * </ol>
+ * */
+TEST(CcardPack, Invalid)
+{
+    const char *path = "/tmp/ccard_pack_invalid.tmp";
+    hll_cnt_ctx_t *ctx = hll_cnt_init(NULL, 10, CCARD_HASH_MURMUR);
+    uint8_t bytes[1024 + 3], b;
+    const void *buf;
+    uint32_t i, len = sizeof(bytes);
+    int fd;
+
+    for (i = 0; i < 1000; i++) {
+        hll_cnt_offer(ctx, &i, sizeof(i));
+    }
+    EXPECT_EQ(hll_cnt_get_bytes(ctx, bytes, &len), 0);
+
+    ccard_pack_writer_t *w = ccard_pack_create(path);
+    EXPECT_EQ(ccard_pack_add(w, "a", 1, bytes, len), CCARD_OK);
+    EXPECT_EQ(ccard_pack_add(w, "a", 1, bytes, len), CCARD_OK);
+    EXPECT_EQ(ccard_pack_finish(w), CCARD_ERR_INVALID_ARGUMENT);
+    EXPECT_EQ(ccard_pack_open(path), (ccard_pack_t *)NULL);
+
+    w = ccard_pack_create(path);
+    EXPECT_EQ(ccard_pack_add(w, "a", 1, bytes, len), CCARD_OK);
+    EXPECT_EQ(ccard_pack_add(w, "b", 1, bytes, len), CCARD_OK);
+    EXPECT_EQ(ccard_pack_finish(w), CCARD_OK);
+
+    // flip a byte of the second record
+    fd = open(path, O_RDWR);
+    ASSERT_GE(fd, 0);
+    EXPECT_EQ(pread(fd, &b, 1, 64 * 18 + 100), 1);
+    b ^= 0xff;
+    EXPECT_EQ(pwrite(fd, &b, 1, 64 * 18 + 100), 1);
+    close(fd);
+
+    ccard_pack_t *pack = ccard_pack_open(path);
+    ASSERT_NE(pack, (ccard_pack_t *)NULL);
+    EXPECT_EQ(ccard_pack_find(pack, "a", 1, &buf, &len), 0);
+    EXPECT_EQ(ccard_pack_find(pack, "b", 1, &buf, &len), CCARD_ERR_IO);
+    EXPECT_EQ(ccard_pack_close(pack), 0);
+
+    // flip a byte of the last key
+    fd = open(path, O_RDWR);
+    off_t end = lseek(fd, 0, SEEK_END);
+    EXPECT_EQ(pwrite(fd, "c", 1, end - 1), 1);
+    close(fd);
+    EXPECT_EQ(ccard_pack_open(path), (ccard_pack_t *)NULL);
+
+    EXPECT_EQ(truncate(path, 100), 0);
+    EXPECT_EQ(ccard_pack_open(path), (ccard_pack_t *)NULL);
+    EXPECT_EQ(ccard_pack_open("/nonexistent/pack"), (ccard_pack_t *)NULL);
+    EXPECT_EQ(ccard_pack_create("/nonexistent/pack"),
+              (ccard_pack_writer_t *)NULL);
+
+    w = ccard_pack_create(path);
+    EXPECT_EQ(ccard_pack_finish(w), CCARD_OK);
+    pack = ccard_pack_open(path);
+    ASSERT_NE(pack, (ccard_pack_t *)NULL);
+    EXPECT_EQ(ccard_pack_size(pack), 0u);
+    EXPECT_EQ(ccard_pack_find(pack, "a", 1, &buf, &len), 1);
+    EXPECT_EQ(ccard_pack_close(pack), 0);
+
+    unlink(path);
+    hll_cnt_fini(ctx);
+}
+
+// vi:ft=c ts=4 sw=4 fdm=marker et
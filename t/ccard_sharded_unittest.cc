@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "ccard_common.h"
+#include "ccard_sharded.h"
+#include "adaptive_counting.h"
+#include "hyperloglog_counting.h"
+#include "hyperloglogplus_counting.h"
+#include "linear_counting.h"
+#include "gtest/gtest.h"
+
+struct offer_range_s {
+    ccard_sharded_t *s;
+    uint32_t from;
+    uint32_t to;
+    int failed;
+};
+
+static void *offer_range(void *arg)
+{
+    struct offer_range_s *r = (struct offer_range_s *)arg;
+    uint32_t i;
+
+    for (i = r->from; i < r->to; i++) {
+        if (ccard_sharded_offer(r->s, &i, sizeof(i)) < 0) {
+            r->failed = 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Tests threads offering to a sharded sketch.
+ *
+ * <ol>
+ * <li>Threads offer overlapping ranges to shards of all algorithms</li>
+ * <li>Merged shards are identical to offering all values to one context</li>
+ * <li>More threads than shards take free shards in turn</li>
+ * <li>Shards are picked by thread or by CPU</li>
+ * </ol>
+ * */
+TEST(CcardSharded, Offer)
+{
+    ccard_algo_t *algos[] = {adp_algo, hll_algo, hllp_algo, lnr_algo};
+    uint8_t opts[] = {CCARD_HASH_MURMUR, CCARD_HASH_MURMUR, 0,
+                      CCARD_HASH_MURMUR};
+    uint32_t shards[] = {4, 0};
+    int flags[] = {0, CCARD_SHARDED_CPU};
+    uint8_t buf[(1 << 12) + 3], expect[(1 << 12) + 3];
+    struct offer_range_s ranges[8];
+    pthread_t threads[8];
+    uint32_t i, j, c, len, elen;
+
+    for (i = 0; i < sizeof(algos) / sizeof(algos[0]); i++) {
+        void *ref = algos[i]->raw_init(NULL, 12, opts[i]);
+
+        for (c = 0; c < 7 * 3000 + 5000; c++) {
+            algos[i]->offer(ref, &c, sizeof(c));
+        }
+        elen = sizeof(expect);
+        EXPECT_EQ(algos[i]->get_bytes(ref, expect, &elen), 0);
+
+        for (j = 0; j < 2; j++) {
+            ccard_sharded_t *s = ccard_sharded_init(algos[i], 12, opts[i],
+                                                    shards[j], flags[j]);
+
+            ASSERT_NE(s, (ccard_sharded_t *)NULL);
+            EXPECT_GT(ccard_sharded_size(s), 0u);
+            EXPECT_EQ(ccard_sharded_card(s), 0);
+
+            for (c = 0; c < 8; c++) {
+                ranges[c].s = s;
+                ranges[c].from = c * 3000;
+                ranges[c].to = c * 3000 + 5000;
+                ranges[c].failed = 0;
+                ASSERT_EQ(pthread_create(&threads[c], NULL, offer_range,
+                                         &ranges[c]), 0);
+            }
+            for (c = 0; c < 8; c++) {
+                ASSERT_EQ(pthread_join(threads[c], NULL), 0);
+                EXPECT_EQ(ranges[c].failed, 0);
+            }
+
+            EXPECT_EQ(ccard_sharded_card(s), algos[i]->card(ref));
+            len = sizeof(buf);
+            EXPECT_EQ(ccard_sharded_get_bytes(s, buf, &len), 0);
+            EXPECT_EQ(len, elen);
+            EXPECT_EQ(memcmp(buf, expect, len), 0);
+            EXPECT_EQ(ccard_sharded_errnum(s), CCARD_OK);
+            printf("actual:26000, estimated: %9lu\n",
+                   (long unsigned int)ccard_sharded_card(s));
+
+            EXPECT_EQ(ccard_sharded_fini(s), 0);
+        }
+        algos[i]->fini(ref);
+    }
+}
+
+/**
+ * Tests reading merged shards.
+ *
+ * <ol>
+ * <li>Cardinality is kept until a shard is modified</li>
+ * <li>Values offered after reading are counted by the next read</li>
+ * <li>Reset clears all shards</li>
+ * <li>Invalid arguments are rejected</li>
+ * </ol>
+ * */
+TEST(CcardSharded, Card)
+{
+    ccard_sharded_t *s = ccard_sharded_init(hll_algo, 10, CCARD_HASH_MURMUR,
+                                            3, 0);
+    hll_cnt_ctx_t *ref = hll_cnt_raw_init(NULL, 10, CCARD_HASH_MURMUR);
+    uint32_t i;
+    int64_t card;
+
+    ASSERT_NE(s, (ccard_sharded_t *)NULL);
+    EXPECT_EQ(ccard_sharded_size(s), 3u);
+    for (i = 0; i < 1000; i++) {
+        EXPECT_EQ(ccard_sharded_offer(s, &i, sizeof(i)),
+                  hll_cnt_offer(ref, &i, sizeof(i)));
+    }
+    card = ccard_sharded_card(s);
+    EXPECT_EQ(card, hll_cnt_card(ref));
+    EXPECT_EQ(ccard_sharded_card(s), card);
+
+    // values counted already don't modify any shard
+    for (i = 0; i < 1000; i++) {
+        EXPECT_EQ(ccard_sharded_offer(s, &i, sizeof(i)), 0);
+    }
+    EXPECT_EQ(ccard_sharded_card(s), card);
+
+    for (i = 1000; i < 2000; i++) {
+        ccard_sharded_offer(s, &i, sizeof(i));
+        hll_cnt_offer(ref, &i, sizeof(i));
+    }
+    EXPECT_NE(ccard_sharded_card(s), card);
+    EXPECT_EQ(ccard_sharded_card(s), hll_cnt_card(ref));
+
+    EXPECT_EQ(ccard_sharded_reset(s), 0);
+    EXPECT_EQ(ccard_sharded_card(s), 0);
+    i = 1;
+    EXPECT_EQ(ccard_sharded_offer(s, &i, sizeof(i)), 1);
+    EXPECT_EQ(ccard_sharded_card(s), 1);
+
+    EXPECT_EQ(ccard_sharded_init(NULL, 10, 0, 1, 0), (ccard_sharded_t *)NULL);
+    EXPECT_EQ(ccard_sharded_offer(NULL, &i, sizeof(i)), -1);
+    EXPECT_EQ(ccard_sharded_card(NULL), -1);
+    EXPECT_EQ(ccard_sharded_size(NULL), 0u);
+    EXPECT_EQ(ccard_sharded_errnum(NULL), CCARD_ERR_INVALID_CTX);
+    EXPECT_EQ(ccard_sharded_fini(NULL), -1);
+
+    EXPECT_EQ(ccard_sharded_fini(s), 0);
+    hll_cnt_fini(ref);
+}
+
+// vi:ft=c ts=4 sw=4 fdm=marker et
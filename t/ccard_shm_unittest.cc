@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "ccard_common.h"
+#include "ccard_shm.h"
+#include "adaptive_counting.h"
+#include "hyperloglog_counting.h"
+#include "hyperloglogplus_counting.h"
+#include "gtest/gtest.h"
+
+/**
+ * Tests atomic byte-max.
+ *
+ * <ol>
+ * <li>Bytes are only raised and the old value is returned</li>
+ * <li>Neighbour bytes in the same word are kept</li>
+ * <li>Bytes at both ends of the buffer are raised as well</li>
+ * </ol>
+ * */
+TEST(CcardShm, Max)
+{
+    uint32_t words[4] = {0, 0, 0, 0};
+    uint8_t *buf = (uint8_t *)words + 1, expect[14];
+    uint32_t i;
+
+    memset(expect, 0, sizeof(expect));
+    for (i = 0; i < sizeof(expect); i++) {
+        EXPECT_EQ(ccard_shm_max(buf, sizeof(expect), i, i + 1), 0);
+        expect[i] = i + 1;
+        EXPECT_EQ(memcmp(buf, expect, sizeof(expect)), 0);
+    }
+    for (i = 0; i < sizeof(expect); i++) {
+        EXPECT_EQ(ccard_shm_max(buf, sizeof(expect), i, 1), i + 1);
+        EXPECT_EQ(ccard_shm_max(buf, sizeof(expect), i, 100), i + 1);
+        expect[i] = 100;
+    }
+    EXPECT_EQ(memcmp(buf, expect, sizeof(expect)), 0);
+    EXPECT_EQ(((uint8_t *)words)[0], 0);
+    EXPECT_EQ(((uint8_t *)words)[15], 0);
+}
+
+/**
+ * Initialize a shared view of buf.
+ * */
+static void *view_init(const ccard_algo_t *algo, void *buf, uint32_t len)
+{
+    if (algo == hll_algo) {
+        return hll_cnt_view_init(buf, len, CCARD_VIEW_SHARED);
+    }
+    if (algo == hllp_algo) {
+        return hllp_cnt_view_init(buf, len, CCARD_VIEW_SHARED);
+    }
+    return adp_cnt_view_init(buf, len, CCARD_VIEW_SHARED);
+}
+
+/**
+ * Offer values [from, to) to a shared view of buf from a child process.
+ * */
+static pid_t offer_in_child(const ccard_algo_t *algo, void *buf, uint32_t len,
+                            const char *name, uint32_t from, uint32_t to)
+{
+    pid_t pid = fork();
+    uint32_t i;
+    void *ctx;
+
+    if (pid != 0) {
+        return pid;
+    }
+
+    if (name) {
+        // attach to the segment by name instead of the inherited mapping
+        buf = ccard_shm_open(name, buf, len);
+        if (!buf) {
+            _exit(1);
+        }
+    }
+    ctx = view_init(algo, buf, len);
+    if (!ctx) {
+        _exit(1);
+    }
+    for (i = from; i < to; i++) {
+        if (algo->offer(ctx, &i, sizeof(i)) < 0) {
+            _exit(1);
+        }
+    }
+    algo->fini(ctx);
+    _exit(0);
+}
+
+/**
+ * Tests processes offering to one shared sketch.
+ *
+ * <ol>
+ * <li>Workers offer overlapping ranges to the same bitmap without locks</li>
+ * <li>Result is identical to offering all values to a private context</li>
+ * <li>Estimator sums of adaptive counting are recomputed on read</li>
+ * <li>Bitmaps are shared by named segments or mappings of the caller</li>
+ * </ol>
+ * */
+TEST(CcardShm, Offer)
+{
+    ccard_algo_t *algos[] = {hll_algo, adp_algo, hllp_algo};
+    char name[64];
+    uint8_t init[(1 << 12) + 3], expect[(1 << 12) + 3];
+    uint32_t i, c, len, elen;
+    pid_t pids[4];
+    int status;
+
+    snprintf(name, sizeof(name), "/ccard_shm_test_%d", (int)getpid());
+    for (i = 0; i < sizeof(algos) / sizeof(algos[0]); i++) {
+        void *ref = algos[i]->raw_init(NULL, 12, i == 2 ? 0 : CCARD_HASH_MURMUR);
+        void *view, *buf;
+
+        len = sizeof(init);
+        EXPECT_EQ(algos[i]->get_bytes(ref, init, &len), 0);
+        if (i == 0) {
+            buf = ccard_shm_open(name, init, len);
+        } else {
+            buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            ASSERT_NE(buf, MAP_FAILED);
+            memcpy(buf, init, len);
+        }
+        ASSERT_NE(buf, (void *)NULL);
+
+        // the parent watches through a shared view as well
+        view = view_init(algos[i], buf, len);
+        ASSERT_NE(view, (void *)NULL);
+        EXPECT_EQ(algos[i]->card(view), 0);
+
+        for (c = 0; c < 4; c++) {
+            pids[c] = offer_in_child(algos[i], buf, len, i == 0 ? name : NULL,
+                                     c * 5000, c * 5000 + 8000);
+            ASSERT_GT(pids[c], 0);
+        }
+        for (c = 0; c < 4; c++) {
+            ASSERT_EQ(waitpid(pids[c], &status, 0), pids[c]);
+            EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        }
+
+        for (c = 0; c < 3 * 5000 + 8000; c++) {
+            algos[i]->offer(ref, &c, sizeof(c));
+        }
+        elen = sizeof(expect);
+        EXPECT_EQ(algos[i]->get_bytes(ref, expect, &elen), 0);
+        EXPECT_EQ(elen, len);
+        EXPECT_EQ(memcmp(buf, expect, len), 0);
+        EXPECT_EQ(algos[i]->card(view), algos[i]->card(ref));
+        printf("actual:23000, estimated: %9lu\n",
+               (long unsigned int)algos[i]->card(view));
+
+        // merging into a shared view raises registers the same way
+        for (c = 0; c < 2000; c++) {
+            uint32_t v = c + 100000;
+
+            algos[i]->offer(ref, &v, sizeof(v));
+        }
+        elen = sizeof(expect);
+        EXPECT_EQ(algos[i]->get_bytes(ref, expect, &elen), 0);
+        EXPECT_EQ(algos[i]->merge_bytes(view, expect, elen, NULL), 0);
+        EXPECT_EQ(memcmp(buf, expect, len), 0);
+        EXPECT_EQ(algos[i]->card(view), algos[i]->card(ref));
+
+        algos[i]->fini(view);
+        algos[i]->fini(ref);
+        if (i == 0) {
+            // the segment can't be opened as another kind of bitmap
+            expect[0] = CCARD_ALGO_ADAPTIVE;
+            EXPECT_EQ(ccard_shm_open(name, expect, len), (void *)NULL);
+            EXPECT_EQ(ccard_shm_close(buf, len), 0);
+            EXPECT_EQ(ccard_shm_unlink(name), 0);
+        } else {
+            munmap(buf, len);
+        }
+    }
+
+    EXPECT_EQ(ccard_shm_unlink(name), -1);
+    EXPECT_EQ(ccard_shm_open(name, NULL, 0), (void *)NULL);
+}
+
+// vi:ft=c ts=4 sw=4 fdm=marker et
@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include "sparse_bitmap.h"
+#include "explicit_set.h"
+#include "gtest/gtest.h"
+
+/**
+ * Tests adding hash values to explicit set.
+ *
+ * <ol>
+ * <li>Distinct values are added once, including 0</li>
+ * <li>Table grows while values are added</li>
+ * <li>No more values are accepted beyond limit</li>
+ * </ol>
+ * */
+TEST(ExplicitSetTest, Add)
+{
+    exp_set_t *es = es_init(1000, NULL);
+    uint64_t i, h, sum = 0;
+    uint32_t pos = 0, n = 0;
+
+    EXPECT_NE(es, (exp_set_t *)NULL);
+    for (i = 0; i < 1000; i++) {
+        EXPECT_EQ(es_add(es, i * 0x10001), 1);
+        EXPECT_EQ(es_add(es, i * 0x10001), 0);
+    }
+    EXPECT_EQ(es->count, 1000u);
+    EXPECT_GE(es->size * 3, es->count * 4);
+    EXPECT_EQ(es_add(es, 1), -1);
+    EXPECT_EQ(es_add(es, 0x10001), 0);
+
+    while (es_next(es, &pos, &h)) {
+        EXPECT_EQ(h % 0x10001, 0u);
+        sum += h / 0x10001;
+        n++;
+    }
+    EXPECT_EQ(n, 1000u);
+    EXPECT_EQ(sum, 999u * 1000 / 2);
+
+    EXPECT_EQ(es_reset(es), 0);
+    EXPECT_EQ(es->count, 0u);
+    pos = 0;
+    EXPECT_EQ(es_next(es, &pos, &h), 0);
+    EXPECT_EQ(es_add(es, 0), 1);
+    EXPECT_EQ(es_add(es, 0), 0);
+    EXPECT_EQ(es->count, 1u);
+
+    es_fini(es);
+}
+
+/**
+ * Tests serializing explicit set.
+ *
+ * <ol>
+ * <li>Dumped bitmap is verified with the same k and values in order</li>
+ * <li>Corrupted bitmaps are rejected</li>
+ * <li>Values not fitting in hash length are rejected</li>
+ * </ol>
+ * */
+TEST(ExplicitSetTest, Dump)
+{
+    exp_set_t *es = es_init(100, NULL);
+    uint64_t hs[] = {0xffffffffffffffffULL, 3, 0, 1ULL << 40};
+    uint8_t buf[1 + 8 * 4];
+    uint32_t i, len;
+
+    for (i = 0; i < 4; i++) {
+        es_add(es, hs[i]);
+    }
+    len = es_dump(es, 12, NULL);
+    EXPECT_EQ(len, sizeof(buf));
+    EXPECT_EQ(es_dump(es, 12, buf), len);
+
+    EXPECT_TRUE(IS_EXPLICIT_BMP(buf));
+    EXPECT_TRUE(IS_SPARSE_BMP(buf));
+    EXPECT_EQ(es_verify(buf, len, 64), 12);
+    EXPECT_EQ(es_hash_at(buf, 0), 0u);
+    EXPECT_EQ(es_hash_at(buf, 1), 3u);
+    EXPECT_EQ(es_hash_at(buf, 2), 1ULL << 40);
+    EXPECT_EQ(es_hash_at(buf, 3), 0xffffffffffffffffULL);
+
+    // values must fit in hash length
+    EXPECT_EQ(es_verify(buf, len, 32), -1);
+    EXPECT_EQ(es_verify(buf, 1 + 8 * 2, 32), 12);
+    EXPECT_EQ(es_verify(buf, 1 + 8 * 3, 32), -1);
+    EXPECT_EQ(es_verify(buf, 1 + 8 * 3, 41), 12);
+
+    EXPECT_EQ(es_verify(buf, len - 1, 64), -1);
+    buf[1] = 3;
+    EXPECT_EQ(es_verify(buf, len, 64), -1);
+    buf[0] = MAKE_SPARSE_ID(12);
+    EXPECT_EQ(es_verify(buf, 1, 64), -1);
+    buf[0] = MAKE_EXPLICIT_ID(0);
+    EXPECT_EQ(es_verify(buf, 1, 64), -1);
+
+    es_fini(es);
+}
+
+/**
+ * Tests copying explicit sets.
+ *
+ * <ol>
+ * <li>Copy has the same values, whether it's new or reused</li>
+ * <li>Copying NULL destroys the set</li>
+ * </ol>
+ * */
+TEST(ExplicitSetTest, Copy)
+{
+    exp_set_t *src = es_init(1000, NULL);
+    exp_set_t *dst = es_init(10, NULL);
+    exp_set_t *cp;
+    uint64_t i;
+
+    for (i = 0; i < 500; i++) {
+        es_add(src, i * 3);
+    }
+
+    EXPECT_EQ(es_copy(dst, src, NULL), dst);
+    cp = es_copy(NULL, src, NULL);
+    ASSERT_NE(cp, (exp_set_t *)NULL);
+    EXPECT_EQ(dst->count, 500u);
+    EXPECT_EQ(dst->limit, 1000u);
+    EXPECT_EQ(cp->count, 500u);
+    for (i = 0; i < 500; i++) {
+        EXPECT_EQ(es_add(dst, i * 3), 0);
+        EXPECT_EQ(es_add(cp, i * 3), 0);
+    }
+    EXPECT_EQ(es_add(dst, 1), 1);
+    EXPECT_EQ(src->count, 500u);
+
+    EXPECT_EQ(es_copy(cp, NULL, NULL), (exp_set_t *)NULL);
+    es_fini(dst);
+    es_fini(src);
+}
+
+// vi:ft=c ts=4 sw=4 fdm=marker et
+
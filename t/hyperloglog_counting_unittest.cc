@@ -1,3 +1,7 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <math.h>
 #include "ccard_common.h"
 #include "hyperloglog_counting.h"
 #include "gtest/gtest.h"
@@ -124,6 +128,7 @@ TEST(HyperloglogCounting, Counting)
  * <li>Tbm1 that contains 10000 to 30000 be serialized as buf1</li>
  * <li>Tbm2 that contains 20000 to 40000 be serialized as buf2</li>
  * <li>Merges buf1 and buf2 into current context</li>
+ * <li>Merges buf1 twice in one call</li>
  * </ol>
  * */
 TEST(HyperloglogCounting, RawMerge)
@@ -164,6 +169,12 @@ TEST(HyperloglogCounting, RawMerge)
     printf("actual:40000, estimated: %9lu, error: %+7.2f%%\n",
            (long unsigned int)esti, (double)(esti - 40000) / 40000 * 100);
 
+    // the same buffer could be passed more than once
+    hll_cnt_reset(tbm2);
+    rc = hll_cnt_merge_raw_bytes(tbm2, buf1, len1, buf1, len1, NULL);
+    EXPECT_EQ(rc, 0);
+    EXPECT_EQ(hll_cnt_card(tbm2), hll_cnt_card(tbm1));
+
     rc = hll_cnt_fini(tbm2);
     EXPECT_EQ(rc, 0);
     rc = hll_cnt_fini(tbm1);
@@ -180,6 +191,7 @@ TEST(HyperloglogCounting, RawMerge)
  * <li>Tbm1 that contains 10000 to 30000 be serialized as buf1</li>
  * <li>Tbm2 that contains 20000 to 40000 be serialized as buf2</li>
  * <li>Merges buf1 and buf2 into current context</li>
+ * <li>Merges buf1 twice in one call</li>
  * </ol>
  * */
 TEST(HyperloglogCounting, Merge)
@@ -220,6 +232,12 @@ TEST(HyperloglogCounting, Merge)
     printf("actual:40000, estimated: %9lu, error: %+7.2f%%\n",
            (long unsigned int)esti, (double)(esti - 40000) / 40000 * 100);
 
+    // the same buffer could be passed more than once
+    hll_cnt_reset(tbm2);
+    rc = hll_cnt_merge_bytes(tbm2, buf1, len1, buf1, len1, NULL);
+    EXPECT_EQ(rc, 0);
+    EXPECT_EQ(hll_cnt_card(tbm2), hll_cnt_card(tbm1));
+
     rc = hll_cnt_fini(tbm2);
     EXPECT_EQ(rc, 0);
     rc = hll_cnt_fini(tbm1);
@@ -247,4 +265,971 @@ TEST(HyperloglogCounting, Deserialize)
     EXPECT_EQ(hll_cnt_card(other), esti);
 }
 
+/**
+ * Fold bitmap to lower precision, the result should be identical to counting
+ * with lower precision directly.
+ *
+ * <ol>
+ * <li>Registers of 8 and 5 bits are folded</li>
+ * <li>Folded context keeps counting with lower precision</li>
+ * </ol>
+ * */
+TEST(HyperloglogCounting, Fold)
+{
+    uint8_t hfs[] = {CCARD_HASH_MURMUR, CCARD_HASH_LOOKUP3, CCARD_HASH_MURMUR64};
+    uint8_t widths[] = {8, 5};
+
+    for (size_t n = 0; n < sizeof(hfs) / sizeof(hfs[0]); n++) {
+        for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+            hll_cnt_ctx_t *ctx16 = hll_cnt_init(NULL, 16, hfs[n]);
+            hll_cnt_ctx_t *ctx10 = hll_cnt_init(NULL, 10, hfs[n]);
+
+            EXPECT_EQ(hll_cnt_pack(ctx16, widths[w]), 0);
+            EXPECT_EQ(hll_cnt_pack(ctx10, widths[w]), 0);
+            for (int64_t i = 1; i <= 100000L; i++) {
+                hll_cnt_offer(ctx16, &i, sizeof(int64_t));
+                hll_cnt_offer(ctx10, &i, sizeof(int64_t));
+            }
+
+            EXPECT_EQ(hll_cnt_fold(ctx16, 0), -1);
+            EXPECT_EQ(hll_cnt_errnum(ctx16), CCARD_ERR_INVALID_ARGUMENT);
+            EXPECT_EQ(hll_cnt_fold(ctx16, 10), 0);
+            for (int64_t i = 100001L; i <= 120000L; i++) {
+                hll_cnt_offer(ctx16, &i, sizeof(int64_t));
+                hll_cnt_offer(ctx10, &i, sizeof(int64_t));
+            }
+
+            uint8_t buf16[1 << 10], buf10[1 << 10];
+            uint32_t len16 = sizeof(buf16), len10 = sizeof(buf10);
+            EXPECT_EQ(hll_cnt_get_raw_bytes(ctx16, buf16, &len16), 0);
+            EXPECT_EQ(hll_cnt_get_raw_bytes(ctx10, buf10, &len10), 0);
+            EXPECT_EQ(len16, len10);
+            EXPECT_EQ(memcmp(buf16, buf10, len10), 0);
+            EXPECT_EQ(hll_cnt_card(ctx16), hll_cnt_card(ctx10));
+
+            hll_cnt_fini(ctx16);
+            hll_cnt_fini(ctx10);
+        }
+    }
+}
+
+/**
+ * Merge bitmaps with different precision
+ * */
+TEST(HyperloglogCounting, MergeDifferentLength)
+{
+    hll_cnt_ctx_t *ctx = hll_cnt_init(NULL, 14, CCARD_HASH_MURMUR);
+    hll_cnt_ctx_t *tbm1 = hll_cnt_init(NULL, 16, CCARD_HASH_MURMUR);
+    hll_cnt_ctx_t *tbm2 = hll_cnt_init(NULL, 12, CCARD_HASH_MURMUR);
+    hll_cnt_ctx_t *expect = hll_cnt_init(NULL, 12, CCARD_HASH_MURMUR);
+    int64_t i;
+
+    for (i = 1; i <= 20000L; i++) {
+        hll_cnt_offer(ctx, &i, sizeof(int64_t));
+        hll_cnt_offer(expect, &i, sizeof(int64_t));
+    }
+    for (i = 10000L; i <= 30000L; i++) {
+        hll_cnt_offer(tbm1, &i, sizeof(int64_t));
+        hll_cnt_offer(expect, &i, sizeof(int64_t));
+    }
+    for (i = 20000L; i <= 40000L; i++) {
+        hll_cnt_offer(tbm2, &i, sizeof(int64_t));
+        hll_cnt_offer(expect, &i, sizeof(int64_t));
+    }
+
+    EXPECT_EQ(hll_cnt_merge(ctx, tbm1, tbm2, NULL), 0);
+    EXPECT_EQ(hll_cnt_card(ctx), hll_cnt_card(expect));
+
+    hll_cnt_fini(expect);
+    hll_cnt_fini(tbm2);
+    hll_cnt_fini(tbm1);
+    hll_cnt_fini(ctx);
+}
+
+/**
+ * Replicate context by deltas.
+ *
+ * <ol>
+ * <li>The first delta carries all buckets</li>
+ * <li>The following deltas carry only buckets raised since the last one</li>
+ * <li>Delta since an unknown epoch carries all buckets again</li>
+ * </ol>
+ * */
+TEST(HyperloglogCounting, Delta)
+{
+    hll_cnt_ctx_t *ctx = hll_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR);
+    hll_cnt_ctx_t *replica = hll_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR);
+    uint32_t len, full_len, rlen = 1 << 14, clen = 1 << 14;
+    uint8_t *buf = (uint8_t *)malloc((1 << 14) + 3);
+    uint8_t *rbuf = (uint8_t *)malloc(rlen);
+    uint8_t *cbuf = (uint8_t *)malloc(clen);
+    int64_t i;
+
+    for (i = 1; i <= 20000; i++) {
+        hll_cnt_offer(ctx, &i, sizeof(int64_t));
+    }
+    EXPECT_EQ(hll_cnt_epoch(ctx), 0);
+    EXPECT_EQ(hll_cnt_get_delta(ctx, 0, NULL, &len), 0);
+    EXPECT_EQ(hll_cnt_epoch(ctx), 0);
+    EXPECT_EQ(hll_cnt_get_delta(ctx, 0, buf, &len), 0);
+    EXPECT_EQ(hll_cnt_epoch(ctx), 1);
+    EXPECT_EQ(len, (uint32_t)(1 << 14) + 3);
+    full_len = len;
+    EXPECT_EQ(hll_cnt_apply_delta(replica, buf, len), 0);
+    EXPECT_EQ(hll_cnt_card(replica), hll_cnt_card(ctx));
+
+    for (i = 20001; i <= 20100; i++) {
+        hll_cnt_offer(ctx, &i, sizeof(int64_t));
+    }
+    len = (1 << 14) + 3;
+    EXPECT_EQ(hll_cnt_get_delta(ctx, 1, buf, &len), 0);
+    EXPECT_LT(len, full_len / 10);
+    EXPECT_EQ(hll_cnt_apply_delta(replica, buf, len), 0);
+    EXPECT_EQ(hll_cnt_get_raw_bytes(ctx, cbuf, &clen), 0);
+    EXPECT_EQ(hll_cnt_get_raw_bytes(replica, rbuf, &rlen), 0);
+    EXPECT_EQ(clen, rlen);
+    EXPECT_EQ(memcmp(cbuf, rbuf, clen), 0);
+
+    /* nothing changed since epoch 2 */
+    len = (1 << 14) + 3;
+    EXPECT_EQ(hll_cnt_get_delta(ctx, 2, buf, &len), 0);
+    EXPECT_EQ(len, 4u);
+    EXPECT_EQ(hll_cnt_apply_delta(replica, buf, len), 0);
+
+    /* unknown epoch */
+    len = (1 << 14) + 3;
+    EXPECT_EQ(hll_cnt_get_delta(ctx, 1, buf, &len), 0);
+    EXPECT_EQ(len, full_len);
+    EXPECT_EQ(hll_cnt_apply_delta(replica, buf, len), 0);
+    EXPECT_EQ(hll_cnt_card(replica), hll_cnt_card(ctx));
+
+    /* serialized bitmap isn't a delta */
+    EXPECT_EQ(hll_cnt_get_bytes(ctx, buf, &len), 0);
+    EXPECT_EQ(hll_cnt_apply_delta(replica, buf, len), -1);
+    EXPECT_EQ(hll_cnt_errnum(replica), CCARD_ERR_MERGE_FAILED);
+
+    free(cbuf);
+    free(rbuf);
+    free(buf);
+    hll_cnt_fini(replica);
+    hll_cnt_fini(ctx);
+}
+
+/**
+ * Count with packed registers.
+ *
+ * <ol>
+ * <li>Results should be identical to registers in bytes</li>
+ * <li>Packed contexts could be merged and folded</li>
+ * </ol>
+ * */
+TEST(HyperloglogCounting, Packed)
+{
+    uint8_t widths[] = {6, 5, 4};
+    uint8_t pbuf[1 << 12], buf[1 << 12];
+    uint32_t plen, len;
+
+    for (size_t n = 0; n < sizeof(widths); n++) {
+        hll_cnt_ctx_t *ctx = hll_cnt_raw_init(NULL, 12, CCARD_HASH_LOOKUP3);
+        hll_cnt_ctx_t *packed = hll_cnt_raw_init(NULL, 12, CCARD_HASH_LOOKUP3);
+        hll_cnt_ctx_t *ctx2 = hll_cnt_raw_init(NULL, 12, CCARD_HASH_LOOKUP3);
+        hll_cnt_ctx_t *packed2 = hll_cnt_raw_init(NULL, 12, CCARD_HASH_LOOKUP3);
+
+        EXPECT_EQ(hll_cnt_pack(packed, 7), -1);
+        EXPECT_EQ(hll_cnt_errnum(packed), CCARD_ERR_INVALID_ARGUMENT);
+        EXPECT_EQ(hll_cnt_pack(packed, widths[n]), 0);
+        EXPECT_EQ(hll_cnt_pack(packed2, widths[n]), 0);
+        for (int64_t i = 1; i <= 50000; i++) {
+            EXPECT_EQ(hll_cnt_offer(packed, &i, sizeof(int64_t)),
+                      hll_cnt_offer(ctx, &i, sizeof(int64_t)));
+            int64_t j = i + 30000;
+            hll_cnt_offer(packed2, &j, sizeof(int64_t));
+            hll_cnt_offer(ctx2, &j, sizeof(int64_t));
+        }
+        EXPECT_EQ(hll_cnt_card(packed), hll_cnt_card(ctx));
+
+        EXPECT_EQ(hll_cnt_merge(packed, packed2, NULL), 0);
+        EXPECT_EQ(hll_cnt_merge(ctx, ctx2, NULL), 0);
+        EXPECT_EQ(hll_cnt_fold(packed, 10), 0);
+        EXPECT_EQ(hll_cnt_fold(ctx, 10), 0);
+        EXPECT_EQ(hll_cnt_card(packed), hll_cnt_card(ctx));
+
+        plen = sizeof(pbuf);
+        len = sizeof(buf);
+        EXPECT_EQ(hll_cnt_get_raw_bytes(packed, pbuf, &plen), 0);
+        EXPECT_EQ(hll_cnt_get_raw_bytes(ctx, buf, &len), 0);
+        EXPECT_EQ(plen, len);
+        EXPECT_EQ(memcmp(pbuf, buf, len), 0);
+
+        EXPECT_EQ(hll_cnt_pack(packed, 8), 0);
+        EXPECT_EQ(hll_cnt_card(packed), hll_cnt_card(ctx));
+        EXPECT_EQ(hll_cnt_pack(packed, widths[n]), 0);
+        EXPECT_EQ(hll_cnt_reset(packed), 0);
+        EXPECT_EQ(hll_cnt_card(packed), 0);
+
+        hll_cnt_fini(packed2);
+        hll_cnt_fini(ctx2);
+        hll_cnt_fini(packed);
+        hll_cnt_fini(ctx);
+    }
+}
+
+/**
+ * Count with 4-bit registers and exceptions.
+ *
+ * <ol>
+ * <li>Registers exceeding 4-bit offsets should be kept exactly</li>
+ * <li>Contexts with the same or different minimum could be merged</li>
+ * </ol>
+ * */
+TEST(HyperloglogCounting, Hll4)
+{
+    hll_cnt_ctx_t *ctx = hll_cnt_raw_init(NULL, 16, CCARD_HASH_MURMUR);
+    hll_cnt_ctx_t *ctx4 = hll_cnt_raw_init(NULL, 16,
+                                           CCARD_HASH_MURMUR | CCARD_OPT_REG4);
+    hll_cnt_ctx_t *other4 = hll_cnt_raw_init(NULL, 16,
+                                             CCARD_HASH_MURMUR | CCARD_OPT_REG4);
+    uint32_t len = (1 << 16) + 3, len4 = (1 << 16) + 3;
+    uint8_t *buf = (uint8_t *)malloc(len);
+    uint8_t *buf4 = (uint8_t *)malloc(len4);
+    int64_t i;
+
+    for (i = 1; i <= 100000; i++) {
+        hll_cnt_offer(ctx, &i, sizeof(int64_t));
+        hll_cnt_offer(ctx4, &i, sizeof(int64_t));
+    }
+    for (i = 1; i <= 1000000; i += 7) {
+        hll_cnt_offer(other4, &i, sizeof(int64_t));
+    }
+
+    EXPECT_EQ(hll_cnt_get_bytes(ctx, buf, &len), 0);
+    EXPECT_EQ(hll_cnt_get_bytes(ctx4, buf4, &len4), 0);
+    EXPECT_EQ(len, len4);
+    EXPECT_EQ(memcmp(buf, buf4, len), 0);
+    EXPECT_NEAR(hll_cnt_card(ctx4), hll_cnt_card(ctx), 1);
+
+    /* same minimum */
+    hll_cnt_ctx_t *copy4 = hll_cnt_init(buf4, len4,
+                                        CCARD_HASH_MURMUR | CCARD_OPT_REG4);
+    EXPECT_EQ(hll_cnt_merge(copy4, ctx4, NULL), 0);
+    EXPECT_NEAR(hll_cnt_card(copy4), hll_cnt_card(ctx), 1);
+
+    /* different minimum */
+    EXPECT_EQ(hll_cnt_merge(ctx4, other4, NULL), 0);
+    EXPECT_EQ(hll_cnt_merge(copy4, other4, NULL), 0);
+    EXPECT_EQ(hll_cnt_merge(ctx, other4, NULL), 0);
+    len = len4 = (1 << 16) + 3;
+    EXPECT_EQ(hll_cnt_get_bytes(ctx, buf, &len), 0);
+    EXPECT_EQ(hll_cnt_get_bytes(ctx4, buf4, &len4), 0);
+    EXPECT_EQ(memcmp(buf, buf4, len), 0);
+    EXPECT_EQ(hll_cnt_get_bytes(copy4, buf4, &len4), 0);
+    EXPECT_EQ(memcmp(buf, buf4, len), 0);
+    EXPECT_NEAR(hll_cnt_card(ctx4), hll_cnt_card(ctx), 1);
+
+    free(buf4);
+    free(buf);
+    hll_cnt_fini(copy4);
+    hll_cnt_fini(other4);
+    hll_cnt_fini(ctx4);
+    hll_cnt_fini(ctx);
+}
+
+/**
+ * Count with sparse bitmap.
+ *
+ * <ol>
+ * <li>Results should be identical to the normal bitmap</li>
+ * <li>Sparse contexts stay sparse when merged, and could be restored from
+ * serialized bytes</li>
+ * <li>Sparse bitmap is converted to the normal one once it gets large</li>
+ * </ol>
+ * */
+TEST(HyperloglogCounting, Sparse)
+{
+    uint8_t opts[] = {CCARD_HASH_MURMUR, CCARD_HASH_MURMUR64,
+                      CCARD_HASH_MURMUR | CCARD_OPT_REG4};
+    uint8_t sbuf[(1 << 12) + 3], buf[(1 << 12) + 3];
+    uint32_t slen, len;
+
+    for (size_t n = 0; n < sizeof(opts); n++) {
+        hll_cnt_ctx_t *ctx = hll_cnt_raw_init(NULL, 12, opts[n]);
+        hll_cnt_ctx_t *sparse = hll_cnt_raw_init(NULL, 12, opts[n] | CCARD_OPT_SPARSE);
+        hll_cnt_ctx_t *sparse2 = hll_cnt_raw_init(NULL, 12, opts[n] | CCARD_OPT_SPARSE);
+        hll_cnt_ctx_t *restored;
+
+        slen = sizeof(sbuf);
+        EXPECT_EQ(hll_cnt_get_raw_bytes(sparse, sbuf, &slen), 0);
+        EXPECT_EQ(slen, 1u);
+        EXPECT_EQ(hll_cnt_card(sparse), 0);
+
+        for (int64_t i = 1; i <= 300; i++) {
+            EXPECT_EQ(hll_cnt_offer(sparse, &i, sizeof(int64_t)),
+                      hll_cnt_offer(ctx, &i, sizeof(int64_t)));
+            int64_t j = i + 200;
+            hll_cnt_offer(sparse2, &j, sizeof(int64_t));
+        }
+        EXPECT_EQ(hll_cnt_card(sparse), hll_cnt_card(ctx));
+
+        /* serialized sparse bitmap */
+        slen = sizeof(sbuf);
+        EXPECT_EQ(hll_cnt_get_bytes(sparse, sbuf, &slen), 0);
+        EXPECT_LT(slen, 1u << 12);
+        restored = hll_cnt_init(sbuf, slen, opts[n]);
+        ASSERT_TRUE(restored != NULL);
+        EXPECT_EQ(hll_cnt_card(restored), hll_cnt_card(sparse));
+        EXPECT_EQ(hll_cnt_init(sbuf, slen - 1, opts[n]), (void *)NULL);
+
+        /* sparse contexts stay sparse when merged */
+        EXPECT_EQ(hll_cnt_merge(sparse, sparse2, NULL), 0);
+        EXPECT_EQ(hll_cnt_merge(ctx, sparse2, NULL), 0);
+        EXPECT_EQ(hll_cnt_card(sparse), hll_cnt_card(ctx));
+        slen = sizeof(sbuf);
+        EXPECT_EQ(hll_cnt_get_raw_bytes(sparse, sbuf, &slen), 0);
+        EXPECT_LT(slen, 1u << 12);
+        EXPECT_EQ(hll_cnt_merge_raw_bytes(restored, sbuf, slen, NULL), 0);
+        EXPECT_EQ(hll_cnt_card(restored), hll_cnt_card(ctx));
+
+        /* folded sparse context */
+        EXPECT_EQ(hll_cnt_fold(restored, 10), 0);
+        hll_cnt_ctx_t *folded = hll_cnt_raw_init(NULL, 12, opts[n]);
+        EXPECT_EQ(hll_cnt_merge(folded, ctx, NULL), 0);
+        EXPECT_EQ(hll_cnt_fold(folded, 10), 0);
+        EXPECT_EQ(hll_cnt_card(restored), hll_cnt_card(folded));
+        hll_cnt_fini(folded);
+
+        /* converted to normal bitmap */
+        for (int64_t i = 1; i <= 20000; i++) {
+            hll_cnt_offer(sparse, &i, sizeof(int64_t));
+            hll_cnt_offer(ctx, &i, sizeof(int64_t));
+        }
+        slen = sizeof(sbuf);
+        len = sizeof(buf);
+        EXPECT_EQ(hll_cnt_get_raw_bytes(sparse, sbuf, &slen), 0);
+        EXPECT_EQ(hll_cnt_get_raw_bytes(ctx, buf, &len), 0);
+        EXPECT_EQ(slen, 1u << 12);
+        EXPECT_EQ(slen, len);
+        EXPECT_EQ(memcmp(sbuf, buf, len), 0);
+        EXPECT_EQ(hll_cnt_card(sparse), hll_cnt_card(ctx));
+
+        /* invalid sparse bitmap */
+        uint8_t bad[] = {MAKE_SPARSE_ID(12), 1, 0xff, 0xff};
+        EXPECT_EQ(hll_cnt_merge_raw_bytes(ctx, bad, sizeof(bad), NULL), -1);
+        EXPECT_EQ(hll_cnt_errnum(ctx), CCARD_ERR_MERGE_FAILED);
+        EXPECT_EQ(hll_cnt_raw_init(bad, sizeof(bad), opts[n]), (void *)NULL);
+
+        hll_cnt_fini(restored);
+        hll_cnt_fini(sparse2);
+        hll_cnt_fini(sparse);
+        hll_cnt_fini(ctx);
+    }
+}
+
+/**
+ * Exact counting with explicit hash values
+ *
+ * <ol>
+ * <li>Explicit contexts are exact and stay explicit when merged or folded</li>
+ * <li>Delta of explicit context is applied as hash values</li>
+ * <li>Context is converted to registers beyond the limit and gets the same
+ * registers as a normal one</li>
+ * <li>Hash values exceeding 32 bits are rejected by 32-bit hash context</li>
+ * </ol>
+ * */
+TEST(HyperloglogCounting, Explicit)
+{
+    int64_t i;
+    uint32_t len, len2;
+    uint8_t buf[3 + 1 + 8 * 128], buf2[3 + 1024];
+    uint8_t opt = CCARD_HASH_MURMUR64 | CCARD_OPT_EXPLICIT;
+    hll_cnt_ctx_t *ctx1 = hll_cnt_init(NULL, 10, opt);
+    hll_cnt_ctx_t *ctx2 = hll_cnt_init(NULL, 12, opt);
+    hll_cnt_ctx_t *ctx3 = hll_cnt_init(NULL, 10, CCARD_HASH_MURMUR64);
+    hll_cnt_ctx_t *ctx4;
+
+    for (i = 1; i <= 50; i++) {
+        EXPECT_EQ(hll_cnt_offer(ctx1, &i, sizeof(i)), 1);
+        EXPECT_EQ(hll_cnt_offer(ctx1, &i, sizeof(i)), 0);
+        hll_cnt_offer(ctx3, &i, sizeof(i));
+    }
+    for (i = 41; i <= 100; i++) {
+        hll_cnt_offer(ctx2, &i, sizeof(i));
+    }
+    EXPECT_EQ(hll_cnt_card(ctx1), 50);
+    EXPECT_EQ(hll_cnt_card(ctx2), 60);
+
+    // merging explicit context of higher precision doesn't fold
+    EXPECT_EQ(hll_cnt_merge(ctx2, ctx1, NULL), 0);
+    EXPECT_EQ(hll_cnt_card(ctx2), 100);
+    len = sizeof(buf);
+    EXPECT_EQ(hll_cnt_get_bytes(ctx2, buf, &len), 0);
+    EXPECT_EQ(buf[2], 12);
+    EXPECT_EQ(hll_cnt_fold(ctx2, 10), 0);
+    EXPECT_EQ(hll_cnt_card(ctx2), 100);
+
+    ctx4 = hll_cnt_init(buf, len, CCARD_HASH_MURMUR64);
+    EXPECT_NE(ctx4, (hll_cnt_ctx_t *)NULL);
+    EXPECT_EQ(hll_cnt_card(ctx4), 100);
+    hll_cnt_fini(ctx4);
+
+    len = sizeof(buf);
+    EXPECT_EQ(hll_cnt_get_delta(ctx2, 0, buf, &len), 0);
+    EXPECT_TRUE(IS_EXPLICIT_BMP(buf + 3));
+    EXPECT_EQ(hll_cnt_apply_delta(ctx1, buf, len), 0);
+    EXPECT_EQ(hll_cnt_card(ctx1), 100);
+
+    // 2^10 bytes of registers hold 128 hash values
+    for (i = 51; i <= 400; i++) {
+        hll_cnt_offer(ctx3, &i, sizeof(i));
+        hll_cnt_offer(ctx1, &i, sizeof(i));
+        if (i == 128) {
+            EXPECT_EQ(hll_cnt_card(ctx1), 128);
+        }
+    }
+    EXPECT_EQ(hll_cnt_card(ctx1), hll_cnt_card(ctx3));
+    len = sizeof(buf2);
+    EXPECT_EQ(hll_cnt_get_bytes(ctx1, buf2, &len), 0);
+    EXPECT_FALSE(IS_EXPLICIT_BMP(buf2 + 3));
+    ctx4 = hll_cnt_init(buf2, len, CCARD_HASH_MURMUR64);
+    len2 = sizeof(buf2);
+    EXPECT_EQ(hll_cnt_get_raw_bytes(ctx3, buf2, &len2), 0);
+    EXPECT_EQ(len2, 1024u);
+    len = sizeof(buf2);
+    EXPECT_EQ(hll_cnt_merge_raw_bytes(ctx4, buf2, len2, NULL), 0);
+    EXPECT_EQ(hll_cnt_card(ctx4), hll_cnt_card(ctx3));
+    hll_cnt_fini(ctx4);
+
+    // hash value 2^32 has no register with 32-bit hash
+    uint8_t bad[] = {CCARD_ALGO_HYPERLOGLOG, CCARD_HASH_MURMUR, 10,
+                     MAKE_EXPLICIT_ID(10), 0, 0, 0, 0, 1, 0, 0, 0};
+    ctx4 = hll_cnt_init(NULL, 10, CCARD_HASH_MURMUR);
+    EXPECT_EQ(hll_cnt_merge_bytes(ctx4, bad, sizeof(bad), NULL), -1);
+    EXPECT_EQ(hll_cnt_errnum(ctx4), CCARD_ERR_MERGE_FAILED);
+    EXPECT_EQ(hll_cnt_merge_raw_bytes(ctx4, bad + 3, sizeof(bad) - 3, NULL), -1);
+    EXPECT_EQ(hll_cnt_errnum(ctx4), CCARD_ERR_MERGE_FAILED);
+    EXPECT_EQ(hll_cnt_init(bad, sizeof(bad), CCARD_HASH_MURMUR),
+              (hll_cnt_ctx_t *)NULL);
+    EXPECT_EQ(hll_cnt_card(ctx4), 0);
+
+    hll_cnt_fini(ctx1);
+    hll_cnt_fini(ctx2);
+    hll_cnt_fini(ctx3);
+    hll_cnt_fini(ctx4);
+}
+
+/**
+ * Tests compressed serialization.
+ *
+ * <ol>
+ * <li>Compressed bytes of sparse and dense registers are smaller</li>
+ * <li>Contexts initialized from compressed bytes have the same estimate</li>
+ * <li>Compressed and plain bytes are merged together</li>
+ * </ol>
+ * */
+TEST(HyperloglogCounting, Compressed)
+{
+    int64_t i;
+    uint32_t len, clen, slen;
+    uint8_t buf[3 + 4096], cbuf[3 + 4096 + 8], sbuf[3 + 4096];
+    hll_cnt_ctx_t *ctx1 = hll_cnt_init(NULL, 12, CCARD_HASH_MURMUR);
+    hll_cnt_ctx_t *ctx2 = hll_cnt_init(NULL, 12, CCARD_HASH_MURMUR);
+    hll_cnt_ctx_t *ctx3;
+
+    for (i = 1; i <= 100; i++) {
+        hll_cnt_offer(ctx1, &i, sizeof(i));
+    }
+    for (i = 1001; i <= 21000; i++) {
+        hll_cnt_offer(ctx2, &i, sizeof(i));
+    }
+
+    slen = sizeof(sbuf);
+    EXPECT_EQ(hll_cnt_get_compressed_bytes(ctx1, sbuf, &slen), 0);
+    EXPECT_EQ(sbuf[0], CCARD_ALGO_HYPERLOGLOG | CCARD_FLAG_COMPRESSED);
+    len = sizeof(buf);
+    EXPECT_EQ(hll_cnt_get_bytes(ctx1, buf, &len), 0);
+    EXPECT_LE(slen, len + 3);
+    ctx3 = hll_cnt_init(sbuf, slen, CCARD_HASH_MURMUR);
+    EXPECT_NE(ctx3, (hll_cnt_ctx_t *)NULL);
+    EXPECT_EQ(hll_cnt_card(ctx3), hll_cnt_card(ctx1));
+    hll_cnt_fini(ctx3);
+
+    len = sizeof(buf);
+    EXPECT_EQ(hll_cnt_get_bytes(ctx2, buf, &len), 0);
+    EXPECT_EQ(len, 3 + 4096u);
+    EXPECT_EQ(hll_cnt_get_compressed_bytes(ctx2, NULL, &clen), 0);
+    EXPECT_LT(clen, len * 3 / 4);
+    EXPECT_EQ(hll_cnt_get_compressed_bytes(ctx2, cbuf, &clen), 0);
+    ctx3 = hll_cnt_init(cbuf, clen, CCARD_HASH_MURMUR);
+    EXPECT_NE(ctx3, (hll_cnt_ctx_t *)NULL);
+    EXPECT_EQ(hll_cnt_card(ctx3), hll_cnt_card(ctx2));
+
+    EXPECT_EQ(hll_cnt_merge_bytes(ctx1, cbuf, clen, NULL), 0);
+    EXPECT_EQ(hll_cnt_merge_bytes(ctx3, sbuf, slen, NULL), 0);
+    EXPECT_EQ(hll_cnt_card(ctx1), hll_cnt_card(ctx3));
+
+    cbuf[clen - 1] ^= 0xff;
+    EXPECT_EQ(hll_cnt_merge_bytes(ctx3, cbuf, clen - 1, NULL), -1);
+    EXPECT_EQ(hll_cnt_errnum(ctx3), CCARD_ERR_MERGE_FAILED);
+
+    hll_cnt_fini(ctx3);
+    hll_cnt_fini(ctx2);
+    hll_cnt_fini(ctx1);
+}
+
+/**
+ * Tests views of borrowed bitmap.
+ *
+ * <ol>
+ * <li>Read-only view is estimated and merged from, but not updated</li>
+ * <li>Writable view updates the borrowed bitmap in place</li>
+ * <li>Only normal bitmap could be borrowed</li>
+ * </ol>
+ * */
+TEST(HyperloglogCounting, View)
+{
+    int64_t i;
+    uint32_t len, len2;
+    uint8_t buf[3 + 4096], buf2[3 + 4096];
+    hll_cnt_ctx_t *ctx1 = hll_cnt_init(NULL, 12, CCARD_HASH_MURMUR);
+    hll_cnt_ctx_t *ctx2 = hll_cnt_init(NULL, 12, CCARD_HASH_MURMUR);
+    hll_cnt_ctx_t *ctx4 = hll_cnt_init(NULL, 12, CCARD_HASH_MURMUR | CCARD_OPT_SPARSE);
+    hll_cnt_ctx_t *view, *ctx3;
+
+    for (i = 1; i <= 20000; i++) {
+        hll_cnt_offer(ctx1, &i, sizeof(i));
+    }
+    len = sizeof(buf);
+    EXPECT_EQ(hll_cnt_get_bytes(ctx1, buf, &len), 0);
+
+    view = hll_cnt_view_init(buf, len, CCARD_VIEW_RDONLY);
+    EXPECT_NE(view, (hll_cnt_ctx_t *)NULL);
+    EXPECT_EQ(hll_cnt_card(view), hll_cnt_card(ctx1));
+    EXPECT_EQ(hll_cnt_offer(view, &i, sizeof(i)), -1);
+    EXPECT_EQ(hll_cnt_errnum(view), CCARD_ERR_VIEW);
+    EXPECT_EQ(hll_cnt_reset(view), -1);
+    EXPECT_EQ(hll_cnt_merge(ctx2, view, NULL), 0);
+    EXPECT_EQ(hll_cnt_card(ctx2), hll_cnt_card(ctx1));
+    len2 = sizeof(buf2);
+    EXPECT_EQ(hll_cnt_get_bytes(view, buf2, &len2), 0);
+    EXPECT_EQ(len2, len);
+    EXPECT_EQ(memcmp(buf, buf2, len), 0);
+    EXPECT_EQ(hll_cnt_fini(view), 0);
+
+    view = hll_cnt_view_init(buf, len, CCARD_VIEW_WRITABLE);
+    EXPECT_NE(view, (hll_cnt_ctx_t *)NULL);
+    for (i = 20001; i <= 40000; i++) {
+        hll_cnt_offer(ctx1, &i, sizeof(i));
+        EXPECT_GE(hll_cnt_offer(view, &i, sizeof(i)), 0);
+    }
+    EXPECT_EQ(hll_cnt_card(view), hll_cnt_card(ctx1));
+    EXPECT_EQ(hll_cnt_fold(view, 10), -1);
+    EXPECT_EQ(hll_cnt_errnum(view), CCARD_ERR_VIEW);
+    ctx3 = hll_cnt_init(buf, len, CCARD_HASH_MURMUR);
+    EXPECT_EQ(hll_cnt_card(ctx3), hll_cnt_card(ctx1));
+    EXPECT_EQ(hll_cnt_reset(view), 0);
+    EXPECT_EQ(buf[3 + 100], 0);
+    EXPECT_EQ(hll_cnt_fini(view), 0);
+
+    /* sparse, compressed or corrupted bitmap */
+    len2 = sizeof(buf2);
+    EXPECT_EQ(hll_cnt_get_bytes(ctx4, buf2, &len2), 0);
+    EXPECT_EQ(hll_cnt_view_init(buf2, len2, CCARD_VIEW_RDONLY), (hll_cnt_ctx_t *)NULL);
+    hll_cnt_fini(ctx4);
+    buf[0] |= CCARD_FLAG_COMPRESSED;
+    EXPECT_EQ(hll_cnt_view_init(buf, len, CCARD_VIEW_RDONLY), (hll_cnt_ctx_t *)NULL);
+    buf[0] &= ~CCARD_FLAG_COMPRESSED;
+    EXPECT_EQ(hll_cnt_view_init(buf, len - 1, CCARD_VIEW_RDONLY), (hll_cnt_ctx_t *)NULL);
+
+    hll_cnt_fini(ctx3);
+    hll_cnt_fini(ctx2);
+    hll_cnt_fini(ctx1);
+}
+
+/**
+ * Tests virtual hyperloglog counting.
+ *
+ * <ol>
+ * <li>Large keys are estimated after subtracting noise of the pool</li>
+ * <li>The whole pool counts no more than distinct (key, object) pairs</li>
+ * <li>Keys never offered are estimated close to zero</li>
+ * <li>Invalid arguments are rejected</li>
+ * </ol>
+ * */
+TEST(HyperloglogCounting, Virtual)
+{
+    vhll_cnt_ctx_t *ctx = vhll_cnt_init(20, 9, CCARD_HASH_MURMUR64);
+    uint32_t key, i, sizes[] = {5000, 20000, 80000};
+    int64_t esti, total = 0;
+
+    ASSERT_NE(ctx, (vhll_cnt_ctx_t *)NULL);
+    // many small keys make noise
+    for (key = 100; key < 5100; key++) {
+        for (i = 0; i < 40; i++) {
+            EXPECT_GE(vhll_cnt_offer(ctx, &key, sizeof(key), &i, sizeof(i)), 0);
+        }
+    }
+    total += 5000 * 40;
+    for (key = 0; key < 3; key++) {
+        for (i = 0; i < sizes[key]; i++) {
+            vhll_cnt_offer(ctx, &key, sizeof(key), &i, sizeof(i));
+        }
+        total += sizes[key];
+    }
+
+    for (key = 0; key < 3; key++) {
+        esti = vhll_cnt_card(ctx, &key, sizeof(key));
+        printf("actual: %u, estimated: %lld\n", sizes[key], (long long)esti);
+        EXPECT_LT(fabs(esti - (double)sizes[key]) / sizes[key], 0.2);
+    }
+    // large keys are hidden in their virtual registers
+    esti = vhll_cnt_card_total(ctx);
+    EXPECT_GT(esti, 5000 * 40 * 0.9);
+    EXPECT_LT(esti, total);
+
+    key = 99999;
+    EXPECT_LT(vhll_cnt_card(ctx, &key, sizeof(key)), 1000);
+
+    EXPECT_EQ(vhll_cnt_offer(ctx, NULL, 4, &i, sizeof(i)), -1);
+    EXPECT_EQ(vhll_cnt_errnum(ctx), CCARD_ERR_INVALID_ARGUMENT);
+    EXPECT_EQ(vhll_cnt_reset(ctx), 0);
+    EXPECT_EQ(vhll_cnt_card_total(ctx), 0);
+    EXPECT_EQ(vhll_cnt_card(ctx, &key, sizeof(key)), 0);
+    EXPECT_EQ(vhll_cnt_fini(ctx), 0);
+
+    EXPECT_EQ(vhll_cnt_init(9, 9, CCARD_HASH_MURMUR64), (vhll_cnt_ctx_t *)NULL);
+    EXPECT_EQ(vhll_cnt_init(20, 3, CCARD_HASH_MURMUR64), (vhll_cnt_ctx_t *)NULL);
+    EXPECT_EQ(vhll_cnt_init(32, 9, CCARD_HASH_MURMUR64), (vhll_cnt_ctx_t *)NULL);
+    EXPECT_EQ(vhll_cnt_fini(NULL), -1);
+}
+
+/**
+ * Tests lazy reset.
+ *
+ * <ol>
+ * <li>Counts the same as reset by clearing the whole bitmap</li>
+ * <li>Serialized and merged bitmaps have no values from before reset</li>
+ * <li>Lazy reset could be turned off and isn't allowed on views</li>
+ * </ol>
+ * */
+TEST(HyperloglogCounting, LazyReset)
+{
+    hll_cnt_ctx_t *ctx = hll_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR);
+    hll_cnt_ctx_t *ref = hll_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR);
+    hll_cnt_ctx_t *tbm, *view;
+    uint8_t *buf = (uint8_t *)malloc(16384 + 3);
+    uint8_t *rbuf = (uint8_t *)malloc(16384 + 3);
+    uint32_t i, n, v, len, rlen;
+
+    EXPECT_EQ(hll_cnt_set_lazy_reset(ctx, 1), 0);
+    for (n = 10; n <= 100000; n *= 10) {
+        EXPECT_EQ(hll_cnt_reset(ctx), 0);
+        EXPECT_EQ(hll_cnt_reset(ref), 0);
+        EXPECT_EQ(hll_cnt_card(ctx), 0);
+        for (i = 0; i < n; i++) {
+            v = i * 7 + n;
+            EXPECT_EQ(hll_cnt_offer(ctx, &v, sizeof(v)),
+                      hll_cnt_offer(ref, &v, sizeof(v)));
+        }
+        EXPECT_EQ(hll_cnt_card(ctx), hll_cnt_card(ref));
+
+        len = rlen = 16384 + 3;
+        EXPECT_EQ(hll_cnt_get_bytes(ctx, buf, &len), 0);
+        EXPECT_EQ(hll_cnt_get_bytes(ref, rbuf, &rlen), 0);
+        EXPECT_EQ(len, rlen);
+        EXPECT_EQ(memcmp(buf, rbuf, len), 0);
+    }
+
+    // stale blocks of merged context are zeros
+    hll_cnt_reset(ctx);
+    hll_cnt_reset(ref);
+    for (i = 0; i < 10; i++) {
+        hll_cnt_offer(ctx, &i, sizeof(i));
+        hll_cnt_offer(ref, &i, sizeof(i));
+    }
+    tbm = hll_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR);
+    EXPECT_EQ(hll_cnt_merge(tbm, ctx, NULL), 0);
+    EXPECT_EQ(hll_cnt_card(tbm), hll_cnt_card(ref));
+    hll_cnt_fini(tbm);
+
+    hll_cnt_reset(ctx);
+    EXPECT_EQ(hll_cnt_set_lazy_reset(ctx, 0), 0);
+    EXPECT_EQ(hll_cnt_card(ctx), 0);
+    len = 16384 + 3;
+    EXPECT_EQ(hll_cnt_get_bytes(ctx, buf, &len), 0);
+    view = hll_cnt_view_init(buf, len, CCARD_VIEW_WRITABLE);
+    ASSERT_NE(view, (hll_cnt_ctx_t *)NULL);
+    EXPECT_EQ(hll_cnt_set_lazy_reset(view, 1), -1);
+    EXPECT_EQ(hll_cnt_errnum(view), CCARD_ERR_VIEW);
+
+    hll_cnt_fini(view);
+    hll_cnt_fini(ctx);
+    hll_cnt_fini(ref);
+    free(buf);
+    free(rbuf);
+}
+
+/**
+ * Tests copying contexts.
+ *
+ * <ol>
+ * <li>Clone serializes the same as the original in any representation, and
+ * is independent of it</li>
+ * <li>Copy overwrites contexts of other representations and k</li>
+ * <li>Loaded bitmap counts the same as the context it was got from</li>
+ * <li>Views could be copied from but not overwritten</li>
+ * </ol>
+ * */
+TEST(HyperloglogCounting, Copy)
+{
+    uint8_t opts[] = {
+        CCARD_HASH_MURMUR,
+        CCARD_HASH_MURMUR | CCARD_OPT_SPARSE,
+        CCARD_HASH_MURMUR | CCARD_OPT_EXPLICIT,
+        CCARD_HASH_MURMUR | CCARD_OPT_REG4,
+        CCARD_HASH_MURMUR | CCARD_OPT_REG6
+    };
+    uint32_t n[] = {10, 300, 20000};
+    uint8_t *buf = (uint8_t *)malloc(4096 + 3);
+    uint8_t *cbuf = (uint8_t *)malloc(4096 + 3);
+    uint32_t i, j, v, len, clen;
+    hll_cnt_ctx_t *dst = hll_cnt_raw_init(NULL, 8, CCARD_HASH_MURMUR);
+    hll_cnt_ctx_t *ctx, *cp, *view;
+
+    for (i = 0; i < sizeof(opts); i++) {
+        for (j = 0; j < 3; j++) {
+            ctx = hll_cnt_raw_init(NULL, 12, opts[i]);
+            for (v = 0; v < n[j]; v++) {
+                hll_cnt_offer(ctx, &v, sizeof(v));
+            }
+            len = 4096 + 3;
+            EXPECT_EQ(hll_cnt_get_bytes(ctx, buf, &len), 0);
+
+            cp = hll_cnt_clone(ctx);
+            ASSERT_NE(cp, (hll_cnt_ctx_t *)NULL);
+            EXPECT_EQ(hll_cnt_card(cp), hll_cnt_card(ctx));
+            clen = 4096 + 3;
+            EXPECT_EQ(hll_cnt_get_bytes(cp, cbuf, &clen), 0);
+            EXPECT_EQ(clen, len);
+            EXPECT_EQ(memcmp(cbuf, buf, len), 0);
+            for (v = 0; v < 1000; v++) {
+                hll_cnt_offer(cp, &v, sizeof(v));
+            }
+            clen = 4096 + 3;
+            EXPECT_EQ(hll_cnt_get_bytes(ctx, cbuf, &clen), 0);
+            EXPECT_EQ(memcmp(cbuf, buf, len), 0);
+            hll_cnt_fini(cp);
+
+            // dst holds the previous context, of another representation
+            EXPECT_EQ(hll_cnt_copy_into(dst, ctx), 0);
+            EXPECT_EQ(hll_cnt_card(dst), hll_cnt_card(ctx));
+            clen = 4096 + 3;
+            EXPECT_EQ(hll_cnt_get_bytes(dst, cbuf, &clen), 0);
+            EXPECT_EQ(clen, len);
+            EXPECT_EQ(memcmp(cbuf, buf, len), 0);
+
+            cp = hll_cnt_raw_init(NULL, 12, opts[i]);
+            EXPECT_EQ(hll_cnt_load_bytes(cp, buf, len), 0);
+            EXPECT_EQ(hll_cnt_card(cp), hll_cnt_card(ctx));
+            hll_cnt_fini(cp);
+            hll_cnt_fini(ctx);
+        }
+    }
+
+    // in place load of normal bitmap, stale blocks are overwritten
+    ctx = hll_cnt_raw_init(NULL, 12, opts[0]);
+    for (v = 0; v < 5000; v++) {
+        hll_cnt_offer(ctx, &v, sizeof(v));
+    }
+    len = 4096 + 3;
+    EXPECT_EQ(hll_cnt_get_bytes(ctx, buf, &len), 0);
+    EXPECT_EQ(len, 4096u + 3);
+    EXPECT_EQ(hll_cnt_set_lazy_reset(dst, 1), 0);
+    EXPECT_EQ(hll_cnt_copy_into(dst, ctx), 0);
+    EXPECT_EQ(hll_cnt_set_lazy_reset(ctx, 1), 0);
+    EXPECT_EQ(hll_cnt_reset(ctx), 0);
+    EXPECT_EQ(hll_cnt_load_bytes(ctx, buf, len), 0);
+    EXPECT_EQ(hll_cnt_card(ctx), hll_cnt_card(dst));
+    EXPECT_EQ(hll_cnt_load_bytes(ctx, buf, 3), -1);
+    EXPECT_EQ(hll_cnt_errnum(ctx), CCARD_ERR_INVALID_ARGUMENT);
+
+    view = hll_cnt_view_init(buf, len, CCARD_VIEW_WRITABLE);
+    ASSERT_NE(view, (hll_cnt_ctx_t *)NULL);
+    EXPECT_EQ(hll_cnt_copy_into(view, ctx), -1);
+    EXPECT_EQ(hll_cnt_errnum(view), CCARD_ERR_VIEW);
+    EXPECT_EQ(hll_cnt_load_bytes(view, buf, len), -1);
+    cp = hll_cnt_clone(view);
+    ASSERT_NE(cp, (hll_cnt_ctx_t *)NULL);
+    EXPECT_EQ(hll_cnt_card(cp), hll_cnt_card(view));
+    EXPECT_EQ(hll_cnt_reset(cp), 0);
+    EXPECT_NE(hll_cnt_card(view), 0);
+
+    EXPECT_EQ(hll_cnt_copy_into(NULL, ctx), -1);
+    EXPECT_EQ(hll_cnt_clone(NULL), (hll_cnt_ctx_t *)NULL);
+    hll_cnt_fini(cp);
+    hll_cnt_fini(view);
+    hll_cnt_fini(ctx);
+    hll_cnt_fini(dst);
+    free(buf);
+    free(cbuf);
+}
+
+/**
+ * Tests getting serialized bitmap as I/O vector.
+ *
+ * <ol>
+ * <li>Header and bitmap are the same bytes as hll_cnt_get_bytes</li>
+ * <li>Bitmap points into the context instead of a copy</li>
+ * <li>Explicit and packed bitmaps aren't stored as they are serialized</li>
+ * </ol>
+ * */
+TEST(HyperloglogCounting, Iov)
+{
+    uint8_t opts[] = {CCARD_HASH_MURMUR, CCARD_HASH_MURMUR | CCARD_OPT_SPARSE};
+    uint8_t hdr[CCARD_IOV_HDR_LEN];
+    uint8_t *buf = (uint8_t *)malloc(4096 + 3);
+    uint8_t fail_opts[] = {
+        CCARD_HASH_MURMUR | CCARD_OPT_EXPLICIT,
+        CCARD_HASH_MURMUR | CCARD_OPT_REG5
+    };
+    struct iovec iov[2];
+    uint32_t i, j, v, len;
+
+    for (i = 0; i < sizeof(opts); i++) {
+        for (j = 10; j <= 10000; j *= 10) {
+            hll_cnt_ctx_t *ctx = hll_cnt_raw_init(NULL, 12, opts[i]);
+
+            for (v = 0; v < j; v++) {
+                hll_cnt_offer(ctx, &v, sizeof(v));
+            }
+            len = 4096 + 3;
+            EXPECT_EQ(hll_cnt_get_bytes(ctx, buf, &len), 0);
+            EXPECT_EQ(hll_cnt_get_iov(ctx, hdr, iov), 0);
+            ASSERT_EQ(iov[0].iov_len + iov[1].iov_len, len);
+            EXPECT_EQ(iov[0].iov_base, (void *)hdr);
+            EXPECT_EQ(memcmp(iov[0].iov_base, buf, iov[0].iov_len), 0);
+            EXPECT_EQ(memcmp(iov[1].iov_base, buf + iov[0].iov_len,
+                             iov[1].iov_len), 0);
+            hll_cnt_fini(ctx);
+        }
+    }
+
+    for (i = 0; i < sizeof(fail_opts); i++) {
+        hll_cnt_ctx_t *ctx = hll_cnt_raw_init(NULL, 12, fail_opts[i]);
+
+        EXPECT_EQ(hll_cnt_get_iov(ctx, hdr, iov), -1);
+        EXPECT_EQ(hll_cnt_errnum(ctx), CCARD_ERR_INVALID_ARGUMENT);
+        hll_cnt_fini(ctx);
+    }
+
+    EXPECT_EQ(hll_cnt_get_iov(NULL, hdr, iov), -1);
+    free(buf);
+}
+
+struct offer_range_s {
+    hll_cnt_ctx_t *ctx;
+    uint32_t from;
+    uint32_t to;
+};
+
+static void *offer_range(void *arg)
+{
+    struct offer_range_s *r = (struct offer_range_s *)arg;
+    uint32_t i;
+
+    for (i = r->from; i < r->to; i++) {
+        hll_cnt_offer(r->ctx, &i, sizeof(i));
+    }
+    return NULL;
+}
+
+/**
+ * Tests concurrent offers.
+ *
+ * <ol>
+ * <li>Threads offer overlapping ranges to one context without locks</li>
+ * <li>Result is identical to offering all values serially</li>
+ * <li>Sparse registers are converted to dense ones first</li>
+ * <li>Packing and lazy reset aren't allowed meanwhile, nor on views</li>
+ * </ol>
+ * */
+TEST(HyperloglogCounting, Concurrent)
+{
+    hll_cnt_ctx_t *ctx = hll_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR | CCARD_OPT_SPARSE);
+    hll_cnt_ctx_t *ref = hll_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR | CCARD_OPT_SPARSE);
+    hll_cnt_ctx_t *view;
+    uint8_t *buf = (uint8_t *)malloc(16384 + 3);
+    uint8_t *rbuf = (uint8_t *)malloc(16384 + 3);
+    struct offer_range_s ranges[4];
+    pthread_t threads[4];
+    uint32_t i, len, rlen;
+
+    for (i = 0; i < 100; i++) {
+        hll_cnt_offer(ctx, &i, sizeof(i));
+        hll_cnt_offer(ref, &i, sizeof(i));
+    }
+    EXPECT_EQ(hll_cnt_set_concurrent(ctx, 1), 0);
+    EXPECT_EQ(hll_cnt_pack(ctx, 6), -1);
+    EXPECT_EQ(hll_cnt_errnum(ctx), CCARD_ERR_INVALID_ARGUMENT);
+    EXPECT_EQ(hll_cnt_set_lazy_reset(ctx, 1), -1);
+    EXPECT_EQ(hll_cnt_errnum(ctx), CCARD_ERR_INVALID_ARGUMENT);
+    EXPECT_EQ(hll_cnt_card(ctx), hll_cnt_card(ref));
+
+    for (i = 0; i < 4; i++) {
+        ranges[i].ctx = ctx;
+        ranges[i].from = i * 50000;
+        ranges[i].to = i * 50000 + 80000;
+        ASSERT_EQ(pthread_create(&threads[i], NULL, offer_range, &ranges[i]), 0);
+    }
+    for (i = 0; i < 4; i++) {
+        ASSERT_EQ(pthread_join(threads[i], NULL), 0);
+    }
+    for (i = 0; i < 3 * 50000 + 80000; i++) {
+        hll_cnt_offer(ref, &i, sizeof(i));
+    }
+
+    len = rlen = 16384 + 3;
+    EXPECT_EQ(hll_cnt_get_bytes(ctx, buf, &len), 0);
+    EXPECT_EQ(hll_cnt_get_bytes(ref, rbuf, &rlen), 0);
+    EXPECT_EQ(len, rlen);
+    EXPECT_EQ(memcmp(buf, rbuf, len), 0);
+    EXPECT_EQ(hll_cnt_card(ctx), hll_cnt_card(ref));
+
+    printf("actual:230000, estimated: %9lu\n",
+           (long unsigned int)hll_cnt_card(ctx));
+
+    // copied bitmaps stay dense in a concurrent context
+    hll_cnt_reset(ref);
+    EXPECT_EQ(hll_cnt_copy_into(ctx, ref), 0);
+    EXPECT_EQ(hll_cnt_card(ctx), 0);
+    ranges[0].from = 0;
+    ranges[0].to = 1000;
+    ranges[1].from = 500;
+    ranges[1].to = 1500;
+    for (i = 0; i < 2; i++) {
+        ASSERT_EQ(pthread_create(&threads[i], NULL, offer_range, &ranges[i]), 0);
+    }
+    for (i = 0; i < 2; i++) {
+        ASSERT_EQ(pthread_join(threads[i], NULL), 0);
+    }
+    for (i = 0; i < 1500; i++) {
+        hll_cnt_offer(ref, &i, sizeof(i));
+    }
+    EXPECT_EQ(hll_cnt_card(ctx), hll_cnt_card(ref));
+
+    EXPECT_EQ(hll_cnt_set_concurrent(ctx, 0), 0);
+    EXPECT_EQ(hll_cnt_card(ctx), hll_cnt_card(ref));
+
+    len = 16384 + 3;
+    EXPECT_EQ(hll_cnt_get_bytes(ctx, buf, &len), 0);
+    view = hll_cnt_view_init(buf, len, CCARD_VIEW_WRITABLE);
+    ASSERT_NE(view, (hll_cnt_ctx_t *)NULL);
+    EXPECT_EQ(hll_cnt_set_concurrent(view, 1), -1);
+    EXPECT_EQ(hll_cnt_errnum(view), CCARD_ERR_VIEW);
+
+    hll_cnt_fini(view);
+    hll_cnt_fini(ctx);
+    hll_cnt_fini(ref);
+    free(buf);
+    free(rbuf);
+}
+
 // vi:ft=c ts=4 sw=4 fdm=marker et
@@ -1,3 +1,6 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include "ccard_common.h"
 #include "hyperloglogplus_counting.h"
 #include "gtest/gtest.h"
@@ -129,5 +132,759 @@ TEST(HyperloglogPlusCounting, MergeBytesVariadic)
     result = hllp_cnt_merge_bytes(ctx, buf1, 1027, buf2, 1027, NULL);
     EXPECT_EQ(result, 0);
     EXPECT_EQ(hllp_cnt_card(ctx), 2);
+
+    // the same buffer could be passed more than once
+    hllp_cnt_reset(ctx);
+    result = hllp_cnt_merge_bytes(ctx, buf1, 1027, buf1, 1027, NULL);
+    EXPECT_EQ(result, 0);
+    EXPECT_EQ(hllp_cnt_card(ctx), 1);
+    result = hllp_cnt_merge_raw_bytes(ctx, buf2 + 3, 1024, buf2 + 3, 1024,
+                                      NULL);
+    EXPECT_EQ(result, 0);
+    EXPECT_EQ(hllp_cnt_card(ctx), 2);
+
+    hllp_cnt_fini(ctx);
+    hllp_cnt_fini(other1);
+    hllp_cnt_fini(other2);
+}
+
+/**
+ * Fold bitmap to lower precision, the result should be identical to counting
+ * with lower precision directly.
+ * */
+TEST(HyperloglogPlusCounting, Fold)
+{
+    hllp_cnt_ctx_t *ctx16 = hllp_cnt_init(NULL, 16);
+    hllp_cnt_ctx_t *ctx10 = hllp_cnt_init(NULL, 10);
+
+    for (int64_t i = 1; i <= 100000L; i++) {
+        hllp_cnt_offer(ctx16, &i, sizeof(int64_t));
+        hllp_cnt_offer(ctx10, &i, sizeof(int64_t));
+    }
+
+    EXPECT_EQ(hllp_cnt_fold(ctx16, 3), -1);
+    EXPECT_EQ(hllp_cnt_errnum(ctx16), CCARD_ERR_INVALID_ARGUMENT);
+    EXPECT_EQ(hllp_cnt_fold(ctx16, 10), 0);
+
+    uint8_t buf16[1 << 10], buf10[1 << 10];
+    uint32_t len16 = sizeof(buf16), len10 = sizeof(buf10);
+    EXPECT_EQ(hllp_cnt_get_raw_bytes(ctx16, buf16, &len16), 0);
+    EXPECT_EQ(hllp_cnt_get_raw_bytes(ctx10, buf10, &len10), 0);
+    EXPECT_EQ(len16, len10);
+    EXPECT_EQ(memcmp(buf16, buf10, len10), 0);
+    EXPECT_EQ(hllp_cnt_card(ctx16), hllp_cnt_card(ctx10));
+
+    hllp_cnt_fini(ctx16);
+    hllp_cnt_fini(ctx10);
+}
+
+TEST(HyperloglogPlusCounting, MergeBytesDifferentLength)
+{
+    hllp_cnt_ctx_t *ctx = hllp_cnt_init(NULL, 10);
+    hllp_cnt_ctx_t *other = hllp_cnt_init(NULL, 14);
+    hllp_cnt_ctx_t *expect = hllp_cnt_init(NULL, 10);
+
+    for (int64_t i = 1; i <= 5000; i++) {
+        hllp_cnt_offer(i % 2 ? ctx : other, &i, sizeof(int64_t));
+        hllp_cnt_offer(expect, &i, sizeof(int64_t));
+    }
+
+    uint32_t len = (1 << 14) + 3;
+    uint8_t *buf = (uint8_t *)malloc(len);
+    EXPECT_EQ(hllp_cnt_get_bytes(other, buf, &len), 0);
+    EXPECT_EQ(hllp_cnt_merge_bytes(ctx, buf, len, NULL), 0);
+    EXPECT_EQ(hllp_cnt_card(ctx), hllp_cnt_card(expect));
+
+    free(buf);
+    hllp_cnt_fini(expect);
+    hllp_cnt_fini(other);
+    hllp_cnt_fini(ctx);
+}
+
+/**
+ * Replicate context by deltas.
+ *
+ * <ol>
+ * <li>The first delta carries all buckets</li>
+ * <li>The following deltas carry only buckets raised since the last one</li>
+ * <li>Delta since an unknown epoch carries all buckets again</li>
+ * </ol>
+ * */
+TEST(HyperloglogPlusCounting, Delta)
+{
+    hllp_cnt_ctx_t *ctx = hllp_cnt_raw_init(NULL, 14);
+    hllp_cnt_ctx_t *replica = hllp_cnt_raw_init(NULL, 14);
+    uint32_t len, full_len, rlen = 1 << 14, clen = 1 << 14;
+    uint8_t *buf = (uint8_t *)malloc((1 << 14) + 3);
+    uint8_t *rbuf = (uint8_t *)malloc(rlen);
+    uint8_t *cbuf = (uint8_t *)malloc(clen);
+    int64_t i;
+
+    for (i = 1; i <= 20000; i++) {
+        hllp_cnt_offer(ctx, &i, sizeof(int64_t));
+    }
+    EXPECT_EQ(hllp_cnt_epoch(ctx), 0);
+    EXPECT_EQ(hllp_cnt_get_delta(ctx, 0, NULL, &len), 0);
+    EXPECT_EQ(hllp_cnt_epoch(ctx), 0);
+    EXPECT_EQ(hllp_cnt_get_delta(ctx, 0, buf, &len), 0);
+    EXPECT_EQ(hllp_cnt_epoch(ctx), 1);
+    EXPECT_EQ(len, (uint32_t)(1 << 14) + 3);
+    full_len = len;
+    EXPECT_EQ(hllp_cnt_apply_delta(replica, buf, len), 0);
+    EXPECT_EQ(hllp_cnt_card(replica), hllp_cnt_card(ctx));
+
+    for (i = 20001; i <= 20100; i++) {
+        hllp_cnt_offer(ctx, &i, sizeof(int64_t));
+    }
+    len = (1 << 14) + 3;
+    EXPECT_EQ(hllp_cnt_get_delta(ctx, 1, buf, &len), 0);
+    EXPECT_LT(len, full_len / 10);
+    EXPECT_EQ(hllp_cnt_apply_delta(replica, buf, len), 0);
+    EXPECT_EQ(hllp_cnt_get_raw_bytes(ctx, cbuf, &clen), 0);
+    EXPECT_EQ(hllp_cnt_get_raw_bytes(replica, rbuf, &rlen), 0);
+    EXPECT_EQ(clen, rlen);
+    EXPECT_EQ(memcmp(cbuf, rbuf, clen), 0);
+
+    /* nothing changed since epoch 2 */
+    len = (1 << 14) + 3;
+    EXPECT_EQ(hllp_cnt_get_delta(ctx, 2, buf, &len), 0);
+    EXPECT_EQ(len, 4u);
+    EXPECT_EQ(hllp_cnt_apply_delta(replica, buf, len), 0);
+
+    /* unknown epoch */
+    len = (1 << 14) + 3;
+    EXPECT_EQ(hllp_cnt_get_delta(ctx, 1, buf, &len), 0);
+    EXPECT_EQ(len, full_len);
+    EXPECT_EQ(hllp_cnt_apply_delta(replica, buf, len), 0);
+    EXPECT_EQ(hllp_cnt_card(replica), hllp_cnt_card(ctx));
+
+    /* serialized bitmap isn't a delta */
+    EXPECT_EQ(hllp_cnt_get_bytes(ctx, buf, &len), 0);
+    EXPECT_EQ(hllp_cnt_apply_delta(replica, buf, len), -1);
+    EXPECT_EQ(hllp_cnt_errnum(replica), CCARD_ERR_MERGE_FAILED);
+
+    free(cbuf);
+    free(rbuf);
+    free(buf);
+    hllp_cnt_fini(replica);
+    hllp_cnt_fini(ctx);
+}
+
+/**
+ * Count with packed registers.
+ *
+ * <ol>
+ * <li>Results should be identical to registers in bytes</li>
+ * <li>Packed contexts could be merged and folded</li>
+ * </ol>
+ * */
+TEST(HyperloglogPlusCounting, Packed)
+{
+    uint8_t widths[] = {6, 5};
+    uint8_t pbuf[1 << 12], buf[1 << 12];
+    uint32_t plen, len;
+
+    for (size_t n = 0; n < sizeof(widths); n++) {
+        hllp_cnt_ctx_t *ctx = hllp_cnt_raw_init(NULL, 12);
+        hllp_cnt_ctx_t *packed = hllp_cnt_raw_init(NULL, 12);
+        hllp_cnt_ctx_t *ctx2 = hllp_cnt_raw_init(NULL, 12);
+        hllp_cnt_ctx_t *packed2 = hllp_cnt_raw_init(NULL, 12);
+
+        EXPECT_EQ(hllp_cnt_pack(packed, 7), -1);
+        EXPECT_EQ(hllp_cnt_errnum(packed), CCARD_ERR_INVALID_ARGUMENT);
+        EXPECT_EQ(hllp_cnt_pack(packed, widths[n]), 0);
+        EXPECT_EQ(hllp_cnt_pack(packed2, widths[n]), 0);
+        for (int64_t i = 1; i <= 50000; i++) {
+            EXPECT_EQ(hllp_cnt_offer(packed, &i, sizeof(int64_t)),
+                      hllp_cnt_offer(ctx, &i, sizeof(int64_t)));
+            int64_t j = i + 30000;
+            hllp_cnt_offer(packed2, &j, sizeof(int64_t));
+            hllp_cnt_offer(ctx2, &j, sizeof(int64_t));
+        }
+        EXPECT_EQ(hllp_cnt_card(packed), hllp_cnt_card(ctx));
+
+        EXPECT_EQ(hllp_cnt_merge(packed, packed2, NULL), 0);
+        EXPECT_EQ(hllp_cnt_merge(ctx, ctx2, NULL), 0);
+        EXPECT_EQ(hllp_cnt_fold(packed, 10), 0);
+        EXPECT_EQ(hllp_cnt_fold(ctx, 10), 0);
+        EXPECT_EQ(hllp_cnt_card(packed), hllp_cnt_card(ctx));
+
+        plen = sizeof(pbuf);
+        len = sizeof(buf);
+        EXPECT_EQ(hllp_cnt_get_raw_bytes(packed, pbuf, &plen), 0);
+        EXPECT_EQ(hllp_cnt_get_raw_bytes(ctx, buf, &len), 0);
+        EXPECT_EQ(plen, len);
+        EXPECT_EQ(memcmp(pbuf, buf, len), 0);
+
+        EXPECT_EQ(hllp_cnt_pack(packed, 8), 0);
+        EXPECT_EQ(hllp_cnt_card(packed), hllp_cnt_card(ctx));
+        EXPECT_EQ(hllp_cnt_pack(packed, widths[n]), 0);
+        EXPECT_EQ(hllp_cnt_reset(packed), 0);
+        EXPECT_EQ(hllp_cnt_card(packed), 0);
+
+        hllp_cnt_fini(packed2);
+        hllp_cnt_fini(ctx2);
+        hllp_cnt_fini(packed);
+        hllp_cnt_fini(ctx);
+    }
+}
+
+/**
+ * Count with sparse representation.
+ *
+ * <ol>
+ * <li>Small cardinality should be counted nearly exactly</li>
+ * <li>Empty sparse context should be serialized</li>
+ * <li>Sparse bitmap should be smaller than the normal one and be restored
+ * from serialized bytes</li>
+ * <li>Sparse contexts could be merged with each other or with normal
+ * ones</li>
+ * <li>Converted context should be identical to the normal one</li>
+ * </ol>
+ * */
+TEST(HyperloglogPlusCounting, Sparse)
+{
+    hllp_cnt_ctx_t *ctx = hllp_cnt_raw_init(NULL, 14);
+    hllp_cnt_ctx_t *sparse = hllp_cnt_raw_init_opt(NULL, 14, CCARD_OPT_SPARSE);
+    hllp_cnt_ctx_t *sparse2 = hllp_cnt_raw_init_opt(NULL, 14, CCARD_OPT_SPARSE);
+    hllp_cnt_ctx_t *restored;
+    uint8_t buf[(1 << 14) + 3], dbuf[(1 << 14) + 3];
+    uint32_t len, dlen;
+    int64_t i;
+
+    EXPECT_EQ(hllp_cnt_raw_init_opt(NULL, 20, CCARD_OPT_SPARSE), (void *)NULL);
+    EXPECT_EQ(hllp_cnt_card(sparse), 0);
+
+    /* empty sparse context has no hashes to serialize */
+    len = sizeof(buf);
+    EXPECT_EQ(hllp_cnt_get_raw_bytes(sparse, buf, &len), 0);
+    EXPECT_EQ(len, 1u);
+    EXPECT_EQ(buf[0], MAKE_SPARSE_ID(14));
+
+    for (i = 1; i <= 1000; i++) {
+        hllp_cnt_offer(sparse, &i, sizeof(int64_t));
+        hllp_cnt_offer(ctx, &i, sizeof(int64_t));
+        int64_t j = i + 500;
+        hllp_cnt_offer(sparse2, &j, sizeof(int64_t));
+    }
+    EXPECT_NEAR(hllp_cnt_card(sparse), 1000, 2);
+
+    len = sizeof(buf);
+    EXPECT_EQ(hllp_cnt_get_bytes(sparse, buf, &len), 0);
+    EXPECT_LT(len, (1u << 14) / 2);
+    restored = hllp_cnt_init(buf, len);
+    ASSERT_TRUE(restored != NULL);
+    EXPECT_EQ(hllp_cnt_card(restored), hllp_cnt_card(sparse));
+    EXPECT_EQ(hllp_cnt_init(buf, len - 1), (void *)NULL);
+
+    /* sparse bitmap merged to normal context gets the same registers */
+    hllp_cnt_ctx_t *merged = hllp_cnt_raw_init(NULL, 14);
+    EXPECT_EQ(hllp_cnt_merge_bytes(merged, buf, len, NULL), 0);
+    len = sizeof(buf);
+    dlen = sizeof(dbuf);
+    EXPECT_EQ(hllp_cnt_get_raw_bytes(merged, buf, &len), 0);
+    EXPECT_EQ(hllp_cnt_get_raw_bytes(ctx, dbuf, &dlen), 0);
+    EXPECT_EQ(len, dlen);
+    EXPECT_EQ(memcmp(buf, dbuf, len), 0);
+    hllp_cnt_fini(merged);
+
+    /* sparse contexts stay sparse when merged */
+    EXPECT_EQ(hllp_cnt_merge(sparse, sparse2, NULL), 0);
+    EXPECT_NEAR(hllp_cnt_card(sparse), 1500, 3);
+    len = sizeof(buf);
+    EXPECT_EQ(hllp_cnt_get_raw_bytes(sparse, buf, &len), 0);
+    EXPECT_LT(len, 1u << 14);
+    EXPECT_EQ(hllp_cnt_merge_raw_bytes(restored, buf, len, NULL), 0);
+    EXPECT_EQ(hllp_cnt_card(restored), hllp_cnt_card(sparse));
+
+    /* converted to normal context once the list gets large */
+    for (i = 1001; i <= 50000; i++) {
+        hllp_cnt_offer(sparse, &i, sizeof(int64_t));
+        hllp_cnt_offer(ctx, &i, sizeof(int64_t));
+    }
+    EXPECT_EQ(hllp_cnt_merge(ctx, sparse2, NULL), 0);
+    len = sizeof(buf);
+    dlen = sizeof(dbuf);
+    EXPECT_EQ(hllp_cnt_get_raw_bytes(sparse, buf, &len), 0);
+    EXPECT_EQ(hllp_cnt_get_raw_bytes(ctx, dbuf, &dlen), 0);
+    EXPECT_EQ(len, 1u << 14);
+    EXPECT_EQ(len, dlen);
+    EXPECT_EQ(memcmp(buf, dbuf, len), 0);
+    EXPECT_EQ(hllp_cnt_card(sparse), hllp_cnt_card(ctx));
+
+    /* sparse context folded */
+    EXPECT_EQ(hllp_cnt_reset(sparse2), 0);
+    EXPECT_EQ(hllp_cnt_card(sparse2), 0);
+    for (i = 1; i <= 1000; i++) {
+        hllp_cnt_offer(sparse2, &i, sizeof(int64_t));
+    }
+    EXPECT_EQ(hllp_cnt_fold(sparse2, 12), 0);
+    EXPECT_EQ(hllp_cnt_fold(ctx, 12), 0);
+    EXPECT_NEAR(hllp_cnt_card(sparse2), 1000, 2);
+    len = sizeof(buf);
+    EXPECT_EQ(hllp_cnt_get_raw_bytes(sparse2, buf, &len), 0);
+    EXPECT_LT(len, 1u << 12);
+
+    /* invalid sparse bitmap */
+    uint8_t bad[] = {MAKE_SPARSE_ID(14), 0x81};
+    EXPECT_EQ(hllp_cnt_merge_raw_bytes(ctx, bad, sizeof(bad), NULL), -1);
+    EXPECT_EQ(hllp_cnt_errnum(ctx), CCARD_ERR_MERGE_FAILED);
+    EXPECT_EQ(hllp_cnt_raw_init(bad, sizeof(bad)), (void *)NULL);
+
+    hllp_cnt_fini(restored);
+    hllp_cnt_fini(sparse2);
+    hllp_cnt_fini(sparse);
+    hllp_cnt_fini(ctx);
+}
+
+/**
+ * Exact counting with explicit hashes
+ *
+ * <ol>
+ * <li>Explicit contexts are exact and stay explicit when merged</li>
+ * <li>Context is converted to sparse representation beyond the limit and
+ * gets the same representation as a sparse one</li>
+ * </ol>
+ * */
+TEST(HyperloglogPlusCounting, Explicit)
+{
+    int64_t i;
+    uint32_t len, len2;
+    uint8_t *buf, *buf2;
+    hllp_cnt_ctx_t *ctx1 = hllp_cnt_raw_init_opt(NULL, 10, CCARD_OPT_EXPLICIT);
+    hllp_cnt_ctx_t *ctx2 = hllp_cnt_raw_init_opt(NULL, 10, CCARD_OPT_EXPLICIT);
+    hllp_cnt_ctx_t *sparse = hllp_cnt_raw_init_opt(NULL, 10, CCARD_OPT_SPARSE);
+    hllp_cnt_ctx_t *ctx3;
+
+    for (i = 1; i <= 80; i++) {
+        EXPECT_EQ(hllp_cnt_offer(ctx1, &i, sizeof(i)), 1);
+        EXPECT_EQ(hllp_cnt_offer(ctx1, &i, sizeof(i)), 0);
+        hllp_cnt_offer(sparse, &i, sizeof(i));
+    }
+    for (i = 61; i <= 120; i++) {
+        hllp_cnt_offer(ctx2, &i, sizeof(i));
+    }
+    EXPECT_EQ(hllp_cnt_card(ctx1), 80);
+
+    EXPECT_EQ(hllp_cnt_get_bytes(ctx2, NULL, &len), 0);
+    EXPECT_EQ(len, 3 + 1 + 8 * 60u);
+    buf = (uint8_t *)malloc(len);
+    EXPECT_EQ(hllp_cnt_get_bytes(ctx2, buf, &len), 0);
+    EXPECT_EQ(hllp_cnt_merge_bytes(ctx1, buf, len, NULL), 0);
+    EXPECT_EQ(hllp_cnt_card(ctx1), 120);
+    ctx3 = hllp_cnt_init(buf, len);
+    EXPECT_NE(ctx3, (hllp_cnt_ctx_t *)NULL);
+    EXPECT_EQ(hllp_cnt_merge(ctx3, ctx1, NULL), 0);
+    EXPECT_EQ(hllp_cnt_card(ctx3), 120);
+    free(buf);
+
+    // 2^10 bytes of registers hold 128 hashes
+    for (i = 81; i <= 300; i++) {
+        hllp_cnt_offer(ctx1, &i, sizeof(i));
+        hllp_cnt_offer(sparse, &i, sizeof(i));
+    }
+    EXPECT_EQ(hllp_cnt_card(ctx1), hllp_cnt_card(sparse));
+    EXPECT_EQ(hllp_cnt_get_raw_bytes(ctx1, NULL, &len), 0);
+    EXPECT_EQ(hllp_cnt_get_raw_bytes(sparse, NULL, &len2), 0);
+    EXPECT_EQ(len, len2);
+    buf = (uint8_t *)malloc(len);
+    buf2 = (uint8_t *)malloc(len2);
+    EXPECT_EQ(hllp_cnt_get_raw_bytes(ctx1, buf, &len), 0);
+    EXPECT_EQ(hllp_cnt_get_raw_bytes(sparse, buf2, &len2), 0);
+    EXPECT_FALSE(IS_EXPLICIT_BMP(buf));
+    EXPECT_EQ(memcmp(buf, buf2, len), 0);
+    free(buf);
+    free(buf2);
+
+    hllp_cnt_fini(ctx1);
+    hllp_cnt_fini(ctx2);
+    hllp_cnt_fini(ctx3);
+    hllp_cnt_fini(sparse);
+}
+
+/**
+ * Tests compressed serialization.
+ *
+ * <ol>
+ * <li>Compressed bytes of sparse and dense registers are smaller</li>
+ * <li>Contexts initialized from compressed bytes have the same estimate</li>
+ * <li>Compressed and plain bytes are merged together</li>
+ * </ol>
+ * */
+TEST(HyperloglogPlusCounting, Compressed)
+{
+    int64_t i;
+    uint32_t len, clen, slen;
+    uint8_t buf[3 + 4096], cbuf[3 + 4096 + 8], sbuf[3 + 4096];
+    hllp_cnt_ctx_t *ctx1 = hllp_cnt_init(NULL, 12);
+    hllp_cnt_ctx_t *ctx2 = hllp_cnt_init(NULL, 12);
+    hllp_cnt_ctx_t *ctx3;
+
+    for (i = 1; i <= 100; i++) {
+        hllp_cnt_offer(ctx1, &i, sizeof(i));
+    }
+    for (i = 1001; i <= 21000; i++) {
+        hllp_cnt_offer(ctx2, &i, sizeof(i));
+    }
+
+    slen = sizeof(sbuf);
+    EXPECT_EQ(hllp_cnt_get_compressed_bytes(ctx1, sbuf, &slen), 0);
+    EXPECT_EQ(sbuf[0], CCARD_ALGO_HYPERLOGLOGPLUS | CCARD_FLAG_COMPRESSED);
+    len = sizeof(buf);
+    EXPECT_EQ(hllp_cnt_get_bytes(ctx1, buf, &len), 0);
+    EXPECT_LE(slen, len + 3);
+    ctx3 = hllp_cnt_init(sbuf, slen);
+    EXPECT_NE(ctx3, (hllp_cnt_ctx_t *)NULL);
+    EXPECT_EQ(hllp_cnt_card(ctx3), hllp_cnt_card(ctx1));
+    hllp_cnt_fini(ctx3);
+
+    len = sizeof(buf);
+    EXPECT_EQ(hllp_cnt_get_bytes(ctx2, buf, &len), 0);
+    EXPECT_EQ(len, 3 + 4096u);
+    EXPECT_EQ(hllp_cnt_get_compressed_bytes(ctx2, NULL, &clen), 0);
+    EXPECT_LT(clen, len * 3 / 4);
+    EXPECT_EQ(hllp_cnt_get_compressed_bytes(ctx2, cbuf, &clen), 0);
+    ctx3 = hllp_cnt_init(cbuf, clen);
+    EXPECT_NE(ctx3, (hllp_cnt_ctx_t *)NULL);
+    EXPECT_EQ(hllp_cnt_card(ctx3), hllp_cnt_card(ctx2));
+
+    EXPECT_EQ(hllp_cnt_merge_bytes(ctx1, cbuf, clen, NULL), 0);
+    EXPECT_EQ(hllp_cnt_merge_bytes(ctx3, sbuf, slen, NULL), 0);
+    EXPECT_EQ(hllp_cnt_card(ctx1), hllp_cnt_card(ctx3));
+
+    cbuf[clen - 1] ^= 0xff;
+    EXPECT_EQ(hllp_cnt_merge_bytes(ctx3, cbuf, clen - 1, NULL), -1);
+    EXPECT_EQ(hllp_cnt_errnum(ctx3), CCARD_ERR_MERGE_FAILED);
+
+    hllp_cnt_fini(ctx3);
+    hllp_cnt_fini(ctx2);
+    hllp_cnt_fini(ctx1);
+}
+
+/**
+ * Tests views of borrowed bitmap.
+ *
+ * <ol>
+ * <li>Read-only view is estimated and merged from, but not updated</li>
+ * <li>Writable view updates the borrowed bitmap in place</li>
+ * <li>Only normal bitmap could be borrowed</li>
+ * </ol>
+ * */
+TEST(HyperloglogPlusCounting, View)
+{
+    int64_t i;
+    uint32_t len, len2;
+    uint8_t buf[3 + 4096], buf2[3 + 4096];
+    hllp_cnt_ctx_t *ctx1 = hllp_cnt_raw_init_opt(NULL, 12, 0);
+    hllp_cnt_ctx_t *ctx2 = hllp_cnt_raw_init_opt(NULL, 12, 0);
+    hllp_cnt_ctx_t *ctx4 = hllp_cnt_raw_init_opt(NULL, 12, CCARD_OPT_SPARSE);
+    hllp_cnt_ctx_t *view, *ctx3;
+
+    for (i = 1; i <= 20000; i++) {
+        hllp_cnt_offer(ctx1, &i, sizeof(i));
+    }
+    len = sizeof(buf);
+    EXPECT_EQ(hllp_cnt_get_bytes(ctx1, buf, &len), 0);
+
+    view = hllp_cnt_view_init(buf, len, CCARD_VIEW_RDONLY);
+    EXPECT_NE(view, (hllp_cnt_ctx_t *)NULL);
+    EXPECT_EQ(hllp_cnt_card(view), hllp_cnt_card(ctx1));
+    EXPECT_EQ(hllp_cnt_offer(view, &i, sizeof(i)), -1);
+    EXPECT_EQ(hllp_cnt_errnum(view), CCARD_ERR_VIEW);
+    EXPECT_EQ(hllp_cnt_reset(view), -1);
+    EXPECT_EQ(hllp_cnt_merge(ctx2, view, NULL), 0);
+    EXPECT_EQ(hllp_cnt_card(ctx2), hllp_cnt_card(ctx1));
+    len2 = sizeof(buf2);
+    EXPECT_EQ(hllp_cnt_get_bytes(view, buf2, &len2), 0);
+    EXPECT_EQ(len2, len);
+    EXPECT_EQ(memcmp(buf, buf2, len), 0);
+    EXPECT_EQ(hllp_cnt_fini(view), 0);
+
+    view = hllp_cnt_view_init(buf, len, CCARD_VIEW_WRITABLE);
+    EXPECT_NE(view, (hllp_cnt_ctx_t *)NULL);
+    for (i = 20001; i <= 40000; i++) {
+        hllp_cnt_offer(ctx1, &i, sizeof(i));
+        EXPECT_GE(hllp_cnt_offer(view, &i, sizeof(i)), 0);
+    }
+    EXPECT_EQ(hllp_cnt_card(view), hllp_cnt_card(ctx1));
+    EXPECT_EQ(hllp_cnt_fold(view, 10), -1);
+    EXPECT_EQ(hllp_cnt_errnum(view), CCARD_ERR_VIEW);
+    ctx3 = hllp_cnt_init(buf, len);
+    EXPECT_EQ(hllp_cnt_card(ctx3), hllp_cnt_card(ctx1));
+    EXPECT_EQ(hllp_cnt_reset(view), 0);
+    EXPECT_EQ(buf[3 + 100], 0);
+    EXPECT_EQ(hllp_cnt_fini(view), 0);
+
+    /* sparse, compressed or corrupted bitmap */
+    len2 = sizeof(buf2);
+    EXPECT_EQ(hllp_cnt_get_bytes(ctx4, buf2, &len2), 0);
+    EXPECT_EQ(hllp_cnt_view_init(buf2, len2, CCARD_VIEW_RDONLY), (hllp_cnt_ctx_t *)NULL);
+    hllp_cnt_fini(ctx4);
+    buf[0] |= CCARD_FLAG_COMPRESSED;
+    EXPECT_EQ(hllp_cnt_view_init(buf, len, CCARD_VIEW_RDONLY), (hllp_cnt_ctx_t *)NULL);
+    buf[0] &= ~CCARD_FLAG_COMPRESSED;
+    EXPECT_EQ(hllp_cnt_view_init(buf, len - 1, CCARD_VIEW_RDONLY), (hllp_cnt_ctx_t *)NULL);
+
+    hllp_cnt_fini(ctx3);
+    hllp_cnt_fini(ctx2);
+    hllp_cnt_fini(ctx1);
+}
+
+/**
+ * Tests copying contexts.
+ *
+ * <ol>
+ * <li>Clone serializes the same as the original in any representation, and
+ * is independent of it</li>
+ * <li>Copy overwrites contexts of other representations and k</li>
+ * <li>Loaded bitmap counts the same as the context it was got from</li>
+ * <li>Views could be copied from but not overwritten</li>
+ * </ol>
+ * */
+TEST(HyperloglogPlusCounting, Copy)
+{
+    uint8_t opts[] = {
+        0,
+        CCARD_OPT_SPARSE,
+        CCARD_OPT_EXPLICIT,
+        CCARD_OPT_REG5,
+        CCARD_OPT_REG6
+    };
+    uint32_t n[] = {10, 300, 20000};
+    uint8_t *buf = (uint8_t *)malloc(4096 + 3);
+    uint8_t *cbuf = (uint8_t *)malloc(4096 + 3);
+    uint32_t i, j, v, len, clen;
+    hllp_cnt_ctx_t *dst = hllp_cnt_raw_init_opt(NULL, 8, 0);
+    hllp_cnt_ctx_t *ctx, *cp, *view;
+
+    for (i = 0; i < sizeof(opts); i++) {
+        for (j = 0; j < 3; j++) {
+            ctx = hllp_cnt_raw_init_opt(NULL, 12, opts[i]);
+            for (v = 0; v < n[j]; v++) {
+                hllp_cnt_offer(ctx, &v, sizeof(v));
+            }
+            len = 4096 + 3;
+            EXPECT_EQ(hllp_cnt_get_bytes(ctx, buf, &len), 0);
+
+            cp = hllp_cnt_clone(ctx);
+            ASSERT_NE(cp, (hllp_cnt_ctx_t *)NULL);
+            EXPECT_EQ(hllp_cnt_card(cp), hllp_cnt_card(ctx));
+            clen = 4096 + 3;
+            EXPECT_EQ(hllp_cnt_get_bytes(cp, cbuf, &clen), 0);
+            EXPECT_EQ(clen, len);
+            EXPECT_EQ(memcmp(cbuf, buf, len), 0);
+            for (v = 0; v < 1000; v++) {
+                hllp_cnt_offer(cp, &v, sizeof(v));
+            }
+            clen = 4096 + 3;
+            EXPECT_EQ(hllp_cnt_get_bytes(ctx, cbuf, &clen), 0);
+            EXPECT_EQ(memcmp(cbuf, buf, len), 0);
+            hllp_cnt_fini(cp);
+
+            // dst holds the previous context, of another representation
+            EXPECT_EQ(hllp_cnt_copy_into(dst, ctx), 0);
+            EXPECT_EQ(hllp_cnt_card(dst), hllp_cnt_card(ctx));
+            clen = 4096 + 3;
+            EXPECT_EQ(hllp_cnt_get_bytes(dst, cbuf, &clen), 0);
+            EXPECT_EQ(clen, len);
+            EXPECT_EQ(memcmp(cbuf, buf, len), 0);
+
+            cp = hllp_cnt_raw_init_opt(NULL, 12, opts[i]);
+            EXPECT_EQ(hllp_cnt_load_bytes(cp, buf, len), 0);
+            EXPECT_EQ(hllp_cnt_card(cp), hllp_cnt_card(ctx));
+            hllp_cnt_fini(cp);
+            hllp_cnt_fini(ctx);
+        }
+    }
+
+    // in place load of normal bitmap, stale blocks are overwritten
+    ctx = hllp_cnt_raw_init_opt(NULL, 12, opts[0]);
+    for (v = 0; v < 5000; v++) {
+        hllp_cnt_offer(ctx, &v, sizeof(v));
+    }
+    len = 4096 + 3;
+    EXPECT_EQ(hllp_cnt_get_bytes(ctx, buf, &len), 0);
+    EXPECT_EQ(len, 4096u + 3);
+    EXPECT_EQ(hllp_cnt_copy_into(dst, ctx), 0);
+    EXPECT_EQ(hllp_cnt_reset(ctx), 0);
+    EXPECT_EQ(hllp_cnt_load_bytes(ctx, buf, len), 0);
+    EXPECT_EQ(hllp_cnt_card(ctx), hllp_cnt_card(dst));
+    EXPECT_EQ(hllp_cnt_load_bytes(ctx, buf, 3), -1);
+    EXPECT_EQ(hllp_cnt_errnum(ctx), CCARD_ERR_INVALID_ARGUMENT);
+
+    view = hllp_cnt_view_init(buf, len, CCARD_VIEW_WRITABLE);
+    ASSERT_NE(view, (hllp_cnt_ctx_t *)NULL);
+    EXPECT_EQ(hllp_cnt_copy_into(view, ctx), -1);
+    EXPECT_EQ(hllp_cnt_errnum(view), CCARD_ERR_VIEW);
+    EXPECT_EQ(hllp_cnt_load_bytes(view, buf, len), -1);
+    cp = hllp_cnt_clone(view);
+    ASSERT_NE(cp, (hllp_cnt_ctx_t *)NULL);
+    EXPECT_EQ(hllp_cnt_card(cp), hllp_cnt_card(view));
+    EXPECT_EQ(hllp_cnt_reset(cp), 0);
+    EXPECT_NE(hllp_cnt_card(view), 0);
+
+    EXPECT_EQ(hllp_cnt_copy_into(NULL, ctx), -1);
+    EXPECT_EQ(hllp_cnt_clone(NULL), (hllp_cnt_ctx_t *)NULL);
+    hllp_cnt_fini(cp);
+    hllp_cnt_fini(view);
+    hllp_cnt_fini(ctx);
+    hllp_cnt_fini(dst);
+    free(buf);
+    free(cbuf);
+}
+
+/**
+ * Tests getting serialized bitmap as I/O vector.
+ *
+ * <ol>
+ * <li>Header and bitmap are the same bytes as hllp_cnt_get_bytes</li>
+ * <li>Bitmap points into the context instead of a copy</li>
+ * <li>Explicit and packed bitmaps aren't stored as they are serialized</li>
+ * </ol>
+ * */
+TEST(HyperloglogPlusCounting, Iov)
+{
+    uint8_t opts[] = {0, CCARD_OPT_SPARSE};
+    uint8_t hdr[CCARD_IOV_HDR_LEN];
+    uint8_t *buf = (uint8_t *)malloc(4096 + 3);
+    uint8_t fail_opts[] = {CCARD_OPT_EXPLICIT, CCARD_OPT_REG6};
+    struct iovec iov[2];
+    uint32_t i, j, v, len;
+
+    for (i = 0; i < sizeof(opts); i++) {
+        for (j = 10; j <= 10000; j *= 10) {
+            hllp_cnt_ctx_t *ctx = hllp_cnt_raw_init_opt(NULL, 12, opts[i]);
+
+            for (v = 0; v < j; v++) {
+                hllp_cnt_offer(ctx, &v, sizeof(v));
+            }
+            len = 4096 + 3;
+            EXPECT_EQ(hllp_cnt_get_bytes(ctx, buf, &len), 0);
+            EXPECT_EQ(hllp_cnt_get_iov(ctx, hdr, iov), 0);
+            ASSERT_EQ(iov[0].iov_len + iov[1].iov_len, len);
+            EXPECT_EQ(iov[0].iov_base, (void *)hdr);
+            EXPECT_EQ(memcmp(iov[0].iov_base, buf, iov[0].iov_len), 0);
+            EXPECT_EQ(memcmp(iov[1].iov_base, buf + iov[0].iov_len,
+                             iov[1].iov_len), 0);
+            hllp_cnt_fini(ctx);
+        }
+    }
+
+    for (i = 0; i < sizeof(fail_opts); i++) {
+        hllp_cnt_ctx_t *ctx = hllp_cnt_raw_init_opt(NULL, 12, fail_opts[i]);
+
+        EXPECT_EQ(hllp_cnt_get_iov(ctx, hdr, iov), -1);
+        EXPECT_EQ(hllp_cnt_errnum(ctx), CCARD_ERR_INVALID_ARGUMENT);
+        hllp_cnt_fini(ctx);
+    }
+
+    EXPECT_EQ(hllp_cnt_get_iov(NULL, hdr, iov), -1);
+    free(buf);
+}
+
+struct offer_range_s {
+    hllp_cnt_ctx_t *ctx;
+    uint32_t from;
+    uint32_t to;
+};
+
+static void *offer_range(void *arg)
+{
+    struct offer_range_s *r = (struct offer_range_s *)arg;
+    uint32_t i;
+
+    for (i = r->from; i < r->to; i++) {
+        hllp_cnt_offer(r->ctx, &i, sizeof(i));
+    }
+    return NULL;
+}
+
+/**
+ * Tests concurrent offers.
+ *
+ * <ol>
+ * <li>Threads offer overlapping ranges to one context without locks</li>
+ * <li>Result is identical to offering all values serially</li>
+ * <li>Sparse registers are converted to dense ones first</li>
+ * <li>Packing isn't allowed meanwhile, nor concurrent views</li>
+ * </ol>
+ * */
+TEST(HyperloglogPlusCounting, Concurrent)
+{
+    hllp_cnt_ctx_t *ctx = hllp_cnt_raw_init_opt(NULL, 14, CCARD_OPT_SPARSE);
+    hllp_cnt_ctx_t *ref = hllp_cnt_raw_init_opt(NULL, 14, CCARD_OPT_SPARSE);
+    hllp_cnt_ctx_t *view;
+    uint8_t *buf = (uint8_t *)malloc(16384 + 3);
+    uint8_t *rbuf = (uint8_t *)malloc(16384 + 3);
+    struct offer_range_s ranges[4];
+    pthread_t threads[4];
+    uint32_t i, len, rlen;
+
+    for (i = 0; i < 100; i++) {
+        hllp_cnt_offer(ctx, &i, sizeof(i));
+        hllp_cnt_offer(ref, &i, sizeof(i));
+    }
+    EXPECT_EQ(hllp_cnt_set_concurrent(ctx, 1), 0);
+    EXPECT_EQ(hllp_cnt_pack(ctx, 6), -1);
+    EXPECT_EQ(hllp_cnt_errnum(ctx), CCARD_ERR_INVALID_ARGUMENT);
+    EXPECT_EQ(hllp_cnt_card(ctx), hllp_cnt_card(ref));
+
+    for (i = 0; i < 4; i++) {
+        ranges[i].ctx = ctx;
+        ranges[i].from = i * 50000;
+        ranges[i].to = i * 50000 + 80000;
+        ASSERT_EQ(pthread_create(&threads[i], NULL, offer_range, &ranges[i]), 0);
+    }
+    for (i = 0; i < 4; i++) {
+        ASSERT_EQ(pthread_join(threads[i], NULL), 0);
+    }
+    for (i = 0; i < 3 * 50000 + 80000; i++) {
+        hllp_cnt_offer(ref, &i, sizeof(i));
+    }
+
+    len = rlen = 16384 + 3;
+    EXPECT_EQ(hllp_cnt_get_bytes(ctx, buf, &len), 0);
+    EXPECT_EQ(hllp_cnt_get_bytes(ref, rbuf, &rlen), 0);
+    EXPECT_EQ(len, rlen);
+    EXPECT_EQ(memcmp(buf, rbuf, len), 0);
+    EXPECT_EQ(hllp_cnt_card(ctx), hllp_cnt_card(ref));
+
+    printf("actual:230000, estimated: %9lu\n",
+           (long unsigned int)hllp_cnt_card(ctx));
+
+    // copied bitmaps stay dense in a concurrent context
+    hllp_cnt_reset(ref);
+    EXPECT_EQ(hllp_cnt_copy_into(ctx, ref), 0);
+    EXPECT_EQ(hllp_cnt_card(ctx), 0);
+    ranges[0].from = 0;
+    ranges[0].to = 1000;
+    ranges[1].from = 500;
+    ranges[1].to = 1500;
+    for (i = 0; i < 2; i++) {
+        ASSERT_EQ(pthread_create(&threads[i], NULL, offer_range, &ranges[i]), 0);
+    }
+    for (i = 0; i < 2; i++) {
+        ASSERT_EQ(pthread_join(threads[i], NULL), 0);
+    }
+    for (i = 0; i < 1500; i++) {
+        hllp_cnt_offer(ref, &i, sizeof(i));
+    }
+    EXPECT_EQ(hllp_cnt_card(ctx), hllp_cnt_card(ref));
+
+    EXPECT_EQ(hllp_cnt_set_concurrent(ctx, 0), 0);
+    EXPECT_EQ(hllp_cnt_card(ctx), hllp_cnt_card(ref));
+
+    len = 16384 + 3;
+    EXPECT_EQ(hllp_cnt_get_bytes(ctx, buf, &len), 0);
+    view = hllp_cnt_view_init(buf, len, CCARD_VIEW_WRITABLE);
+    ASSERT_NE(view, (hllp_cnt_ctx_t *)NULL);
+    EXPECT_EQ(hllp_cnt_set_concurrent(view, 1), -1);
+    EXPECT_EQ(hllp_cnt_errnum(view), CCARD_ERR_VIEW);
+
+    hllp_cnt_fini(view);
+    hllp_cnt_fini(ctx);
+    hllp_cnt_fini(ref);
+    free(buf);
+    free(rbuf);
 }
 
@@ -1,3 +1,5 @@
+#include <stdlib.h>
+#include <string.h>
 #include "ccard_common.h"
 #include "linear_counting.h"
 #include "gtest/gtest.h"
@@ -124,6 +126,7 @@ TEST(LinearCounting, Counting)
  * <li>Tbm1 that contains 10000 to 30000 be serialized as buf1</li>
  * <li>Tbm2 that contains 20000 to 40000 be serialized as buf2</li>
  * <li>Merges buf1 and buf2 into current context</li>
+ * <li>Merges buf1 twice in one call</li>
  * </ol>
  * */
 TEST(LinearCounting, RawMerge)
@@ -163,6 +166,12 @@ TEST(LinearCounting, RawMerge)
     printf("actual:40000, estimated: %9lu, error: %+7.2f%%\n",
            (long unsigned int)esti, (double)(esti - 40000) / 40000 * 100);
 
+    // the same buffer could be passed more than once
+    lnr_cnt_reset(tbm2);
+    rc = lnr_cnt_merge_raw_bytes(tbm2, buf1, len1, buf1, len1, NULL);
+    EXPECT_EQ(rc, 0);
+    EXPECT_EQ(lnr_cnt_card(tbm2), lnr_cnt_card(tbm1));
+
     rc = lnr_cnt_fini(tbm2);
     EXPECT_EQ(rc, 0);
     rc = lnr_cnt_fini(tbm1);
@@ -179,6 +188,7 @@ TEST(LinearCounting, RawMerge)
  * <li>Tbm1 that contains 10000 to 30000 be serialized as buf1</li>
  * <li>Tbm2 that contains 20000 to 40000 be serialized as buf2</li>
  * <li>Merges buf1 and buf2 into current context</li>
+ * <li>Merges buf1 twice in one call</li>
  * </ol>
  * */
 TEST(LinearCounting, Merge)
@@ -219,6 +229,12 @@ TEST(LinearCounting, Merge)
     printf("actual:40000, estimated: %9lu, error: %+7.2f%%\n",
            (long unsigned int)esti, (double)(esti - 40000) / 40000 * 100);
 
+    // the same buffer could be passed more than once
+    lnr_cnt_reset(tbm2);
+    rc = lnr_cnt_merge_bytes(tbm2, buf1, len1, buf1, len1, NULL);
+    EXPECT_EQ(rc, 0);
+    EXPECT_EQ(lnr_cnt_card(tbm2), lnr_cnt_card(tbm1));
+
     rc = lnr_cnt_fini(tbm2);
     EXPECT_EQ(rc, 0);
     rc = lnr_cnt_fini(tbm1);
@@ -251,5 +267,292 @@ TEST(LinearCounting, Deserialize)
     EXPECT_EQ(lnr_cnt_card(other), esti);
 }
 
+/**
+ * Tests compressed serialization.
+ *
+ * <ol>
+ * <li>Compressed bytes of a nearly empty bitmap are smaller</li>
+ * <li>Contexts initialized from compressed bytes have the same estimate</li>
+ * <li>Compressed bytes are merged</li>
+ * </ol>
+ * */
+TEST(LinearCounting, Compressed)
+{
+    int64_t i;
+    uint32_t len, clen;
+    uint8_t buf[3 + 4096], cbuf[3 + 4096 + 8];
+    lnr_cnt_ctx_t *ctx1 = lnr_cnt_init(NULL, 12, CCARD_HASH_MURMUR);
+    lnr_cnt_ctx_t *ctx2 = lnr_cnt_init(NULL, 12, CCARD_HASH_MURMUR);
+    lnr_cnt_ctx_t *ctx3;
+
+    for (i = 1; i <= 1000; i++) {
+        lnr_cnt_offer(ctx1, &i, sizeof(i));
+    }
+    for (i = 501; i <= 1500; i++) {
+        lnr_cnt_offer(ctx2, &i, sizeof(i));
+    }
+
+    len = sizeof(buf);
+    EXPECT_EQ(lnr_cnt_get_bytes(ctx1, buf, &len), 0);
+    clen = sizeof(cbuf);
+    EXPECT_EQ(lnr_cnt_get_compressed_bytes(ctx1, cbuf, &clen), 0);
+    EXPECT_EQ(cbuf[0], CCARD_ALGO_LINEAR | CCARD_FLAG_COMPRESSED);
+    EXPECT_LT(clen, len / 2);
+
+    ctx3 = lnr_cnt_init(cbuf, clen, CCARD_HASH_MURMUR);
+    EXPECT_NE(ctx3, (lnr_cnt_ctx_t *)NULL);
+    EXPECT_EQ(lnr_cnt_card(ctx3), lnr_cnt_card(ctx1));
+
+    EXPECT_EQ(lnr_cnt_merge_bytes(ctx2, cbuf, clen, NULL), 0);
+    EXPECT_EQ(lnr_cnt_merge(ctx3, ctx2, NULL), 0);
+    EXPECT_EQ(lnr_cnt_card(ctx3), lnr_cnt_card(ctx2));
+
+    EXPECT_EQ(lnr_cnt_merge_bytes(ctx2, cbuf, clen - 1, NULL), -1);
+
+    lnr_cnt_fini(ctx3);
+    lnr_cnt_fini(ctx2);
+    lnr_cnt_fini(ctx1);
+}
+
+/**
+ * Tests views of borrowed bitmap.
+ *
+ * <ol>
+ * <li>Read-only view is estimated and merged from, but not updated</li>
+ * <li>Writable view updates the borrowed bitmap in place</li>
+ * <li>Only normal bitmap could be borrowed</li>
+ * </ol>
+ * */
+TEST(LinearCounting, View)
+{
+    int64_t i;
+    uint32_t len, len2;
+    uint8_t buf[3 + 4096], buf2[3 + 4096];
+    lnr_cnt_ctx_t *ctx1 = lnr_cnt_init(NULL, 12, CCARD_HASH_MURMUR);
+    lnr_cnt_ctx_t *ctx2 = lnr_cnt_init(NULL, 12, CCARD_HASH_MURMUR);
+    lnr_cnt_ctx_t *view, *ctx3;
+
+    for (i = 1; i <= 20000; i++) {
+        lnr_cnt_offer(ctx1, &i, sizeof(i));
+    }
+    len = sizeof(buf);
+    EXPECT_EQ(lnr_cnt_get_bytes(ctx1, buf, &len), 0);
+
+    view = lnr_cnt_view_init(buf, len, CCARD_VIEW_RDONLY);
+    EXPECT_NE(view, (lnr_cnt_ctx_t *)NULL);
+    EXPECT_EQ(lnr_cnt_card(view), lnr_cnt_card(ctx1));
+    EXPECT_EQ(lnr_cnt_offer(view, &i, sizeof(i)), -1);
+    EXPECT_EQ(lnr_cnt_errnum(view), CCARD_ERR_VIEW);
+    EXPECT_EQ(lnr_cnt_reset(view), -1);
+    EXPECT_EQ(lnr_cnt_merge(ctx2, view, NULL), 0);
+    EXPECT_EQ(lnr_cnt_card(ctx2), lnr_cnt_card(ctx1));
+    len2 = sizeof(buf2);
+    EXPECT_EQ(lnr_cnt_get_bytes(view, buf2, &len2), 0);
+    EXPECT_EQ(len2, len);
+    EXPECT_EQ(memcmp(buf, buf2, len), 0);
+    EXPECT_EQ(lnr_cnt_fini(view), 0);
+
+    view = lnr_cnt_view_init(buf, len, CCARD_VIEW_WRITABLE);
+    EXPECT_NE(view, (lnr_cnt_ctx_t *)NULL);
+    for (i = 20001; i <= 40000; i++) {
+        lnr_cnt_offer(ctx1, &i, sizeof(i));
+        EXPECT_GE(lnr_cnt_offer(view, &i, sizeof(i)), 0);
+    }
+    EXPECT_EQ(lnr_cnt_card(view), lnr_cnt_card(ctx1));
+    ctx3 = lnr_cnt_init(buf, len, CCARD_HASH_MURMUR);
+    EXPECT_EQ(lnr_cnt_card(ctx3), lnr_cnt_card(ctx1));
+    EXPECT_EQ(lnr_cnt_reset(view), 0);
+    EXPECT_EQ(buf[3 + 100], 0);
+    EXPECT_EQ(lnr_cnt_fini(view), 0);
+
+    /* sparse, compressed or corrupted bitmap */
+    buf[0] |= CCARD_FLAG_COMPRESSED;
+    EXPECT_EQ(lnr_cnt_view_init(buf, len, CCARD_VIEW_RDONLY), (lnr_cnt_ctx_t *)NULL);
+    buf[0] &= ~CCARD_FLAG_COMPRESSED;
+    EXPECT_EQ(lnr_cnt_view_init(buf, len - 1, CCARD_VIEW_RDONLY), (lnr_cnt_ctx_t *)NULL);
+
+    lnr_cnt_fini(ctx3);
+    lnr_cnt_fini(ctx2);
+    lnr_cnt_fini(ctx1);
+}
+
+/**
+ * Tests lazy reset.
+ *
+ * <ol>
+ * <li>Counts the same as reset by clearing the whole bitmap</li>
+ * <li>Serialized and merged bitmaps have no values from before reset</li>
+ * <li>Lazy reset could be turned off and isn't allowed on views</li>
+ * </ol>
+ * */
+TEST(LinearCounting, LazyReset)
+{
+    lnr_cnt_ctx_t *ctx = lnr_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR);
+    lnr_cnt_ctx_t *ref = lnr_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR);
+    lnr_cnt_ctx_t *tbm, *view;
+    uint8_t *buf = (uint8_t *)malloc(16384 + 3);
+    uint8_t *rbuf = (uint8_t *)malloc(16384 + 3);
+    uint32_t i, n, v, len, rlen;
+
+    EXPECT_EQ(lnr_cnt_set_lazy_reset(ctx, 1), 0);
+    for (n = 10; n <= 100000; n *= 10) {
+        EXPECT_EQ(lnr_cnt_reset(ctx), 0);
+        EXPECT_EQ(lnr_cnt_reset(ref), 0);
+        EXPECT_EQ(lnr_cnt_card(ctx), 0);
+        for (i = 0; i < n; i++) {
+            v = i * 7 + n;
+            EXPECT_EQ(lnr_cnt_offer(ctx, &v, sizeof(v)),
+                      lnr_cnt_offer(ref, &v, sizeof(v)));
+        }
+        EXPECT_EQ(lnr_cnt_card(ctx), lnr_cnt_card(ref));
+
+        len = rlen = 16384 + 3;
+        EXPECT_EQ(lnr_cnt_get_bytes(ctx, buf, &len), 0);
+        EXPECT_EQ(lnr_cnt_get_bytes(ref, rbuf, &rlen), 0);
+        EXPECT_EQ(len, rlen);
+        EXPECT_EQ(memcmp(buf, rbuf, len), 0);
+    }
+
+    // stale blocks of merged context are zeros
+    lnr_cnt_reset(ctx);
+    lnr_cnt_reset(ref);
+    for (i = 0; i < 10; i++) {
+        lnr_cnt_offer(ctx, &i, sizeof(i));
+        lnr_cnt_offer(ref, &i, sizeof(i));
+    }
+    tbm = lnr_cnt_raw_init(NULL, 14, CCARD_HASH_MURMUR);
+    EXPECT_EQ(lnr_cnt_merge(tbm, ctx, NULL), 0);
+    EXPECT_EQ(lnr_cnt_card(tbm), lnr_cnt_card(ref));
+    lnr_cnt_fini(tbm);
+
+    lnr_cnt_reset(ctx);
+    EXPECT_EQ(lnr_cnt_set_lazy_reset(ctx, 0), 0);
+    EXPECT_EQ(lnr_cnt_card(ctx), 0);
+    len = 16384 + 3;
+    EXPECT_EQ(lnr_cnt_get_bytes(ctx, buf, &len), 0);
+    view = lnr_cnt_view_init(buf, len, CCARD_VIEW_WRITABLE);
+    ASSERT_NE(view, (lnr_cnt_ctx_t *)NULL);
+    EXPECT_EQ(lnr_cnt_set_lazy_reset(view, 1), -1);
+    EXPECT_EQ(lnr_cnt_errnum(view), CCARD_ERR_VIEW);
+
+    lnr_cnt_fini(view);
+    lnr_cnt_fini(ctx);
+    lnr_cnt_fini(ref);
+    free(buf);
+    free(rbuf);
+}
+
+/**
+ * Tests copying contexts.
+ *
+ * <ol>
+ * <li>Clone and copy serialize the same as the original</li>
+ * <li>Loaded bitmap counts the same as the context it was got from</li>
+ * <li>Bitmap lengths must match, views can't be overwritten</li>
+ * </ol>
+ * */
+TEST(LinearCounting, Copy)
+{
+    lnr_cnt_ctx_t *ctx = lnr_cnt_raw_init(NULL, 12, CCARD_HASH_MURMUR);
+    lnr_cnt_ctx_t *dst = lnr_cnt_raw_init(NULL, 12, CCARD_HASH_MURMUR);
+    lnr_cnt_ctx_t *small = lnr_cnt_raw_init(NULL, 10, CCARD_HASH_MURMUR);
+    lnr_cnt_ctx_t *cp, *view;
+    uint8_t *buf = (uint8_t *)malloc(4096 + 3);
+    uint8_t *cbuf = (uint8_t *)malloc(4096 + 3);
+    uint32_t v, len, clen;
+
+    for (v = 0; v < 3000; v++) {
+        lnr_cnt_offer(ctx, &v, sizeof(v));
+    }
+    len = 4096 + 3;
+    EXPECT_EQ(lnr_cnt_get_bytes(ctx, buf, &len), 0);
+
+    cp = lnr_cnt_clone(ctx);
+    ASSERT_NE(cp, (lnr_cnt_ctx_t *)NULL);
+    EXPECT_EQ(lnr_cnt_card(cp), lnr_cnt_card(ctx));
+    clen = 4096 + 3;
+    EXPECT_EQ(lnr_cnt_get_bytes(cp, cbuf, &clen), 0);
+    EXPECT_EQ(memcmp(cbuf, buf, len), 0);
+    EXPECT_EQ(lnr_cnt_reset(cp), 0);
+    EXPECT_GT(lnr_cnt_card(ctx), 0);
+    lnr_cnt_fini(cp);
+
+    // lazily reset dst gets all blocks from ctx
+    EXPECT_EQ(lnr_cnt_set_lazy_reset(dst, 1), 0);
+    EXPECT_EQ(lnr_cnt_reset(dst), 0);
+    EXPECT_EQ(lnr_cnt_copy_into(dst, ctx), 0);
+    EXPECT_EQ(lnr_cnt_card(dst), lnr_cnt_card(ctx));
+    clen = 4096 + 3;
+    EXPECT_EQ(lnr_cnt_get_bytes(dst, cbuf, &clen), 0);
+    EXPECT_EQ(memcmp(cbuf, buf, len), 0);
+
+    EXPECT_EQ(lnr_cnt_reset(dst), 0);
+    EXPECT_EQ(lnr_cnt_load_bytes(dst, buf, len), 0);
+    EXPECT_EQ(lnr_cnt_card(dst), lnr_cnt_card(ctx));
+    clen = 4096 + 3;
+    EXPECT_EQ(lnr_cnt_get_compressed_bytes(ctx, cbuf, &clen), 0);
+    EXPECT_EQ(lnr_cnt_reset(dst), 0);
+    EXPECT_EQ(lnr_cnt_load_bytes(dst, cbuf, clen), 0);
+    EXPECT_EQ(lnr_cnt_card(dst), lnr_cnt_card(ctx));
+
+    EXPECT_EQ(lnr_cnt_copy_into(small, ctx), -1);
+    EXPECT_EQ(lnr_cnt_errnum(small), CCARD_ERR_INVALID_ARGUMENT);
+    EXPECT_EQ(lnr_cnt_load_bytes(small, buf, len), -1);
+    EXPECT_EQ(lnr_cnt_card(small), 0);
+
+    view = lnr_cnt_view_init(buf, len, CCARD_VIEW_RDONLY);
+    ASSERT_NE(view, (lnr_cnt_ctx_t *)NULL);
+    EXPECT_EQ(lnr_cnt_copy_into(view, ctx), -1);
+    EXPECT_EQ(lnr_cnt_errnum(view), CCARD_ERR_VIEW);
+    EXPECT_EQ(lnr_cnt_copy_into(dst, view), 0);
+    EXPECT_EQ(lnr_cnt_card(dst), lnr_cnt_card(view));
+
+    lnr_cnt_fini(view);
+    lnr_cnt_fini(small);
+    lnr_cnt_fini(dst);
+    lnr_cnt_fini(ctx);
+    free(buf);
+    free(cbuf);
+}
+
+/**
+ * Tests getting serialized bitmap as I/O vector.
+ *
+ * <ol>
+ * <li>Header and bitmap are the same bytes as lnr_cnt_get_bytes</li>
+ * <li>Bitmap points into the context instead of a copy</li>
+ * </ol>
+ * */
+TEST(LinearCounting, Iov)
+{
+    uint8_t opts[] = {CCARD_HASH_MURMUR, CCARD_HASH_LOOKUP3};
+    uint8_t hdr[CCARD_IOV_HDR_LEN];
+    uint8_t *buf = (uint8_t *)malloc(4096 + 3);
+    struct iovec iov[2];
+    uint32_t i, j, v, len;
+
+    for (i = 0; i < sizeof(opts); i++) {
+        for (j = 10; j <= 10000; j *= 10) {
+            lnr_cnt_ctx_t *ctx = lnr_cnt_raw_init(NULL, 12, opts[i]);
+
+            for (v = 0; v < j; v++) {
+                lnr_cnt_offer(ctx, &v, sizeof(v));
+            }
+            len = 4096 + 3;
+            EXPECT_EQ(lnr_cnt_get_bytes(ctx, buf, &len), 0);
+            EXPECT_EQ(lnr_cnt_get_iov(ctx, hdr, iov), 0);
+            ASSERT_EQ(iov[0].iov_len + iov[1].iov_len, len);
+            EXPECT_EQ(iov[0].iov_base, (void *)hdr);
+            EXPECT_EQ(memcmp(iov[0].iov_base, buf, iov[0].iov_len), 0);
+            EXPECT_EQ(memcmp(iov[1].iov_base, buf + iov[0].iov_len,
+                             iov[1].iov_len), 0);
+            lnr_cnt_fini(ctx);
+        }
+    }
+
+    EXPECT_EQ(lnr_cnt_get_iov(NULL, hdr, iov), -1);
+    free(buf);
+}
+
 // vi:ft=c ts=4 sw=4 fdm=marker et
 
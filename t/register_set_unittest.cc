@@ -1,3 +1,4 @@
+#include <math.h>
 #include "register_set.h"
 #include "gtest/gtest.h"
 
@@ -27,5 +28,121 @@ TEST(RegisterSetTest, GetAndSet)
     rs_fini(rs);
 }
 
+/**
+ * Tests registers of different widths don't affect neighbours.
+ * */
+TEST(RegisterSetTest, Width)
+{
+    uint8_t widths[] = {4, 5, 6, 8};
+    uint32_t value;
+
+    for (size_t n = 0; n < sizeof(widths); n++) {
+        uint32_t max = (1U << widths[n]) - 1;
+        reg_set_t *rs = rs_init_width(1000, widths[n], NULL, 0);
+        EXPECT_NE(rs, (reg_set_t *)NULL);
+        EXPECT_EQ(rs->size, (1000 + 32 / widths[n] - 1) / (32 / widths[n]));
+
+        for (uint32_t i = 0; i < 1000; i++) {
+            EXPECT_EQ(rs_set(rs, i, (i * 7) & max), 0);
+        }
+        for (uint32_t i = 0; i < 1000; i++) {
+            EXPECT_EQ(rs_get(rs, i, &value), 0);
+            EXPECT_EQ((i * 7) & max, value);
+        }
+        EXPECT_EQ(rs_set(rs, 1000, 1), -1);
+        EXPECT_EQ(rs_get(rs, 1000, &value), -1);
+
+        rs_fini(rs);
+    }
+
+    EXPECT_EQ(rs_init_width(1000, 9, NULL, 0), (reg_set_t *)NULL);
+}
+
+/**
+ * Tests word-level maximum merge and sum against per-register results.
+ * */
+TEST(RegisterSetTest, MergeAndSum)
+{
+    uint8_t widths[] = {4, 5, 6, 8};
+    uint32_t x, y, value, zeros;
+    double sum, expect_sum;
+
+    for (size_t n = 0; n < sizeof(widths); n++) {
+        uint32_t max = (1U << widths[n]) - 1;
+        reg_set_t *rs = rs_init_width(999, widths[n], NULL, 0);
+        reg_set_t *other = rs_init_width(999, widths[n], NULL, 0);
+
+        srand(n);
+        for (uint32_t i = 0; i < 999; i++) {
+            rs_set(rs, i, rand() & max);
+            rs_set(other, i, rand() & max);
+        }
+
+        reg_set_t *copy = rs_init_width(999, widths[n], rs->M, rs->size);
+        EXPECT_EQ(rs_merge(rs, other), 0);
+
+        expect_sum = 0;
+        uint32_t expect_zeros = 0;
+        for (uint32_t i = 0; i < 999; i++) {
+            rs_get(copy, i, &x);
+            rs_get(other, i, &y);
+            rs_get(rs, i, &value);
+            EXPECT_EQ(x > y ? x : y, value);
+            expect_sum += pow(2, -(double)value);
+            expect_zeros += value == 0;
+        }
+        EXPECT_EQ(rs_sum(rs, &sum, &zeros), 0);
+        EXPECT_EQ(expect_sum, sum);
+        EXPECT_EQ(expect_zeros, zeros);
+
+        rs_fini(copy);
+        rs_fini(other);
+        rs_fini(rs);
+    }
+}
+
+/**
+ * Tests copying register sets.
+ *
+ * <ol>
+ * <li>Copy has the same registers, whether it's new or reused</li>
+ * <li>Set of another width is resized</li>
+ * <li>Copying NULL destroys the set</li>
+ * </ol>
+ * */
+TEST(RegisterSetTest, Copy)
+{
+    reg_set_t *src = rs_init_width(1000, 5, NULL, 0);
+    reg_set_t *dst = rs_init_width(1000, 5, NULL, 0);
+    reg_set_t *wide = rs_init_width(1000, 8, NULL, 0);
+    reg_set_t *cp;
+    uint32_t i, value;
+
+    for (i = 0; i < 1000; i++) {
+        rs_set(src, i, i % 31);
+    }
+
+    EXPECT_EQ(rs_copy(dst, src, NULL), dst);
+    wide = rs_copy(wide, src, NULL);
+    cp = rs_copy(NULL, src, NULL);
+    ASSERT_NE(wide, (reg_set_t *)NULL);
+    ASSERT_NE(cp, (reg_set_t *)NULL);
+    EXPECT_EQ(wide->width, 5);
+    EXPECT_EQ(wide->size, src->size);
+    for (i = 0; i < 1000; i++) {
+        EXPECT_EQ(rs_get(dst, i, &value), 0);
+        EXPECT_EQ(value, i % 31);
+        EXPECT_EQ(rs_get(wide, i, &value), 0);
+        EXPECT_EQ(value, i % 31);
+        EXPECT_EQ(rs_get(cp, i, &value), 0);
+        EXPECT_EQ(value, i % 31);
+    }
+
+    EXPECT_EQ(rs_copy(cp, NULL, NULL), (reg_set_t *)NULL);
+    rs_fini(wide);
+    rs_fini(dst);
+    rs_fini(src);
+}
+
 // vi:ft=c ts=4 sw=4 fdm=marker et
 